@@ -22,6 +22,7 @@
 #include "ble_srv_common.h"
 #include "app_util.h"
 #include "nrf_gpio.h"
+#include "app_timer.h"
 #include "wiegand.h"
 
 #define BLE_UUID_WIEGAND_SERVICE        0xABCD
@@ -34,6 +35,10 @@
 static void on_connect(ble_wiegand_t * p_wiegand, ble_evt_t * p_ble_evt)
 {
     p_wiegand->conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+    if (sd_ble_tx_buffer_count_get(&p_wiegand->tx_count) != NRF_SUCCESS)
+    {
+        p_wiegand->tx_count = 1;
+    }
 }
 
 
@@ -45,7 +50,326 @@ static void on_connect(ble_wiegand_t * p_wiegand, ble_evt_t * p_ble_evt)
 static void on_disconnect(ble_wiegand_t * p_wiegand, ble_evt_t * p_ble_evt)
 {
     UNUSED_PARAMETER(p_ble_evt);
-    p_wiegand->conn_handle = BLE_CONN_HANDLE_INVALID;
+    p_wiegand->conn_handle             = BLE_CONN_HANDLE_INVALID;
+    p_wiegand->is_notification_enabled = false;
+    p_wiegand->is_export_enabled       = false;
+    p_wiegand->is_sync                 = false;
+    p_wiegand->is_replay_notification_enabled = false;
+    p_wiegand->is_replay_notify_pending       = false;
+    p_wiegand->is_control_notification_enabled = false;
+}
+
+
+/**@brief Function for handling a write to the last cards CCCD.
+ *
+ * @param[in]   p_wiegand     Wiegand Service structure.
+ * @param[in]   p_evt_write   Write event received from the BLE stack.
+ */
+static void on_last_cards_cccd_write(ble_wiegand_t * p_wiegand, ble_gatts_evt_write_t * p_evt_write)
+{
+    if (p_evt_write->len == 2)
+    {
+        ble_wiegand_evt_t evt;
+
+        p_wiegand->is_notification_enabled = ble_srv_is_notification_enabled(p_evt_write->data);
+        if (p_wiegand->evt_handler != NULL)
+        {
+            evt.evt_type = p_wiegand->is_notification_enabled ? BLE_WIEGAND_EVT_NOTIFICATION_ENABLED
+                                                              : BLE_WIEGAND_EVT_NOTIFICATION_DISABLED;
+            p_wiegand->evt_handler(p_wiegand, &evt);
+        }
+    }
+}
+
+/**@brief Function for handling a write to the last cards characteristic.
+ *
+ * @details The application reloads the characteristic with the cards the client lacks.
+ *
+ * @param[in]   p_wiegand     Wiegand Service structure.
+ * @param[in]   p_evt_write   Write event received from the BLE stack.
+ */
+static void on_last_cards_write(ble_wiegand_t * p_wiegand, ble_gatts_evt_write_t * p_evt_write)
+{
+    if (p_evt_write->len != BLE_WIEGAND_SYNC_LEN && p_evt_write->len != BLE_WIEGAND_SYNC_FLAGS_LEN)
+    {
+        return;
+    }
+    p_wiegand->sync_seq        = uint32_decode(p_evt_write->data);
+    p_wiegand->is_sync_release = p_evt_write->len == BLE_WIEGAND_SYNC_FLAGS_LEN &&
+                                 (p_evt_write->data[4] & BLE_WIEGAND_SYNC_RELEASE) != 0;
+    p_wiegand->is_sync         = true;
+
+    if (p_wiegand->evt_handler != NULL)
+    {
+        ble_wiegand_evt_t evt;
+
+        evt.evt_type = BLE_WIEGAND_EVT_SYNC_WRITTEN;
+        p_wiegand->evt_handler(p_wiegand, &evt);
+    }
+}
+
+/**@brief Function for queueing the custom frame once its length has been written.
+ *
+ * @details A frame longer than the Send Data last written, or a length written only in part,
+ *          is not sent but ends as a failed job, notified like any other.
+ *
+ * @param[in]   p_wiegand   Wiegand Service structure.
+ * @param[in]   len_whole   TRUE if both bytes of Data Length were written.
+ */
+static void on_custom_frame_written(ble_wiegand_t * p_wiegand, bool len_whole)
+{
+    uint32_t err_code;
+
+    err_code = wiegand_tx_custom_add(p_wiegand->send_data_len, len_whole);
+    UNUSED_VARIABLE(ble_wiegand_replay_status_update(p_wiegand, err_code == NRF_ERROR_INVALID_LENGTH));
+}
+
+/**@brief Function for handling an executed queued write.
+ *
+ * @details The stack has written the values in place already. The queue lists each piece as
+ *          handle, offset and length, 2 bytes each little endian, then the data, and ends with
+ *          an invalid handle. A frame goes out if its length was among them, checked against
+ *          the furthest Send Data byte they reached.
+ *
+ * @param[in]   p_wiegand   Wiegand Service structure.
+ */
+static void on_queued_write_exec(ble_wiegand_t * p_wiegand)
+{
+    const uint8_t * p_queue     = (const uint8_t *)p_wiegand->queued_writes;
+    uint16_t        pos         = 0;
+    uint16_t        data_len    = 0;
+    uint8_t         length_mask = 0;    // Data Length bytes written, bit 0 the low one
+
+    while (pos + 6 <= BLE_WIEGAND_QUEUED_WRITES_LEN)
+    {
+        uint16_t handle = uint16_decode(&p_queue[pos]);
+        uint16_t offset;
+        uint16_t len;
+
+        if (handle == BLE_GATT_HANDLE_INVALID)
+        {
+            break;
+        }
+        offset = uint16_decode(&p_queue[pos + 2]);
+        len    = uint16_decode(&p_queue[pos + 4]);
+        if (handle == p_wiegand->send_data_handles.value_handle && offset + len > data_len)
+        {
+            data_len = offset + len;
+        }
+        if (handle == p_wiegand->data_length_handles.value_handle && len > 0)
+        {
+            // the stack kept offset + len within the 2 bytes
+            length_mask |= ((1 << len) - 1) << offset;
+        }
+        pos += 6 + len;
+    }
+    if (data_len > 0)
+    {
+        p_wiegand->send_data_len = data_len;
+    }
+    if (length_mask != 0)
+    {
+        on_custom_frame_written(p_wiegand, length_mask == 0x03);
+    }
+}
+
+/**@brief Function for queueing replay jobs as written to the replay characteristic.
+ *
+ * @param[in]   p_data    One byte, the card to send once, or jobs of BLE_WIEGAND_REPLAY_JOB_LEN bytes.
+ * @param[in]   len       Length of p_data.
+ * @param[out]  p_added   Jobs queued.
+ *
+ * @return      NRF_SUCCESS if every job was queued, NRF_ERROR_INVALID_LENGTH if len is neither,
+ *              otherwise the error the first job turned away got.
+ */
+static uint32_t replay_jobs_add(const uint8_t * p_data, uint16_t len, uint8_t * p_added)
+{
+    wiegand_tx_job_t job;
+    uint32_t         result = NRF_SUCCESS;
+
+    *p_added = 0;
+    if (len == 1)
+    {
+        job.card_idx = p_data[0];
+        job.repeat   = 1;
+        job.gap_ms   = 0;
+        result       = wiegand_tx_job_add(&job);
+        *p_added     = result == NRF_SUCCESS;
+        return result;
+    }
+    if (len % BLE_WIEGAND_REPLAY_JOB_LEN != 0)
+    {
+        return NRF_ERROR_INVALID_LENGTH;
+    }
+    for (uint16_t pos = 0; pos < len; pos += BLE_WIEGAND_REPLAY_JOB_LEN)
+    {
+        uint32_t err_code;
+
+        job.card_idx = p_data[pos];
+        job.repeat   = p_data[pos + 1];
+        job.gap_ms   = uint16_decode(&p_data[pos + 2]);
+        err_code     = wiegand_tx_job_add(&job);
+        if (err_code == NRF_SUCCESS)
+        {
+            (*p_added)++;
+        }
+        else if (result == NRF_SUCCESS)
+        {
+            result = err_code;
+        }
+    }
+    return result;
+}
+
+/**@brief Function for handling a write to the replay characteristic.
+ *
+ * @details Only queues the jobs, wiegand_task sends the frames, so the stack is never held up
+ *          by a transmission. Jobs that do not fit in the queue are turned away.
+ *
+ * @param[in]   p_wiegand     Wiegand Service structure.
+ * @param[in]   p_evt_write   Write event received from the BLE stack.
+ */
+static void on_replay_write(ble_wiegand_t * p_wiegand, ble_gatts_evt_write_t * p_evt_write)
+{
+    uint8_t added;
+
+    UNUSED_VARIABLE(replay_jobs_add(p_evt_write->data, p_evt_write->len, &added));
+    UNUSED_VARIABLE(ble_wiegand_replay_status_update(p_wiegand, false));
+}
+
+/**@brief Function for handling a write to the export CCCD.
+ *
+ * @param[in]   p_wiegand     Wiegand Service structure.
+ * @param[in]   p_evt_write   Write event received from the BLE stack.
+ */
+static void on_export_cccd_write(ble_wiegand_t * p_wiegand, ble_gatts_evt_write_t * p_evt_write)
+{
+    if (p_evt_write->len == 2)
+    {
+        p_wiegand->is_export_enabled = ble_srv_is_notification_enabled(p_evt_write->data);
+    }
+}
+
+/**@brief Function for handling a write to the export characteristic.
+ *
+ * @details The export itself runs from the main loop, next to the card store.
+ *
+ * @param[in]   p_wiegand     Wiegand Service structure.
+ * @param[in]   p_evt_write   Write event received from the BLE stack.
+ */
+static void on_export_write(ble_wiegand_t * p_wiegand, ble_gatts_evt_write_t * p_evt_write)
+{
+    if (p_evt_write->len == BLE_WIEGAND_EXPORT_START_LEN)
+    {
+        p_wiegand->export_start_seq    = uint32_decode(p_evt_write->data);
+        p_wiegand->is_export_requested = true;
+    }
+}
+
+/**@brief Function for setting the transmit timing as written to the TX timing characteristic.
+ *
+ * @details Invalid timings are ignored, the characteristic is refreshed either way so the
+ *          client can read back what is in use.
+ *
+ * @param[in]   p_wiegand   Wiegand Service structure.
+ * @param[in]   p_data      Profile byte, then the timing if BLE_WIEGAND_TX_TIMING_WRITE_LEN long.
+ * @param[in]   len         Length of p_data.
+ *
+ * @return      The result of wiegand_tx_profile_set, NRF_ERROR_INVALID_LENGTH if len is neither.
+ */
+static uint32_t tx_timing_set(ble_wiegand_t * p_wiegand, const uint8_t * p_data, uint16_t len)
+{
+    wiegand_tx_timing_t timing;
+    uint8_t             profile;
+    uint32_t            err_code;
+
+    if (len != 1 && len != BLE_WIEGAND_TX_TIMING_WRITE_LEN)
+    {
+        return NRF_ERROR_INVALID_LENGTH;
+    }
+    profile = p_data[0] & ~BLE_WIEGAND_TX_LOOPBACK;
+    wiegand_tx_profile_get(&timing);
+    if (len == BLE_WIEGAND_TX_TIMING_WRITE_LEN)
+    {
+        timing.pulse_us  = uint16_decode(&p_data[1]);
+        timing.period_us = uint16_decode(&p_data[3]);
+        timing.gap_ms    = uint16_decode(&p_data[5]);
+    }
+    else if (profile == WIEGAND_TX_PROFILE_CUSTOM)
+    {
+        // keep the stored custom timing
+        timing = wiegand_tx_profile_info(WIEGAND_TX_PROFILE_CUSTOM)->timing;
+    }
+
+    err_code = wiegand_tx_profile_set(profile, &timing);
+    if (err_code == NRF_SUCCESS)
+    {
+        // loopback needs the PPI capture mode, the profile stands either way
+        UNUSED_VARIABLE(wiegand_tx_loopback_set((p_data[0] & BLE_WIEGAND_TX_LOOPBACK) != 0));
+    }
+    ble_wiegand_tx_timing_update(p_wiegand);
+
+    if (err_code == NRF_SUCCESS && p_wiegand->evt_handler != NULL)
+    {
+        ble_wiegand_evt_t evt;
+
+        evt.evt_type = BLE_WIEGAND_EVT_TX_TIMING_WRITTEN;
+        p_wiegand->evt_handler(p_wiegand, &evt);
+    }
+    return err_code;
+}
+
+/**@brief Function for handling a write to the TX timing characteristic.
+ *
+ * @param[in]   p_wiegand     Wiegand Service structure.
+ * @param[in]   p_evt_write   Write event received from the BLE stack.
+ */
+static void on_tx_timing_write(ble_wiegand_t * p_wiegand, ble_gatts_evt_write_t * p_evt_write)
+{
+    UNUSED_VARIABLE(tx_timing_set(p_wiegand, p_evt_write->data, p_evt_write->len));
+}
+
+/**@brief Function for handling a write to the clock characteristic.
+ *
+ * @details Setting the clock walks the card store, so it is left to wiegand_task and the
+ *          application refreshes the characteristic on WIEGAND_EVT_CLOCK_SET. Until then,
+ *          or for good if the time is bad, it is put back to the boot time as it was.
+ *
+ * @param[in]   p_wiegand     Wiegand Service structure.
+ * @param[in]   p_evt_write   Write event received from the BLE stack.
+ */
+static void on_clock_write(ble_wiegand_t * p_wiegand, ble_gatts_evt_write_t * p_evt_write)
+{
+    if (p_evt_write->len == BLE_WIEGAND_CLOCK_LEN)
+    {
+        wiegand_clock_request(uint32_decode(p_evt_write->data));
+    }
+    ble_wiegand_clock_update(p_wiegand);
+}
+
+/**@brief Function for handling a write to the control point.
+ *
+ * @details Only queues the command, it runs from the main loop next to the card store.
+ *
+ * @param[in]   p_wiegand     Wiegand Service structure.
+ * @param[in]   p_evt_write   Write event received from the BLE stack.
+ */
+static void on_control_write(ble_wiegand_t * p_wiegand, ble_gatts_evt_write_t * p_evt_write)
+{
+    ble_wiegand_notify_t * p_cmd;
+    uint8_t                next = (p_wiegand->control_head + 1) & (BLE_WIEGAND_CONTROL_QUEUE - 1);
+
+    if (p_evt_write->len < BLE_WIEGAND_CONTROL_HEADER_LEN || p_evt_write->len > BLE_WIEGAND_NOTIFY_LEN ||
+        next == p_wiegand->control_tail)
+    {
+        // nothing to answer to, or no room for the answer
+        p_wiegand->control_dropped++;
+        return;
+    }
+    p_cmd      = &p_wiegand->control_queue[p_wiegand->control_head];
+    p_cmd->len = p_evt_write->len;
+    memcpy(p_cmd->data, p_evt_write->data, p_evt_write->len);
+    p_wiegand->control_head = next;
 }
 
 /**@brief Function for handling the Write event.
@@ -55,29 +379,80 @@ static void on_disconnect(ble_wiegand_t * p_wiegand, ble_evt_t * p_ble_evt)
  */
 static void on_write(ble_wiegand_t * p_wiegand, ble_evt_t * p_ble_evt)
 {
-    uint8_t read_data[10];
-    uint16_t len;
-
     ble_gatts_evt_write_t * p_evt_write = &p_ble_evt->evt.gatts_evt.params.write;
 
+    if (p_evt_write->op == BLE_GATTS_OP_EXEC_WRITE_REQ_NOW)
+    {
+        on_queued_write_exec(p_wiegand);
+        return;
+    }
     if (p_evt_write->handle == p_wiegand->last_cards_handles.cccd_handle)
     {
+        on_last_cards_cccd_write(p_wiegand, p_evt_write);
+        return;
+    }
+    if (p_evt_write->handle == p_wiegand->last_cards_handles.value_handle)
+    {
+        on_last_cards_write(p_wiegand, p_evt_write);
+        return;
+    }
+    if (p_evt_write->handle == p_wiegand->replay_handles.cccd_handle)
+    {
+        if (p_evt_write->len == 2)
+        {
+            p_wiegand->is_replay_notification_enabled = ble_srv_is_notification_enabled(p_evt_write->data);
+        }
         return;
     }
     if (p_evt_write->handle == p_wiegand->replay_handles.value_handle)
     {
-	sd_ble_gatts_value_get(p_wiegand->replay_handles.value_handle, 0, &len, 
-			       read_data);
-    	send_wiegand(read_data[0]);
-    	return;
+        on_replay_write(p_wiegand, p_evt_write);
+        return;
     }
     if (p_evt_write->handle == p_wiegand->send_data_handles.value_handle)
     {
+        // already in the frame, sent once its length is written
+        p_wiegand->send_data_len = p_evt_write->offset + p_evt_write->len;
         return;
     }
     if (p_evt_write->handle == p_wiegand->data_length_handles.value_handle)
     {
-  return;
+        on_custom_frame_written(p_wiegand, p_evt_write->offset == 0 &&
+                                           p_evt_write->len == BLE_WIEGAND_DATA_LENGTH_LEN);
+        return;
+    }
+    if (p_evt_write->handle == p_wiegand->tx_timing_handles.value_handle)
+    {
+        on_tx_timing_write(p_wiegand, p_evt_write);
+        return;
+    }
+    if (p_evt_write->handle == p_wiegand->clock_handles.value_handle)
+    {
+        on_clock_write(p_wiegand, p_evt_write);
+        return;
+    }
+    if (p_evt_write->handle == p_wiegand->export_handles.cccd_handle)
+    {
+        on_export_cccd_write(p_wiegand, p_evt_write);
+        return;
+    }
+    if (p_evt_write->handle == p_wiegand->export_handles.value_handle)
+    {
+        on_export_write(p_wiegand, p_evt_write);
+        return;
+    }
+    if (p_evt_write->handle == p_wiegand->control_handles.cccd_handle)
+    {
+        if (p_evt_write->len == 2)
+        {
+            p_wiegand->is_control_notification_enabled = ble_srv_is_notification_enabled(p_evt_write->data);
+        }
+        return;
+    }
+    if (p_evt_write->handle == p_wiegand->control_handles.value_handle)
+    {
+        on_control_write(p_wiegand, p_evt_write);
+        return;
     }
 
 }
@@ -99,6 +474,22 @@ void ble_wiegand_on_ble_evt(ble_wiegand_t * p_wiegand, ble_evt_t * p_ble_evt)
         on_write(p_wiegand, p_ble_evt);
         break;
 
+    case BLE_EVT_USER_MEM_REQUEST:
+        {
+            // lets clients upload a frame longer than a write in one go
+            ble_user_mem_block_t mem_block;
+
+            mem_block.p_mem = (uint8_t *)p_wiegand->queued_writes;
+            mem_block.len   = sizeof(p_wiegand->queued_writes);
+            UNUSED_VARIABLE(sd_ble_user_mem_reply(p_wiegand->conn_handle, &mem_block));
+        }
+        break;
+
+    case BLE_EVT_TX_COMPLETE:
+        // the main loop refills the buffers when it wakes up
+        p_wiegand->tx_done += p_ble_evt->evt.common_evt.params.tx_complete.count;
+        break;
+
     default:
         // No implementation needed.
         break;
@@ -116,16 +507,27 @@ static uint32_t last_cards_char_add(ble_wiegand_t            * p_wiegand,
                                     const ble_wiegand_init_t * p_wiegand_init)
 {
     ble_gatts_char_md_t char_md;
+    ble_gatts_attr_md_t cccd_md;
     ble_gatts_attr_t    attr_char_value;
     ble_uuid_t          ble_uuid;
     ble_gatts_attr_md_t attr_md;
 
+    memset(&cccd_md, 0, sizeof(cccd_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+    cccd_md.write_perm = p_wiegand_init->wiegand_last_cards_attr_md.cccd_write_perm;
+    cccd_md.vloc       = BLE_GATTS_VLOC_STACK;
+
     memset(&char_md, 0, sizeof(char_md));
 
     char_md.char_props.read = 1;
+    char_md.char_props.write = 1;
+    char_md.char_props.notify = 1;
     char_md.p_char_user_desc  = NULL;
     char_md.p_char_pf         = NULL;
     char_md.p_user_desc_md    = NULL;
+    char_md.p_cccd_md         = &cccd_md;
+    char_md.p_sccd_md         = NULL;
 
     BLE_UUID_BLE_ASSIGN(ble_uuid, BLE_UUID_WIEGAND_LAST_CARDS);
 
@@ -163,16 +565,27 @@ static uint32_t last_cards_char_add(ble_wiegand_t            * p_wiegand,
 static uint32_t replay_char_add(ble_wiegand_t * p_wiegand, const ble_wiegand_init_t * p_wiegand_init)
 {
     ble_gatts_char_md_t char_md;
+    ble_gatts_attr_md_t cccd_md;
     ble_gatts_attr_t    attr_char_value;
     ble_uuid_t          ble_uuid;
     ble_gatts_attr_md_t attr_md;
 
+    memset(&cccd_md, 0, sizeof(cccd_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+    cccd_md.write_perm = p_wiegand_init->wiegand_replay_attr_md.cccd_write_perm;
+    cccd_md.vloc       = BLE_GATTS_VLOC_STACK;
+
     memset(&char_md, 0, sizeof(char_md));
 
+    char_md.char_props.read   = 1;
     char_md.char_props.write  = 1;
+    char_md.char_props.notify = 1;
     char_md.p_char_user_desc = NULL;
     char_md.p_char_pf        = NULL;
     char_md.p_user_desc_md   = NULL;
+    char_md.p_cccd_md        = &cccd_md;
+    char_md.p_sccd_md        = NULL;
 
     BLE_UUID_BLE_ASSIGN(ble_uuid, BLE_UUID_WIEGAND_REPLAY);
 
@@ -183,15 +596,15 @@ static uint32_t replay_char_add(ble_wiegand_t * p_wiegand, const ble_wiegand_ini
     attr_md.vloc       = BLE_GATTS_VLOC_STACK;
     attr_md.rd_auth    = 0;
     attr_md.wr_auth    = 0;
-    attr_md.vlen       = 0;
+    attr_md.vlen       = 1;
 
     memset(&attr_char_value, 0, sizeof(attr_char_value));
 
     attr_char_value.p_uuid    = &ble_uuid;
     attr_char_value.p_attr_md = &attr_md;
-    attr_char_value.init_len  = sizeof (uint8_t);
+    attr_char_value.init_len  = 0;
     attr_char_value.init_offs = 0;
-    attr_char_value.max_len   = sizeof (uint8_t);
+    attr_char_value.max_len   = BLE_WIEGAND_REPLAY_WRITE_LEN;
     attr_char_value.p_value   = 0;
 
     return sd_ble_gatts_characteristic_add(p_wiegand->service_handle,
@@ -200,7 +613,7 @@ static uint32_t replay_char_add(ble_wiegand_t * p_wiegand, const ble_wiegand_ini
                                            &p_wiegand->replay_handles);
 }
 
-/**@brief Function for adding the Body Sensor Location characteristic.
+/**@brief Function for adding the Send Data characteristic, kept in the custom frame.
  *
  * @param[in]   p_wiegand        Heart Rate Service structure.
  * @param[in]   p_wiegand_init   Information needed to initialize the service.
@@ -228,19 +641,19 @@ static uint32_t send_data_char_add(ble_wiegand_t * p_wiegand,
 
     attr_md.read_perm  = p_wiegand_init->wiegand_send_data_attr_md.read_perm;
     attr_md.write_perm = p_wiegand_init->wiegand_send_data_attr_md.write_perm;
-    attr_md.vloc       = BLE_GATTS_VLOC_STACK;
+    attr_md.vloc       = BLE_GATTS_VLOC_USER;
     attr_md.rd_auth    = 0;
     attr_md.wr_auth    = 0;
-    attr_md.vlen       = 0;
+    attr_md.vlen       = 1;
 
     memset(&attr_char_value, 0, sizeof(attr_char_value));
 
     attr_char_value.p_uuid    = &ble_uuid;
     attr_char_value.p_attr_md = &attr_md;
-    attr_char_value.init_len  = BLE_UUID_WIEGAND_SEND_DATA_LEN;
+    attr_char_value.init_len  = 0;
     attr_char_value.init_offs = 0;
     attr_char_value.max_len   = BLE_UUID_WIEGAND_SEND_DATA_LEN;
-    attr_char_value.p_value   = 0;
+    attr_char_value.p_value   = wiegand_tx_custom_get()->data;
 
     return sd_ble_gatts_characteristic_add(p_wiegand->service_handle,
                                            &char_md,
@@ -250,7 +663,7 @@ static uint32_t send_data_char_add(ble_wiegand_t * p_wiegand,
 
 
 
-/**@brief Function for adding the Body Sensor Location characteristic.
+/**@brief Function for adding the Data Length characteristic, kept in the custom frame.
  *
  * @param[in]   p_wiegand        Heart Rate Service structure.
  * @param[in]   p_wiegand_init   Information needed to initialize the service.
@@ -278,7 +691,7 @@ static uint32_t data_length_char_add(ble_wiegand_t * p_wiegand, const ble_wiegan
 
     attr_md.read_perm  = p_wiegand_init->wiegand_data_length_attr_md.read_perm;
     attr_md.write_perm = p_wiegand_init->wiegand_data_length_attr_md.write_perm;
-    attr_md.vloc       = BLE_GATTS_VLOC_STACK;
+    attr_md.vloc       = BLE_GATTS_VLOC_USER;
     attr_md.rd_auth    = 0;
     attr_md.wr_auth    = 0;
     attr_md.vlen       = 0;
@@ -287,10 +700,11 @@ static uint32_t data_length_char_add(ble_wiegand_t * p_wiegand, const ble_wiegan
 
     attr_char_value.p_uuid    = &ble_uuid;
     attr_char_value.p_attr_md = &attr_md;
-    attr_char_value.init_len  = sizeof (uint8_t);
+    attr_char_value.init_len  = BLE_WIEGAND_DATA_LENGTH_LEN;
     attr_char_value.init_offs = 0;
-    attr_char_value.max_len   = sizeof (uint8_t);
-    attr_char_value.p_value   = 0;
+    attr_char_value.max_len   = BLE_WIEGAND_DATA_LENGTH_LEN;
+    // little endian like the CPU, the stack writes the length in place
+    attr_char_value.p_value   = (uint8_t *)&wiegand_tx_custom_get()->bit_len;
 
     return sd_ble_gatts_characteristic_add(p_wiegand->service_handle,
                                            &char_md,
@@ -298,66 +712,410 @@ static uint32_t data_length_char_add(ble_wiegand_t * p_wiegand, const ble_wiegan
                                            &p_wiegand->data_length_handles);
 }
 
-
-uint32_t ble_wiegand_init(ble_wiegand_t * p_wiegand, const ble_wiegand_init_t * p_wiegand_init)
+/**@brief Function for adding the TX timing characteristic.
+ *
+ * @param[in]   p_wiegand        Wiegand Service structure.
+ * @param[in]   p_wiegand_init   Information needed to initialize the service.
+ *
+ * @return      NRF_SUCCESS on success, otherwise an error code.
+ */
+static uint32_t tx_timing_char_add(ble_wiegand_t * p_wiegand, const ble_wiegand_init_t * p_wiegand_init)
 {
-    uint32_t   err_code;
-    ble_uuid_t ble_uuid;
-
-    // Initialize service structure
-    p_wiegand->evt_handler                 = p_wiegand_init->evt_handler;
-    p_wiegand->conn_handle                 = BLE_CONN_HANDLE_INVALID;
-
-    // Add service
-    BLE_UUID_BLE_ASSIGN(ble_uuid, BLE_UUID_WIEGAND_SERVICE);
+    ble_gatts_char_md_t char_md;
+    ble_gatts_attr_t    attr_char_value;
+    ble_uuid_t          ble_uuid;
+    ble_gatts_attr_md_t attr_md;
 
-    err_code = sd_ble_gatts_service_add(BLE_GATTS_SRVC_TYPE_PRIMARY,
-                                        &ble_uuid,
-                                        &p_wiegand->service_handle);
+    memset(&char_md, 0, sizeof(char_md));
 
-    if (err_code != NRF_SUCCESS)
-    {
-        return err_code;
-    }
+    char_md.char_props.read  = 1;
+    char_md.char_props.write = 1;
+    char_md.p_char_user_desc = NULL;
+    char_md.p_char_pf        = NULL;
+    char_md.p_user_desc_md   = NULL;
 
-    // Add last_card characteristic
-    err_code = last_cards_char_add(p_wiegand, p_wiegand_init);
-    if (err_code != NRF_SUCCESS)
-    {
-        return err_code;
-    }
+    BLE_UUID_BLE_ASSIGN(ble_uuid, BLE_UUID_WIEGAND_TX_TIMING);
 
-    // Add replay characteristic
-    err_code = replay_char_add(p_wiegand, p_wiegand_init);
-    if (err_code != NRF_SUCCESS)
-    {
-        return err_code;
-    }
+    memset(&attr_md, 0, sizeof(attr_md));
 
-    // Add send_data characteristic
-    err_code = send_data_char_add(p_wiegand, p_wiegand_init);
-    if (err_code != NRF_SUCCESS)
-    {
-        return err_code;
-    }
+    attr_md.read_perm  = p_wiegand_init->wiegand_tx_timing_attr_md.read_perm;
+    attr_md.write_perm = p_wiegand_init->wiegand_tx_timing_attr_md.write_perm;
+    attr_md.vloc       = BLE_GATTS_VLOC_STACK;
+    attr_md.rd_auth    = 0;
+    attr_md.wr_auth    = 0;
+    attr_md.vlen       = 1;
 
-    // Add data_length characteristic
-    err_code = data_length_char_add(p_wiegand, p_wiegand_init);
-    if (err_code != NRF_SUCCESS)
-    {
-        return err_code;
-    }
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
 
+    attr_char_value.p_uuid    = &ble_uuid;
+    attr_char_value.p_attr_md = &attr_md;
+    attr_char_value.init_len  = 0;
+    attr_char_value.init_offs = 0;
+    attr_char_value.max_len   = BLE_WIEGAND_TX_TIMING_LEN;
+    attr_char_value.p_value   = 0;
 
-    return NRF_SUCCESS;
+    return sd_ble_gatts_characteristic_add(p_wiegand->service_handle,
+                                           &char_md,
+                                           &attr_char_value,
+                                           &p_wiegand->tx_timing_handles);
 }
 
-uint32_t ble_wiegand_sensor_contact_supported_set(ble_wiegand_t * p_wiegand, bool is_sensor_contact_supported)
+/**@brief Function for adding the clock characteristic.
+ *
+ * @param[in]   p_wiegand        Wiegand Service structure.
+ * @param[in]   p_wiegand_init   Information needed to initialize the service.
+ *
+ * @return      NRF_SUCCESS on success, otherwise an error code.
+ */
+static uint32_t clock_char_add(ble_wiegand_t * p_wiegand, const ble_wiegand_init_t * p_wiegand_init)
 {
-    // Check if we are connected to peer
-    if (p_wiegand->conn_handle == BLE_CONN_HANDLE_INVALID)
-    {
-        p_wiegand->is_sensor_contact_supported = is_sensor_contact_supported;
+    ble_gatts_char_md_t char_md;
+    ble_gatts_attr_t    attr_char_value;
+    ble_uuid_t          ble_uuid;
+    ble_gatts_attr_md_t attr_md;
+
+    memset(&char_md, 0, sizeof(char_md));
+
+    char_md.char_props.read  = 1;
+    char_md.char_props.write = 1;
+    char_md.p_char_user_desc = NULL;
+    char_md.p_char_pf        = NULL;
+    char_md.p_user_desc_md   = NULL;
+
+    BLE_UUID_BLE_ASSIGN(ble_uuid, BLE_UUID_WIEGAND_CLOCK);
+
+    memset(&attr_md, 0, sizeof(attr_md));
+
+    attr_md.read_perm  = p_wiegand_init->wiegand_clock_attr_md.read_perm;
+    attr_md.write_perm = p_wiegand_init->wiegand_clock_attr_md.write_perm;
+    attr_md.vloc       = BLE_GATTS_VLOC_STACK;
+    attr_md.rd_auth    = 0;
+    attr_md.wr_auth    = 0;
+    attr_md.vlen       = 0;
+
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+
+    attr_char_value.p_uuid    = &ble_uuid;
+    attr_char_value.p_attr_md = &attr_md;
+    attr_char_value.init_len  = BLE_WIEGAND_CLOCK_LEN;
+    attr_char_value.init_offs = 0;
+    attr_char_value.max_len   = BLE_WIEGAND_CLOCK_LEN;
+    attr_char_value.p_value   = 0;
+
+    return sd_ble_gatts_characteristic_add(p_wiegand->service_handle,
+                                           &char_md,
+                                           &attr_char_value,
+                                           &p_wiegand->clock_handles);
+}
+
+/**@brief Function for adding the export characteristic.
+ *
+ * @param[in]   p_wiegand        Wiegand Service structure.
+ * @param[in]   p_wiegand_init   Information needed to initialize the service.
+ *
+ * @return      NRF_SUCCESS on success, otherwise an error code.
+ */
+static uint32_t export_char_add(ble_wiegand_t * p_wiegand, const ble_wiegand_init_t * p_wiegand_init)
+{
+    ble_gatts_char_md_t char_md;
+    ble_gatts_attr_md_t cccd_md;
+    ble_gatts_attr_t    attr_char_value;
+    ble_uuid_t          ble_uuid;
+    ble_gatts_attr_md_t attr_md;
+
+    memset(&cccd_md, 0, sizeof(cccd_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+    cccd_md.write_perm = p_wiegand_init->wiegand_export_attr_md.cccd_write_perm;
+    cccd_md.vloc       = BLE_GATTS_VLOC_STACK;
+
+    memset(&char_md, 0, sizeof(char_md));
+
+    char_md.char_props.read   = 1;
+    char_md.char_props.write  = 1;
+    char_md.char_props.notify = 1;
+    char_md.p_char_user_desc  = NULL;
+    char_md.p_char_pf         = NULL;
+    char_md.p_user_desc_md    = NULL;
+    char_md.p_cccd_md         = &cccd_md;
+    char_md.p_sccd_md         = NULL;
+
+    BLE_UUID_BLE_ASSIGN(ble_uuid, BLE_UUID_WIEGAND_EXPORT);
+
+    memset(&attr_md, 0, sizeof(attr_md));
+
+    attr_md.read_perm  = p_wiegand_init->wiegand_export_attr_md.read_perm;
+    attr_md.write_perm = p_wiegand_init->wiegand_export_attr_md.write_perm;
+    attr_md.vloc       = BLE_GATTS_VLOC_STACK;
+    attr_md.rd_auth    = 0;
+    attr_md.wr_auth    = 0;
+    attr_md.vlen       = 1;
+
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+
+    attr_char_value.p_uuid    = &ble_uuid;
+    attr_char_value.p_attr_md = &attr_md;
+    attr_char_value.init_len  = 0;
+    attr_char_value.init_offs = 0;
+    attr_char_value.max_len   = BLE_WIEGAND_EXPORT_LEN > BLE_WIEGAND_NOTIFY_LEN ? BLE_WIEGAND_EXPORT_LEN
+                                                                               : BLE_WIEGAND_NOTIFY_LEN;
+    attr_char_value.p_value   = 0;
+
+    return sd_ble_gatts_characteristic_add(p_wiegand->service_handle,
+                                           &char_md,
+                                           &attr_char_value,
+                                           &p_wiegand->export_handles);
+}
+
+
+/**@brief Function for adding the connection characteristic.
+ *
+ * @param[in]   p_wiegand        Wiegand Service structure.
+ * @param[in]   p_wiegand_init   Information needed to initialize the service.
+ *
+ * @return      NRF_SUCCESS on success, otherwise an error code.
+ */
+static uint32_t conn_char_add(ble_wiegand_t * p_wiegand, const ble_wiegand_init_t * p_wiegand_init)
+{
+    ble_gatts_char_md_t char_md;
+    ble_gatts_attr_t    attr_char_value;
+    ble_uuid_t          ble_uuid;
+    ble_gatts_attr_md_t attr_md;
+
+    memset(&char_md, 0, sizeof(char_md));
+
+    char_md.char_props.read  = 1;
+    char_md.p_char_user_desc = NULL;
+    char_md.p_char_pf        = NULL;
+    char_md.p_user_desc_md   = NULL;
+
+    BLE_UUID_BLE_ASSIGN(ble_uuid, BLE_UUID_WIEGAND_CONN);
+
+    memset(&attr_md, 0, sizeof(attr_md));
+
+    attr_md.read_perm  = p_wiegand_init->wiegand_conn_attr_md.read_perm;
+    attr_md.write_perm = p_wiegand_init->wiegand_conn_attr_md.write_perm;
+    attr_md.vloc       = BLE_GATTS_VLOC_STACK;
+    attr_md.rd_auth    = 0;
+    attr_md.wr_auth    = 0;
+    attr_md.vlen       = 0;
+
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+
+    attr_char_value.p_uuid    = &ble_uuid;
+    attr_char_value.p_attr_md = &attr_md;
+    attr_char_value.init_len  = BLE_WIEGAND_CONN_LEN;
+    attr_char_value.init_offs = 0;
+    attr_char_value.max_len   = BLE_WIEGAND_CONN_LEN;
+    attr_char_value.p_value   = 0;
+
+    return sd_ble_gatts_characteristic_add(p_wiegand->service_handle,
+                                           &char_md,
+                                           &attr_char_value,
+                                           &p_wiegand->conn_handles);
+}
+
+
+/**@brief Function for adding the control point characteristic.
+ *
+ * @param[in]   p_wiegand        Wiegand Service structure.
+ * @param[in]   p_wiegand_init   Information needed to initialize the service.
+ *
+ * @return      NRF_SUCCESS on success, otherwise an error code.
+ */
+static uint32_t control_char_add(ble_wiegand_t * p_wiegand, const ble_wiegand_init_t * p_wiegand_init)
+{
+    ble_gatts_char_md_t char_md;
+    ble_gatts_attr_md_t cccd_md;
+    ble_gatts_attr_t    attr_char_value;
+    ble_uuid_t          ble_uuid;
+    ble_gatts_attr_md_t attr_md;
+
+    memset(&cccd_md, 0, sizeof(cccd_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+    cccd_md.write_perm = p_wiegand_init->wiegand_control_attr_md.cccd_write_perm;
+    cccd_md.vloc       = BLE_GATTS_VLOC_STACK;
+
+    memset(&char_md, 0, sizeof(char_md));
+
+    char_md.char_props.write_wo_resp = 1;
+    char_md.char_props.write         = 1;
+    char_md.char_props.notify        = 1;
+    char_md.p_char_user_desc         = NULL;
+    char_md.p_char_pf                = NULL;
+    char_md.p_user_desc_md           = NULL;
+    char_md.p_cccd_md                = &cccd_md;
+    char_md.p_sccd_md                = NULL;
+
+    BLE_UUID_BLE_ASSIGN(ble_uuid, BLE_UUID_WIEGAND_CONTROL);
+
+    memset(&attr_md, 0, sizeof(attr_md));
+
+    attr_md.read_perm  = p_wiegand_init->wiegand_control_attr_md.read_perm;
+    attr_md.write_perm = p_wiegand_init->wiegand_control_attr_md.write_perm;
+    attr_md.vloc       = BLE_GATTS_VLOC_STACK;
+    attr_md.rd_auth    = 0;
+    attr_md.wr_auth    = 0;
+    attr_md.vlen       = 1;
+
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+
+    attr_char_value.p_uuid    = &ble_uuid;
+    attr_char_value.p_attr_md = &attr_md;
+    attr_char_value.init_len  = 0;
+    attr_char_value.init_offs = 0;
+    attr_char_value.max_len   = BLE_WIEGAND_NOTIFY_LEN;
+    attr_char_value.p_value   = 0;
+
+    return sd_ble_gatts_characteristic_add(p_wiegand->service_handle,
+                                           &char_md,
+                                           &attr_char_value,
+                                           &p_wiegand->control_handles);
+}
+
+
+uint32_t ble_wiegand_init(ble_wiegand_t * p_wiegand, const ble_wiegand_init_t * p_wiegand_init)
+{
+    uint32_t   err_code;
+    ble_uuid_t ble_uuid;
+
+    // Initialize service structure
+    p_wiegand->evt_handler                 = p_wiegand_init->evt_handler;
+    p_wiegand->conn_handle                 = BLE_CONN_HANDLE_INVALID;
+    p_wiegand->is_notification_enabled     = false;
+    p_wiegand->is_replay_notification_enabled = false;
+    p_wiegand->is_replay_notify_pending       = false;
+    p_wiegand->tx_count                    = 1;
+    p_wiegand->tx_sent                     = 0;
+    p_wiegand->tx_done                     = 0;
+    p_wiegand->is_tx_full                  = false;
+    p_wiegand->is_sync                     = false;
+    p_wiegand->sync_seq                    = 0;
+    p_wiegand->is_sync_release             = false;
+    p_wiegand->send_data_len               = 0;
+    p_wiegand->p_last_cards                = NULL;
+    p_wiegand->last_cards_len              = 0;
+    p_wiegand->notify_head                 = 0;
+    p_wiegand->notify_tail                 = 0;
+    p_wiegand->notify_dropped              = 0;
+    p_wiegand->p_card_store                = p_wiegand_init->p_card_store;
+    p_wiegand->is_export_enabled           = false;
+    p_wiegand->is_export_requested         = false;
+    p_wiegand->is_exporting                = false;
+    p_wiegand->export_records              = 0;
+    p_wiegand->export_bytes                = 0;
+    p_wiegand->export_ms                   = 0;
+    p_wiegand->export_rate                 = 0;
+    p_wiegand->is_control_notification_enabled = false;
+    p_wiegand->control_head                = 0;
+    p_wiegand->control_run                 = 0;
+    p_wiegand->control_tail                = 0;
+    p_wiegand->control_dropped             = 0;
+
+    // Add service
+    BLE_UUID_BLE_ASSIGN(ble_uuid, BLE_UUID_WIEGAND_SERVICE);
+
+    err_code = sd_ble_gatts_service_add(BLE_GATTS_SRVC_TYPE_PRIMARY,
+                                        &ble_uuid,
+                                        &p_wiegand->service_handle);
+
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    // Add last_card characteristic
+    err_code = last_cards_char_add(p_wiegand, p_wiegand_init);
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    // Add replay characteristic
+    err_code = replay_char_add(p_wiegand, p_wiegand_init);
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    err_code = ble_wiegand_replay_status_update(p_wiegand, false);
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    // Add send_data characteristic
+    err_code = send_data_char_add(p_wiegand, p_wiegand_init);
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    // Add data_length characteristic
+    err_code = data_length_char_add(p_wiegand, p_wiegand_init);
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    // Add tx_timing characteristic
+    err_code = tx_timing_char_add(p_wiegand, p_wiegand_init);
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    err_code = ble_wiegand_tx_timing_update(p_wiegand);
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    // Add clock characteristic
+    err_code = clock_char_add(p_wiegand, p_wiegand_init);
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    err_code = ble_wiegand_clock_update(p_wiegand);
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    // Add export characteristic
+    err_code = export_char_add(p_wiegand, p_wiegand_init);
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    // Add connection characteristic
+    err_code = conn_char_add(p_wiegand, p_wiegand_init);
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+    // Add control point characteristic
+    err_code = control_char_add(p_wiegand, p_wiegand_init);
+    if (err_code != NRF_SUCCESS)
+    {
+        return err_code;
+    }
+
+
+    return NRF_SUCCESS;
+}
+
+uint32_t ble_wiegand_sensor_contact_supported_set(ble_wiegand_t * p_wiegand, bool is_sensor_contact_supported)
+{
+    // Check if we are connected to peer
+    if (p_wiegand->conn_handle == BLE_CONN_HANDLE_INVALID)
+    {
+        p_wiegand->is_sensor_contact_supported = is_sensor_contact_supported;
         return NRF_SUCCESS;
     }
     else
@@ -378,8 +1136,512 @@ uint32_t ble_wiegand_body_sensor_location_set(ble_wiegand_t * p_wiegand, uint8_t
     return sd_ble_gatts_value_set(p_wiegand->replay_handles.value_handle, 0, &len, &body_sensor_location);
 }
 
-uint32_t ble_wiegand_last_cards_set(ble_wiegand_t * p_wiegand, uint8_t *cards, uint16_t len)
+uint32_t ble_wiegand_last_cards_set(ble_wiegand_t * p_wiegand, const uint8_t *cards, uint16_t len)
 {
+    p_wiegand->p_last_cards   = cards;
+    p_wiegand->last_cards_len = len;
     return sd_ble_gatts_value_set(p_wiegand->last_cards_handles.value_handle,
                                   0, &len, cards);
 }
+
+uint32_t ble_wiegand_card_notify(ble_wiegand_t * p_wiegand, const uint8_t *entry, uint16_t len)
+{
+    ble_wiegand_notify_t * p_notify;
+    uint8_t                next = (p_wiegand->notify_head + 1) & (BLE_WIEGAND_NOTIFY_QUEUE - 1);
+
+    if (p_wiegand->conn_handle == BLE_CONN_HANDLE_INVALID || !p_wiegand->is_notification_enabled)
+    {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    if (next == p_wiegand->notify_tail)
+    {
+        p_wiegand->notify_dropped++;
+        return NRF_ERROR_NO_MEM;
+    }
+    p_notify      = &p_wiegand->notify_queue[p_wiegand->notify_head];
+    p_notify->len = len <= BLE_WIEGAND_NOTIFY_LEN ? len : 0;
+    memcpy(p_notify->data, entry, p_notify->len);
+    p_wiegand->notify_head = next;
+    return NRF_SUCCESS;
+}
+
+/**@brief Function for checking a notification can go out now.
+ *
+ * @param[in]   p_wiegand   Wiegand Service structure.
+ *
+ * @return      TRUE if the stack has a TX buffer free.
+ */
+static bool tx_buffer_free(ble_wiegand_t * p_wiegand)
+{
+    uint32_t done = p_wiegand->tx_done;
+
+    if ((int32_t)(p_wiegand->tx_sent - done) < 0)
+    {
+        // other services' notifications completed too
+        p_wiegand->tx_sent = done;
+    }
+    if (p_wiegand->is_tx_full && done == p_wiegand->tx_full_done)
+    {
+        return false;
+    }
+    p_wiegand->is_tx_full = false;
+    return p_wiegand->tx_sent - done < p_wiegand->tx_count;
+}
+
+/**@brief Function for handing a notification to the stack.
+ *
+ * @param[in]   p_wiegand   Wiegand Service structure.
+ * @param[in]   handle      Value handle of the characteristic.
+ * @param[in]   p_data      Notification data.
+ * @param[in]   len         Length of p_data.
+ *
+ * @return      The result of sd_ble_gatts_hvx.
+ */
+static uint32_t notification_send(ble_wiegand_t * p_wiegand, uint16_t handle, uint8_t * p_data, uint16_t len)
+{
+    ble_gatts_hvx_params_t hvx_params;
+    uint32_t               done = p_wiegand->tx_done;
+    uint32_t               err_code;
+
+    memset(&hvx_params, 0, sizeof(hvx_params));
+
+    hvx_params.handle = handle;
+    hvx_params.type   = BLE_GATT_HVX_NOTIFICATION;
+    hvx_params.offset = 0;
+    hvx_params.p_len  = &len;
+    hvx_params.p_data = p_data;
+
+    err_code = sd_ble_gatts_hvx(p_wiegand->conn_handle, &hvx_params);
+    if (err_code == NRF_SUCCESS)
+    {
+        p_wiegand->tx_sent++;
+    }
+    else if (err_code == BLE_ERROR_NO_TX_BUFFERS)
+    {
+        // other services hold the rest, wait for the next BLE_EVT_TX_COMPLETE
+        p_wiegand->is_tx_full   = true;
+        p_wiegand->tx_full_done = done;
+    }
+    return err_code;
+}
+
+/**@brief Function for sending queued card notifications.
+ *
+ * @param[in]   p_wiegand   Wiegand Service structure.
+ */
+static void card_notify_send(ble_wiegand_t * p_wiegand)
+{
+    bool sent = false;
+
+    if (p_wiegand->conn_handle == BLE_CONN_HANDLE_INVALID || !p_wiegand->is_notification_enabled)
+    {
+        // nobody to tell any more
+        p_wiegand->notify_tail = p_wiegand->notify_head;
+        return;
+    }
+    while (p_wiegand->notify_tail != p_wiegand->notify_head && tx_buffer_free(p_wiegand))
+    {
+        ble_wiegand_notify_t * p_notify = &p_wiegand->notify_queue[p_wiegand->notify_tail];
+
+        sent = true;
+        if (notification_send(p_wiegand, p_wiegand->last_cards_handles.value_handle,
+                              p_notify->data, p_notify->len) == BLE_ERROR_NO_TX_BUFFERS)
+        {
+            break;
+        }
+        // anything else will not go any better next time
+        p_wiegand->notify_tail = (p_wiegand->notify_tail + 1) & (BLE_WIEGAND_NOTIFY_QUEUE - 1);
+    }
+    if (sent && p_wiegand->p_last_cards != NULL)
+    {
+        // the notification data became the value, put the last cards back
+        uint16_t len = p_wiegand->last_cards_len;
+        UNUSED_VARIABLE(sd_ble_gatts_value_set(p_wiegand->last_cards_handles.value_handle,
+                                               0, &len, p_wiegand->p_last_cards));
+    }
+}
+
+/**@brief Function for notifying the replay job status once a job has ended.
+ *
+ * @param[in]   p_wiegand   Wiegand Service structure.
+ */
+static void replay_notify_send(ble_wiegand_t * p_wiegand)
+{
+    uint32_t err_code;
+
+    if (!p_wiegand->is_replay_notify_pending || !tx_buffer_free(p_wiegand))
+    {
+        return;
+    }
+    if (p_wiegand->conn_handle == BLE_CONN_HANDLE_INVALID || !p_wiegand->is_replay_notification_enabled)
+    {
+        p_wiegand->is_replay_notify_pending = false;
+        return;
+    }
+    // no data, the stack sends the value the status update left
+    err_code = notification_send(p_wiegand, p_wiegand->replay_handles.value_handle,
+                                 NULL, BLE_WIEGAND_REPLAY_STATUS_LEN);
+    if (err_code != BLE_ERROR_NO_TX_BUFFERS)
+    {
+        p_wiegand->is_replay_notify_pending = false;
+    }
+}
+
+/**@brief Function for finishing an export, the result becomes the export value.
+ *
+ * @param[in]   p_wiegand   Wiegand Service structure.
+ */
+static void export_done(ble_wiegand_t * p_wiegand)
+{
+    uint8_t  value[BLE_WIEGAND_EXPORT_LEN];
+    uint16_t len   = BLE_WIEGAND_EXPORT_LEN;
+    uint64_t ticks = wiegand_clock_ticks() - p_wiegand->export_start_ticks;
+
+    p_wiegand->is_exporting = false;
+    p_wiegand->export_ms    = (uint32_t)(ticks * 1000 / APP_TIMER_CLOCK_FREQ);
+    p_wiegand->export_rate  = ticks ? (uint32_t)((uint64_t)p_wiegand->export_bytes * APP_TIMER_CLOCK_FREQ / ticks)
+                                    : 0;
+
+    UNUSED_VARIABLE(uint32_encode(p_wiegand->export_records, &value[0]));
+    UNUSED_VARIABLE(uint32_encode(p_wiegand->export_bytes, &value[4]));
+    UNUSED_VARIABLE(uint32_encode(p_wiegand->export_rate, &value[8]));
+    UNUSED_VARIABLE(sd_ble_gatts_value_set(p_wiegand->export_handles.value_handle, 0, &len, value));
+
+    if (p_wiegand->evt_handler != NULL)
+    {
+        ble_wiegand_evt_t evt;
+
+        evt.evt_type = BLE_WIEGAND_EVT_EXPORT_DONE;
+        p_wiegand->evt_handler(p_wiegand, &evt);
+    }
+}
+
+/**@brief Function for sending the export, a piece per TX buffer.
+ *
+ * @details Records are coded just before they are sent, so cards read meanwhile are exported
+ *          too and records that made way for them are skipped.
+ *
+ * @param[in]   p_wiegand   Wiegand Service structure.
+ */
+static void export_send(ble_wiegand_t * p_wiegand)
+{
+    const card_store_t * p_store = p_wiegand->p_card_store;
+    const uint8_t *      p_rec;
+
+    if (p_wiegand->is_export_requested)
+    {
+        uint32_t seq = p_wiegand->export_start_seq;
+
+        p_wiegand->is_export_requested = false;
+        if (p_store == NULL)
+        {
+            return;
+        }
+        // older records than the oldest stored are skipped
+        if ((int32_t)(seq - p_store->first_seq) < 0)
+        {
+            seq = p_store->first_seq;
+        }
+        p_wiegand->is_exporting        = true;
+        p_wiegand->export_seq          = seq;
+        p_wiegand->export_fill         = CARD_CODEC_HEADER_LEN;
+        p_wiegand->export_records      = 0;
+        p_wiegand->export_bytes        = 0;
+        p_wiegand->export_start_ticks  = wiegand_clock_ticks();
+        card_codec_header_put(p_wiegand->export_buf, CARD_CODEC_COUNT_OPEN, seq);
+        card_codec_start(&p_wiegand->export_codec, seq);
+    }
+    if (!p_wiegand->is_exporting)
+    {
+        return;
+    }
+    if (p_wiegand->conn_handle == BLE_CONN_HANDLE_INVALID || !p_wiegand->is_export_enabled)
+    {
+        p_wiegand->is_exporting = false;
+        return;
+    }
+    // the store only changes between main loop passes, walk it from here on
+    p_rec = card_store_record(p_store, p_wiegand->export_seq, NULL);
+    while (tx_buffer_free(p_wiegand))
+    {
+        uint16_t len;
+        uint32_t err_code;
+
+        while (p_wiegand->export_fill < BLE_WIEGAND_NOTIFY_LEN)
+        {
+            if (p_rec == NULL)
+            {
+                if (p_store->count == 0 || (int32_t)(p_wiegand->export_seq - p_store->first_seq) >= 0)
+                {
+                    break;
+                }
+                // the records left were dropped meanwhile, go on from the oldest
+                p_wiegand->export_seq = p_store->first_seq;
+                p_rec                 = card_store_record(p_store, p_wiegand->export_seq, NULL);
+                continue;
+            }
+            p_wiegand->export_fill += card_codec_encode(&p_wiegand->export_codec, p_wiegand->export_seq,
+                                                        p_rec, &p_wiegand->export_buf[p_wiegand->export_fill]);
+            p_wiegand->export_seq++;
+            p_wiegand->export_records++;
+            p_rec = card_store_next(p_store, p_rec);
+        }
+
+        // the empty piece after the last one ends the export
+        len      = MIN(p_wiegand->export_fill, BLE_WIEGAND_NOTIFY_LEN);
+        err_code = notification_send(p_wiegand, p_wiegand->export_handles.value_handle,
+                                     p_wiegand->export_buf, len);
+        if (err_code == BLE_ERROR_NO_TX_BUFFERS)
+        {
+            return;
+        }
+        if (err_code != NRF_SUCCESS)
+        {
+            // disconnected or notifications turned off under us
+            p_wiegand->is_exporting = false;
+            return;
+        }
+        p_wiegand->export_bytes += len;
+        p_wiegand->export_fill  -= len;
+        memmove(p_wiegand->export_buf, &p_wiegand->export_buf[len], p_wiegand->export_fill);
+        if (len == 0)
+        {
+            export_done(p_wiegand);
+            return;
+        }
+    }
+}
+
+/**@brief Function for giving the control point result code for an error code.
+ *
+ * @param[in]   err_code   NRF_SUCCESS or the error a command ended with.
+ *
+ * @return      The ble_wiegand_control_status_t sent back for it.
+ */
+static uint16_t control_status(uint32_t err_code)
+{
+    switch (err_code)
+    {
+        case NRF_SUCCESS:
+            return BLE_WIEGAND_CONTROL_OK;
+
+        case NRF_ERROR_NO_MEM:
+            return BLE_WIEGAND_CONTROL_QUEUE_FULL;
+
+        case NRF_ERROR_NOT_SUPPORTED:
+            return BLE_WIEGAND_CONTROL_NOT_SUPPORTED;
+
+        case NRF_ERROR_INVALID_PARAM:
+            return BLE_WIEGAND_CONTROL_BAD_PARAM;
+
+        case NRF_ERROR_INVALID_STATE:
+            return BLE_WIEGAND_CONTROL_NOT_NOW;
+
+        case NRF_ERROR_INVALID_LENGTH:
+            return BLE_WIEGAND_CONTROL_BAD_LENGTH;
+
+        default:
+            return BLE_WIEGAND_CONTROL_FAILED;
+    }
+}
+
+/**@brief Function for running a control point command, it is replaced by its result.
+ *
+ * @param[in]   p_wiegand   Wiegand Service structure.
+ * @param[in]   p_cmd       Command as written.
+ */
+static void control_cmd_run(ble_wiegand_t * p_wiegand, ble_wiegand_notify_t * p_cmd)
+{
+    uint8_t   params[BLE_WIEGAND_NOTIFY_LEN];
+    uint16_t  len     = p_cmd->len - BLE_WIEGAND_CONTROL_HEADER_LEN;
+    uint8_t * p_out   = &p_cmd->data[BLE_WIEGAND_CONTROL_RESULT_LEN];
+    uint16_t  out_len = 0;
+    uint32_t  result;
+
+    // the result goes where the parameters were
+    memcpy(params, &p_cmd->data[BLE_WIEGAND_CONTROL_HEADER_LEN], len);
+    switch (p_cmd->data[0])
+    {
+        case BLE_WIEGAND_CONTROL_REPLAY:
+            result = replay_jobs_add(params, len, p_out);
+            out_len = 1;
+            UNUSED_VARIABLE(ble_wiegand_replay_status_update(p_wiegand, false));
+            break;
+
+        case BLE_WIEGAND_CONTROL_CLEAR:
+            if (len != 0 && len != 4)
+            {
+                result = NRF_ERROR_INVALID_LENGTH;
+            }
+            else if (p_wiegand->evt_handler == NULL || p_wiegand->p_card_store == NULL)
+            {
+                result = NRF_ERROR_NOT_SUPPORTED;
+            }
+            else
+            {
+                ble_wiegand_evt_t evt;
+
+                evt.evt_type  = BLE_WIEGAND_EVT_CLEAR_REQUESTED;
+                evt.clear_seq = len ? uint32_decode(params) : card_store_next_seq(p_wiegand->p_card_store);
+                evt.cleared   = 0;
+                p_wiegand->evt_handler(p_wiegand, &evt);
+                result  = NRF_SUCCESS;
+                out_len = uint16_encode(evt.cleared, p_out);
+            }
+            break;
+
+        case BLE_WIEGAND_CONTROL_TIME:
+            if (len != BLE_WIEGAND_CLOCK_LEN)
+            {
+                result = NRF_ERROR_INVALID_LENGTH;
+                break;
+            }
+            result = wiegand_clock_set(uint32_decode(params));
+            UNUSED_VARIABLE(ble_wiegand_clock_update(p_wiegand));
+            out_len = uint32_encode(wiegand_clock_boot_time(), p_out);
+            break;
+
+        case BLE_WIEGAND_CONTROL_PROFILE:
+            result = tx_timing_set(p_wiegand, params, len);
+            p_out[out_len++] = wiegand_tx_profile_get(NULL) |
+                               (wiegand_tx_loopback_get() ? BLE_WIEGAND_TX_LOOPBACK : 0);
+            break;
+
+        case BLE_WIEGAND_CONTROL_EXPORT:
+            if (len != BLE_WIEGAND_EXPORT_START_LEN)
+            {
+                result = NRF_ERROR_INVALID_LENGTH;
+            }
+            else if (p_wiegand->p_card_store == NULL || !p_wiegand->is_export_enabled)
+            {
+                // nowhere to send it
+                result = NRF_ERROR_INVALID_STATE;
+            }
+            else
+            {
+                // export_send picks it up straight after
+                p_wiegand->export_start_seq    = uint32_decode(params);
+                p_wiegand->is_export_requested = true;
+                result = NRF_SUCCESS;
+            }
+            break;
+
+        default:
+            result = NRF_ERROR_NOT_SUPPORTED;
+            break;
+    }
+    UNUSED_VARIABLE(uint16_encode(control_status(result), &p_cmd->data[BLE_WIEGAND_CONTROL_HEADER_LEN]));
+    p_cmd->len = BLE_WIEGAND_CONTROL_RESULT_LEN + out_len;
+}
+
+/**@brief Function for running the control point commands written and notifying their results.
+ *
+ * @param[in]   p_wiegand   Wiegand Service structure.
+ */
+static void control_task(ble_wiegand_t * p_wiegand)
+{
+    uint8_t head = p_wiegand->control_head;
+
+    for (; p_wiegand->control_run != head;
+         p_wiegand->control_run = (p_wiegand->control_run + 1) & (BLE_WIEGAND_CONTROL_QUEUE - 1))
+    {
+        control_cmd_run(p_wiegand, &p_wiegand->control_queue[p_wiegand->control_run]);
+    }
+    if (p_wiegand->conn_handle == BLE_CONN_HANDLE_INVALID || !p_wiegand->is_control_notification_enabled)
+    {
+        // the commands ran, nobody to tell
+        p_wiegand->control_tail = p_wiegand->control_run;
+        return;
+    }
+    while (p_wiegand->control_tail != p_wiegand->control_run && tx_buffer_free(p_wiegand))
+    {
+        ble_wiegand_notify_t * p_result = &p_wiegand->control_queue[p_wiegand->control_tail];
+
+        if (notification_send(p_wiegand, p_wiegand->control_handles.value_handle,
+                              p_result->data, p_result->len) == BLE_ERROR_NO_TX_BUFFERS)
+        {
+            break;
+        }
+        p_wiegand->control_tail = (p_wiegand->control_tail + 1) & (BLE_WIEGAND_CONTROL_QUEUE - 1);
+    }
+}
+
+void ble_wiegand_notify_task(ble_wiegand_t * p_wiegand)
+{
+    card_notify_send(p_wiegand);
+    control_task(p_wiegand);
+    replay_notify_send(p_wiegand);
+    export_send(p_wiegand);
+}
+
+uint32_t ble_wiegand_tx_timing_update(ble_wiegand_t * p_wiegand)
+{
+    const wiegand_tx_measure_t * p_measure = wiegand_tx_measure_get();
+    wiegand_tx_timing_t          timing;
+    uint8_t                      value[BLE_WIEGAND_TX_TIMING_LEN];
+    uint16_t                     len = 0;
+
+    value[len++] = wiegand_tx_profile_get(&timing) |
+                   (wiegand_tx_loopback_get() ? BLE_WIEGAND_TX_LOOPBACK : 0);
+    len += uint16_encode(timing.pulse_us, &value[len]);
+    len += uint16_encode(timing.period_us, &value[len]);
+    len += uint16_encode(timing.gap_ms, &value[len]);
+    len += uint16_encode(p_measure->pulses, &value[len]);
+    len += uint16_encode(p_measure->missed, &value[len]);
+    len += uint16_encode(p_measure->pulse_min_us, &value[len]);
+    len += uint16_encode(p_measure->pulse_max_us, &value[len]);
+    len += uint16_encode(p_measure->period_min_us, &value[len]);
+    len += uint16_encode(p_measure->period_max_us, &value[len]);
+
+    return sd_ble_gatts_value_set(p_wiegand->tx_timing_handles.value_handle, 0, &len, value);
+}
+
+uint32_t ble_wiegand_replay_status_update(ble_wiegand_t * p_wiegand, bool notify)
+{
+    const wiegand_tx_job_status_t * p_status = wiegand_tx_job_status_get();
+    uint8_t                         value[BLE_WIEGAND_REPLAY_STATUS_LEN];
+    uint16_t                        len = BLE_WIEGAND_REPLAY_STATUS_LEN;
+    uint32_t                        err_code;
+
+    value[0] = p_status->queued;
+    value[1] = p_status->left;
+    UNUSED_VARIABLE(uint16_encode(p_status->card_idx, &value[2]));
+    UNUSED_VARIABLE(uint16_encode(p_status->done, &value[4]));
+    UNUSED_VARIABLE(uint16_encode(p_status->failed, &value[6]));
+    UNUSED_VARIABLE(uint16_encode(p_status->rejected, &value[8]));
+    UNUSED_VARIABLE(uint16_encode((uint16_t)p_status->last_err, &value[10]));
+
+    err_code = sd_ble_gatts_value_set(p_wiegand->replay_handles.value_handle, 0, &len, value);
+    if (err_code == NRF_SUCCESS && notify)
+    {
+        // sent from the main loop with the other notifications
+        p_wiegand->is_replay_notify_pending = true;
+    }
+    return err_code;
+}
+
+uint32_t ble_wiegand_clock_update(ble_wiegand_t * p_wiegand)
+{
+    uint8_t  value[BLE_WIEGAND_CLOCK_LEN];
+    uint16_t len = uint32_encode(wiegand_clock_boot_time(), value);
+
+    return sd_ble_gatts_value_set(p_wiegand->clock_handles.value_handle, 0, &len, value);
+}
+
+uint32_t ble_wiegand_conn_set(ble_wiegand_t * p_wiegand, const ble_wiegand_conn_t * p_conn)
+{
+    uint8_t  value[BLE_WIEGAND_CONN_LEN];
+    uint16_t len = 0;
+
+    value[len++] = p_conn->profile;
+    len += uint16_encode(p_conn->params.max_conn_interval, &value[len]);
+    len += uint16_encode(p_conn->params.slave_latency, &value[len]);
+    len += uint16_encode(p_conn->params.conn_sup_timeout, &value[len]);
+    for (uint8_t i = 0; i < BLE_WIEGAND_CONN_PROFILES; i++)
+    {
+        len += uint32_encode(p_conn->time_ms[i], &value[len]);
+    }
+    len += uint16_encode(p_conn->rejected, &value[len]);
+
+    return sd_ble_gatts_value_set(p_wiegand->conn_handles.value_handle, 0, &len, value);
+}
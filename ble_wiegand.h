@@ -7,26 +7,140 @@
 #include "ble_srv_common.h"
 
 #include "wiegand.h"
+#include "card_codec.h"
 
 // service defines
 #define BLE_UUID_WIEGAND_LAST_CARDS	0xAAAA
 #define BLE_MAX_TX_LEN	511
-#define BLE_MAX_CARDS BLE_MAX_TX_LEN/sizeof(Card)
+#define BLE_WIEGAND_NOTIFY_LEN          20      /**< Longest card notification, the default ATT MTU less its header. */
+#define BLE_WIEGAND_NOTIFY_QUEUE        8       /**< Card notifications waiting for a TX buffer, must be a power of two. */
 #define BLE_UUID_WIEGAND_REPLAY		0xBBBB
 #define BLE_UUID_WIEGAND_SEND_DATA      0xCCCC
-#define BLE_UUID_WIEGAND_SEND_DATA_LEN  20
+#define BLE_UUID_WIEGAND_SEND_DATA_LEN  CARD_DATA_LEN
 #define BLE_UUID_WIEGAND_DATA_LENGTH	0xDDDD
+#define BLE_UUID_WIEGAND_TX_TIMING      0xEEEE
+#define BLE_UUID_WIEGAND_CLOCK          0xEEEF
+#define BLE_UUID_WIEGAND_EXPORT         0xEEF0
+#define BLE_UUID_WIEGAND_CONN           0xEEF1
+#define BLE_UUID_WIEGAND_CONTROL        0xEEF2
+
+/* Last cards sync, little endian. Writing the sequence number after the last
+ * card the client holds makes reads return the cards from it on for the rest
+ * of the connection, oldest first and as many as fit, rather than the newest.
+ * A fifth byte of flags may follow. */
+#define BLE_WIEGAND_SYNC_LEN            4
+#define BLE_WIEGAND_SYNC_FLAGS_LEN      5
+#define BLE_WIEGAND_SYNC_RELEASE        0x01    /**< Flag to free the cards before the sequence number. */
+
+/* Replay, little endian. Written with one byte, the card to send as for
+ * send_wiegand, or with one or more jobs of 4 bytes: card, times to send it,
+ * then the gap in ms between frames. Jobs are queued and run back to back.
+ * Reads give the job status, notified when a job ends: jobs queued, frames
+ * left of the running job, its card (0xFFFF if none), jobs done, failed and
+ * turned away, and the result of the last job to end. */
+#define BLE_WIEGAND_REPLAY_JOB_LEN      4
+#define BLE_WIEGAND_REPLAY_WRITE_LEN    (WIEGAND_TX_JOBS * BLE_WIEGAND_REPLAY_JOB_LEN)
+#define BLE_WIEGAND_REPLAY_STATUS_LEN   12
+
+/* Custom frames. Send Data holds the frame's bits right aligned, first bit
+ * sent first, in as many bytes as it takes; frames longer than a write are
+ * sent with a long (queued) write. Data Length is the frame's length in bits,
+ * 2 bytes little endian; writing it sends the frame, so does a queued write
+ * that includes it, once executed. The stack writes both straight into the
+ * frame wiegand_tx_custom_get returns. A length that needs more bytes than the
+ * last Send Data write held, or that was written only in part, sends nothing;
+ * the replay status counts it as a failed job with NRF_ERROR_INVALID_LENGTH. */
+#define BLE_WIEGAND_DATA_LENGTH_LEN     2
+#define BLE_WIEGAND_QUEUED_WRITES_LEN   128     /**< Stack memory for queued writes, a frame and its length in 18 byte pieces. */
+
+/* TX timing value, little endian. Written as either just the first byte, or
+ * the first 7 bytes to give the custom profile's timing. Reads add the
+ * loopback measurement of the last transmission. */
+#define BLE_WIEGAND_TX_LOOPBACK         0x80    /**< Flag in the profile byte to measure transmissions. */
+#define BLE_WIEGAND_TX_TIMING_WRITE_LEN 7       /**< profile, pulse us, period us, gap ms */
+#define BLE_WIEGAND_TX_TIMING_LEN       19      /**< ... then pulses, missed, width min/max us, period min/max us */
+
+/* Clock value, little endian. Written with the Unix time now, read back as
+ * the Unix time the device booted at, 0 until the clock has been set. */
+#define BLE_WIEGAND_CLOCK_LEN           4
+
+/* Export value, little endian. Written with the sequence number to start
+ * from, the cards from there on are notified as one stream coded as in
+ * card_codec.h, header first with its count open, cut into
+ * BLE_WIEGAND_NOTIFY_LEN byte pieces, and ended by an empty notification. Reads give the last export: records, bytes and
+ * bytes per second. */
+#define BLE_WIEGAND_EXPORT_START_LEN    4
+#define BLE_WIEGAND_EXPORT_LEN          12
+
+/* Connection value, little endian, read only: the profile asked for, then
+ * the connection interval in 1.25 ms units, slave latency and supervision
+ * timeout in 10 ms units the central set, then ms spent in each profile since
+ * boot and the profile changes the central turned down. */
+#define BLE_WIEGAND_CONN_LEN            17
+
+/* Control point, written with or without response. A command is an opcode,
+ * a tag the client picks, then the opcode's parameters, little endian, in a
+ * write of its own. Commands run from the main loop in the order written,
+ * so several can be sent in one connection event, and each result is
+ * notified: opcode, tag, a ble_wiegand_control_status_t as 2 bytes, then the
+ * opcode's data. Commands written while BLE_WIEGAND_CONTROL_QUEUE - 1 are
+ * still waiting for their result to go out are dropped unanswered. */
+#define BLE_WIEGAND_CONTROL_QUEUE       8       /**< Must be a power of two. */
+#define BLE_WIEGAND_CONTROL_HEADER_LEN  2       /**< opcode and tag */
+#define BLE_WIEGAND_CONTROL_RESULT_LEN  4       /**< opcode, tag and result */
+
+/**@brief Control point opcodes. */
+typedef enum {
+    BLE_WIEGAND_CONTROL_REPLAY = 1,                         /**< Card, or jobs, as written to the replay characteristic. Gives the jobs queued, 1 byte. */
+    BLE_WIEGAND_CONTROL_CLEAR,                              /**< Frees the cards before a sequence number, 4 bytes, or every card without. Gives the cards freed, 2 bytes. */
+    BLE_WIEGAND_CONTROL_TIME,                               /**< Unix time now as written to the clock characteristic. Gives the boot time, 4 bytes. */
+    BLE_WIEGAND_CONTROL_PROFILE,                            /**< 1 or 7 bytes as written to the TX timing characteristic. Gives the profile byte. */
+    BLE_WIEGAND_CONTROL_EXPORT                              /**< Sequence number to start from as written to the export characteristic, export notifications on. */
+} ble_wiegand_control_op_t;
+
+/**@brief Control point result codes. Each has the value of the nRF error code it stands for. */
+typedef enum {
+    BLE_WIEGAND_CONTROL_OK            = 0,                  /**< Done. */
+    BLE_WIEGAND_CONTROL_QUEUE_FULL    = 4,                  /**< The replay queue had no room for a job. */
+    BLE_WIEGAND_CONTROL_NOT_SUPPORTED = 6,                  /**< Unknown opcode, or nothing to run it on. */
+    BLE_WIEGAND_CONTROL_BAD_PARAM     = 7,                  /**< A time, profile or timing out of range. */
+    BLE_WIEGAND_CONTROL_NOT_NOW       = 8,                  /**< Export without export notifications on. */
+    BLE_WIEGAND_CONTROL_BAD_LENGTH    = 9,                  /**< Parameters of the wrong length. */
+    BLE_WIEGAND_CONTROL_FAILED        = 0xFFFF              /**< Any other error. */
+} ble_wiegand_control_status_t;
+
+/**@brief Connection parameter profiles. */
+typedef enum {
+    BLE_WIEGAND_CONN_IDLE,                                  /**< Long interval and slave latency, nothing to move. */
+    BLE_WIEGAND_CONN_FAST,                                  /**< Shortest interval, an export or replay jobs are running. */
+    BLE_WIEGAND_CONN_PROFILES
+} ble_wiegand_conn_profile_t;
+
+/**@brief Connection parameters as reported through the connection characteristic. */
+typedef struct
+{
+    uint8_t                      profile;                                              /**< Profile asked for, see ble_wiegand_conn_profile_t. */
+    ble_gap_conn_params_t        params;                                               /**< Parameters in use, the interval in both min and max. */
+    uint32_t                     time_ms[BLE_WIEGAND_CONN_PROFILES];                   /**< Time connected in each profile. */
+    uint16_t                     rejected;                                             /**< Profile changes the central turned down. */
+} ble_wiegand_conn_t;
 
 /**@brief Heart Rate Service event type. */
 typedef enum {
     BLE_WIEGAND_EVT_NOTIFICATION_ENABLED,                   /**< Heart Rate value notification enabled event. */
-    BLE_WIEGAND_EVT_NOTIFICATION_DISABLED                   /**< Heart Rate value notification disabled event. */
+    BLE_WIEGAND_EVT_NOTIFICATION_DISABLED,                  /**< Heart Rate value notification disabled event. */
+    BLE_WIEGAND_EVT_TX_TIMING_WRITTEN,                      /**< The client changed the transmit timing. */
+    BLE_WIEGAND_EVT_EXPORT_DONE,                            /**< The last piece of an export has been queued. */
+    BLE_WIEGAND_EVT_SYNC_WRITTEN,                           /**< The client asked for the cards from sync_seq on. */
+    BLE_WIEGAND_EVT_CLEAR_REQUESTED                         /**< The client asked to free cards, from the main loop. */
 } ble_wiegand_evt_type_t;
 
 /**@brief Heart Rate Service event. */
 typedef struct
 {
     ble_wiegand_evt_type_t evt_type;                        /**< Type of event. */
+    uint32_t               clear_seq;                       /**< BLE_WIEGAND_EVT_CLEAR_REQUESTED: free the cards before this sequence number ... */
+    uint16_t               cleared;                         /**< ... and the handler sets how many it freed. */
 } ble_wiegand_evt_t;
 
 // Forward declaration of the ble_wiegand_t type.
@@ -42,12 +156,25 @@ typedef struct
     ble_wiegand_evt_handler_t    evt_handler;                                          /**< Event handler to be called for handling events in the Heart Rate Service. */
     bool                         is_sensor_contact_supported;                          /**< Determines if sensor contact detection is to be supported. */
     uint8_t *                    p_body_sensor_location;                               /**< If not NULL, initial value of the Body Sensor Location characteristic. */
-    ble_srv_security_mode_t 	 wiegand_last_cards_attr_md;                           /**< Initial security level for heart rate service measurement attribute */
-    ble_srv_security_mode_t      wiegand_replay_attr_md;                               /**< Initial security level for body sensor location attribute */
+    ble_srv_cccd_security_mode_t wiegand_last_cards_attr_md;                           /**< Initial security level for the last cards attribute and its CCCD */
+    ble_srv_cccd_security_mode_t wiegand_replay_attr_md;                               /**< Initial security level for the replay attribute and its CCCD */
     ble_srv_security_mode_t      wiegand_send_data_attr_md;                            /**< Initial security level for body sensor location attribute */
     ble_srv_security_mode_t      wiegand_data_length_attr_md;                          /**< Initial security level for body sensor location attribute */
+    ble_srv_security_mode_t      wiegand_tx_timing_attr_md;                            /**< Initial security level for the TX timing attribute */
+    ble_srv_security_mode_t      wiegand_clock_attr_md;                                /**< Initial security level for the clock attribute */
+    ble_srv_cccd_security_mode_t wiegand_export_attr_md;                               /**< Initial security level for the export attribute and its CCCD */
+    ble_srv_security_mode_t      wiegand_conn_attr_md;                                 /**< Initial security level for the connection attribute */
+    ble_srv_cccd_security_mode_t wiegand_control_attr_md;                              /**< Initial security level for the control point attribute and its CCCD */
+    const card_store_t *         p_card_store;                                         /**< Cards to export, only read from the main loop. */
 } ble_wiegand_init_t;
 
+/**@brief A card notification waiting to be sent, or a control point command or its result. */
+typedef struct
+{
+    uint8_t                      len;
+    uint8_t                      data[BLE_WIEGAND_NOTIFY_LEN];
+} ble_wiegand_notify_t;
+
 /**@brief Heart Rate Service structure. This contains various status information for the service. */
 typedef struct ble_wiegand_s
 {
@@ -59,9 +186,53 @@ typedef struct ble_wiegand_s
     ble_gatts_char_handles_t     replay_handles;                                       /**< Handles related to the Body Sensor Location characteristic. */
     ble_gatts_char_handles_t     send_data_handles;                                    /**< Handles related to the Heart Rate Control Point characteristic. */
     ble_gatts_char_handles_t     data_length_handles;                                  /**< Handles related to the Heart Rate Control Point characteristic. */
+    ble_gatts_char_handles_t     tx_timing_handles;                                    /**< Handles related to the TX timing characteristic. */
+    ble_gatts_char_handles_t     clock_handles;                                        /**< Handles related to the clock characteristic. */
+    ble_gatts_char_handles_t     export_handles;                                       /**< Handles related to the export characteristic. */
+    ble_gatts_char_handles_t     conn_handles;                                         /**< Handles related to the connection characteristic. */
+    ble_gatts_char_handles_t     control_handles;                                      /**< Handles related to the control point characteristic. */
     uint16_t                     conn_handle;                                          /**< Handle of the current connection (as provided by the BLE stack, is BLE_CONN_HANDLE_INVALID if not in a connection). */
     bool                         is_sensor_contact_detected;                           /**< TRUE if sensor contact has been detected. */
     uint16_t                     rr_interval_count;                                    /**< Number of RR Interval measurements since the last Heart Rate Measurement transmission. */
+    volatile bool                is_notification_enabled;                              /**< TRUE if the client enabled last cards notifications. */
+    volatile bool                is_replay_notification_enabled;                       /**< TRUE if the client enabled replay status notifications ... */
+    volatile bool                is_replay_notify_pending;                             /**< ... and a job ended since the last one went out. */
+    uint8_t                      tx_count;                                             /**< TX buffers the stack has for the connection. */
+    uint32_t                     tx_sent;                                              /**< Notifications queued in the stack, main loop only. */
+    volatile uint32_t            tx_done;                                              /**< ... and sent, from BLE_EVT_TX_COMPLETE. */
+    bool                         is_tx_full;                                           /**< TRUE if the stack ran out of TX buffers ... */
+    uint32_t                     tx_full_done;                                         /**< ... with tx_done at this count. */
+    volatile bool                is_sync;                                              /**< TRUE once the client wrote the last cards sync ... */
+    volatile uint32_t            sync_seq;                                             /**< ... with the first card it lacks ... */
+    volatile bool                is_sync_release;                                      /**< ... and asked to free the cards before it. */
+    const uint8_t *              p_last_cards;                                         /**< Last cards value, put back after each notification. */
+    uint16_t                     last_cards_len;
+    ble_wiegand_notify_t         notify_queue[BLE_WIEGAND_NOTIFY_QUEUE];               /**< Card notifications not yet sent, only touched from the main loop. */
+    uint8_t                      notify_head;
+    uint8_t                      notify_tail;
+    uint32_t                     notify_dropped;                                       /**< Card notifications dropped because the queue was full. */
+    uint32_t                     queued_writes[BLE_WIEGAND_QUEUED_WRITES_LEN / 4];     /**< User memory for the stack's queued writes, word aligned. */
+    uint16_t                     send_data_len;                                        /**< Bytes of the custom frame the client last wrote to Send Data. */
+    const card_store_t *         p_card_store;                                         /**< Cards to export. */
+    volatile bool                is_export_enabled;                                    /**< TRUE if the client enabled export notifications. */
+    volatile bool                is_export_requested;                                  /**< TRUE from a write to the export characteristic ... */
+    volatile uint32_t            export_start_seq;                                     /**< ... until the main loop starts an export from this record. */
+    bool                         is_exporting;
+    uint32_t                     export_seq;                                           /**< Next record to code. */
+    card_codec_t                 export_codec;
+    uint8_t                      export_buf[BLE_WIEGAND_NOTIFY_LEN + CARD_CODEC_ENTRY_MAX]; /**< Coded, not yet notified. */
+    uint16_t                     export_fill;
+    uint64_t                     export_start_ticks;                                   /**< RTC1 ticks at the start of the export. */
+    uint32_t                     export_records;                                       /**< Records in the last export. */
+    uint32_t                     export_bytes;                                         /**< Bytes notified in the last export. */
+    uint32_t                     export_ms;                                            /**< Time the last export took. */
+    uint32_t                     export_rate;                                          /**< Bytes per second of the last export. */
+    volatile bool                is_control_notification_enabled;                      /**< TRUE if the client enabled control point results. */
+    ble_wiegand_notify_t         control_queue[BLE_WIEGAND_CONTROL_QUEUE];             /**< Commands written, each replaced by its result once run. */
+    volatile uint8_t             control_head;                                         /**< Next command to write, from the BLE event handler. */
+    uint8_t                      control_run;                                          /**< Next command to run, main loop only. */
+    uint8_t                      control_tail;                                         /**< Next result to notify, main loop only. */
+    uint32_t                     control_dropped;                                      /**< Commands dropped, too short or too many waiting. */
 } ble_wiegand_t;
 
 /**@brief Function for initializing the Heart Rate Service.
@@ -112,7 +283,81 @@ void ble_wiegand_sensor_contact_detected_update(ble_wiegand_t * p_wiegand, bool
  */
 uint32_t ble_wiegand_body_sensor_location_set(ble_wiegand_t * p_wiegand, uint8_t body_sensor_location);
 
-uint32_t ble_wiegand_last_cards_set(ble_wiegand_t * p_wiegand, uint8_t *cards, uint16_t len);
+/**@brief Function for setting the last cards characteristic.
+ *
+ * @details The value is copied into the stack. cards has to stay valid until the next call, it
+ *          is put back after each card notification, which overwrites the value.
+ *
+ * @param[in]   p_wiegand   Wiegand Service structure.
+ * @param[in]   cards       Newest cards, a stream with a header as in card_codec.h.
+ * @param[in]   len         Length of cards.
+ *
+ * @return      NRF_SUCCESS on success, otherwise an error code.
+ */
+uint32_t ble_wiegand_last_cards_set(ble_wiegand_t * p_wiegand, const uint8_t *cards, uint16_t len);
+
+/**@brief Function for queueing a notification of a new card on the last cards characteristic.
+ *
+ * @details entry is the card's record as a stream of its own with a header, as in card_codec.h.
+ *          An entry longer than BLE_WIEGAND_NOTIFY_LEN is notified empty, the client then reads
+ *          the characteristic.
+ *          The queue is sent from ble_wiegand_notify_task. Main loop only.
+ *
+ * @param[in]   p_wiegand   Wiegand Service structure.
+ * @param[in]   entry       Coded card.
+ * @param[in]   len         Length of entry.
+ *
+ * @return      NRF_SUCCESS if queued, NRF_ERROR_INVALID_STATE if no client asked for
+ *              notifications, NRF_ERROR_NO_MEM if the queue is full.
+ */
+uint32_t ble_wiegand_card_notify(ble_wiegand_t * p_wiegand, const uint8_t *entry, uint16_t len);
+
+/**@brief Function for running control point commands and sending queued card notifications,
+ *        command results and the export, from the main loop.
+ *
+ * @details Card notifications go first, then results. Sends until every TX buffer of the connection is in
+ *          use, then waits for BLE_EVT_TX_COMPLETE to free some, so each connection event
+ *          carries as many notifications as the stack can take.
+ *
+ * @param[in]   p_wiegand   Wiegand Service structure.
+ */
+void ble_wiegand_notify_task(ble_wiegand_t * p_wiegand);
+
+/**@brief Function for refreshing the TX timing characteristic from the transmitter.
+ *
+ * @details Call after the timing changed or a transmission was measured.
+ *
+ * @param[in]   p_wiegand   Wiegand Service structure.
+ *
+ * @return      NRF_SUCCESS on success, otherwise an error code.
+ */
+uint32_t ble_wiegand_tx_timing_update(ble_wiegand_t * p_wiegand);
+
+/**@brief Function for refreshing the replay characteristic from the job status.
+ *
+ * @param[in]   p_wiegand   Wiegand Service structure.
+ * @param[in]   notify      TRUE to notify the client too, once a job has ended.
+ *
+ * @return      NRF_SUCCESS on success, otherwise an error code.
+ */
+uint32_t ble_wiegand_replay_status_update(ble_wiegand_t * p_wiegand, bool notify);
+
+/**@brief Function for refreshing the clock characteristic from the Wiegand clock.
+ *
+ * @param[in]   p_wiegand   Wiegand Service structure.
+ *
+ * @return      NRF_SUCCESS on success, otherwise an error code.
+ */
+uint32_t ble_wiegand_clock_update(ble_wiegand_t * p_wiegand);
+
+/**@brief Function for setting the connection characteristic.
+ *
+ * @param[in]   p_wiegand   Wiegand Service structure.
+ * @param[in]   p_conn      Connection profile and parameters in use.
+ *
+ * @return      NRF_SUCCESS on success, otherwise an error code.
+ */
+uint32_t ble_wiegand_conn_set(ble_wiegand_t * p_wiegand, const ble_wiegand_conn_t * p_conn);
 
 #endif // BLE_WIEGAND_H__
 
@@ -0,0 +1,365 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "wiegand_format.h"
+#include "card_store.h"
+#include "card_codec.h"
+
+#define FLAGS_USED 0x3F
+
+// bytes still to be read from an entry, end is cleared once it runs out
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+} reader_t;
+
+static uint32_t zigzag(uint32_t delta)
+{
+    return (delta << 1) ^ (uint32_t)((int32_t)delta >> 31);
+}
+
+static uint32_t unzigzag(uint32_t value)
+{
+    return (value >> 1) ^ (0 - (value & 1));
+}
+
+static uint8_t *varint_put(uint8_t *p, uint32_t value)
+{
+    while (value >= 0x80) {
+        *p++ = value | 0x80;
+        value >>= 7;
+    }
+    *p++ = value;
+    return p;
+}
+
+static uint8_t byte_get(reader_t *r)
+{
+    if (r->p == r->end) {
+        r->end = NULL;
+        return 0;
+    }
+    return *r->p++;
+}
+
+static uint32_t varint_get(reader_t *r)
+{
+    uint32_t value = 0;
+
+    for (uint8_t shift = 0; shift < 35; shift += 7) {
+        uint8_t b = byte_get(r);
+        value |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            return value;
+        }
+    }
+    r->end = NULL;      // longer than any 32 bit value
+    return 0;
+}
+
+static uint32_t le_get(const uint8_t *p, uint8_t len)
+{
+    uint32_t value = 0;
+
+    for (uint8_t i = 0; i < len; i++) {
+        value |= (uint32_t)p[i] << (8 * i);
+    }
+    return value;
+}
+
+static void le_put(uint8_t *p, uint32_t value, uint8_t len)
+{
+    for (uint8_t i = 0; i < len; i++) {
+        p[i] = value >> (8 * i);
+    }
+}
+
+// true if the card data decodes as format, with the fields it holds in *fields
+static bool fields_derive(uint16_t bit_len, const uint8_t *data, uint8_t format,
+                          wiegand_fields_t *fields)
+{
+    uint64_t value = 0;
+
+    if (bit_len > 64) {
+        return false;
+    }
+    for (uint8_t i = 0; i < CARD_BYTES(bit_len); i++) {
+        value = (value << 8) | data[i];
+    }
+    return wiegand_format_decode(value, bit_len, fields) == format;
+}
+
+void card_codec_reset(card_codec_t *p_codec)
+{
+    memset(p_codec, 0, sizeof(*p_codec));
+    p_codec->seq = UINT32_MAX;
+}
+
+void card_codec_start(card_codec_t *p_codec, uint32_t first_seq)
+{
+    card_codec_reset(p_codec);
+    p_codec->seq = first_seq - 1;
+}
+
+void card_codec_header_put(uint8_t *out, uint16_t count, uint32_t first_seq)
+{
+    out[0] = CARD_CODEC_VERSION;
+    le_put(&out[1], count, 2);
+    le_put(&out[3], first_seq, 4);
+}
+
+uint16_t card_codec_header_get(const uint8_t *in, uint16_t len, uint16_t *p_count, uint32_t *p_first_seq)
+{
+    if (len < CARD_CODEC_HEADER_LEN || in[0] != CARD_CODEC_VERSION) {
+        return 0;
+    }
+    *p_count = le_get(&in[1], 2);
+    *p_first_seq = le_get(&in[3], 4);
+    return CARD_CODEC_HEADER_LEN;
+}
+
+uint16_t card_codec_encode(card_codec_t *p_codec, uint32_t seq, const uint8_t *rec, uint8_t *out)
+{
+    uint16_t bit_len = rec[0] + 1;
+    uint16_t data_len = CARD_BYTES(bit_len);
+    uint8_t format = rec[1];
+    uint16_t hits = le_get(&rec[2], 2);
+    uint32_t seen = le_get(&rec[4], 4);
+    const uint8_t *data = &rec[card_store_record_len(rec) - data_len];
+    uint8_t flags = 0;
+    uint8_t *p = out + 1;
+
+    if (bit_len != p_codec->bit_len || format != p_codec->format) {
+        flags |= CARD_CODEC_SHAPE;
+        p = varint_put(p, bit_len);
+        *p++ = format;
+    }
+    if (seq != p_codec->seq + 1) {
+        flags |= CARD_CODEC_SEQ;
+        p = varint_put(p, zigzag(seq - (p_codec->seq + 1)));
+    }
+    if (hits != 1) {
+        flags |= CARD_CODEC_HITS;
+        p = varint_put(p, hits);
+    }
+    p = varint_put(p, zigzag(seen - p_codec->last_seen));
+    if (format != WIEGAND_FORMAT_UNKNOWN) {
+        uint32_t facility = le_get(&rec[CARD_HEADER_LEN], 4);
+        uint32_t number = le_get(&rec[CARD_HEADER_LEN + 4], 4);
+        wiegand_fields_t fields;
+
+        if (!fields_derive(bit_len, data, format, &fields) ||
+            fields.facility != facility || fields.number != number) {
+            flags |= CARD_CODEC_FIELDS;
+            p = varint_put(p, facility);
+            p = varint_put(p, number);
+        }
+    }
+    if (bit_len == p_codec->bit_len) {
+        uint8_t same = 0;
+
+        while (same < data_len && data[same] == p_codec->data[same]) {
+            same++;
+        }
+        if (same == data_len) {
+            flags |= CARD_CODEC_SAME;
+        } else {
+            // cards from one site mostly differ in their last bytes only
+            flags |= CARD_CODEC_XOR;
+            *p++ = same;
+            for (uint8_t i = same; i < data_len; i++) {
+                *p++ = data[i] ^ p_codec->data[i];
+            }
+        }
+    } else {
+        memcpy(p, data, data_len);
+        p += data_len;
+    }
+    out[0] = flags;
+
+    p_codec->seq = seq;
+    p_codec->last_seen = seen;
+    p_codec->bit_len = bit_len;
+    p_codec->format = format;
+    memcpy(p_codec->data, data, data_len);
+    return p - out;
+}
+
+uint16_t card_codec_decode(card_codec_t *p_codec, const uint8_t *in, uint16_t len,
+                           uint32_t *p_seq, uint8_t *rec, uint16_t *p_rec_len)
+{
+    reader_t r = { .p = in, .end = in + len };
+    uint8_t flags = byte_get(&r);
+    uint16_t bit_len = p_codec->bit_len;
+    uint8_t format = p_codec->format;
+    uint32_t seq = p_codec->seq + 1;
+    uint32_t hits = 1;
+    uint32_t seen;
+    uint32_t facility = 0;
+    uint32_t number = 0;
+    uint16_t data_len;
+    uint8_t *data;
+
+    if (flags & ~FLAGS_USED) {
+        return 0;
+    }
+    if (flags & CARD_CODEC_SHAPE) {
+        bit_len = varint_get(&r);
+        format = byte_get(&r);
+    }
+    if (flags & CARD_CODEC_SEQ) {
+        seq += unzigzag(varint_get(&r));
+    }
+    if (flags & CARD_CODEC_HITS) {
+        hits = varint_get(&r);
+    }
+    seen = p_codec->last_seen + unzigzag(varint_get(&r));
+    if (flags & CARD_CODEC_FIELDS) {
+        facility = varint_get(&r);
+        number = varint_get(&r);
+    }
+    if (r.end == NULL || bit_len == 0 || bit_len > WIEGAND_MAX_BITS || hits > UINT16_MAX ||
+        ((flags & CARD_CODEC_FIELDS) && format == WIEGAND_FORMAT_UNKNOWN) ||
+        ((flags & (CARD_CODEC_SAME | CARD_CODEC_XOR)) && bit_len != p_codec->bit_len)) {
+        return 0;
+    }
+
+    data_len = CARD_BYTES(bit_len);
+    rec[0] = bit_len - 1;
+    rec[1] = format;
+    le_put(&rec[2], hits, 2);
+    le_put(&rec[4], seen, 4);
+    data = &rec[CARD_HEADER_LEN + (format != WIEGAND_FORMAT_UNKNOWN ? CARD_FIELDS_LEN : 0)];
+    if (flags & CARD_CODEC_SAME) {
+        memcpy(data, p_codec->data, data_len);
+    } else if (flags & CARD_CODEC_XOR) {
+        uint8_t same = byte_get(&r);
+
+        if (same >= data_len) {
+            return 0;
+        }
+        memcpy(data, p_codec->data, same);
+        for (uint8_t i = same; i < data_len; i++) {
+            data[i] = byte_get(&r) ^ p_codec->data[i];
+        }
+    } else {
+        for (uint8_t i = 0; i < data_len; i++) {
+            data[i] = byte_get(&r);
+        }
+    }
+    if (r.end == NULL) {
+        return 0;
+    }
+    if (format != WIEGAND_FORMAT_UNKNOWN) {
+        if (!(flags & CARD_CODEC_FIELDS)) {
+            wiegand_fields_t fields;
+
+            // left out although the card does not decode as its format
+            if (!fields_derive(bit_len, data, format, &fields)) {
+                return 0;
+            }
+            facility = fields.facility;
+            number = fields.number;
+        }
+        le_put(&rec[CARD_HEADER_LEN], facility, 4);
+        le_put(&rec[CARD_HEADER_LEN + 4], number, 4);
+    }
+
+    p_codec->seq = seq;
+    p_codec->last_seen = seen;
+    p_codec->bit_len = bit_len;
+    p_codec->format = format;
+    memcpy(p_codec->data, data, data_len);
+    *p_seq = seq;
+    *p_rec_len = card_store_record_len(rec);
+    return r.p - in;
+}
+
+uint16_t card_codec_export(const card_store_t *p_store, uint8_t *out, uint16_t max_len,
+                           uint32_t *p_seq)
+{
+    uint8_t entry[CARD_CODEC_ENTRY_MAX];
+    card_codec_t codec;
+    card_codec_t fresh;
+    const uint8_t *first = card_store_record(p_store, p_store->first_seq, NULL);
+    const uint8_t *rec;
+    uint32_t seq;
+    uint32_t start;
+    uint32_t total = 0;
+    uint32_t before = 0;    // bytes the records before rec take in the full stream
+    uint16_t count = 0;
+    uint16_t len = CARD_CODEC_HEADER_LEN;
+
+    if (p_seq) {
+        *p_seq = card_store_next_seq(p_store);
+    }
+    if (max_len < CARD_CODEC_HEADER_LEN) {
+        return 0;
+    }
+    max_len -= CARD_CODEC_HEADER_LEN;
+
+    // Each entry but the first codes the same whichever record the stream
+    // starts from, so the stream from rec on is the first entry coded afresh
+    // plus the rest of the full stream.
+    card_codec_start(&codec, p_store->first_seq);
+    for (rec = first, seq = p_store->first_seq; rec != NULL; rec = card_store_next(p_store, rec), seq++) {
+        total += card_codec_encode(&codec, seq, rec, entry);
+    }
+    card_codec_start(&codec, p_store->first_seq);
+    for (rec = first, seq = p_store->first_seq; rec != NULL; rec = card_store_next(p_store, rec), seq++) {
+        uint16_t entry_len = card_codec_encode(&codec, seq, rec, entry);
+
+        card_codec_start(&fresh, seq);
+        if (card_codec_encode(&fresh, seq, rec, entry) + total - before - entry_len <= max_len) {
+            break;
+        }
+        before += entry_len;
+    }
+
+    // with none that fit seq is the next sequence number, the stream has no entries
+    start = seq;
+    if (p_seq) {
+        *p_seq = start;
+    }
+    card_codec_start(&codec, start);
+    for (; rec != NULL; rec = card_store_next(p_store, rec), seq++) {
+        len += card_codec_encode(&codec, seq, rec, &out[len]);
+        count++;
+    }
+    card_codec_header_put(out, count, start);
+    return len;
+}
+
+uint16_t card_codec_export_from(const card_store_t *p_store, uint32_t seq, uint8_t *out,
+                                uint16_t max_len)
+{
+    uint8_t entry[CARD_CODEC_ENTRY_MAX];
+    card_codec_t codec;
+    const uint8_t *rec;
+    uint32_t start;
+    uint16_t count = 0;
+    uint16_t len = CARD_CODEC_HEADER_LEN;
+
+    if (max_len < CARD_CODEC_HEADER_LEN) {
+        return 0;
+    }
+    if ((int32_t)(seq - p_store->first_seq) < 0) {
+        seq = p_store->first_seq;
+    }
+    start = seq;
+    card_codec_start(&codec, start);
+    for (rec = card_store_record(p_store, seq, NULL); rec != NULL; rec = card_store_next(p_store, rec), seq++) {
+        uint16_t entry_len = card_codec_encode(&codec, seq, rec, entry);
+
+        if (len + entry_len > max_len) {
+            break;
+        }
+        memcpy(&out[len], entry, entry_len);
+        len += entry_len;
+        count++;
+    }
+    card_codec_header_put(out, count, start);
+    return len;
+}
@@ -0,0 +1,108 @@
+#ifndef CARD_CODEC_H_
+#define CARD_CODEC_H_
+
+#include <stdint.h>
+
+#include "card_store.h"
+
+// Compact form of card store records for the flash journal and the BLE
+// export. Records are coded as a stream, each entry against the record before
+// it, so a run of cards from one site costs a few bytes apiece:
+//   byte 0      flags below, the top two bits are 0 so 0xFF is never an entry
+//   varint      bit length, then 1 byte format, if CARD_CODEC_SHAPE
+//   varint      sequence number - (previous + 1), zigzag, if CARD_CODEC_SEQ
+//   varint      hit count, if CARD_CODEC_HITS, else 1
+//   varint      last seen - previous last seen, zigzag
+//   varint x 2  facility code and card number, if CARD_CODEC_FIELDS
+//   then        the card data: none if CARD_CODEC_SAME, if CARD_CODEC_XOR a
+//               count of leading bytes equal to the previous card's and the
+//               rest XORed with it, else CARD_BYTES(bit length) bytes as is
+// Varints are little endian base 128, 7 bits a byte with the top bit set on
+// all but the last. Fields of a known format are left out when decoding the
+// card data gives them back, which it does unless the format table changed.
+// The first entry after a reset is coded against an empty record with
+// sequence number -1, a last seen time of 0 and no bits.
+//
+// Streams sent to a client start with a header instead, so whatever reads
+// them can tell what they hold before decoding an entry:
+//   byte 0      CARD_CODEC_VERSION, anything else is a stream to leave alone
+//   bytes 1-2   entries in the stream, CARD_CODEC_COUNT_OPEN if not known
+//               when it starts
+//   bytes 3-6   sequence number of the first record
+// all little endian. The first entry is then coded against an empty record
+// numbered one before that, so it leaves its sequence number out.
+#define CARD_CODEC_SHAPE  0x01      // bit length or format differ from the previous record
+#define CARD_CODEC_SEQ    0x02      // not the sequence number after the previous record
+#define CARD_CODEC_HITS   0x04      // read more than once
+#define CARD_CODEC_FIELDS 0x08      // facility code and card number follow
+#define CARD_CODEC_SAME   0x10      // same card data as the previous record
+#define CARD_CODEC_XOR    0x20      // card data XORed with the previous record's
+
+#define CARD_CODEC_VERSION 1
+#define CARD_CODEC_HEADER_LEN 7
+#define CARD_CODEC_COUNT_OPEN 0xFFFF
+
+// longest entry: flags, shape, seq, hits, time, fields and data
+#define CARD_CODEC_ENTRY_MAX (1 + 3 + 5 + 3 + 5 + 10 + 1 + CARD_DATA_LEN)
+
+// the previous record of a stream, all the codec needs to go on
+typedef struct {
+    uint32_t seq;
+    uint32_t last_seen;
+    uint16_t bit_len;       // 0 before the first record
+    uint8_t format;
+    uint8_t data[CARD_DATA_LEN];
+} card_codec_t;
+
+// starts a new stream
+void card_codec_reset(card_codec_t *p_codec);
+
+// starts a new stream whose first record is numbered first_seq, as one with a header does
+void card_codec_start(card_codec_t *p_codec, uint32_t first_seq);
+
+// writes the header of a stream of count entries from first_seq on to out
+void card_codec_header_put(uint8_t *out, uint16_t count, uint32_t first_seq);
+
+/*
+ * Reads the header of the stream at in, of which len bytes are available,
+ * into *p_count and *p_first_seq. Returns CARD_CODEC_HEADER_LEN, or 0 if it
+ * is cut short or of another version.
+ */
+uint16_t card_codec_header_get(const uint8_t *in, uint16_t len, uint16_t *p_count, uint32_t *p_first_seq);
+
+/*
+ * Codes the store record rec, sequence number seq, into out, which must have
+ * room for CARD_CODEC_ENTRY_MAX bytes. Returns the entry's length.
+ */
+uint16_t card_codec_encode(card_codec_t *p_codec, uint32_t seq, const uint8_t *rec, uint8_t *out);
+
+/*
+ * Decodes the entry at in, of which len bytes are available, into a store
+ * record at rec, room for CARD_RECORD_MAX bytes, with its sequence number in
+ * *p_seq and its length in *p_rec_len. Returns the entry's length, or 0 if
+ * it is cut short or malformed, leaving the stream as it was.
+ */
+uint16_t card_codec_decode(card_codec_t *p_codec, const uint8_t *in, uint16_t len,
+                           uint32_t *p_seq, uint8_t *rec, uint16_t *p_rec_len);
+
+/*
+ * Codes the newest records of the store that fit in max_len bytes as a stream
+ * with a header into out. Returns its length, 0 if max_len has no room for
+ * the header, and, if p_seq is not NULL, sets *p_seq to the sequence number
+ * of the first record in it. With no records to give the stream is a header
+ * of 0 entries from the next sequence number on.
+ */
+uint16_t card_codec_export(const card_store_t *p_store, uint8_t *out, uint16_t max_len,
+                           uint32_t *p_seq);
+
+/*
+ * Codes the records of the store from sequence number seq on, oldest first,
+ * as a stream with a header into out, as many as fit in max_len bytes.
+ * Records older than the oldest stored are skipped. Returns the stream's
+ * length, 0 if max_len has no room for the header. With nothing from seq on
+ * the stream is a header of 0 entries.
+ */
+uint16_t card_codec_export_from(const card_store_t *p_store, uint32_t seq, uint8_t *out,
+                                uint16_t max_len);
+
+#endif /* CARD_CODEC_H_ */
@@ -0,0 +1,594 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nrf_error.h"
+#include "app_timer.h"
+#include "pstorage.h"
+#include "crc16.h"
+#include "card_store.h"
+#include "card_codec.h"
+#include "card_journal.h"
+
+#define RTC_MASK 0x00FFFFFF
+#define IDLE_TICKS APP_TIMER_TICKS(CARD_JOURNAL_IDLE_MS, 0)
+#define ALIGN4(len) (((len) + 3) & ~3)
+#define BLANK 0xFF
+#define WRITE_MAX (CARD_JOURNAL_CHUNK - CARD_JOURNAL_WRITE_HEADER_LEN)
+
+// what the header of a page says about it
+typedef struct {
+    uint32_t seq;           // page sequence number
+    uint32_t first_seq;     // first new record the page can hold
+    uint32_t last_seq;      // last new record in it, if summarised
+    uint16_t count;         // entries in it, likewise
+    bool summarised;
+} page_info_t;
+
+static card_store_t *p_store = NULL;
+static pstorage_handle_t journal_handle;
+static app_timer_id_t idle_timer_id;
+static card_journal_stats_t stats;
+
+// Entries on their way to flash. pstorage reads them when the write runs, so
+// the chunk is left alone until the write is done.
+static uint32_t chunk[CARD_JOURNAL_CHUNK / 4];
+
+static uint16_t page_size;
+static uint16_t page;                   // page being written
+static uint16_t page_used;              // bytes of it written or being written
+static bool next_erased;                // the page after it is ready for writing
+static uint32_t write_seq;              // first record not written yet
+static uint32_t chunk_seq;              // ... before the chunk being written
+static card_codec_t codec;              // the page's stream up to the last entry
+static card_codec_t chunk_codec;        // ... before the chunk being written
+static uint16_t page_entries;           // entries in the page being written
+static uint16_t chunk_entries;          // ... before the chunk being written
+static uint32_t page_first_seq;         // first new record the page being written can hold
+static bool page_closed;                // its summary is written or on its way, it takes no more
+static uint32_t summary[2];             // summary on its way to flash
+static uint32_t dirty[CARD_JOURNAL_DIRTY];
+static uint8_t dirty_count;
+static uint8_t chunk_dirty;             // dirty records in the chunk being written, the first ones
+static uint32_t last_next_seq;          // store's next sequence number when last looked at
+static uint32_t last_change;            // RTC ticks at the last new or reread record
+
+static uint8_t op_code;                 // flash operation under way, 0 if none
+static volatile bool op_done;
+static volatile uint32_t op_result;
+static volatile bool idle_timer_running;
+
+static void journal_pstorage_cb(pstorage_handle_t *p_handle, uint8_t op, uint32_t result,
+                                uint8_t *p_data, uint32_t data_len)
+{
+    if (op == PSTORAGE_LOAD_OP_CODE) {
+        return;     // loads are done in place
+    }
+    op_result = result;
+    op_done = true;
+}
+
+// nothing to do, the main loop runs once the timer wakes it
+static void idle_timer_handler(void *p_context)
+{
+    idle_timer_running = false;
+}
+
+static uint32_t page_handle_get(uint16_t i, pstorage_handle_t *p_handle)
+{
+    return pstorage_block_identifier_get(&journal_handle, i, p_handle);
+}
+
+static uint32_t word_get(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void word_put(uint8_t *p, uint32_t word)
+{
+    for (uint8_t i = 0; i < 4; i++) {
+        p[i] = word >> (8 * i);
+    }
+}
+
+// CRC16 of the page sequence number and first sequence number, as in the header
+static uint16_t header_crc(uint32_t seq, uint32_t first_seq)
+{
+    uint8_t ident[8];
+
+    word_put(&ident[0], seq);
+    word_put(&ident[4], first_seq);
+    return crc16_compute(ident, sizeof(ident), NULL);
+}
+
+// true if page i was opened by the journal and its header is whole
+static bool page_header_get(uint16_t i, page_info_t *p_info)
+{
+    pstorage_handle_t handle;
+    uint8_t *header = (uint8_t *)chunk;
+    uint8_t *summary_in = &header[CARD_JOURNAL_SUMMARY_OFFSET];
+    uint16_t crc;
+
+    if (page_handle_get(i, &handle) != NRF_SUCCESS ||
+        pstorage_load(header, &handle, CARD_JOURNAL_HEADER_LEN, 0) != NRF_SUCCESS ||
+        word_get(header) != CARD_JOURNAL_MAGIC) {
+        return false;
+    }
+    p_info->seq = word_get(&header[4]);
+    p_info->first_seq = word_get(&header[8]);
+    crc = header_crc(p_info->seq, p_info->first_seq);
+    if ((header[12] | (header[13] << 8)) != crc) {
+        return false;   // cut short while the page was being opened
+    }
+    p_info->last_seq = word_get(&summary_in[0]);
+    p_info->count = summary_in[4] | (summary_in[5] << 8);
+    p_info->summarised = (summary_in[6] | (summary_in[7] << 8)) == crc16_compute(summary_in, 6, &crc);
+    return true;
+}
+
+// true if nothing has been written to page i since it was erased
+static bool page_blank(uint16_t i)
+{
+    pstorage_handle_t handle;
+
+    if (page_handle_get(i, &handle) != NRF_SUCCESS) {
+        return false;
+    }
+    for (uint16_t pos = 0; pos < page_size; pos += sizeof(chunk)) {
+        if (pstorage_load((uint8_t *)chunk, &handle, sizeof(chunk), pos) != NRF_SUCCESS) {
+            return false;
+        }
+        for (uint16_t w = 0; w < sizeof(chunk) / 4; w++) {
+            if (chunk[w] != 0xFFFFFFFF) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Replays the entries of page i into the store and leaves the codec and
+ * page_entries where the page ends. Returns the offset of the first blank
+ * word, or page_size if the page is full or a write in it was cut short, so
+ * nothing gets written after it.
+ */
+static uint16_t page_replay(uint16_t i)
+{
+    pstorage_handle_t handle;
+    uint8_t *buf = (uint8_t *)chunk;
+    uint8_t rec[CARD_RECORD_MAX];
+    uint16_t pos = CARD_JOURNAL_HEADER_LEN;
+
+    card_codec_reset(&codec);
+    page_entries = 0;
+    if (page_handle_get(i, &handle) != NRF_SUCCESS) {
+        return page_size;
+    }
+    while (pos + CARD_JOURNAL_WRITE_HEADER_LEN <= page_size) {
+        uint16_t len;
+        uint16_t crc;
+        uint16_t done = 0;
+
+        if (pstorage_load(buf, &handle, CARD_JOURNAL_WRITE_HEADER_LEN, pos) != NRF_SUCCESS) {
+            break;
+        }
+        if (word_get(buf) == 0xFFFFFFFF) {
+            return pos;
+        }
+        len = buf[0] | (buf[1] << 8);
+        crc = buf[2] | (buf[3] << 8);
+        if (len == 0 || len > WRITE_MAX ||
+            pos + CARD_JOURNAL_WRITE_HEADER_LEN + len > page_size ||
+            pstorage_load(buf, &handle, ALIGN4(len), pos + CARD_JOURNAL_WRITE_HEADER_LEN) != NRF_SUCCESS ||
+            crc16_compute(buf, len, NULL) != crc) {
+            // a reset hit while this was being written
+            stats.torn++;
+            break;
+        }
+        while (done < len) {
+            uint16_t rec_len;
+            uint32_t seq;
+            uint16_t used = card_codec_decode(&codec, &buf[done], len - done, &seq, rec, &rec_len);
+
+            if (used == 0 || card_store_restore(p_store, seq, rec, rec_len) != NRF_SUCCESS) {
+                return page_size;
+            }
+            stats.restored++;
+            page_entries++;
+            done += used;
+        }
+        pos += CARD_JOURNAL_WRITE_HEADER_LEN + ALIGN4(len);
+    }
+    return page_size;
+}
+
+uint32_t card_journal_init(card_store_t *p_store_in)
+{
+    pstorage_module_param_t param;
+    uint32_t err_code;
+    page_info_t info;
+    page_info_t newest_info;
+    int32_t newest = -1;
+
+    memset(&stats, 0, sizeof(stats));
+    p_store = NULL;
+    page_size = PSTORAGE_FLASH_PAGE_SIZE;
+    dirty_count = 0;
+    chunk_dirty = 0;
+    op_code = 0;
+    op_done = false;
+    idle_timer_running = false;
+
+    err_code = app_timer_create(&idle_timer_id, APP_TIMER_MODE_SINGLE_SHOT, idle_timer_handler);
+    if (err_code != NRF_SUCCESS) {
+        return err_code;
+    }
+    param.block_size = page_size;
+    param.block_count = CARD_JOURNAL_PAGES;
+    param.cb = journal_pstorage_cb;
+    err_code = pstorage_register(&param, &journal_handle);
+    if (err_code != NRF_SUCCESS) {
+        return err_code;
+    }
+
+    card_codec_reset(&codec);
+    // the newest page is the one being written, the ring's oldest follows it
+    for (uint16_t i = 0; i < CARD_JOURNAL_PAGES; i++) {
+        if (page_header_get(i, &info) && (newest < 0 || (int32_t)(info.seq - stats.page_seq) > 0)) {
+            newest = i;
+            stats.page_seq = info.seq;
+        }
+    }
+    p_store = p_store_in;
+    if (newest < 0) {
+        // nothing written yet, the first write waits for page 0 to be erased
+        page = CARD_JOURNAL_PAGES - 1;
+        page_used = page_size;
+        page_closed = true;
+    } else {
+        uint16_t start = newest;
+        uint32_t floor;
+        uint16_t n;
+
+        page_header_get(newest, &info);
+        newest_info = info;
+        // Records older than the newest page's first by more than the store
+        // can hold cannot end up in it, so go back through the headers only
+        // as far as the page they start in.
+        floor = info.first_seq - CARD_STORE_MAX_RECORDS;
+        for (n = 1; n < CARD_JOURNAL_PAGES; n++) {
+            uint16_t i = (newest + CARD_JOURNAL_PAGES - n) % CARD_JOURNAL_PAGES;
+            uint32_t seq = info.seq;
+            bool reached = (int32_t)(info.first_seq - floor) <= 0;
+
+            if (!page_header_get(i, &info) || info.seq != seq - 1) {
+                break;
+            }
+            stats.logged += info.summarised ? info.count : 0;
+            if (!reached) {
+                start = i;
+            }
+        }
+        for (n = start; ; n = (n + 1) % CARD_JOURNAL_PAGES) {
+            page_used = page_replay(n);
+            stats.pages_read++;
+            if (n == newest) {
+                break;
+            }
+        }
+        page = newest;
+        page_first_seq = newest_info.first_seq;
+        page_closed = newest_info.summarised;
+        if (page_closed) {
+            page_used = page_size;
+        }
+        stats.logged += page_entries;
+        printf("Journal: %ld entries, %ld restored from %ld pages, %d cards in the store\r\n",
+               stats.logged, stats.restored, stats.pages_read, p_store->count);
+    }
+    // a reset must not cost the oldest page, so only erase it if need be
+    next_erased = page_blank((page + 1) % CARD_JOURNAL_PAGES);
+    write_seq = card_store_next_seq(p_store);
+    last_next_seq = write_seq;
+    app_timer_cnt_get(&last_change);
+    return NRF_SUCCESS;
+}
+
+void card_journal_touch(uint32_t seq)
+{
+    if (p_store == NULL || (int32_t)(seq - write_seq) >= 0) {
+        return;     // not written yet, it goes out as it is now
+    }
+    // the ones in the chunk being written were coded before this change
+    for (uint8_t i = chunk_dirty; i < dirty_count; i++) {
+        if (dirty[i] == seq) {
+            return;
+        }
+    }
+    if (dirty_count == CARD_JOURNAL_DIRTY) {
+        // only the hit count of the oldest is lost, its record is written
+        memmove(&dirty[0], &dirty[1], sizeof(dirty[0]) * (CARD_JOURNAL_DIRTY - 1));
+        dirty_count--;
+        if (chunk_dirty > 0) {
+            chunk_dirty--;
+        }
+    }
+    dirty[dirty_count++] = seq;
+    app_timer_cnt_get(&last_change);
+}
+
+// appends the entry of record seq to the chunk, false if it does not fit
+static bool entry_add(uint16_t *p_len, uint16_t room, uint32_t seq)
+{
+    uint8_t entry[CARD_CODEC_ENTRY_MAX];
+    card_codec_t next = codec;
+    const uint8_t *rec = card_store_record(p_store, seq, NULL);
+    uint16_t len;
+
+    if (rec == NULL) {
+        return true;    // dropped from the store meanwhile, nothing to write
+    }
+    len = card_codec_encode(&next, seq, rec, entry);
+    if (*p_len + len > room) {
+        return false;
+    }
+    memcpy((uint8_t *)chunk + *p_len, entry, len);
+    *p_len += len;
+    codec = next;
+    page_entries++;
+    stats.entries++;
+    return true;
+}
+
+// Fills the chunk from the next free word of the page being written. *p_full
+// is set if something waiting did not fit, records the store has dropped
+// meanwhile are passed over. The dirty records taken stay listed until the
+// write has made it, chunk_dirty counts them.
+static uint16_t chunk_fill(bool *p_full)
+{
+    uint16_t room = page_closed ? 0 : page_size - page_used;
+    uint32_t next_seq = card_store_next_seq(p_store);
+    uint8_t *buf = (uint8_t *)chunk;
+    uint16_t start = 0;
+    uint16_t len;
+    uint16_t crc;
+    uint8_t done = 0;
+
+    if (room > CARD_JOURNAL_CHUNK) {
+        room = CARD_JOURNAL_CHUNK;
+    }
+    if (page_used == 0) {
+        // the summary stays erased until the page is full
+        memset(buf, BLANK, CARD_JOURNAL_HEADER_LEN);
+        word_put(&buf[0], CARD_JOURNAL_MAGIC);
+        word_put(&buf[4], stats.page_seq);
+        word_put(&buf[8], write_seq);
+        crc = header_crc(stats.page_seq, write_seq);
+        buf[12] = crc;
+        buf[13] = crc >> 8;
+        start = CARD_JOURNAL_HEADER_LEN;
+        page_first_seq = write_seq;
+        page_entries = 0;
+        card_codec_reset(&codec);
+    }
+    len = start + CARD_JOURNAL_WRITE_HEADER_LEN;
+    while (done < dirty_count && entry_add(&len, room, dirty[done])) {
+        done++;
+    }
+    chunk_dirty = done;
+    while (write_seq != next_seq && entry_add(&len, room, write_seq)) {
+        write_seq++;
+    }
+    *p_full = done < dirty_count || write_seq != next_seq;
+    if (len == start + CARD_JOURNAL_WRITE_HEADER_LEN) {
+        return start;   // nothing fits, or nothing to write but the new page's header
+    }
+    // each write carries its length and CRC so one cut short shows at boot
+    crc = crc16_compute(&buf[start + CARD_JOURNAL_WRITE_HEADER_LEN],
+                        len - start - CARD_JOURNAL_WRITE_HEADER_LEN, NULL);
+    buf[start] = len - start - CARD_JOURNAL_WRITE_HEADER_LEN;
+    buf[start + 1] = (len - start - CARD_JOURNAL_WRITE_HEADER_LEN) >> 8;
+    buf[start + 2] = crc;
+    buf[start + 3] = crc >> 8;
+    // room is whole words, so the padding always fits
+    memset(&buf[len], BLANK, ALIGN4(len) - len);
+    return ALIGN4(len);
+}
+
+// the dirty records of the chunk are in flash, or were dropped from the store
+static void chunk_dirty_drop(void)
+{
+    memmove(&dirty[0], &dirty[chunk_dirty], sizeof(dirty[0]) * (dirty_count - chunk_dirty));
+    dirty_count -= chunk_dirty;
+    chunk_dirty = 0;
+}
+
+// writes the summary of the full page into its header
+static void summary_write(void)
+{
+    pstorage_handle_t handle;
+    uint8_t *p = (uint8_t *)summary;
+    uint16_t crc = header_crc(stats.page_seq, page_first_seq);
+    uint32_t err_code;
+
+    word_put(&p[0], write_seq - 1);
+    p[4] = page_entries;
+    p[5] = page_entries >> 8;
+    crc = crc16_compute(p, 6, &crc);
+    p[6] = crc;
+    p[7] = crc >> 8;
+    // whether or not it makes it, nothing more goes in this page
+    page_closed = true;
+    err_code = page_handle_get(page, &handle);
+    if (err_code == NRF_SUCCESS) {
+        err_code = pstorage_store(&handle, p, sizeof(summary), CARD_JOURNAL_SUMMARY_OFFSET);
+    }
+    if (err_code != NRF_SUCCESS) {
+        printf("Journal summary write failed: %ld\r\n", err_code);
+        stats.errors++;
+        return;
+    }
+    op_code = PSTORAGE_STORE_OP_CODE;
+    stats.writes++;
+    stats.bytes += sizeof(summary);
+}
+
+// writes what is waiting, moving on to the next page when this one is full
+static void chunk_write(void)
+{
+    pstorage_handle_t handle;
+    uint16_t len;
+    uint32_t err_code;
+    bool full;
+
+    chunk_seq = write_seq;
+    chunk_codec = codec;
+    chunk_entries = page_entries;
+    len = chunk_fill(&full);
+    if (len == 0) {
+        // any dirty records taken are gone from the store, nothing to write for them
+        chunk_dirty_drop();
+    }
+    if (len == 0 && full && !page_closed) {
+        // nothing more fits on this page
+        summary_write();
+        return;
+    }
+    if (len == 0 && full && next_erased) {
+        page = (page + 1) % CARD_JOURNAL_PAGES;
+        page_used = 0;
+        page_closed = false;
+        next_erased = false;
+        stats.page_seq++;
+        len = chunk_fill(&full);
+    }
+    if (len == 0) {
+        chunk_dirty_drop();
+        return;
+    }
+    err_code = page_handle_get(page, &handle);
+    if (err_code == NRF_SUCCESS) {
+        err_code = pstorage_store(&handle, (uint8_t *)chunk, len, page_used);
+    }
+    if (err_code != NRF_SUCCESS) {
+        printf("Journal write failed: %ld\r\n", err_code);
+        stats.errors++;
+        write_seq = chunk_seq;
+        codec = chunk_codec;
+        page_entries = chunk_entries;
+        chunk_dirty = 0;
+        return;
+    }
+    op_code = PSTORAGE_STORE_OP_CODE;
+    page_used += len;
+    stats.writes++;
+    stats.bytes += len;
+}
+
+static void page_erase(void)
+{
+    pstorage_handle_t handle;
+    uint32_t err_code;
+
+    err_code = page_handle_get((page + 1) % CARD_JOURNAL_PAGES, &handle);
+    if (err_code == NRF_SUCCESS) {
+        err_code = pstorage_clear(&handle, page_size);
+    }
+    if (err_code != NRF_SUCCESS) {
+        printf("Journal erase failed: %ld\r\n", err_code);
+        stats.errors++;
+        return;
+    }
+    op_code = PSTORAGE_CLEAR_OP_CODE;
+}
+
+// called once the flash operation under way has finished
+static void op_finish(void)
+{
+    if (op_result != NRF_SUCCESS) {
+        printf("Journal flash op %d failed: %ld\r\n", op_code, op_result);
+        stats.errors++;
+        if (op_code == PSTORAGE_STORE_OP_CODE) {
+            // what made it to flash is unknown, write the records again on the next page
+            write_seq = chunk_seq;
+            page_entries = chunk_entries;
+            page_used = page_size;
+            chunk_dirty = 0;
+        }
+    } else if (op_code == PSTORAGE_STORE_OP_CODE) {
+        chunk_dirty_drop();
+    } else if (op_code == PSTORAGE_CLEAR_OP_CODE) {
+        next_erased = true;
+        stats.erases++;
+    }
+    op_code = 0;
+    op_done = false;
+}
+
+void card_journal_task(bool quiet)
+{
+    uint32_t now;
+    uint32_t idle_ticks;
+    uint32_t next_seq;
+    uint32_t waiting;
+
+    if (p_store == NULL) {
+        return;
+    }
+    if (op_code != 0) {
+        if (!op_done) {
+            return;
+        }
+        op_finish();
+    }
+
+    next_seq = card_store_next_seq(p_store);
+    app_timer_cnt_get(&now);
+    if (next_seq != last_next_seq) {
+        last_next_seq = next_seq;
+        last_change = now;
+    }
+    if ((int32_t)(p_store->first_seq - write_seq) > 0) {
+        // the store let go of records before they were written
+        stats.missed += p_store->first_seq - write_seq;
+        write_seq = p_store->first_seq;
+    }
+    waiting = next_seq - write_seq;
+    idle_ticks = (now - last_change) & RTC_MASK;
+
+    if (idle_ticks < IDLE_TICKS && (waiting > 0 || dirty_count > 0 || !next_erased) &&
+        !idle_timer_running) {
+        // come back once the reader has gone quiet
+        idle_timer_running = true;
+        app_timer_start(idle_timer_id, IDLE_TICKS - idle_ticks, NULL);
+    }
+    if (!quiet) {
+        return;
+    }
+    // a write fits between two cards, an erase takes longer than some gaps
+    if ((waiting > 0 || dirty_count > 0) &&
+        (idle_ticks >= IDLE_TICKS || waiting >= CARD_JOURNAL_BATCH ||
+         dirty_count == CARD_JOURNAL_DIRTY)) {
+        chunk_write();
+    }
+    // a quiet spell is the best time for an erase, but a steady stream of
+    // cards must not find the journal waiting for one once this page is full
+    if (op_code == 0 && !next_erased &&
+        (idle_ticks >= IDLE_TICKS || page_closed ||
+         page_used >= page_size / 100 * CARD_JOURNAL_ERASE_FILL)) {
+        page_erase();
+    }
+}
+
+bool card_journal_busy(void)
+{
+    return p_store != NULL &&
+           (op_code != 0 || dirty_count > 0 || write_seq != card_store_next_seq(p_store));
+}
+
+const card_journal_stats_t *card_journal_stats_get(void)
+{
+    return &stats;
+}
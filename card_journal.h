@@ -0,0 +1,89 @@
+#ifndef CARD_JOURNAL_H_
+#define CARD_JOURNAL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "card_store.h"
+#include "card_codec.h"
+
+// The card journal keeps every record the store takes in flash, so the cards
+// outlive a reset or a flat battery. It is a log across a ring of
+// CARD_JOURNAL_PAGES pages registered with pstorage. Each page starts with a
+// header written along with its first entries:
+//   bytes 0-3   CARD_JOURNAL_MAGIC
+//   bytes 4-7   page sequence number, one more than the page before it
+//   bytes 8-11  sequence number of the first new record the page can hold
+//   bytes 12-13 CRC16 of bytes 4-11, then 2 bytes left erased
+// and a summary, left erased until the page is full:
+//   bytes 16-19 sequence number of the last new record in the page
+//   bytes 20-21 entries in the page
+//   bytes 22-23 CRC16 of bytes 4-11 and 16-21
+// Then come the writes, each a word with the length and the CRC16 of the
+// entries after it, then the entries padded with 0xFF to a word. All numbers
+// are little endian. The entries of a page are a card_codec stream of their
+// own, so each page reads back without the ones before it.
+// A card read again is written again under its old sequence number with its
+// new hit count, and the later entry wins. Pages fill in turn and the one
+// after the page being written is erased ahead of time, so every page is
+// erased once per trip round the ring and the oldest page goes first.
+//
+// At boot only the page headers are read to find the newest page and how far
+// back records can still fit in the store, and only those pages are replayed,
+// so startup takes as long however many cards the journal holds. A write a
+// reset cut short fails its CRC and ends its page, the next write goes to a
+// fresh page.
+#define CARD_JOURNAL_MAGIC 0x534B4C42   // "BLKS"
+#define CARD_JOURNAL_HEADER_LEN 24
+#define CARD_JOURNAL_SUMMARY_OFFSET 16
+#define CARD_JOURNAL_WRITE_HEADER_LEN 4
+
+// Flash writes and erases stall the CPU, so they wait until no card is
+// coming in. Records are gathered into writes of up to CARD_JOURNAL_CHUNK
+// bytes, a few ms of flash time, once the reader has been quiet for
+// CARD_JOURNAL_IDLE_MS or sooner once CARD_JOURNAL_BATCH records are
+// waiting. Erasing a page takes over 20 ms, so the next page is erased
+// after such a quiet spell, or between two cards as soon as the page being
+// written is CARD_JOURNAL_ERASE_FILL percent full, long before it is needed.
+// Until written, records are only in the RAM store.
+#define CARD_JOURNAL_CHUNK 256          // a multiple of 4
+#define CARD_JOURNAL_IDLE_MS 500
+#define CARD_JOURNAL_BATCH 8
+#define CARD_JOURNAL_ERASE_FILL 50
+#define CARD_JOURNAL_DIRTY 8            // reread records waiting to be written again
+
+typedef struct {
+    uint32_t logged;        // entries in the journal at boot, from the page summaries
+    uint32_t restored;      // entries read back at boot
+    uint32_t pages_read;    // pages read back at boot
+    uint32_t torn;          // writes found cut short at boot
+    uint32_t entries;       // entries written since boot
+    uint32_t bytes;         // bytes written, padding and page headers included
+    uint32_t writes;        // flash writes
+    uint32_t erases;        // page erases
+    uint32_t errors;        // flash operations that failed
+    uint32_t missed;        // records that left the store before they were written
+    uint32_t page_seq;      // sequence number of the page being written
+} card_journal_stats_t;
+
+/*
+ * Registers the journal's pages with pstorage and replays the newest of them
+ * into the store, oldest first, so the store ends up holding the newest cards
+ * and numbering carries on after them. Must run after pstorage_init and before
+ * any card is read.
+ */
+uint32_t card_journal_init(card_store_t *p_store);
+
+// the record with sequence number seq was read again and needs writing again
+void card_journal_touch(uint32_t seq);
+
+// Writes out what is waiting, from the main loop. quiet is false while a card
+// is coming in, no flash operation is started then.
+void card_journal_task(bool quiet);
+
+// true while records wait to be written or a flash operation is under way
+bool card_journal_busy(void);
+
+const card_journal_stats_t *card_journal_stats_get(void);
+
+#endif /* CARD_JOURNAL_H_ */
@@ -0,0 +1,349 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "nrf_error.h"
+#include "wiegand_format.h"
+#include "card_store.h"
+
+#define INDEX_MASK (CARD_INDEX_SIZE - 1)
+
+uint16_t card_store_record_len(const uint8_t *rec)
+{
+    uint16_t bit_len = rec[0] + 1;
+    return CARD_HEADER_LEN + (rec[1] != WIEGAND_FORMAT_UNKNOWN ? CARD_FIELDS_LEN : 0) +
+           CARD_BYTES(bit_len);
+}
+
+// offset of the record after the one at offset
+static uint16_t record_next(const card_store_t *p_store, uint16_t offset)
+{
+    offset += card_store_record_len(&p_store->data[offset]);
+    if (p_store->wrapped && offset == p_store->end) {
+        offset = 0;
+    }
+    return offset;
+}
+
+// FNV-1a over the bit length and card data
+static uint32_t card_hash(uint8_t bits, const uint8_t *data, uint16_t data_len)
+{
+    uint32_t hash = 2166136261UL;
+
+    hash = (hash ^ bits) * 16777619UL;
+    for (uint16_t i = 0; i < data_len; i++) {
+        hash = (hash ^ data[i]) * 16777619UL;
+    }
+    return hash;
+}
+
+// true while the entry's record is still in the store
+static bool entry_live(const card_store_t *p_store, const card_index_entry_t *entry)
+{
+    return entry->seq - p_store->first_seq < p_store->count;
+}
+
+// bits is the bit length - 1, as in the record
+static bool record_matches(const uint8_t *rec, uint8_t bits, const uint8_t *data, uint16_t data_len)
+{
+    return rec[0] == bits && memcmp(&rec[card_store_record_len(rec) - data_len], data, data_len) == 0;
+}
+
+static void record_seen(uint8_t *rec, uint16_t hits, uint32_t seen)
+{
+    rec[2] = hits;
+    rec[3] = hits >> 8;
+    for (uint8_t i = 0; i < 4; i++) {
+        rec[4 + i] = seen >> (8 * i);
+    }
+}
+
+/*
+ * Looks a card up in the index. Returns the entry of its record if it is
+ * stored, otherwise NULL with *p_slot set to where a new record should be
+ * indexed: a free slot if there is one, else the oldest live entry.
+ */
+static card_index_entry_t *index_find(card_store_t *p_store, uint32_t hash, uint8_t bits,
+                                      const uint8_t *data, uint16_t data_len,
+                                      card_index_entry_t **p_slot)
+{
+    card_index_entry_t *slot = NULL;
+
+    for (uint8_t i = 0; i < CARD_INDEX_PROBES; i++) {
+        card_index_entry_t *entry = &p_store->index[(hash + i) & INDEX_MASK];
+
+        if (!entry_live(p_store, entry)) {
+            if (slot == NULL || entry_live(p_store, slot)) {
+                slot = entry;
+            }
+            continue;
+        }
+        if (entry->tag == (uint16_t)(hash >> 16) &&
+            record_matches(&p_store->data[entry->offset], bits, data, data_len)) {
+            return entry;
+        }
+        if (slot == NULL || (entry_live(p_store, slot) && entry->seq < slot->seq)) {
+            slot = entry;
+        }
+    }
+    *p_slot = slot;
+    return NULL;
+}
+
+void card_store_init(card_store_t *p_store, card_store_policy_t policy)
+{
+    memset(p_store, 0, sizeof(*p_store));
+    // sequence numbers this far ahead are never live, so the index starts empty
+    memset(p_store->index, 0xFF, sizeof(p_store->index));
+    p_store->policy = policy;
+}
+
+void card_store_policy_set(card_store_t *p_store, card_store_policy_t policy)
+{
+    p_store->policy = policy;
+}
+
+// drops the oldest record
+static void drop_oldest(card_store_t *p_store)
+{
+    p_store->head += card_store_record_len(&p_store->data[p_store->head]);
+    p_store->count--;
+    p_store->first_seq++;
+    if (p_store->count == 0) {
+        // start over at the bottom so the next records lie back to back
+        p_store->head = 0;
+        p_store->tail = 0;
+        p_store->end = 0;
+        p_store->wrapped = false;
+    } else if (p_store->wrapped && p_store->head == p_store->end) {
+        p_store->head = 0;
+        p_store->end = p_store->tail;
+        p_store->wrapped = false;
+    }
+}
+
+// offset a record of rec_len bytes can go to, or -1 if there is no room
+static int32_t space_find(card_store_t *p_store, uint16_t rec_len)
+{
+    if (p_store->wrapped) {
+        return p_store->head - p_store->tail >= rec_len ? p_store->tail : -1;
+    }
+    if (WIEGAND_STORE_SIZE - p_store->tail >= rec_len) {
+        return p_store->tail;
+    }
+    if (p_store->head >= rec_len) {
+        // no room left at the end, carry on from the start
+        p_store->wrapped = true;
+        p_store->end = p_store->tail;
+        p_store->tail = 0;
+        return 0;
+    }
+    return -1;
+}
+
+// makes the record of rec_len bytes written at offset the newest, indexed
+// in slot unless that is NULL
+static void record_commit(card_store_t *p_store, uint16_t offset, uint16_t rec_len,
+                          card_index_entry_t *slot, uint32_t hash)
+{
+    p_store->tail = offset + rec_len;
+    if (!p_store->wrapped) {
+        p_store->end = p_store->tail;
+    }
+    p_store->offsets[card_store_next_seq(p_store) % CARD_STORE_MAX_RECORDS] = offset;
+    if (slot != NULL) {
+        slot->seq = card_store_next_seq(p_store);
+        slot->offset = offset;
+        slot->tag = hash >> 16;
+    }
+    p_store->count++;
+}
+
+uint32_t card_store_add(card_store_t *p_store, const Card *card, uint32_t seen,
+                        uint32_t *p_seq, uint16_t *p_hits)
+{
+    uint16_t data_len = CARD_BYTES(card->bit_len);
+    uint8_t bits = card->bit_len - 1;
+    bool known = card->format != WIEGAND_FORMAT_UNKNOWN;
+    uint16_t rec_len = CARD_HEADER_LEN + (known ? CARD_FIELDS_LEN : 0) + data_len;
+    card_index_entry_t *entry;
+    card_index_entry_t *slot;
+    uint32_t hash;
+    int32_t offset;
+
+    if (card->bit_len == 0 || card->bit_len > WIEGAND_MAX_BITS) {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+
+    hash = card_hash(bits, card->data, data_len);
+    entry = index_find(p_store, hash, bits, card->data, data_len, &slot);
+    if (entry != NULL) {
+        // read again, just note it on the existing record
+        uint8_t *rec = &p_store->data[entry->offset];
+        uint16_t hits = rec[2] | (rec[3] << 8);
+        hits += hits < UINT16_MAX;
+        record_seen(rec, hits, seen);
+        p_store->coalesced++;
+        if (p_seq) {
+            *p_seq = entry->seq;
+        }
+        if (p_hits) {
+            *p_hits = hits;
+        }
+        return NRF_SUCCESS;
+    }
+
+    while ((offset = space_find(p_store, rec_len)) < 0) {
+        if (p_store->policy == CARD_STORE_STOP) {
+            p_store->refused++;
+            return NRF_ERROR_NO_MEM;
+        }
+        drop_oldest(p_store);
+        p_store->overwritten++;
+    }
+
+    uint8_t *rec = &p_store->data[offset];
+    rec[0] = bits;
+    rec[1] = card->format;
+    record_seen(rec, 1, seen);
+    rec += CARD_HEADER_LEN;
+    // keep the decoded fields so clients don't have to parse the bits
+    if (known) {
+        for (uint8_t i = 0; i < 4; i++) {
+            rec[i] = card->facility >> (8 * i);
+            rec[4 + i] = card->number >> (8 * i);
+        }
+        rec += CARD_FIELDS_LEN;
+    }
+    memcpy(rec, card->data, data_len);
+
+    if (p_seq) {
+        *p_seq = card_store_next_seq(p_store);
+    }
+    record_commit(p_store, offset, rec_len, slot, hash);
+    if (p_hits) {
+        *p_hits = 1;
+    }
+    return NRF_SUCCESS;
+}
+
+uint32_t card_store_restore(card_store_t *p_store, uint32_t seq, const uint8_t *rec, uint16_t len)
+{
+    uint16_t data_len = CARD_BYTES(rec[0] + 1);
+    const uint8_t *data;
+    card_index_entry_t *slot;
+    uint32_t hash;
+    int32_t offset;
+
+    if (len != card_store_record_len(rec)) {
+        return NRF_ERROR_INVALID_LENGTH;
+    }
+    data = &rec[len - data_len];
+    if (seq - p_store->first_seq < p_store->count) {
+        // a later copy of a record already here, only the reads can differ
+        uint8_t *stored = (uint8_t *)card_store_record(p_store, seq, NULL);
+        memcpy(&stored[2], &rec[2], CARD_HEADER_LEN - 2);
+        return NRF_SUCCESS;
+    }
+    if ((int32_t)(seq - card_store_next_seq(p_store)) < 0) {
+        return NRF_SUCCESS;     // reread of a card that has since made way
+    }
+    if (seq != card_store_next_seq(p_store)) {
+        // records went missing in between, keep numbering from this one
+        while (p_store->count > 0) {
+            drop_oldest(p_store);
+        }
+        p_store->first_seq = seq;
+    }
+
+    hash = card_hash(rec[0], data, data_len);
+    if (index_find(p_store, hash, rec[0], data, data_len, &slot) != NULL) {
+        // the older record keeps the index, the card is read again under that one
+        slot = NULL;
+    }
+    // older records make way whatever the policy, the newest are worth more
+    while ((offset = space_find(p_store, len)) < 0) {
+        drop_oldest(p_store);
+    }
+    memcpy(&p_store->data[offset], rec, len);
+    record_commit(p_store, offset, len, slot, hash);
+    return NRF_SUCCESS;
+}
+
+const uint8_t *card_store_record(const card_store_t *p_store, uint32_t seq, uint16_t *p_len)
+{
+    uint16_t offset;
+
+    if (seq - p_store->first_seq >= p_store->count) {
+        return NULL;
+    }
+    offset = p_store->offsets[seq % CARD_STORE_MAX_RECORDS];
+    if (p_len) {
+        *p_len = card_store_record_len(&p_store->data[offset]);
+    }
+    return &p_store->data[offset];
+}
+
+uint32_t card_store_get(const card_store_t *p_store, uint16_t idx, Card *card)
+{
+    const uint8_t *rec = card_store_record(p_store, p_store->first_seq + idx, NULL);
+
+    if (rec == NULL) {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    card->bit_len = rec[0] + 1;
+    card->format = rec[1];
+    card->hits = rec[2] | (rec[3] << 8);
+    card->last_seen = 0;
+    for (uint8_t i = 0; i < 4; i++) {
+        card->last_seen |= (uint32_t)rec[4 + i] << (8 * i);
+    }
+    card->facility = 0;
+    card->number = 0;
+    rec += CARD_HEADER_LEN;
+    if (card->format != WIEGAND_FORMAT_UNKNOWN) {
+        for (uint8_t i = 0; i < 4; i++) {
+            card->facility |= (uint32_t)rec[i] << (8 * i);
+            card->number |= (uint32_t)rec[4 + i] << (8 * i);
+        }
+        rec += CARD_FIELDS_LEN;
+    }
+    memcpy(card->data, rec, CARD_BYTES(card->bit_len));
+    return NRF_SUCCESS;
+}
+
+uint32_t card_store_seen_shift(card_store_t *p_store, uint32_t seq, uint32_t limit, uint32_t offset)
+{
+    uint8_t *rec = (uint8_t *)card_store_record(p_store, seq, NULL);
+    uint32_t seen = 0;
+
+    if (rec == NULL) {
+        return NRF_ERROR_NOT_FOUND;
+    }
+    for (uint8_t i = 0; i < 4; i++) {
+        seen |= (uint32_t)rec[4 + i] << (8 * i);
+    }
+    if (seen >= limit) {
+        return NRF_ERROR_NOT_FOUND;
+    }
+    record_seen(rec, rec[2] | (rec[3] << 8), seen + offset);
+    return NRF_SUCCESS;
+}
+
+uint16_t card_store_release(card_store_t *p_store, uint32_t seq)
+{
+    uint16_t dropped = 0;
+
+    while (p_store->count > 0 && (int32_t)(seq - p_store->first_seq) > 0) {
+        drop_oldest(p_store);
+        dropped++;
+    }
+    return dropped;
+}
+
+const uint8_t *card_store_next(const card_store_t *p_store, const uint8_t *rec)
+{
+    uint16_t offset = record_next(p_store, rec - p_store->data);
+
+    return offset == p_store->tail ? NULL : &p_store->data[offset];
+}
@@ -0,0 +1,143 @@
+#ifndef CARD_STORE_H_
+#define CARD_STORE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define WIEGAND_MAX_BITS 256
+#define CARD_DATA_LEN (WIEGAND_MAX_BITS / 8)
+#define CARD_BYTES(bits) (((bits) + 7) / 8)
+#define WIEGAND_STORE_SIZE 1600 // bytes of card records
+
+// A card in unpacked form. data holds the card as a big endian number of
+// CARD_BYTES(bit_len) bytes, the first bit sent is its most significant bit.
+typedef struct Card Card;
+struct Card {
+    uint16_t bit_len;
+    uint8_t format;         // matched format, WIEGAND_FORMAT_UNKNOWN if none
+    uint32_t facility;      // facility code, 0 if the format has none
+    uint32_t number;        // card number
+    uint16_t hits;          // times the card was read, filled in by card_store_get
+    uint32_t last_seen;     // time in seconds of the latest read, likewise
+    uint8_t data[CARD_DATA_LEN];
+};
+
+// Cards are packed into the store as length prefixed records:
+//   byte 0      bit length - 1, so 1 to 256 bits
+//   byte 1      format, WIEGAND_FORMAT_UNKNOWN if none matched
+//   bytes 2-3   times the card was read, little endian
+//   bytes 4-7   time in seconds of the latest read, little endian
+//   4 + 4 bytes facility code and card number, little endian, known formats only
+//   then        CARD_BYTES(bit length) bytes of card data as in Card
+// A 26 bit H10301 card takes 20 bytes, a card of unknown format 8 bytes plus
+// its data.
+#define CARD_HEADER_LEN 8
+#define CARD_FIELDS_LEN 8
+#define CARD_RECORD_MAX (CARD_HEADER_LEN + CARD_FIELDS_LEN + CARD_DATA_LEN)
+// most records the store can hold, all of 8 bits or fewer
+#define CARD_STORE_MAX_RECORDS (WIEGAND_STORE_SIZE / (CARD_HEADER_LEN + 1))
+
+// what to do with a new card when the store is full
+typedef enum {
+    CARD_STORE_OVERWRITE,   // drop the oldest cards to make room
+    CARD_STORE_STOP,        // keep what is stored and refuse the new card
+} card_store_policy_t;
+
+// Repeat reads of a recent card update its record rather than adding another.
+// The index is an open addressing hash table over the records, an entry whose
+// record has been dropped is free again. If all the slots a card can go to
+// are taken the oldest entry makes way, so only older cards can be missed.
+#define CARD_INDEX_SIZE 32      // must be a power of two
+#define CARD_INDEX_PROBES 8     // slots tried for each card
+
+typedef struct {
+    uint32_t seq;           // sequence number of the record
+    uint16_t offset;        // where it starts in data
+    uint16_t tag;           // hash of the card, checked before the record
+} card_index_entry_t;
+
+// The records form a ring, oldest first. A record never wraps around the end
+// of data: if it does not fit there it goes to the start and the space left
+// at the end is unused until the oldest records move past it. Every record
+// gets the next sequence number, the oldest one's is first_seq. The offset of
+// record seq is kept in offsets[seq % CARD_STORE_MAX_RECORDS], the records
+// stored never number more, so any of them is found without a walk.
+typedef struct {
+    uint8_t data[WIEGAND_STORE_SIZE];
+    uint16_t head;          // offset of the oldest record
+    uint16_t tail;          // offset just past the newest record
+    uint16_t end;           // end of the records from head on, tail unless wrapped
+    bool wrapped;           // the newest records start again at offset 0
+    uint16_t count;         // records stored
+    uint32_t first_seq;     // sequence number of the oldest record
+    uint32_t overwritten;   // records dropped to make room
+    uint32_t refused;       // records not stored because the store was full
+    uint32_t coalesced;     // repeat reads folded into an existing record
+    card_store_policy_t policy;
+    card_index_entry_t index[CARD_INDEX_SIZE];
+    uint16_t offsets[CARD_STORE_MAX_RECORDS];   // where each record starts in data, by sequence number
+} card_store_t;
+
+void card_store_init(card_store_t *p_store, card_store_policy_t policy);
+void card_store_policy_set(card_store_t *p_store, card_store_policy_t policy);
+
+/*
+ * Stores a card read at time seen. A card already in the index only has its
+ * record's hit count and last seen time updated. Otherwise it is appended:
+ * with CARD_STORE_OVERWRITE the oldest records are dropped until it fits,
+ * with CARD_STORE_STOP NRF_ERROR_NO_MEM is returned when full. If p_seq and
+ * p_hits are not NULL they are set to the record's sequence number and the
+ * card's hit count, 1 for a new record.
+ */
+uint32_t card_store_add(card_store_t *p_store, const Card *card, uint32_t seen,
+                        uint32_t *p_seq, uint16_t *p_hits);
+
+/*
+ * Puts back a record saved earlier under sequence number seq, for replaying
+ * the flash journal oldest first. A record already in the store takes the
+ * hit count and last seen time of the copy. Older sequence numbers are
+ * ignored, a gap in them empties the store first, and the oldest records
+ * make way whatever the policy.
+ */
+uint32_t card_store_restore(card_store_t *p_store, uint32_t seq, const uint8_t *rec, uint16_t len);
+
+// unpacks the idx-th card in the store, 0 being the oldest
+uint32_t card_store_get(const card_store_t *p_store, uint16_t idx, Card *card);
+
+// the record with sequence number seq and, if p_len is not NULL, its
+// length, or NULL if it is no longer stored
+const uint8_t *card_store_record(const card_store_t *p_store, uint32_t seq, uint16_t *p_len);
+
+// length of the record starting at rec
+uint16_t card_store_record_len(const uint8_t *rec);
+
+/*
+ * Adds offset to the last seen time of record seq if that is below limit, for
+ * moving times counted from boot onto a clock set later. Returns
+ * NRF_ERROR_NOT_FOUND if the record is gone or its time is not below limit.
+ */
+uint32_t card_store_seen_shift(card_store_t *p_store, uint32_t seq, uint32_t limit, uint32_t offset);
+
+/*
+ * Drops the records before sequence number seq, for cards a client has
+ * taken. Numbering carries on as before. Returns the records dropped.
+ */
+uint16_t card_store_release(card_store_t *p_store, uint32_t seq);
+
+// the record after rec in the store, or NULL if rec is the newest
+const uint8_t *card_store_next(const card_store_t *p_store, const uint8_t *rec);
+
+// sequence number the next card will get
+static inline uint32_t card_store_next_seq(const card_store_t *p_store)
+{
+    return p_store->first_seq + p_store->count;
+}
+
+// bytes the records take up, out of WIEGAND_STORE_SIZE
+static inline uint16_t card_store_used(const card_store_t *p_store)
+{
+    return p_store->wrapped ? p_store->end - p_store->head + p_store->tail
+                            : p_store->tail - p_store->head;
+}
+
+#endif /* CARD_STORE_H_ */
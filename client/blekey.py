@@ -3,13 +3,199 @@ import cmd
 import pygatt
 import pprint as pp
 import os
+import struct
+import time
 
 # Set default MAC so you can just "connect" without any parameters
 DEFAULT_MAC = "DE:AB:92:17:E6:41"
 # gatttool seems to take a long time getting data from the nrf51
 DEFAULT_TIMEOUT = 15
-CARD_DATA_LEN = 7
+# the last cards characteristic holds the newest card records coded as in
+# card_codec.h: a header of version, entries (CODEC_COUNT_OPEN if not known
+# when the stream started) and first sequence number, then for each entry a
+# flags byte and varints against the record before it
+CODEC_VERSION = 1
+CODEC_HEADER_FMT = "<BHI"
+CODEC_COUNT_OPEN = 0xFFFF
+CODEC_SHAPE = 0x01
+CODEC_SEQ = 0x02
+CODEC_HITS = 0x04
+CODEC_FIELDS = 0x08
+CODEC_SAME = 0x10
+CODEC_XOR = 0x20
+FORMAT_UNKNOWN = 0xFF
+# must match the order of the formats table in wiegand_format.c: name, then
+# first bit and length of the facility code and of the card number
+CARD_FORMATS = [("H10301", 1, 8, 9, 16),
+                ("H10306", 1, 16, 17, 16),
+                ("C1k35s", 2, 12, 14, 20),
+                ("H10304", 1, 16, 17, 19),
+                ("C1k48s", 2, 22, 24, 23)]
 BLE_DEVICE = "hci0"
+# attribute handles
+LAST_CARDS_HND = 0x0b
+REPLAY_HND = 0x0e
+SEND_DATA_HND = 0x11
+DATA_LENGTH_HND = 0x13
+TX_TIMING_HND = 0x15
+CLOCK_HND = 0x17
+EXPORT_HND = 0x19
+CONN_HND = 0x1c
+CONTROL_HND = 0x1e
+BATTERY_HND = 0x22
+# with notifications on, each card read is sent as the last cards
+# characteristic, a stream of its own; an empty one means read the characteristic
+LAST_CARDS_UUID = "0000aaaa-0000-1000-8000-00805f9b34fb"
+# writing the sequence number to start from to the export characteristic
+# streams the cards from there on as notifications, one card_codec.h stream
+# cut into pieces and ended by an empty one; it then reads back records,
+# bytes and bytes per second
+EXPORT_UUID = "0000eef0-0000-1000-8000-00805f9b34fb"
+# writing the sequence number after the last card held to the last cards
+# characteristic makes it hold the cards from there on, oldest first; the
+# flag frees the cards before it on BLEKey
+SYNC_FMT = "<I"
+SYNC_FLAGS_FMT = "<IB"
+SYNC_RELEASE = 0x01
+EXPORT_START_FMT = "<I"
+EXPORT_FMT = "<III"
+# replay jobs are card, times to send it and the gap in ms between frames;
+# the replay characteristic reads back jobs queued, frames left of the running
+# job, its card (0xFFFF if none), jobs done, failed and turned away, and the
+# result of the last job to end
+REPLAY_JOB_FMT = "<BBH"
+REPLAY_JOBS = 8
+REPLAY_STATUS_FMT = "<BBHHHHH"
+REPLAY_IDLE = 0xFFFF
+# a custom frame is its bits right aligned, first bit first, then its length
+# in bits as "<H"; writing the length sends it
+DATA_LENGTH_FMT = "<H"
+MAX_BITS = 256
+# tx timing is profile (| loopback flag), pulse us, period us, gap ms, then
+# the loopback measurement: pulses, missed, width min/max, period min/max
+TX_PROFILES = ["standard", "fast", "slow", "custom"]
+TX_LOOPBACK = 0x80
+TX_TIMING_FMT = "<BHHH"
+TX_MEASURE_FMT = "<HHHHHH"
+# the clock is written with the Unix time now and reads back the Unix time
+# BLEKey booted at, 0 until set. Card times from TIME_UNIX on are Unix time,
+# smaller ones are seconds since the boot the card was read in
+CLOCK_FMT = "<I"
+TIME_UNIX = 946684800
+# the connection characteristic reads profile, interval in 1.25 ms units,
+# slave latency, supervision timeout in 10 ms units, ms spent idle and fast
+# since boot and the profile changes the central turned down
+CONN_FMT = "<BHHHIIH"
+CONN_PROFILES = ["idle", "fast"]
+# a control point command is opcode, a tag of the client's, then the
+# parameters as written to the characteristic the opcode stands for; commands
+# go as write commands, several in one connection event, and each result is
+# notified as opcode, tag, error code (0 is success), then the opcode's data.
+# At most CONTROL_WAITING results may be waiting at a time
+CONTROL_UUID = "0000eef2-0000-1000-8000-00805f9b34fb"
+CONTROL_FMT = "<BB"
+CONTROL_RESULT_FMT = "<BBH"
+CONTROL_WAITING = 7
+CONTROL_REPLAY = 1
+CONTROL_CLEAR = 2
+CONTROL_TIME = 3
+CONTROL_PROFILE = 4
+CONTROL_EXPORT = 5
+CONTROL_OPS = {"replay": CONTROL_REPLAY, "clear": CONTROL_CLEAR, "time": CONTROL_TIME,
+               "profile": CONTROL_PROFILE, "export": CONTROL_EXPORT}
+CONTROL_ERRORS = {4: "queue full", 6: "not supported", 7: "bad value", 8: "not now", 9: "bad length",
+                  0xFFFF: "failed"}
+
+
+def unzigzag(value):
+    return (value >> 1) ^ -(value & 1)
+
+
+def card_field(value, bit_len, pos, length):
+    return (value >> (bit_len - pos - length)) & ((1 << length) - 1)
+
+
+def stream_header(raw):
+    """Returns the entries and first sequence number of a card stream"""
+    if len(raw) < struct.calcsize(CODEC_HEADER_FMT):
+        raise ValueError("card stream cut short")
+    version, count, first = struct.unpack_from(CODEC_HEADER_FMT, raw)
+    if version != CODEC_VERSION:
+        raise ValueError("card stream version %d, expected %d" % (version, CODEC_VERSION))
+    return count, first
+
+
+def parse_cards(raw):
+    """Yields (seq, bit length, format, hits, last seen, facility, number,
+    data) for each record of a card stream, decoded where it lies"""
+    raw = bytearray(raw)
+    count, first = stream_header(raw)
+    state = {"pos": struct.calcsize(CODEC_HEADER_FMT)}
+
+    def byte():
+        if state["pos"] >= len(raw):
+            raise ValueError("card record cut short")
+        state["pos"] += 1
+        return raw[state["pos"] - 1]
+
+    def varint():
+        value = shift = 0
+        while True:
+            b = byte()
+            value |= (b & 0x7F) << shift
+            shift += 7
+            if not b & 0x80:
+                return value
+
+    seq, seen, bit_len, fmt, prev = first - 1, 0, 0, FORMAT_UNKNOWN, bytearray()
+    entries = 0
+    while state["pos"] < len(raw):
+        flags = byte()
+        if flags & CODEC_SHAPE:
+            bit_len = varint()
+            fmt = byte()
+        seq += 1
+        if flags & CODEC_SEQ:
+            seq += unzigzag(varint())
+        hits = varint() if flags & CODEC_HITS else 1
+        seen += unzigzag(varint())
+        fc = cn = 0
+        if flags & CODEC_FIELDS:
+            fc = varint()
+            cn = varint()
+        data_len = (bit_len + 7) // 8
+        if flags & CODEC_SAME:
+            data = bytearray(prev)
+        elif flags & CODEC_XOR:
+            same = byte()
+            data = prev[:same] + bytearray(byte() ^ prev[i] for i in range(same, data_len))
+        else:
+            data = bytearray(byte() for _ in range(data_len))
+        if fmt < len(CARD_FORMATS) and not flags & CODEC_FIELDS:
+            value = int(''.join('{:02x}'.format(x) for x in data), 16)
+            _, fc_pos, fc_len, cn_pos, cn_len = CARD_FORMATS[fmt]
+            fc = card_field(value, bit_len, fc_pos, fc_len) if fc_len else 0
+            cn = card_field(value, bit_len, cn_pos, cn_len)
+        prev = data
+        entries += 1
+        yield seq, bit_len, fmt, hits, seen, fc, cn, data
+    if count != CODEC_COUNT_OPEN and entries != count:
+        raise ValueError("card stream holds %d cards, its header says %d" % (entries, count))
+
+
+def print_cards(raw):
+    for seq, bit_len, fmt, hits, seen, fc, cn, data in parse_cards(raw):
+        print ("%d. %d bit card:" % (seq, bit_len)),
+        fixed = ''.join('{:02x}'.format(x) for x in data)
+        if fmt < len(CARD_FORMATS):
+            print ("0x%s %s FC: %d CN: %d" % (fixed, CARD_FORMATS[fmt][0], fc, cn)),
+        else:
+            print ("0x%s" % fixed),
+        if seen >= TIME_UNIX:
+            print ("seen %d times, last %s" % (hits, time.strftime(
+                "%Y-%m-%d %H:%M:%S", time.localtime(seen))))
+        else:
+            print ("seen %d times, last %ds after boot" % (hits, seen))
 
 
 class BLEKeyClient(cmd.Cmd):
@@ -18,6 +204,7 @@ class BLEKeyClient(cmd.Cmd):
     def __init__(self):
         cmd.Cmd.__init__(self)
         self.macs = []
+        self.sync_next = 0
         self.prompt = '\033[1;30m[n/c]\033[1;m blekey> '
 
     def emptyline(self):
@@ -41,6 +228,8 @@ class BLEKeyClient(cmd.Cmd):
                                            app_options="-t random")
         self.bk.connect(timeout=DEFAULT_TIMEOUT)
         self.do_bat(None)
+        if not self.boot_time():
+            self.do_clock(None)
         self.prompt = "\033[1;34m[%s]\033[1;m blekey>" % mac
 
     def complete_connect(self, text, line, begidx, endidx):
@@ -69,7 +258,62 @@ class BLEKeyClient(cmd.Cmd):
             except ValueError:
                 print("Error. Please provide a number between 0-255")
                 return
-        self.bk.char_write(0x0d, data)
+        self.bk.char_write(REPLAY_HND, data)
+
+    def do_replay(self, line):
+        data = bytearray()
+        try:
+            for job in line.split():
+                fields = [int(f) for f in job.split(",")]
+                if len(fields) > 3:
+                    raise ValueError
+                card, repeat, gap = (fields + [1, 0])[:3]
+                data += bytearray(struct.pack(REPLAY_JOB_FMT, card, repeat, gap))
+        except (ValueError, struct.error):
+            self.help_replay()
+            return
+        if len(data) > REPLAY_JOBS * struct.calcsize(REPLAY_JOB_FMT):
+            self.help_replay()
+            return
+        if data:
+            self.bk.char_write(REPLAY_HND, data)
+        raw = bytes(bytearray(self.bk.char_read_hnd(REPLAY_HND, timeout=DEFAULT_TIMEOUT)))
+        queued, left, card, done, failed, rejected, err = struct.unpack(REPLAY_STATUS_FMT, raw)
+        if card == REPLAY_IDLE:
+            print("Idle, %d jobs queued" % queued)
+        else:
+            print("Sending card %d, %d frames left, %d jobs queued" % (card, left, queued))
+        print("%d jobs done, %d failed, %d turned away, last result %d"
+              % (done, failed, rejected, err))
+
+    def help_replay(self):
+        print("Usage: replay [CARD[,REPEAT[,GAP_MS]] ...]")
+        print("Queues up to %d jobs, each sending CARD REPEAT times with GAP_MS "
+              "between frames, and shows how the jobs are going. Without "
+              "jobs it only shows that. CARD is as for tx." % REPLAY_JOBS)
+
+    def do_frame(self, line):
+        try:
+            bits, value = line.split()
+            bits = int(bits)
+            value = int(value, 16)
+        except ValueError:
+            self.help_frame()
+            return
+        if not 0 < bits <= MAX_BITS or value >> bits:
+            self.help_frame()
+            return
+        data_len = (bits + 7) // 8
+        data = bytearray((value >> (8 * (data_len - 1 - i))) & 0xFF for i in range(data_len))
+        print("Sending %d bit frame..." % bits)
+        # longer than a single write, gatttool sends it as a long write
+        self.bk.char_write(SEND_DATA_HND, data)
+        self.bk.char_write(DATA_LENGTH_HND, bytearray(struct.pack(DATA_LENGTH_FMT, bits)))
+
+    def help_frame(self):
+        print("Usage: frame BITS HEX")
+        print("Sends a frame of BITS bits, up to %d, given in hex, out on the "
+              "Wiegand lines. tx 254 sends it again." % MAX_BITS)
 
     def help_tx(self):
         print("Usage: tx <num>")
@@ -78,25 +322,259 @@ class BLEKeyClient(cmd.Cmd):
 
     def do_readcards(self, _):
         print("reading last cards...")
-        last_cards = self.bk.char_read_hnd(0x0b, timeout=DEFAULT_TIMEOUT)
-        num_cards = len(last_cards) / CARD_DATA_LEN
-        if not last_cards:
+        last_cards = self.bk.char_read_hnd(LAST_CARDS_HND, timeout=DEFAULT_TIMEOUT)
+        if not stream_header(bytearray(last_cards))[0]:
             print("no cards read/received from BLEKey...")
             return
-        for i in range(0, num_cards):
-            start = i * 7
-            print ("%d. %d bit card:" % (i, last_cards[start])),
-            card_data = reversed(last_cards[start + 1:start + 6])
-            fixed = ''.join('{:02x}'.format(x) for x in card_data)
-            print ("0x%s" % fixed)
-            fixed = None
-            card_data = None
+        print_cards(last_cards)
 
     def help_readcards(self):
-        print("readcards reads the last three cards")
+        print("readcards reads the newest cards BLEKey holds")
+
+    def do_sync(self, line):
+        args = line.split()
+        if "free" in args:
+            args.remove("free")
+            release = True
+        else:
+            release = False
+        try:
+            if args:
+                self.sync_next = int(args[0])
+        except ValueError:
+            self.help_sync()
+            return
+        got = 0
+        while True:
+            if release:
+                data = struct.pack(SYNC_FLAGS_FMT, self.sync_next, SYNC_RELEASE)
+            else:
+                data = struct.pack(SYNC_FMT, self.sync_next)
+            self.bk.char_write(LAST_CARDS_HND, bytearray(data))
+            raw = self.bk.char_read_hnd(LAST_CARDS_HND, timeout=DEFAULT_TIMEOUT)
+            if not stream_header(bytearray(raw))[0]:
+                break
+            print_cards(raw)
+            for card in parse_cards(raw):
+                self.sync_next = card[0] + 1
+                got += 1
+        print("%d new cards, next sync from %d" % (got, self.sync_next))
+
+    def help_sync(self):
+        print("Usage: sync [SEQ] [free]")
+        print("Reads only the cards BLEKey took since the last sync, or from "
+              "sequence number SEQ on. With free BLEKey drops the cards "
+              "already synced, for good.")
+
+    def on_card(self, _, value):
+        if value:
+            print_cards(value)
+        else:
+            print("card too long to notify, use readcards")
+
+    def do_watch(self, _):
+        print("watching for cards, Ctrl-C to stop...")
+        self.bk.subscribe(LAST_CARDS_UUID, callback=self.on_card)
+        try:
+            self.bk.run()
+        except KeyboardInterrupt:
+            self.bk.stop()
+
+    def help_watch(self):
+        print("Usage: watch")
+        print("Prints every card BLEKey reads as soon as it is read.")
+
+    def on_export(self, _, value):
+        if value:
+            self.export_data += bytearray(value)
+        else:
+            self.bk.stop()
+
+    def do_export(self, line):
+        try:
+            start = int(line) if line else 0
+        except ValueError:
+            self.help_export()
+            return
+        print("exporting cards...")
+        self.export_data = bytearray()
+        self.bk.subscribe(EXPORT_UUID, callback=self.on_export)
+        self.bk.char_write(EXPORT_HND, bytearray(struct.pack(EXPORT_START_FMT, start)))
+        try:
+            self.bk.run()
+        except KeyboardInterrupt:
+            self.bk.stop()
+            return
+        print_cards(self.export_data)
+        raw = bytes(bytearray(self.bk.char_read_hnd(EXPORT_HND, timeout=DEFAULT_TIMEOUT)))
+        records, size, rate = struct.unpack(EXPORT_FMT, raw)
+        print("%d cards, %d bytes at %d bytes/s" % (records, size, rate))
+
+    def help_export(self):
+        print("Usage: export [SEQ]")
+        print("Streams every card in BLEKey's store, or those from sequence "
+              "number SEQ on, much faster than readcards can read them.")
+
+    def do_timing(self, line):
+        args = line.split()
+        if args:
+            loopback = TX_LOOPBACK if "loopback" in args else 0
+            args = [a for a in args if a != "loopback"]
+            try:
+                profile = TX_PROFILES.index(args[0])
+                data = [profile | loopback]
+                if args[0] == "custom" and len(args) == 4:
+                    data = bytearray(struct.pack(TX_TIMING_FMT, profile | loopback,
+                                                 *[int(a) for a in args[1:]]))
+            except (ValueError, IndexError):
+                self.help_timing()
+                return
+            self.bk.char_write(TX_TIMING_HND, data)
+        raw = bytes(bytearray(self.bk.char_read_hnd(TX_TIMING_HND, timeout=DEFAULT_TIMEOUT)))
+        profile, pulse, period, gap = struct.unpack_from(TX_TIMING_FMT, raw)
+        print("profile %s: %d us pulses every %d us, %d ms gap%s" %
+              (TX_PROFILES[profile & ~TX_LOOPBACK], pulse, period, gap,
+               ", loopback on" if profile & TX_LOOPBACK else ""))
+        pulses, missed, wmin, wmax, pmin, pmax = struct.unpack_from(
+            TX_MEASURE_FMT, raw, struct.calcsize(TX_TIMING_FMT))
+        if pulses or missed:
+            print("last replay: %d pulses, %d missed, width %d-%d us, "
+                  "period %d-%d us, jitter %d us" %
+                  (pulses, missed, wmin, wmax, pmin, pmax, pmax - pmin))
+
+    def help_timing(self):
+        print("Usage: timing [standard|fast|slow|custom [PULSE PERIOD GAP]] [loopback]")
+        print("Shows or sets the replay timing. The setting is kept across "
+              "resets. With loopback the next replays are measured on the "
+              "input pins, run timing again afterwards to see the result.")
+
+    def boot_time(self):
+        raw = bytes(bytearray(self.bk.char_read_hnd(CLOCK_HND, timeout=DEFAULT_TIMEOUT)))
+        return struct.unpack(CLOCK_FMT, raw)[0]
+
+    def do_clock(self, _):
+        self.bk.char_write(CLOCK_HND, bytearray(struct.pack(CLOCK_FMT, int(time.time()))))
+        print("BLEKey clock set, booted %s" % time.strftime(
+            "%Y-%m-%d %H:%M:%S", time.localtime(self.boot_time())))
+
+    def help_clock(self):
+        print("Usage: clock")
+        print("Sets BLEKey's clock to this computer's, so cards are stamped "
+              "with the date and time. connect does this when it is not set. "
+              "Cards read since boot before it was set are moved onto it.")
+
+    def do_conn(self, _):
+        raw = bytes(bytearray(self.bk.char_read_hnd(CONN_HND, timeout=DEFAULT_TIMEOUT)))
+        profile, interval, latency, timeout, idle_ms, fast_ms, rejected = struct.unpack(CONN_FMT, raw)
+        print("%s profile: %.2f ms interval, latency %d, %d ms timeout"
+              % (CONN_PROFILES[profile], interval * 1.25, latency, timeout * 10))
+        print("%.1f s idle, %.1f s fast since boot, %d changes turned down"
+              % (idle_ms / 1000.0, fast_ms / 1000.0, rejected))
+
+    def help_conn(self):
+        print("Usage: conn")
+        print("Shows the connection parameters in use. BLEKey asks for a "
+              "short interval while an export or replay jobs run and a long "
+              "one with slave latency otherwise.")
+
+    def control_command(self, line):
+        """Returns the opcode and parameters of one ctl command"""
+        args = line.split()
+        op = CONTROL_OPS[args[0]]
+        if op == CONTROL_REPLAY and len(args) == 2 and "," not in args[1]:
+            params = struct.pack("<B", int(args[1]))
+        elif op == CONTROL_REPLAY and len(args) == 2:
+            fields = [int(f) for f in args[1].split(",")]
+            card, repeat, gap = (fields + [1, 0])[:3]
+            params = struct.pack(REPLAY_JOB_FMT, card, repeat, gap)
+        elif op in (CONTROL_CLEAR, CONTROL_EXPORT) and len(args) <= 2:
+            params = struct.pack(SYNC_FMT, int(args[1])) if len(args) == 2 else b""
+            if op == CONTROL_EXPORT and not params:
+                params = struct.pack(EXPORT_START_FMT, 0)
+        elif op == CONTROL_TIME and len(args) == 1:
+            params = struct.pack(CLOCK_FMT, int(time.time()))
+        elif op == CONTROL_PROFILE and len(args) in (2, 3):
+            loopback = TX_LOOPBACK if args[2:] == ["loopback"] else 0
+            if len(args) == 3 and not loopback:
+                raise ValueError
+            params = struct.pack("<B", TX_PROFILES.index(args[1]) | loopback)
+        else:
+            raise ValueError
+        return op, params
+
+    def on_control(self, _, value):
+        op, tag, err = struct.unpack_from(CONTROL_RESULT_FMT, bytes(bytearray(value)))
+        self.ctl_results[tag] = (op, err, bytearray(value)[struct.calcsize(CONTROL_RESULT_FMT):])
+        self.ctl_stop()
+
+    def on_ctl_export(self, _, value):
+        if value:
+            self.export_data += bytearray(value)
+        else:
+            self.export_running = False
+            self.ctl_stop()
+
+    def ctl_stop(self):
+        if len(self.ctl_results) == self.ctl_sent and not self.export_running:
+            self.bk.stop()
+
+    def do_ctl(self, line):
+        try:
+            commands = [self.control_command(c) for c in line.split(";") if c.strip()]
+        except (ValueError, KeyError, IndexError, struct.error):
+            self.help_ctl()
+            return
+        if not commands or len(commands) > CONTROL_WAITING:
+            self.help_ctl()
+            return
+        self.ctl_results = {}
+        self.ctl_sent = len(commands)
+        self.export_data = bytearray()
+        self.export_running = any(op == CONTROL_EXPORT for op, _ in commands)
+        self.bk.subscribe(CONTROL_UUID, callback=self.on_control)
+        if self.export_running:
+            self.bk.subscribe(EXPORT_UUID, callback=self.on_ctl_export)
+        # back to back, BLEKey answers once it ran them
+        for tag, (op, params) in enumerate(commands):
+            self.bk.char_write(CONTROL_HND, bytearray(struct.pack(CONTROL_FMT, op, tag) + params))
+        try:
+            self.bk.run()
+        except KeyboardInterrupt:
+            self.bk.stop()
+        for tag, (op, _) in enumerate(commands):
+            name = [n for n, o in CONTROL_OPS.items() if o == op][0]
+            if tag not in self.ctl_results:
+                print("%s: no answer" % name)
+                continue
+            _, err, data = self.ctl_results[tag]
+            if err:
+                print("%s: %s" % (name, CONTROL_ERRORS.get(err, "error %d" % err)))
+            elif op == CONTROL_REPLAY:
+                print("%s: %d jobs queued" % (name, data[0]))
+            elif op == CONTROL_CLEAR:
+                print("%s: %d cards freed" % (name, struct.unpack("<H", bytes(data))[0]))
+            elif op == CONTROL_TIME:
+                print("%s: booted %s" % (name, time.strftime(
+                    "%Y-%m-%d %H:%M:%S", time.localtime(struct.unpack(CLOCK_FMT, bytes(data))[0]))))
+            elif op == CONTROL_PROFILE:
+                print("%s: %s%s" % (name, TX_PROFILES[data[0] & ~TX_LOOPBACK],
+                                    ", loopback on" if data[0] & TX_LOOPBACK else ""))
+            else:
+                print("%s: started" % name)
+        if self.export_data:
+            print_cards(self.export_data)
+
+    def help_ctl(self):
+        print("Usage: ctl COMMAND[; COMMAND ...]")
+        print("Sends up to %d commands to the control point at once, without "
+              "waiting for each to be answered, then shows their results. "
+              "COMMAND is one of replay CARD[,REPEAT[,GAP_MS]], clear [SEQ], "
+              "time, profile standard|fast|slow [loopback] or export [SEQ]. "
+              "clear frees the cards before SEQ, or all of them, for good."
+              % CONTROL_WAITING)
 
     def do_bat(self, _):
-        battery = self.bk.char_read_hnd(0x14, timeout=DEFAULT_TIMEOUT)
+        battery = self.bk.char_read_hnd(BATTERY_HND, timeout=DEFAULT_TIMEOUT)
         print("Battery at %d%%" % battery[0])
 
     def help_bat(self):
@@ -44,6 +44,8 @@
 #include "device_manager.h"
 #include "ble_debug_assert_handler.h"
 #include "pstorage.h"
+#include "card_codec.h"
+#include "card_journal.h"
 #include "app_trace.h"
 #include "wiegand.h"
 
@@ -57,18 +59,31 @@
 #define DEVICE_NAME                          "BLEKey"                                   /**< Name of device. Will be included in the advertising data. */
 #define MANUFACTURER_NAME                    "MB_EE"                                   /**< Manufacturer. Will be passed to Device Information Service. */
 #define APP_ADV_INTERVAL                     0x0C80                                    /**< The advertising interval (in units of 0.625 ms). */
+#define APP_ADV_FAST_INTERVAL                MSEC_TO_UNITS(100, UNIT_0_625_MS)          /**< Advertising interval for ADV_FAST_TIME after a new card (100 ms). */
+#define APP_ADV_IDLE_INTERVAL                MSEC_TO_UNITS(5000, UNIT_0_625_MS)         /**< Advertising interval once no new card has come for ADV_IDLE_DELAY (5 seconds). */
+#define ADV_FAST_TIME                        (30ULL * APP_TIMER_CLOCK_FREQ)             /**< RTC1 ticks of fast advertising after a new card (30 seconds). */
+#define ADV_IDLE_DELAY                       (600ULL * APP_TIMER_CLOCK_FREQ)            /**< RTC1 ticks without a new card before advertising slows down (10 minutes). */
+#define ADV_STATUS_COMPANY_ID                0xFFFF                                     /**< Company identifier of the status, the one set aside for testing. */
+#define ADV_STATUS_VERSION                   1                                          /**< First byte of the status, bump when its layout changes. */
+#define ADV_STATUS_LEN                       5                                          /**< version, next sequence number (low 16 bits), battery %, store fill % */
 #define APP_ADV_TIMEOUT_IN_SECONDS           0                                       /**< The advertising timeout in units of seconds. */
 
 #define APP_TIMER_PRESCALER                  0                                          /**< Value of the RTC1 PRESCALER register. */
-#define APP_TIMER_MAX_TIMERS                 4                                          /**< Maximum number of simultaneously created timers. */
+#define APP_TIMER_MAX_TIMERS                 6                                          /**< Maximum number of simultaneously created timers. */
 #define APP_TIMER_OP_QUEUE_SIZE              4                                          /**< Size of timer operation queues. */
 
 #define BATTERY_LEVEL_MEAS_INTERVAL          APP_TIMER_TICKS(5000, APP_TIMER_PRESCALER) /**< Battery level measurement interval (ticks). */
 
-#define MIN_CONN_INTERVAL                    MSEC_TO_UNITS(500, UNIT_1_25_MS)           /**< Minimum acceptable connection interval (0.5 seconds). */
-#define MAX_CONN_INTERVAL                    MSEC_TO_UNITS(1000, UNIT_1_25_MS)          /**< Maximum acceptable connection interval (1 second). */
-#define SLAVE_LATENCY                        0                                          /**< Slave latency. */
-#define CONN_SUP_TIMEOUT                     MSEC_TO_UNITS(4000, UNIT_10_MS)            /**< Connection supervisory timeout (4 seconds). */
+#define MIN_CONN_INTERVAL                    MSEC_TO_UNITS(500, UNIT_1_25_MS)           /**< Minimum acceptable connection interval when idle (0.5 seconds). */
+#define MAX_CONN_INTERVAL                    MSEC_TO_UNITS(1000, UNIT_1_25_MS)          /**< Maximum acceptable connection interval when idle (1 second). */
+#define SLAVE_LATENCY                        4                                          /**< Slave latency when idle, connection events skipped with nothing to send. */
+#define CONN_SUP_TIMEOUT                     MSEC_TO_UNITS(12000, UNIT_10_MS)           /**< Connection supervisory timeout when idle (12 seconds), over twice the longest time between events listened to. */
+#define FAST_MIN_CONN_INTERVAL               MSEC_TO_UNITS(7.5, UNIT_1_25_MS)           /**< Minimum acceptable connection interval while data moves (7.5 ms). */
+#define FAST_MAX_CONN_INTERVAL               MSEC_TO_UNITS(20, UNIT_1_25_MS)            /**< Maximum acceptable connection interval while data moves (20 ms). */
+#define FAST_SLAVE_LATENCY                   0                                          /**< Slave latency while data moves. */
+#define FAST_CONN_SUP_TIMEOUT                MSEC_TO_UNITS(4000, UNIT_10_MS)            /**< Connection supervisory timeout while data moves (4 seconds). */
+#define CONN_IDLE_DELAY                      (2 * APP_TIMER_CLOCK_FREQ)                 /**< RTC1 ticks with no export or replay job before the idle profile is asked for again (2 seconds). */
+#define CONN_REPORT_INTERVAL                 APP_TIMER_CLOCK_FREQ                       /**< RTC1 ticks between refreshes of the connection characteristic while connected (1 second). */
 
 #define FIRST_CONN_PARAMS_UPDATE_DELAY       APP_TIMER_TICKS(5000, APP_TIMER_PRESCALER) /**< Time from initiating event (connect or start of notification) to first time sd_ble_gap_conn_param_update is called (5 seconds). */
 #define NEXT_CONN_PARAMS_UPDATE_DELAY        APP_TIMER_TICKS(30000, APP_TIMER_PRESCALER)/**< Time between each call to sd_ble_gap_conn_param_update after the first call (30 seconds). */
@@ -83,12 +98,64 @@
 #define SEC_PARAM_MAX_KEY_SIZE               16                                         /**< Maximum encryption key size. */
 
 #define DEAD_BEEF                            0xDEADBEEF                                 /**< Value used as error code on stack dump, can be used to identify stack location on stack unwind. */
+#define SETTINGS_MAGIC                       0x424B5302                                 /**< Marks a written settings block, bump when settings_t changes. */
 #define VBAT_MAX_IN_MV						 3000
+#define POWER_REPORT_MEASUREMENTS            12                                         /**< Battery measurements between main loop activity reports (1 minute). */
+#define RTC_MASK                             0x00FFFFFF                                 /**< RTC1 is a 24 bit counter. */
 
 static uint16_t                              m_conn_handle = BLE_CONN_HANDLE_INVALID;   /**< Handle of the current connection. */
 static ble_gap_adv_params_t                  m_adv_params;                              /**< Parameters to be passed to the stack when starting advertising. */
+static volatile bool                         m_advertising = false;                     /**< Advertising has been started and no central has connected since. */
+static uint8_t                               m_adv_status[ADV_STATUS_LEN];              /**< Capture status in the advertising data. */
+static bool                                  m_adv_new_card = false;                    /**< A new card has been stored since boot ... */
+static uint64_t                              m_adv_card_ticks;                          /**< ... and the Wiegand clock at its first pulse. */
 static ble_bas_t                             m_bas;                                     /**< Structure used to identify the battery service. */
 static ble_wiegand_t                         m_wiegand;                                 /**< Structure used to identify the heart rate service. */
+static card_store_t                          m_card_store;                              /**< Cards read, shared with the Wiegand module. */
+static uint8_t                               m_cards_tx[BLE_MAX_TX_LEN];                /**< Newest cards coded for the last cards characteristic. */
+static volatile bool                         m_cards_dirty = true;                      /**< The card store or the client's sync changed since the last cards characteristic was loaded. */
+
+/**@brief Connection parameters of each profile, the idle ones are also the preferred ones at connection. */
+static const ble_gap_conn_params_t           m_conn_profiles[BLE_WIEGAND_CONN_PROFILES] =
+{
+    [BLE_WIEGAND_CONN_IDLE] =
+    {
+        .min_conn_interval = MIN_CONN_INTERVAL,
+        .max_conn_interval = MAX_CONN_INTERVAL,
+        .slave_latency     = SLAVE_LATENCY,
+        .conn_sup_timeout  = CONN_SUP_TIMEOUT
+    },
+    [BLE_WIEGAND_CONN_FAST] =
+    {
+        .min_conn_interval = FAST_MIN_CONN_INTERVAL,
+        .max_conn_interval = FAST_MAX_CONN_INTERVAL,
+        .slave_latency     = FAST_SLAVE_LATENCY,
+        .conn_sup_timeout  = FAST_CONN_SUP_TIMEOUT
+    }
+};
+
+static ble_wiegand_conn_t                    m_conn;                                    /**< Profile asked for, parameters in use and time in each profile. */
+static volatile bool                         m_conn_changed = false;                    /**< Connected, disconnected or the parameters changed since the main loop last looked. */
+static volatile bool                         m_conn_requested = false;                  /**< A profile change waits for the central's answer. */
+static bool                                  m_conn_connected = false;                  /**< Connected as the main loop last saw it. */
+static uint64_t                              m_conn_ticks;                              /**< Wiegand clock when the time in the profile was last counted ... */
+static uint64_t                              m_conn_busy_ticks;                         /**< ... when an export or replay job last ran ... */
+static uint64_t                              m_conn_report_ticks;                       /**< ... and when the connection characteristic was last set. */
+static uint64_t                              m_conn_profile_ticks[BLE_WIEGAND_CONN_PROFILES]; /**< Time connected in each profile. */
+
+/**@brief Main loop activity, to work out what the CPU costs on a coin cell. Interrupt handlers
+ *        and the SoftDevice are not included. */
+typedef struct
+{
+    uint32_t                                 wakeups;                                   /**< Returns from sd_app_evt_wait. */
+    uint32_t                                 awake_ticks;                               /**< RTC1 ticks from waking up to waiting again, only meaningful summed over many wakeups. */
+    uint32_t                                 cards_loads;                               /**< Times the last cards characteristic was loaded. */
+} power_stats_t;
+
+static power_stats_t                         m_power_stats;                             /**< Main loop activity since the last report. */
+static uint32_t                              m_wakeup_ticks;                            /**< RTC1 when the main loop last woke up. */
+static uint8_t                               m_power_measurements;                      /**< Battery measurements since the last report. */
+static volatile bool                         m_power_report = false;                    /**< Time to print the main loop activity. */
 
 static app_timer_id_t                        m_battery_timer_id;                        /**< Battery timer. */
 //static app_timer_id_t                        m_heart_rate_timer_id;                     /**< Heart rate measurement timer. */
@@ -97,6 +164,20 @@ static app_timer_id_t                        m_battery_timer_id;
 static dm_application_instance_t             m_app_handle;                              /**< Application identifier allocated by device manager */
 
 static bool                                  m_memory_access_in_progress = false;       /**< Flag to keep track of ongoing operations on persistent memory. */
+
+/**@brief Settings kept in flash across resets. The size has to be a multiple of 4 and at least
+ *        PSTORAGE_MIN_BLOCK_SIZE. */
+typedef struct
+{
+    uint32_t                                 magic;                                     /**< SETTINGS_MAGIC once written. */
+    wiegand_tx_timing_t                      tx_custom;                                 /**< Timing of the custom TX profile. */
+    uint8_t                                  tx_profile;                                /**< TX profile in use. */
+    uint8_t                                  reserved[1];
+    uint32_t                                 cards_freed;                               /**< Cards before this sequence number were taken by a client and freed. */
+} settings_t;
+
+static pstorage_handle_t                     m_settings_handle;                         /**< Flash block holding the settings. */
+static settings_t                            m_settings;                                /**< Source of the last settings write, pstorage reads it when the write runs. */
 #ifdef BLE_DFU_APP_SUPPORT
 static ble_dfu_t                             m_dfus;                                    /**< Structure used to identify the DFU service. */
 #endif // BLE_DFU_APP_SUPPORT
@@ -234,6 +315,11 @@ static void battery_level_meas_timeout_handler(void * p_context)
 {
     UNUSED_PARAMETER(p_context);
     battery_level_update();
+    if (++m_power_measurements == POWER_REPORT_MEASUREMENTS)
+    {
+        m_power_measurements = 0;
+        m_power_report       = true;
+    }
 }
 
 
@@ -300,16 +386,15 @@ static void gap_params_init(void)
 }
 
 
-/**@brief Function for initializing the Advertising functionality.
- *
- * @details Encodes the required advertising data and passes it to the stack.
- *          Also builds a structure to be passed to the stack when starting advertising.
+/**@brief Function for encoding the advertising data, with the capture status, and passing it to
+ *        the stack.
  */
-static void advertising_init(void)
+static void advertising_data_set(void)
 {
-    uint32_t      err_code;
-    ble_advdata_t advdata;
-    uint8_t       flags = BLE_GAP_ADV_FLAG_BR_EDR_NOT_SUPPORTED;
+    uint32_t                 err_code;
+    ble_advdata_t            advdata;
+    ble_advdata_manuf_data_t manuf_data;
+    uint8_t                  flags = BLE_GAP_ADV_FLAG_BR_EDR_NOT_SUPPORTED;
 
     ble_uuid_t adv_uuids[] =
     {
@@ -317,6 +402,10 @@ static void advertising_init(void)
         {BLE_UUID_DEVICE_INFORMATION_SERVICE, BLE_UUID_TYPE_BLE}
     };
 
+    manuf_data.company_identifier = ADV_STATUS_COMPANY_ID;
+    manuf_data.data.p_data        = m_adv_status;
+    manuf_data.data.size          = sizeof(m_adv_status);
+
     // Build and set advertising data.
     memset(&advdata, 0, sizeof(advdata));
 
@@ -326,9 +415,37 @@ static void advertising_init(void)
     advdata.flags.p_data            = &flags;
     advdata.uuids_complete.uuid_cnt = sizeof(adv_uuids) / sizeof(adv_uuids[0]);
     advdata.uuids_complete.p_uuids  = adv_uuids;
+    advdata.p_manuf_specific_data   = &manuf_data;
 
     err_code = ble_advdata_set(&advdata, NULL);
     APP_ERROR_CHECK(err_code);
+}
+
+
+/**@brief Function for coding the capture status carried in the advertising data.
+ *
+ * @details Scanners tell new cards from the sequence number without connecting.
+ *
+ * @param[out]  p_status   ADV_STATUS_LEN bytes of status.
+ */
+static void advertising_status_encode(uint8_t * p_status)
+{
+    p_status[0] = ADV_STATUS_VERSION;
+    UNUSED_VARIABLE(uint16_encode((uint16_t)card_store_next_seq(&m_card_store), &p_status[1]));
+    p_status[3] = m_bas.battery_level_last;
+    p_status[4] = (uint8_t)((uint32_t)card_store_used(&m_card_store) * 100 / WIEGAND_STORE_SIZE);
+}
+
+
+/**@brief Function for initializing the Advertising functionality.
+ *
+ * @details Encodes the required advertising data and passes it to the stack.
+ *          Also builds a structure to be passed to the stack when starting advertising.
+ */
+static void advertising_init(void)
+{
+    advertising_status_encode(m_adv_status);
+    advertising_data_set();
 
     memset(&whitelist, 0, sizeof(ble_gap_whitelist_t));
 
@@ -370,6 +487,7 @@ static void advertising_stop(void)
 
     err_code = sd_ble_gap_adv_stop();
     APP_ERROR_CHECK(err_code);
+    m_advertising = false;
 
     nrf_gpio_pin_clear(ADVERTISING_LED_PIN_NO);
 }
@@ -401,6 +519,212 @@ static void reset_prepare(void)
 #endif // BLE_DFU_APP_SUPPORT
 
 
+/**@brief Function for handling pstorage events for the settings block.
+ */
+static void settings_pstorage_cb(pstorage_handle_t * p_handle,
+                                 uint8_t             op_code,
+                                 uint32_t            result,
+                                 uint8_t           * p_data,
+                                 uint32_t            data_len)
+{
+    if (result != NRF_SUCCESS)
+    {
+        printf("settings flash op %d failed: %ld\r\n", op_code, result);
+    }
+}
+
+
+/**@brief Function for loading the settings and applying them.
+ *
+ * @details Must run after pstorage_init. A blank or foreign block leaves the defaults in place.
+ */
+static void settings_init(void)
+{
+    uint32_t                err_code;
+    pstorage_module_param_t param;
+
+    param.block_size  = sizeof(settings_t);
+    param.block_count = 1;
+    param.cb          = settings_pstorage_cb;
+
+    err_code = pstorage_register(&param, &m_settings_handle);
+    APP_ERROR_CHECK(err_code);
+
+    err_code = pstorage_load((uint8_t *)&m_settings, &m_settings_handle, sizeof(settings_t), 0);
+    APP_ERROR_CHECK(err_code);
+
+    if (m_settings.magic == SETTINGS_MAGIC)
+    {
+        // the custom timing first, the stored profile may be the custom one
+        if (wiegand_tx_profile_set(WIEGAND_TX_PROFILE_CUSTOM, &m_settings.tx_custom) != NRF_SUCCESS ||
+            wiegand_tx_profile_set(m_settings.tx_profile, &m_settings.tx_custom) != NRF_SUCCESS)
+        {
+            wiegand_tx_profile_set(WIEGAND_TX_PROFILE_STANDARD, NULL);
+        }
+    }
+    else
+    {
+        m_settings.cards_freed = 0;
+    }
+}
+
+
+/**@brief Function for writing the current settings to flash.
+ */
+static void settings_store(void)
+{
+    uint32_t err_code;
+
+    m_settings.magic      = SETTINGS_MAGIC;
+    m_settings.tx_custom  = wiegand_tx_profile_info(WIEGAND_TX_PROFILE_CUSTOM)->timing;
+    m_settings.tx_profile = wiegand_tx_profile_get(NULL);
+
+    err_code = pstorage_update(&m_settings_handle, (uint8_t *)&m_settings, sizeof(settings_t), 0);
+    APP_ERROR_CHECK(err_code);
+}
+
+
+/**@brief Function for freeing the cards a client has taken, for good.
+ *
+ * @param[in]   seq         Cards before this sequence number go.
+ * @param[out]  p_cleared   Cards freed, may be NULL.
+ */
+static void cards_release(uint32_t seq, uint16_t * p_cleared)
+{
+    uint16_t cleared;
+
+    // no further than the cards there are, numbering may have started over
+    if ((int32_t)(seq - card_store_next_seq(&m_card_store)) > 0)
+    {
+        seq = card_store_next_seq(&m_card_store);
+    }
+    cleared = card_store_release(&m_card_store, seq);
+    if ((int32_t)(seq - m_settings.cards_freed) > 0)
+    {
+        m_settings.cards_freed = seq;
+        settings_store();
+    }
+    if (p_cleared != NULL)
+    {
+        *p_cleared = cleared;
+    }
+}
+
+
+/**@brief Function for handling the Wiegand Service events.
+ *
+ * @param[in]   p_wiegand   Wiegand Service structure.
+ * @param[in]   p_evt       Event received from the Wiegand Service.
+ */
+static void on_wiegand_svc_evt(ble_wiegand_t * p_wiegand, ble_wiegand_evt_t * p_evt)
+{
+    if (p_evt->evt_type == BLE_WIEGAND_EVT_TX_TIMING_WRITTEN)
+    {
+        settings_store();
+    }
+    else if (p_evt->evt_type == BLE_WIEGAND_EVT_SYNC_WRITTEN)
+    {
+        m_cards_dirty = true;
+    }
+    else if (p_evt->evt_type == BLE_WIEGAND_EVT_EXPORT_DONE)
+    {
+        printf("Export: %ld cards, %ld bytes in %ld ms, %ld bytes/s\r\n",
+               p_wiegand->export_records, p_wiegand->export_bytes,
+               p_wiegand->export_ms, p_wiegand->export_rate);
+    }
+    else if (p_evt->evt_type == BLE_WIEGAND_EVT_CLEAR_REQUESTED)
+    {
+        cards_release(p_evt->clear_seq, &p_evt->cleared);
+        m_cards_dirty = true;
+    }
+}
+
+
+/**@brief Function for notifying a connected client of a card as soon as it is read.
+ *
+ * @param[in]   seq   Sequence number of the card's record.
+ */
+static void card_notify(uint32_t seq)
+{
+    uint8_t         stream[CARD_CODEC_HEADER_LEN + CARD_CODEC_ENTRY_MAX];
+    card_codec_t    codec;
+    uint16_t        len;
+    const uint8_t * p_rec = card_store_record(&m_card_store, seq, NULL);
+
+    if (p_rec == NULL)
+    {
+        return;
+    }
+    // a stream of its own, it carries its time in full
+    card_codec_header_put(stream, 1, seq);
+    card_codec_start(&codec, seq);
+    len = CARD_CODEC_HEADER_LEN + card_codec_encode(&codec, seq, p_rec, &stream[CARD_CODEC_HEADER_LEN]);
+    UNUSED_VARIABLE(ble_wiegand_card_notify(&m_wiegand, stream, len));
+}
+
+
+/**@brief Function for handling the Wiegand events.
+ *
+ * @param[in]   p_evt   Event received from the Wiegand module.
+ */
+static void on_wiegand_evt(const wiegand_evt_t * p_evt)
+{
+    if (p_evt->evt_type == WIEGAND_EVT_TX_DONE)
+    {
+        // picks up the loopback measurement
+        ble_wiegand_tx_timing_update(&m_wiegand);
+        UNUSED_VARIABLE(ble_wiegand_replay_status_update(&m_wiegand, false));
+    }
+    else if (p_evt->evt_type == WIEGAND_EVT_JOB_DONE)
+    {
+        UNUSED_VARIABLE(ble_wiegand_replay_status_update(&m_wiegand, true));
+    }
+    else if (p_evt->evt_type == WIEGAND_EVT_CLOCK_SET)
+    {
+        UNUSED_VARIABLE(ble_wiegand_clock_update(&m_wiegand));
+    }
+    else if (p_evt->evt_type == WIEGAND_EVT_CARD_STORED ||
+             p_evt->evt_type == WIEGAND_EVT_CARD_UPDATED)
+    {
+        m_cards_dirty = true;
+        if (p_evt->evt_type == WIEGAND_EVT_CARD_STORED)
+        {
+            card_notify(p_evt->seq);
+        }
+        if (p_evt->evt_type == WIEGAND_EVT_CARD_STORED && p_evt->hits == 1)
+        {
+            m_adv_new_card   = true;
+            m_adv_card_ticks = p_evt->ticks;
+        }
+        if (p_evt->evt_type == WIEGAND_EVT_CARD_UPDATED || p_evt->hits > 1)
+        {
+            // new records reach the journal by themselves, rereads and records
+            // moved onto the clock need telling
+            card_journal_touch(p_evt->seq);
+        }
+    }
+}
+
+
+/**@brief Function for bringing back the cards kept in flash.
+ *
+ * @details Must run after pstorage_init and before the first card is read.
+ */
+static void card_journal_start(void)
+{
+    uint32_t err_code = card_journal_init(&m_card_store);
+    APP_ERROR_CHECK(err_code);
+
+    if ((int32_t)(m_settings.cards_freed - card_store_next_seq(&m_card_store)) > 0)
+    {
+        // the journal numbers from scratch again
+        m_settings.cards_freed = 0;
+    }
+    // the journal still holds the cards a client took, drop them again
+    UNUSED_VARIABLE(card_store_release(&m_card_store, m_settings.cards_freed));
+}
+
+
 /**@brief Function for initializing services that will be used by the application.
  *
  * @details Initialize the Heart Rate, Battery and Device Information services.
@@ -418,22 +742,43 @@ static void services_init(void)
 
     memset(&wiegand_init, 0, sizeof(wiegand_init));
 
-    wiegand_init.evt_handler                 = NULL;
+    wiegand_init.evt_handler                 = on_wiegand_svc_evt;
     wiegand_init.is_sensor_contact_supported = true;
     wiegand_init.p_body_sensor_location      = &body_sensor_location;
 
     // Here the sec level for the Heart Rate Service can be changed/increased.
     BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_last_cards_attr_md.read_perm);
-    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&wiegand_init.wiegand_last_cards_attr_md.write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_last_cards_attr_md.write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_last_cards_attr_md.cccd_write_perm);
 
-    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&wiegand_init.wiegand_replay_attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_replay_attr_md.read_perm);
     BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_replay_attr_md.write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_replay_attr_md.cccd_write_perm);
 
-    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&wiegand_init.wiegand_replay_attr_md.read_perm);
-    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_replay_attr_md.write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_send_data_attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_send_data_attr_md.write_perm);
 
-    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_replay_attr_md.read_perm);
-    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_replay_attr_md.write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_data_length_attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_data_length_attr_md.write_perm);
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_tx_timing_attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_tx_timing_attr_md.write_perm);
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_clock_attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_clock_attr_md.write_perm);
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_export_attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_export_attr_md.write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_export_attr_md.cccd_write_perm);
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_conn_attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&wiegand_init.wiegand_conn_attr_md.write_perm);
+
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&wiegand_init.wiegand_control_attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_control_attr_md.write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&wiegand_init.wiegand_control_attr_md.cccd_write_perm);
+
+    wiegand_init.p_card_store = &m_card_store;
 
     err_code = ble_wiegand_init(&m_wiegand, &wiegand_init);
     APP_ERROR_CHECK(err_code);
@@ -518,18 +863,67 @@ static void advertising_start(void)
 
     err_code = sd_ble_gap_adv_start(&m_adv_params);
     APP_ERROR_CHECK(err_code);
+    m_advertising = true;
 
     nrf_gpio_pin_set(ADVERTISING_LED_PIN_NO);
 }
 
 
+/**@brief Function for keeping the advertising up to date with the captures.
+ *
+ * @details Runs from the main loop. Sets the advertising data again only when the status in it
+ *          has changed, and advertises fast for ADV_FAST_TIME after a new card and slowly once
+ *          none has come for ADV_IDLE_DELAY. The interval only changes while advertising, a
+ *          central connecting meanwhile leaves advertising off.
+ */
+static void advertising_task(void)
+{
+    uint8_t  status[ADV_STATUS_LEN];
+    uint64_t quiet = wiegand_clock_ticks() - m_adv_card_ticks;
+    uint16_t interval;
+    uint8_t  is_nested;
+
+    advertising_status_encode(status);
+    if (memcmp(status, m_adv_status, sizeof(status)) != 0)
+    {
+        memcpy(m_adv_status, status, sizeof(status));
+        advertising_data_set();
+    }
+
+    if (m_adv_new_card && quiet < ADV_FAST_TIME)
+    {
+        interval = APP_ADV_FAST_INTERVAL;
+    }
+    else if (quiet < ADV_IDLE_DELAY)
+    {
+        interval = APP_ADV_INTERVAL;
+    }
+    else
+    {
+        interval = APP_ADV_IDLE_INTERVAL;
+    }
+    if (interval == m_adv_params.interval || !m_advertising)
+    {
+        return;
+    }
+
+    // the BLE events are held off, advertising_start runs from them
+    UNUSED_VARIABLE(sd_nvic_critical_region_enter(&is_nested));
+    if (m_advertising && sd_ble_gap_adv_stop() == NRF_SUCCESS)
+    {
+        m_adv_params.interval = interval;
+        m_advertising = sd_ble_gap_adv_start(&m_adv_params) == NRF_SUCCESS;
+    }
+    UNUSED_VARIABLE(sd_nvic_critical_region_exit(is_nested));
+}
+
+
 /**@brief Function for handling the Connection Parameters Module.
  *
  * @details This function will be called for all events in the Connection Parameters Module which
- *          are passed to the application.
- *          @note All this function does is to disconnect. This could have been done by simply
- *                setting the disconnect_on_fail config parameter, but instead we use the event
- *                handler mechanism to demonstrate its use.
+ *          are passed to the application. A central that turns down a profile change keeps the
+ *          connection with the parameters it has; one that never agrees to the idle parameters
+ *          it connected with is disconnected.
  *
  * @param[in]   p_evt   Event received from the Connection Parameters Module.
  */
@@ -537,7 +931,16 @@ static void on_conn_params_evt(ble_conn_params_evt_t * p_evt)
 {
     uint32_t err_code;
 
-    if(p_evt->evt_type == BLE_CONN_PARAMS_EVT_FAILED)
+    if (m_conn_requested)
+    {
+        m_conn_requested = false;
+        if (p_evt->evt_type == BLE_CONN_PARAMS_EVT_FAILED)
+        {
+            m_conn.rejected++;
+            m_conn_changed = true;
+        }
+    }
+    else if(p_evt->evt_type == BLE_CONN_PARAMS_EVT_FAILED)
     {
         err_code = sd_ble_gap_disconnect(m_conn_handle, BLE_HCI_CONN_INTERVAL_UNACCEPTABLE);
         APP_ERROR_CHECK(err_code);
@@ -545,6 +948,94 @@ static void on_conn_params_evt(ble_conn_params_evt_t * p_evt)
 }
 
 
+/**@brief Function for asking the central for the parameters of a connection profile.
+ *
+ * @details Main loop only. The Connection Parameters module also runs from the BLE events and
+ *          its timer, which are held off meanwhile.
+ *
+ * @param[in]   profile   Profile to change to, see ble_wiegand_conn_profile_t.
+ */
+static void conn_profile_request(uint8_t profile)
+{
+    uint32_t              err_code;
+    uint8_t               is_nested;
+    ble_gap_conn_params_t params = m_conn_profiles[profile];
+
+    m_conn.profile   = profile;
+    m_conn_requested = true;
+    m_conn_changed   = true;
+    UNUSED_VARIABLE(sd_nvic_critical_region_enter(&is_nested));
+    err_code = ble_conn_params_change_conn_params(&params);
+    UNUSED_VARIABLE(sd_nvic_critical_region_exit(is_nested));
+    if (err_code != NRF_SUCCESS)
+    {
+        // the central keeps its parameters until the next change
+        m_conn_requested = false;
+        printf("Conn: profile %d not asked for, error %ld\r\n", profile, err_code);
+    }
+}
+
+
+/**@brief Function for matching the connection profile to the work in hand.
+ *
+ * @details Runs from the main loop. Asks for the fast profile once an export or replay jobs
+ *          start and for the idle one after CONN_IDLE_DELAY with neither, counts the time
+ *          connected in each profile and keeps the connection characteristic up to date.
+ */
+static void conn_profile_task(void)
+{
+    const wiegand_tx_job_status_t * p_jobs    = wiegand_tx_job_status_get();
+    uint64_t                        now       = wiegand_clock_ticks();
+    bool                            connected = m_conn_handle != BLE_CONN_HANDLE_INVALID;
+    bool                            busy      = m_wiegand.is_exporting || m_wiegand.is_export_requested ||
+                                                p_jobs->queued != 0 || p_jobs->card_idx != WIEGAND_TX_JOB_IDLE;
+
+    if (m_conn_connected)
+    {
+        m_conn_profile_ticks[m_conn.profile] += now - m_conn_ticks;
+    }
+    m_conn_ticks = now;
+    if (connected && !m_conn_connected && m_conn.profile != BLE_WIEGAND_CONN_IDLE)
+    {
+        // the last connection ended in the fast profile
+        conn_profile_request(BLE_WIEGAND_CONN_IDLE);
+    }
+    m_conn_connected = connected;
+
+    if (busy)
+    {
+        m_conn_busy_ticks = now;
+    }
+    if (connected && busy && m_conn.profile == BLE_WIEGAND_CONN_IDLE)
+    {
+        conn_profile_request(BLE_WIEGAND_CONN_FAST);
+    }
+    else if (connected && !busy && m_conn.profile == BLE_WIEGAND_CONN_FAST &&
+             now - m_conn_busy_ticks >= CONN_IDLE_DELAY)
+    {
+        conn_profile_request(BLE_WIEGAND_CONN_IDLE);
+    }
+
+    if (m_conn_changed || (connected && now - m_conn_report_ticks >= CONN_REPORT_INTERVAL))
+    {
+        if (m_conn_changed)
+        {
+            m_conn_changed = false;
+            printf("Conn: %s profile, %ld us interval, latency %d, %d ms timeout, %d turned down\r\n",
+                   m_conn.profile == BLE_WIEGAND_CONN_FAST ? "fast" : "idle",
+                   (uint32_t)m_conn.params.max_conn_interval * 1250, m_conn.params.slave_latency,
+                   m_conn.params.conn_sup_timeout * 10, m_conn.rejected);
+        }
+        for (uint8_t i = 0; i < BLE_WIEGAND_CONN_PROFILES; i++)
+        {
+            m_conn.time_ms[i] = (uint32_t)(m_conn_profile_ticks[i] * 1000 / APP_TIMER_CLOCK_FREQ);
+        }
+        UNUSED_VARIABLE(ble_wiegand_conn_set(&m_wiegand, &m_conn));
+        m_conn_report_ticks = now;
+    }
+}
+
+
 /**@brief Function for handling a Connection Parameters error.
  *
  * @param[in]   nrf_error   Error code containing information about what went wrong.
@@ -589,10 +1080,23 @@ static void on_ble_evt(ble_evt_t * p_ble_evt)
     {
         case BLE_GAP_EVT_CONNECTED:
             nrf_gpio_pin_clear(ADVERTISING_LED_PIN_NO);
+            m_advertising = false;
             m_conn_handle = p_ble_evt->evt.gap_evt.conn_handle;
+            m_conn.params = p_ble_evt->evt.gap_evt.params.connected.conn_params;
+            m_conn_requested = false;
+            m_conn_changed = true;
+            break;
+
+        case BLE_GAP_EVT_CONN_PARAM_UPDATE:
+            m_conn.params = p_ble_evt->evt.gap_evt.params.conn_param_update.conn_params;
+            m_conn_changed = true;
             break;
 
         case BLE_GAP_EVT_DISCONNECTED:
+            m_conn_handle = BLE_CONN_HANDLE_INVALID;
+            m_conn_changed = true;
+            // back to the newest cards for the next client
+            m_cards_dirty = true;
             advertising_start();
             break;
 
@@ -751,28 +1255,90 @@ static void device_manager_init(void)
 }
 
 
+/**@brief Function for loading the last cards characteristic, if the card store changed.
+ */
+static void last_cards_update(void)
+{
+    uint16_t len;
+
+    if (!m_cards_dirty)
+    {
+        return;
+    }
+    m_cards_dirty = false;
+    if (m_wiegand.is_sync)
+    {
+        uint32_t seq = m_wiegand.sync_seq;
+
+        if (m_wiegand.is_sync_release)
+        {
+            m_wiegand.is_sync_release = false;
+            cards_release(seq, NULL);
+        }
+        // the cards the client lacks, oldest first
+        len = card_codec_export_from(&m_card_store, seq, m_cards_tx, sizeof(m_cards_tx));
+    }
+    else
+    {
+        // the newest cards that fit in the characteristic, coded compactly
+        len = card_codec_export(&m_card_store, m_cards_tx, sizeof(m_cards_tx), NULL);
+    }
+    ble_wiegand_last_cards_set(&m_wiegand, m_cards_tx, len);
+    m_power_stats.cards_loads++;
+}
+
+
+/**@brief Function for printing and restarting the main loop activity count.
+ */
+static void power_report(void)
+{
+    m_power_report = false;
+    printf("Power: %ld wakeups, %ld ms awake, %ld card loads in the last minute\r\n",
+           m_power_stats.wakeups,
+           (uint32_t)(((uint64_t)m_power_stats.awake_ticks * 1000) / APP_TIMER_CLOCK_FREQ),
+           m_power_stats.cards_loads);
+    printf("Conn: %ld ms idle, %ld ms fast since boot\r\n",
+           m_conn.time_ms[BLE_WIEGAND_CONN_IDLE], m_conn.time_ms[BLE_WIEGAND_CONN_FAST]);
+    memset(&m_power_stats, 0, sizeof(m_power_stats));
+}
+
+
 /**@brief Function for the Power manager.
-*/
+ *
+ * @details Counts the wakeups and the time the main loop spends awake.
+ */
 static void power_manage(void)
 {
-    uint32_t err_code = sd_app_evt_wait();
+    uint32_t err_code;
+    uint32_t ticks;
+
+    UNUSED_VARIABLE(app_timer_cnt_get(&ticks));
+    m_power_stats.awake_ticks += (ticks - m_wakeup_ticks) & RTC_MASK;
+
+    err_code = sd_app_evt_wait();
     APP_ERROR_CHECK(err_code);
+
+    UNUSED_VARIABLE(app_timer_cnt_get(&m_wakeup_ticks));
+    m_power_stats.wakeups++;
 }
 
 
 /**@brief Function for application main entry.
 */
-Wiegand_ctx wiegand_ctx;
 int main(void)
 {
-    // initialze wiegand context data struct
+    // keep the newest cards once the store is full
+    card_store_init(&m_card_store, CARD_STORE_OVERWRITE);
 
     // Initialize.
     leds_init();
     timers_init();
     ble_stack_init();
-    wiegand_init(&wiegand_ctx);
+    wiegand_init(&m_card_store);
+    wiegand_evt_handler_set(on_wiegand_evt);
     device_manager_init();
+    settings_init();
+    card_journal_start();
     gap_params_init();
     advertising_init();
     services_init();
@@ -789,21 +1355,15 @@ int main(void)
     for (;;)
     {
         wiegand_task();
-        // number of cards over the maximum that we can transmit
-        uint16_t num_skip = 0;
-        if (wiegand_ctx.card_count > BLE_MAX_CARDS) {
-            num_skip = wiegand_ctx.card_count - BLE_MAX_CARDS;
-        }
-        // number of bytes to transmit over BLE
-        uint16_t tx_len = wiegand_ctx.card_count * sizeof(Card);
-        if (tx_len > BLE_MAX_TX_LEN) {
-            tx_len = BLE_MAX_TX_LEN;
+        card_journal_task(!wiegand_rx_busy());
+        last_cards_update();
+        ble_wiegand_notify_task(&m_wiegand);
+        conn_profile_task();
+        advertising_task();
+        if (m_power_report)
+        {
+            power_report();
         }
-
-        // load cards for transmission
-        ble_wiegand_last_cards_set(&m_wiegand,
-                (uint8_t *)&(wiegand_ctx.card_store[num_skip]),
-                tx_len);
         power_manage();
     }
 }
@@ -0,0 +1,350 @@
+/* Host benchmark of the card record codec.
+ *
+ * Feeds mixes of card reads like the ones BLEKey sees in the field through
+ * the card store and codes every new or reread record the way the flash
+ * journal writes it, and the newest records the way the BLE export sends
+ * them. Reports bytes per record against the store's own layout and the
+ * fixed size entries the journal used before, and checks every entry
+ * decodes back to the record it came from. A client syncing the whole store
+ * a characteristic read at a time is checked to get every record once.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nrf_error.h"
+#include "wiegand_format.h"
+#include "card_store.h"
+#include "card_codec.h"
+
+#define BENCH_READS         2000
+#define BENCH_PAGE_SIZE     1024            // PSTORAGE_FLASH_PAGE_SIZE
+#define BENCH_PAGE_HEADER   8               // CARD_JOURNAL_HEADER_LEN
+#define BENCH_BLE_WINDOW    511             // BLE_MAX_TX_LEN
+#define BENCH_FIXED_HEADER  5               // length and sequence number before the codec
+#define ALIGN4(len)         (((len) + 3) & ~3)
+
+typedef struct
+{
+    const char * p_name;
+    const char * p_about;
+    void      (* gen)(Card * p_card, uint32_t * p_step);
+} bench_mix_t;
+
+typedef struct
+{
+    uint32_t reads;
+    uint32_t records;           // records the store took, rereads excluded
+    uint32_t entries;           // journal entries, one per new or reread record
+    uint32_t record_bytes;      // ... as laid out in the store
+    uint32_t fixed_bytes;       // ... as length, sequence number and record, word aligned
+    uint32_t codec_bytes;       // ... coded, page headers and padding left out
+    uint16_t window_raw;        // newest records whole in BLE_MAX_TX_LEN bytes
+    uint16_t window_codec;      // ... coded
+    uint16_t sync_reads;        // BLE_MAX_TX_LEN reads to sync the whole store from scratch
+    bool     ok;
+} bench_result_t;
+
+static uint32_t m_rand_state = 1;
+static card_store_t m_store;
+
+static uint32_t bench_rand(void)
+{
+    // xorshift32, repeatable across hosts
+    m_rand_state ^= m_rand_state << 13;
+    m_rand_state ^= m_rand_state >> 17;
+    m_rand_state ^= m_rand_state << 5;
+    return m_rand_state;
+}
+
+// a badge of the population of count, a fifth of them make most of the reads
+static uint32_t badge_pick(uint32_t count)
+{
+    if (bench_rand() % 5 != 0)
+    {
+        return bench_rand() % (count / 5);
+    }
+    return bench_rand() % count;
+}
+
+static void card_format_set(Card * p_card, uint8_t format, uint32_t facility, uint32_t number)
+{
+    wiegand_fields_t fields = { .format = format, .facility = facility, .number = number };
+    uint64_t         bits;
+
+    memset(p_card, 0, sizeof(*p_card));
+    p_card->bit_len = wiegand_format_encode(&fields, &bits);
+    // the store keeps what the decoder makes of the card, fields cut to size
+    wiegand_format_decode(bits, p_card->bit_len, &fields);
+    p_card->format   = fields.format;
+    p_card->facility = fields.facility;
+    p_card->number   = fields.number;
+    for (uint16_t i = CARD_BYTES(p_card->bit_len); i-- > 0; bits >>= 8)
+    {
+        p_card->data[i] = (uint8_t)bits;
+    }
+}
+
+static void card_unknown_set(Card * p_card, uint16_t bit_len)
+{
+    memset(p_card, 0, sizeof(*p_card));
+    p_card->bit_len = bit_len;
+    p_card->format  = WIEGAND_FORMAT_UNKNOWN;
+    for (uint16_t i = 0; i < CARD_BYTES(bit_len); i++)
+    {
+        p_card->data[i] = (uint8_t)bench_rand();
+    }
+    if (bit_len % 8)
+    {
+        p_card->data[0] &= (1U << (bit_len % 8)) - 1;
+    }
+}
+
+// one door at one site: 26 bit badges of a single facility, reads minutes apart
+static void gen_site(Card * p_card, uint32_t * p_step)
+{
+    card_format_set(p_card, wiegand_format_find(26), 42, 1000 + badge_pick(300));
+    *p_step = 5 + bench_rand() % 600;
+}
+
+// a campus: three 26 bit facilities and a Corporate 1000 building
+static void gen_campus(Card * p_card, uint32_t * p_step)
+{
+    static const uint32_t facilities[] = { 17, 18, 120 };
+    uint32_t              badge        = badge_pick(2000);
+
+    if (badge % 4 == 3)
+    {
+        card_format_set(p_card, wiegand_format_find(35), 2741, 50000 + badge);
+    }
+    else
+    {
+        card_format_set(p_card, wiegand_format_find(26), facilities[badge % 3], 20000 + badge);
+    }
+    *p_step = 1 + bench_rand() % 120;
+}
+
+// cards from many sites: every known format and some of no known format
+static void gen_mixed(Card * p_card, uint32_t * p_step)
+{
+    static const uint16_t unknown[] = { 32, 40, 56 };
+    uint32_t              kind      = bench_rand() % 8;
+
+    if (kind < 5)
+    {
+        card_format_set(p_card, kind, bench_rand() % 64, bench_rand());
+    }
+    else
+    {
+        card_unknown_set(p_card, unknown[kind - 5]);
+    }
+    *p_step = 30 + bench_rand() % 3600;
+}
+
+// random 26 bit cards read once each, nothing in common with the card before
+static void gen_random(Card * p_card, uint32_t * p_step)
+{
+    card_format_set(p_card, wiegand_format_find(26), bench_rand(), bench_rand());
+    *p_step = 1;
+}
+
+static const bench_mix_t m_mixes[] =
+{
+    { "site",   "1 facility, 300 badges, rereads",        gen_site   },
+    { "campus", "3 facilities + C1k35s, 2000 badges",     gen_campus },
+    { "mixed",  "all formats + unknown 32/40/56 bit",     gen_mixed  },
+    { "random", "random 26 bit, no rereads",              gen_random },
+};
+
+// newest records that lie whole in a window of max_len bytes as stored
+static uint16_t raw_window(uint16_t max_len)
+{
+    uint32_t bytes = 0;
+    uint16_t cards = 0;
+
+    for (uint32_t seq = card_store_next_seq(&m_store); seq-- != m_store.first_seq; cards++)
+    {
+        uint16_t len;
+
+        card_store_record(&m_store, seq, &len);
+        if (bytes + len > max_len)
+        {
+            break;
+        }
+        bytes += len;
+    }
+    return cards;
+}
+
+// codes the newest records for BLE and checks they decode back
+static bool export_check(bench_result_t * p_result)
+{
+    uint8_t      buf[BENCH_BLE_WINDOW];
+    uint8_t      rec[CARD_RECORD_MAX];
+    card_codec_t codec;
+    uint32_t     first;
+    uint32_t     header_seq;
+    uint32_t     seq;
+    uint16_t     count;
+    uint16_t     len = card_codec_export(&m_store, buf, sizeof(buf), &first);
+    uint16_t     pos = card_codec_header_get(buf, len, &count, &header_seq);
+
+    if (pos == 0 || header_seq != first)
+    {
+        return false;
+    }
+    card_codec_start(&codec, first);
+    while (pos < len)
+    {
+        uint16_t        rec_len;
+        uint16_t        stored_len;
+        uint16_t        used     = card_codec_decode(&codec, &buf[pos], len - pos, &seq, rec, &rec_len);
+        const uint8_t * p_stored = card_store_record(&m_store, seq, &stored_len);
+
+        if (used == 0 || p_stored == NULL || seq != first + p_result->window_codec ||
+            rec_len != stored_len || memcmp(rec, p_stored, rec_len) != 0)
+        {
+            return false;
+        }
+        pos += used;
+        p_result->window_codec++;
+    }
+    p_result->window_raw = raw_window(BENCH_BLE_WINDOW);
+    return count == p_result->window_codec && first + count == card_store_next_seq(&m_store);
+}
+
+// syncs the store from scratch a window at a time, as a client does
+static bool sync_check(bench_result_t * p_result)
+{
+    uint8_t  buf[BENCH_BLE_WINDOW];
+    uint8_t  rec[CARD_RECORD_MAX];
+    uint32_t next = 0;
+
+    for (;;)
+    {
+        card_codec_t codec;
+        uint16_t     count;
+        uint32_t     first;
+        uint16_t     len = card_codec_export_from(&m_store, next, buf, sizeof(buf));
+        uint16_t     pos = card_codec_header_get(buf, len, &count, &first);
+
+        if (pos == 0)
+        {
+            return false;
+        }
+        if (count == 0)
+        {
+            break;
+        }
+        card_codec_start(&codec, first);
+        while (pos < len)
+        {
+            uint32_t        seq;
+            uint16_t        rec_len;
+            uint16_t        stored_len;
+            uint16_t        used     = card_codec_decode(&codec, &buf[pos], len - pos, &seq, rec, &rec_len);
+            const uint8_t * p_stored = card_store_record(&m_store, seq, &stored_len);
+
+            if (used == 0 || p_stored == NULL || (seq != next && next != 0) ||
+                rec_len != stored_len || memcmp(rec, p_stored, rec_len) != 0)
+            {
+                return false;
+            }
+            pos  += used;
+            next  = seq + 1;
+        }
+        p_result->sync_reads++;
+    }
+    return next == card_store_next_seq(&m_store);
+}
+
+static void mix_run(const bench_mix_t * p_mix, bench_result_t * p_result)
+{
+    card_codec_t encoder;
+    card_codec_t decoder;
+    uint32_t     now       = 0;
+    uint16_t     page_used = BENCH_PAGE_SIZE;
+
+    memset(p_result, 0, sizeof(*p_result));
+    p_result->ok = true;
+    m_rand_state = 0x424C454B;
+    card_store_init(&m_store, CARD_STORE_OVERWRITE);
+
+    for (uint32_t i = 0; i < BENCH_READS; i++)
+    {
+        Card            card;
+        uint32_t        step;
+        uint32_t        seq;
+        uint16_t        hits;
+        uint16_t        rec_len;
+        uint16_t        len;
+        uint8_t         entry[CARD_CODEC_ENTRY_MAX];
+        uint8_t         rec[CARD_RECORD_MAX];
+        uint32_t        decoded_seq;
+        uint16_t        decoded_len;
+        const uint8_t * p_rec;
+
+        p_mix->gen(&card, &step);
+        now += step;
+        if (card_store_add(&m_store, &card, now, &seq, &hits) != NRF_SUCCESS)
+        {
+            p_result->ok = false;
+            break;
+        }
+        p_result->reads++;
+        p_result->records += hits == 1;
+        p_rec = card_store_record(&m_store, seq, &rec_len);
+
+        // every new or reread record is a journal entry, a page codes on its own
+        if (page_used + CARD_CODEC_ENTRY_MAX > BENCH_PAGE_SIZE)
+        {
+            card_codec_reset(&encoder);
+            card_codec_reset(&decoder);
+            page_used = BENCH_PAGE_HEADER;
+        }
+        len = card_codec_encode(&encoder, seq, p_rec, entry);
+        page_used += len;
+        p_result->entries++;
+        p_result->record_bytes += rec_len;
+        p_result->fixed_bytes  += ALIGN4(BENCH_FIXED_HEADER + rec_len);
+        p_result->codec_bytes  += len;
+        if (card_codec_decode(&decoder, entry, len, &decoded_seq, rec, &decoded_len) != len ||
+            decoded_seq != seq || decoded_len != rec_len || memcmp(rec, p_rec, rec_len) != 0)
+        {
+            p_result->ok = false;
+        }
+    }
+    p_result->ok = export_check(p_result) && sync_check(p_result) && p_result->ok;
+}
+
+int main(void)
+{
+    bool ok = true;
+
+    printf("%u reads per mix, bytes per journal entry: store record / fixed entry / coded\n\n",
+           BENCH_READS);
+    printf("%-7s %-38s %7s %7s %6s %6s %6s %8s %9s %4s %6s\n", "mix", "", "reads", "records",
+           "store", "fixed", "coded", "per page", "BLE cards", "sync", "");
+    for (uint32_t i = 0; i < sizeof(m_mixes) / sizeof(m_mixes[0]); i++)
+    {
+        const bench_mix_t * p_mix = &m_mixes[i];
+        bench_result_t      result;
+        uint32_t            n;
+
+        mix_run(p_mix, &result);
+        n = result.entries ? result.entries : 1;
+        printf("%-7s %-38s %7u %7u %6.1f %6.1f %6.1f %3u/%-4u %4u/%-4u %4u %s\n",
+               p_mix->p_name, p_mix->p_about, result.reads, result.records,
+               (double)result.record_bytes / n, (double)result.fixed_bytes / n,
+               (double)result.codec_bytes / n,
+               (BENCH_PAGE_SIZE - BENCH_PAGE_HEADER) * n / result.fixed_bytes,
+               (BENCH_PAGE_SIZE - BENCH_PAGE_HEADER) * n / result.codec_bytes,
+               result.window_raw, result.window_codec, result.sync_reads, result.ok ? "ok" : "BAD");
+        ok = ok && result.ok;
+    }
+    printf("\nper page and BLE cards: fixed entries or whole store records / coded\n");
+    printf("sync: reads of the last cards characteristic to sync the store from scratch\n");
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,336 @@
+/* Simulated flash behind the pstorage API.
+ *
+ * Covers the pstorage data area as laid out by pstorage_platform.h. Stores
+ * and clears are queued and run one at a time like the SDK module does: each
+ * one halts the CPU for as long as the nRF51 takes to write its words or
+ * erase its pages, then reports back through the module's callback from the
+ * SoftDevice event. Writing can only clear bits, as on the real part. The
+ * flash keeps its contents across pstorage_init, so a second init after
+ * sim_flash_init models a reset. sim_flash_fail_set makes some stores fail
+ * the way the SoftDevice reports a flash operation it gave up on.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "nrf.h"
+#include "nrf_error.h"
+#include "pstorage.h"
+#include "nrf_sim.h"
+
+#define SIM_FLASH_WORD_NS   46000ULL        // t_WRITE, one word
+#define SIM_FLASH_ERASE_NS  21000000ULL     // t_ERASEPAGE
+#define SIM_FLASH_PAGES     64
+#define SIM_FLASH_QUEUE     PSTORAGE_CMD_QUEUE_SIZE
+
+typedef struct
+{
+    pstorage_size_t   block_size;
+    pstorage_size_t   block_count;
+    pstorage_block_t  base_id;
+    pstorage_ntf_cb_t cb;
+} sim_module_t;
+
+typedef struct
+{
+    uint8_t           op_code;
+    pstorage_handle_t handle;
+    uint8_t *         p_src;
+    pstorage_size_t   size;
+    pstorage_size_t   offset;
+} sim_flash_cmd_t;
+
+static uint8_t          m_flash[SIM_FLASH_PAGES * 1024];
+static sim_module_t     m_modules[PSTORAGE_MAX_APPLICATIONS];
+static uint32_t         m_module_count;
+static uint32_t         m_next_addr;
+static sim_flash_cmd_t  m_queue[SIM_FLASH_QUEUE];
+static uint32_t         m_queue_head;
+static uint32_t         m_queue_tail;
+static bool             m_running;
+static sim_flash_stats_t m_stats;
+static uint32_t         m_page_erases[SIM_FLASH_PAGES];
+static uint32_t         m_last_addr;            // last store done, for sim_flash_tear
+static uint32_t         m_last_size;
+static uint32_t         m_fail_every;           // every so many stores fail, 0 for none
+static uint32_t         m_stores;               // stores done since sim_flash_init
+
+static uint32_t page_size(void)
+{
+    return PSTORAGE_FLASH_PAGE_SIZE;
+}
+
+// offset into m_flash of a flash address in the data area
+static uint8_t * flash_at(uint32_t addr)
+{
+    return &m_flash[addr - PSTORAGE_DATA_START_ADDR];
+}
+
+void sim_flash_init(void)
+{
+    memset(m_flash, 0xFF, sizeof(m_flash));
+    memset(m_page_erases, 0, sizeof(m_page_erases));
+    memset(&m_stats, 0, sizeof(m_stats));
+    m_last_size = 0;
+    m_fail_every = 0;
+    m_stores = 0;
+    if (PSTORAGE_FLASH_PAGE_END * page_size() - PSTORAGE_DATA_START_ADDR > sizeof(m_flash))
+    {
+        fprintf(stderr, "pstorage data area larger than the simulated flash\n");
+    }
+}
+
+const sim_flash_stats_t * sim_flash_stats(void)
+{
+    uint32_t pages = (PSTORAGE_SWAP_ADDR - PSTORAGE_DATA_START_ADDR) / page_size();
+
+    m_stats.page_erases_min = UINT32_MAX;
+    m_stats.page_erases_max = 0;
+    for (uint32_t i = 0; i < pages; i++)
+    {
+        // pages no module owns stay untouched and would only hide the spread
+        if (i * page_size() >= m_next_addr - PSTORAGE_DATA_START_ADDR)
+        {
+            break;
+        }
+        if (m_page_erases[i] < m_stats.page_erases_min)
+        {
+            m_stats.page_erases_min = m_page_erases[i];
+        }
+        if (m_page_erases[i] > m_stats.page_erases_max)
+        {
+            m_stats.page_erases_max = m_page_erases[i];
+        }
+    }
+    if (m_stats.page_erases_min == UINT32_MAX)
+    {
+        m_stats.page_erases_min = 0;
+    }
+    return &m_stats;
+}
+
+/*
+ * Undoes the second half of the last store, as if a reset had come while it
+ * was being written: words are written in order and the ones not reached yet
+ * are still erased. Returns the bytes undone.
+ */
+uint32_t sim_flash_tear(void)
+{
+    uint32_t kept = m_last_size / 8 * 4;
+
+    memset(flash_at(m_last_addr) + kept, 0xFF, m_last_size - kept);
+    return m_last_size - kept;
+}
+
+// from now on every store that is the every-th since init fails, 0 for none
+void sim_flash_fail_set(uint32_t every)
+{
+    m_fail_every = every;
+}
+
+static void cmd_done(void);
+
+static void cmd_start(void)
+{
+    sim_flash_cmd_t * p_cmd = &m_queue[m_queue_tail % SIM_FLASH_QUEUE];
+    uint64_t          busy_ns;
+
+    if (p_cmd->op_code == PSTORAGE_STORE_OP_CODE)
+    {
+        busy_ns = (p_cmd->size / 4) * SIM_FLASH_WORD_NS;
+    }
+    else
+    {
+        busy_ns = ((p_cmd->size + page_size() - 1) / page_size()) * SIM_FLASH_ERASE_NS;
+    }
+    m_running = true;
+    m_stats.busy_ns += busy_ns;
+    if (busy_ns > m_stats.halt_max_ns)
+    {
+        m_stats.halt_max_ns = busy_ns;
+    }
+    sim_cpu_halt(sim_time_ns() + busy_ns);
+    sim_sd_evt_schedule(sim_time_ns() + busy_ns, cmd_done);
+}
+
+static void cmd_done(void)
+{
+    sim_flash_cmd_t * p_cmd = &m_queue[m_queue_tail % SIM_FLASH_QUEUE];
+    uint8_t *         p_dst = flash_at(p_cmd->handle.block_id) + p_cmd->offset;
+    uint32_t          result = NRF_SUCCESS;
+
+    if (p_cmd->op_code == PSTORAGE_STORE_OP_CODE && m_fail_every && ++m_stores % m_fail_every == 0)
+    {
+        // the CPU was still halted, but nothing reached the flash
+        result = NRF_ERROR_TIMEOUT;
+    }
+    else if (p_cmd->op_code == PSTORAGE_STORE_OP_CODE)
+    {
+        for (uint32_t i = 0; i < p_cmd->size; i++)
+        {
+            p_dst[i] &= p_cmd->p_src[i];
+        }
+        m_stats.writes++;
+        m_stats.words += p_cmd->size / 4;
+        m_last_addr = p_cmd->handle.block_id + p_cmd->offset;
+        m_last_size = p_cmd->size;
+    }
+    else
+    {
+        uint32_t first = (p_cmd->handle.block_id - PSTORAGE_DATA_START_ADDR) / page_size();
+        uint32_t pages = (p_cmd->size + page_size() - 1) / page_size();
+
+        memset(p_dst, 0xFF, pages * page_size());
+        for (uint32_t i = 0; i < pages; i++)
+        {
+            m_page_erases[first + i]++;
+        }
+        m_stats.erases += pages;
+    }
+    m_queue_tail++;
+    m_running = false;
+    m_modules[p_cmd->handle.module_id].cb(&p_cmd->handle, p_cmd->op_code, result,
+                                          p_cmd->p_src, p_cmd->size);
+    if (m_queue_tail != m_queue_head)
+    {
+        cmd_start();
+    }
+}
+
+static uint32_t cmd_queue(uint8_t op_code, pstorage_handle_t * p_handle, uint8_t * p_src,
+                          pstorage_size_t size, pstorage_size_t offset)
+{
+    sim_flash_cmd_t * p_cmd;
+
+    if (m_queue_head - m_queue_tail >= SIM_FLASH_QUEUE)
+    {
+        return NRF_ERROR_NO_MEM;
+    }
+    p_cmd = &m_queue[m_queue_head++ % SIM_FLASH_QUEUE];
+    p_cmd->op_code = op_code;
+    p_cmd->handle  = *p_handle;
+    p_cmd->p_src   = p_src;
+    p_cmd->size    = size;
+    p_cmd->offset  = offset;
+    if (!m_running)
+    {
+        cmd_start();
+    }
+    return NRF_SUCCESS;
+}
+
+static bool handle_ok(const pstorage_handle_t * p_handle)
+{
+    const sim_module_t * p_module;
+
+    if (p_handle->module_id >= m_module_count)
+    {
+        return false;
+    }
+    p_module = &m_modules[p_handle->module_id];
+    return p_handle->block_id >= p_module->base_id &&
+           p_handle->block_id < p_module->base_id + p_module->block_count * p_module->block_size;
+}
+
+static pstorage_size_t block_size(const pstorage_handle_t * p_handle)
+{
+    return m_modules[p_handle->module_id].block_size;
+}
+
+uint32_t pstorage_init(void)
+{
+    // the flash itself survives, only the module state starts over
+    memset(m_modules, 0, sizeof(m_modules));
+    m_module_count = 0;
+    m_next_addr    = PSTORAGE_DATA_START_ADDR;
+    m_queue_head   = 0;
+    m_queue_tail   = 0;
+    m_running      = false;
+    return NRF_SUCCESS;
+}
+
+uint32_t pstorage_register(pstorage_module_param_t * p_module_param, pstorage_handle_t * p_block_id)
+{
+    uint32_t       size  = p_module_param->block_size * p_module_param->block_count;
+    sim_module_t * p_module;
+
+    if (m_module_count >= PSTORAGE_MAX_APPLICATIONS || p_module_param->cb == NULL)
+    {
+        return NRF_ERROR_NO_MEM;
+    }
+    if (p_module_param->block_size < PSTORAGE_MIN_BLOCK_SIZE ||
+        p_module_param->block_size > PSTORAGE_MAX_BLOCK_SIZE ||
+        p_module_param->block_count == 0 ||
+        m_next_addr + size > PSTORAGE_SWAP_ADDR ||
+        (size > page_size() && page_size() % p_module_param->block_size))
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    p_module = &m_modules[m_module_count];
+    p_module->block_size  = p_module_param->block_size;
+    p_module->block_count = p_module_param->block_count;
+    p_module->base_id     = m_next_addr;
+    p_module->cb          = p_module_param->cb;
+    p_block_id->module_id = m_module_count++;
+    p_block_id->block_id  = m_next_addr;
+    // every module starts on a page of its own
+    m_next_addr += (size + page_size() - 1) / page_size() * page_size();
+    return NRF_SUCCESS;
+}
+
+uint32_t pstorage_block_identifier_get(pstorage_handle_t * p_base_id, pstorage_size_t block_num,
+                                       pstorage_handle_t * p_block_id)
+{
+    if (p_base_id->module_id >= m_module_count ||
+        block_num >= m_modules[p_base_id->module_id].block_count)
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    p_block_id->module_id = p_base_id->module_id;
+    p_block_id->block_id  = p_base_id->block_id + block_num * block_size(p_base_id);
+    return NRF_SUCCESS;
+}
+
+uint32_t pstorage_store(pstorage_handle_t * p_dest, uint8_t * p_src, pstorage_size_t size,
+                        pstorage_size_t offset)
+{
+    if (!handle_ok(p_dest) || size == 0 || size + offset > block_size(p_dest))
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    if (((uintptr_t)p_src & 3) || (offset & 3) || (size & 3))
+    {
+        return NRF_ERROR_INVALID_ADDR;
+    }
+    return cmd_queue(PSTORAGE_STORE_OP_CODE, p_dest, p_src, size, offset);
+}
+
+uint32_t pstorage_load(uint8_t * p_dest, pstorage_handle_t * p_src, pstorage_size_t size,
+                       pstorage_size_t offset)
+{
+    if (!handle_ok(p_src) || size == 0 || size + offset > block_size(p_src))
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    if (((uintptr_t)p_dest & 3) || (offset & 3))
+    {
+        return NRF_ERROR_INVALID_ADDR;
+    }
+    memcpy(p_dest, flash_at(p_src->block_id) + offset, size);
+    m_modules[p_src->module_id].cb(p_src, PSTORAGE_LOAD_OP_CODE, NRF_SUCCESS, p_dest, size);
+    return NRF_SUCCESS;
+}
+
+uint32_t pstorage_clear(pstorage_handle_t * p_dest, pstorage_size_t size)
+{
+    if (!handle_ok(p_dest) || ((p_dest->block_id - PSTORAGE_DATA_START_ADDR) % page_size()))
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    return cmd_queue(PSTORAGE_CLEAR_OP_CODE, p_dest, NULL, size, 0);
+}
+
+uint32_t pstorage_access_status_get(uint32_t * p_count)
+{
+    *p_count = m_queue_head - m_queue_tail;
+    return NRF_SUCCESS;
+}
@@ -0,0 +1,798 @@
+/* Host benchmark of the Wiegand service over a simulated BLE link.
+ *
+ * Builds ble_wiegand.c and wiegand.c against the simulated peripherals in
+ * nrf_sim.c and the simulated GATT server in gatt_sim.c, with a central at
+ * the other end that writes, reads and takes notifications the way the
+ * client does. First checks every characteristic behaves as documented in
+ * ble_wiegand.h, then measures, for a few connection intervals, the export
+ * of the whole store, a burst of card notifications, and the same commands
+ * sent as write requests to their own characteristics and pipelined to the
+ * control point. Each run is a child of its own, wiegand.c keeps its state
+ * in statics.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "nrf.h"
+#include "nrf_error.h"
+#include "nordic_common.h"
+#include "app_util.h"
+#include "ble_wiegand.h"
+#include "wiegand.h"
+#include "card_codec.h"
+#include "nrf_sim.h"
+#include "gatt_sim.h"
+
+#define BENCH_CARDS         200             // cards read into the store, it keeps the newest
+#define BENCH_BURST         (BLE_WIEGAND_NOTIFY_QUEUE - 1)  // card notifications queued at once
+#define BENCH_COMMANDS      6               // commands sent back to back, setting the clock and the profile in turn
+#define BENCH_RESULTS       16              // control point results the central keeps
+#define BENCH_STREAM_MAX    8192
+#define BENCH_CLOCK_UNIX    1700000000UL    // Unix time the client sets the clock to
+#define BENCH_FRAME_BITS    200             // custom frame longer than a write
+
+// handles the client has hard coded, see client/blekey.py
+#define BENCH_LAST_CARDS_HND    0x0b
+#define BENCH_REPLAY_HND        0x0e
+#define BENCH_SEND_DATA_HND     0x11
+#define BENCH_DATA_LENGTH_HND   0x13
+#define BENCH_TX_TIMING_HND     0x15
+#define BENCH_CLOCK_HND         0x17
+#define BENCH_EXPORT_HND        0x19
+#define BENCH_CONN_HND          0x1c
+#define BENCH_CONTROL_HND       0x1e
+
+typedef struct
+{
+    uint32_t interval_us;       // connection interval
+    uint8_t  packets;           // packets each way per connection event
+    uint8_t  tx_buffers;
+} bench_link_t;
+
+static const bench_link_t m_links[] =
+{
+    { 7500,  6, 7 },
+    { 7500,  1, 7 },
+    { 20000, 6, 7 },
+    { 50000, 6, 7 },
+};
+
+static FILE *        mp_report;
+static card_store_t  m_store;
+static ble_wiegand_t m_wiegand;
+static uint64_t      m_interval_ns;
+static uint32_t      m_rand_state = 1;
+
+// what the central received
+static uint8_t       m_stream[BENCH_STREAM_MAX];    // export notifications, end to end
+static uint16_t      m_stream_len;
+static bool          m_stream_done;                 // ... and the empty one that ends it
+static uint32_t      m_stream_pieces;
+static uint64_t      m_stream_end_ns;
+static uint32_t      m_card_notes;
+static uint64_t      m_card_note_ns;                // the last card notification
+static bool          m_card_note_ok;                // ... every one a stream of one card
+static uint32_t      m_replay_notes;
+static uint8_t       m_replay_status[BLE_WIEGAND_REPLAY_STATUS_LEN];
+static uint32_t      m_done;                        // writes answered, reads come back
+static uint16_t      m_done_status;
+static uint8_t       m_done_data[BLE_GATTS_VAR_ATTR_LEN_MAX];
+static uint16_t      m_done_len;
+static ble_wiegand_notify_t m_results[BENCH_RESULTS];   // control point results, in order
+static uint32_t      m_result_count;
+
+// main loop work the bench asks for
+static bool          m_burst;                       // queue BENCH_BURST card notifications
+static uint32_t      m_want;                        // notifications or answers waited for
+
+static uint32_t bench_rand(void)
+{
+    // xorshift32, repeatable across hosts
+    m_rand_state ^= m_rand_state << 13;
+    m_rand_state ^= m_rand_state >> 17;
+    m_rand_state ^= m_rand_state << 5;
+    return m_rand_state;
+}
+
+static void check(bool * p_ok, const char * p_what, bool passed)
+{
+    fprintf(mp_report, "  %-52s %s\n", p_what, passed ? "ok" : "FAIL");
+    *p_ok = *p_ok && passed;
+}
+
+/*
+ * The central
+ */
+
+static void central_notify(uint16_t handle, const uint8_t * p_data, uint16_t len)
+{
+    if (handle == m_wiegand.export_handles.value_handle)
+    {
+        m_stream_pieces++;
+        if (len == 0)
+        {
+            m_stream_done  = true;
+            m_stream_end_ns = sim_time_ns();
+        }
+        else if (m_stream_len + len <= sizeof(m_stream))
+        {
+            memcpy(&m_stream[m_stream_len], p_data, len);
+            m_stream_len += len;
+        }
+    }
+    else if (handle == m_wiegand.last_cards_handles.value_handle)
+    {
+        uint16_t count;
+        uint32_t first;
+
+        m_card_notes++;
+        m_card_note_ns = sim_time_ns();
+        m_card_note_ok = m_card_note_ok && card_codec_header_get(p_data, len, &count, &first) != 0 && count == 1;
+    }
+    else if (handle == m_wiegand.control_handles.value_handle)
+    {
+        ble_wiegand_notify_t * p_result = &m_results[m_result_count++ % BENCH_RESULTS];
+
+        p_result->len = len;
+        memcpy(p_result->data, p_data, len);
+    }
+    else if (handle == m_wiegand.replay_handles.value_handle && len == BLE_WIEGAND_REPLAY_STATUS_LEN)
+    {
+        m_replay_notes++;
+        memcpy(m_replay_status, p_data, len);
+    }
+}
+
+static void central_done(uint16_t handle, uint16_t gatt_status, const uint8_t * p_data, uint16_t len)
+{
+    m_done++;
+    m_done_status = gatt_status;
+    m_done_len    = len;
+    if (len > 0)
+    {
+        memcpy(m_done_data, p_data, len);
+    }
+}
+
+static bool central_answered(void)
+{
+    return sim_gatt_idle();
+}
+
+static bool replay_noted(void)
+{
+    return m_replay_notes >= m_want;
+}
+
+static bool cards_noted(void)
+{
+    return m_card_notes >= m_want;
+}
+
+static bool results_noted(void)
+{
+    return m_result_count >= m_want;
+}
+
+static bool export_ended(void)
+{
+    return m_stream_done;
+}
+
+// runs connection events until done says so, false if it never did
+static bool link_run(bool (*done)(void), uint32_t events)
+{
+    for (uint32_t i = 0; i < events; i++)
+    {
+        if (done())
+        {
+            return true;
+        }
+        sim_run_until(sim_time_ns() + m_interval_ns);
+    }
+    return done();
+}
+
+static uint16_t write_run(uint16_t handle, const uint8_t * p_data, uint16_t len)
+{
+    if (sim_gatt_write(handle, p_data, len, true) != NRF_SUCCESS || !link_run(central_answered, 100))
+    {
+        return BLE_GATT_STATUS_UNKNOWN;
+    }
+    return m_done_status;
+}
+
+// reads a value whole into m_done_data
+static uint16_t read_run(uint16_t handle)
+{
+    if (sim_gatt_read(handle) != NRF_SUCCESS || !link_run(central_answered, 100))
+    {
+        return BLE_GATT_STATUS_UNKNOWN;
+    }
+    return m_done_status;
+}
+
+// a control point command, as a write command
+static uint32_t control_send(uint8_t opcode, uint8_t tag, const uint8_t * p_params, uint16_t len)
+{
+    uint8_t cmd[BLE_WIEGAND_NOTIFY_LEN];
+
+    cmd[0] = opcode;
+    cmd[1] = tag;
+    memcpy(&cmd[BLE_WIEGAND_CONTROL_HEADER_LEN], p_params, len);
+    return sim_gatt_write(BENCH_CONTROL_HND, cmd, BLE_WIEGAND_CONTROL_HEADER_LEN + len, false);
+}
+
+// the ith benchmark command, setting the clock or the profile, as a request or to the control point
+static uint32_t command_send(uint32_t i, bool control)
+{
+    uint8_t value[BLE_WIEGAND_CLOCK_LEN];
+
+    if (i % 2)
+    {
+        value[0] = WIEGAND_TX_PROFILE_STANDARD;
+        return control ? control_send(BLE_WIEGAND_CONTROL_PROFILE, i, value, 1)
+                       : sim_gatt_write(BENCH_TX_TIMING_HND, value, 1, true);
+    }
+    uint32_encode(BENCH_CLOCK_UNIX, value);
+    return control ? control_send(BLE_WIEGAND_CONTROL_TIME, i, value, BLE_WIEGAND_CLOCK_LEN)
+                   : sim_gatt_write(BENCH_CLOCK_HND, value, BLE_WIEGAND_CLOCK_LEN, true);
+}
+
+// the nth result since the central connected is for opcode and tag, with this result
+static bool result_check(uint32_t n, uint8_t opcode, uint8_t tag, uint16_t result)
+{
+    const ble_wiegand_notify_t * p_result = &m_results[n % BENCH_RESULTS];
+
+    return n < m_result_count && p_result->len >= BLE_WIEGAND_CONTROL_RESULT_LEN &&
+           p_result->data[0] == opcode && p_result->data[1] == tag &&
+           uint16_decode(&p_result->data[BLE_WIEGAND_CONTROL_HEADER_LEN]) == result;
+}
+
+static uint16_t cccd_enable(uint16_t handle)
+{
+    uint8_t cccd[2] = { BLE_GATT_HVX_NOTIFICATION, 0 };
+
+    return write_run(handle, cccd, sizeof(cccd));
+}
+
+/*
+ * The device
+ */
+
+static void ble_evt(ble_evt_t * p_ble_evt)
+{
+    ble_wiegand_on_ble_evt(&m_wiegand, p_ble_evt);
+}
+
+// the client freeing cards, as main.c does it
+static void wiegand_svc_evt(ble_wiegand_t * p_wiegand, ble_wiegand_evt_t * p_evt)
+{
+    if (p_evt->evt_type == BLE_WIEGAND_EVT_CLEAR_REQUESTED)
+    {
+        uint32_t seq = p_evt->clear_seq;
+
+        if ((int32_t)(seq - card_store_next_seq(&m_store)) > 0)
+        {
+            seq = card_store_next_seq(&m_store);
+        }
+        p_evt->cleared = card_store_release(&m_store, seq);
+    }
+}
+
+static void wiegand_evt(const wiegand_evt_t * p_evt)
+{
+    if (p_evt->evt_type == WIEGAND_EVT_TX_DONE)
+    {
+        ble_wiegand_tx_timing_update(&m_wiegand);
+        UNUSED_VARIABLE(ble_wiegand_replay_status_update(&m_wiegand, false));
+    }
+    else if (p_evt->evt_type == WIEGAND_EVT_JOB_DONE)
+    {
+        UNUSED_VARIABLE(ble_wiegand_replay_status_update(&m_wiegand, true));
+    }
+    else if (p_evt->evt_type == WIEGAND_EVT_CLOCK_SET)
+    {
+        UNUSED_VARIABLE(ble_wiegand_clock_update(&m_wiegand));
+    }
+}
+
+// a card just read, as main.c notifies it
+static void card_notify(uint32_t seq)
+{
+    uint8_t      stream[CARD_CODEC_HEADER_LEN + CARD_CODEC_ENTRY_MAX];
+    card_codec_t codec;
+    uint16_t     len;
+
+    card_codec_header_put(stream, 1, seq);
+    card_codec_start(&codec, seq);
+    len = CARD_CODEC_HEADER_LEN + card_codec_encode(&codec, seq, card_store_record(&m_store, seq, NULL),
+                                                    &stream[CARD_CODEC_HEADER_LEN]);
+    UNUSED_VARIABLE(ble_wiegand_card_notify(&m_wiegand, stream, len));
+}
+
+// main loop pass, as main.c runs it
+static void bench_thread(void)
+{
+    wiegand_task();
+    if (m_burst)
+    {
+        m_burst = false;
+        for (uint32_t i = 0; i < BENCH_BURST; i++)
+        {
+            card_notify(card_store_next_seq(&m_store) - BENCH_BURST + i);
+        }
+    }
+    ble_wiegand_notify_task(&m_wiegand);
+}
+
+static void store_fill(void)
+{
+    m_rand_state = 1;
+    card_store_init(&m_store, CARD_STORE_OVERWRITE);
+    for (uint32_t i = 0; i < BENCH_CARDS; i++)
+    {
+        wiegand_fields_t fields = { .format = wiegand_format_find(26), .facility = 42,
+                                    .number = 1000 + bench_rand() % 60000 };
+        Card             card;
+        uint64_t         bits;
+        uint32_t         seq;
+        uint16_t         hits;
+
+        memset(&card, 0, sizeof(card));
+        card.bit_len = wiegand_format_encode(&fields, &bits);
+        wiegand_format_decode(bits, card.bit_len, &fields);
+        card.format   = fields.format;
+        card.facility = fields.facility;
+        card.number   = fields.number;
+        for (uint16_t n = CARD_BYTES(card.bit_len); n-- > 0; bits >>= 8)
+        {
+            card.data[n] = (uint8_t)bits;
+        }
+        UNUSED_VARIABLE(card_store_add(&m_store, &card, 60 * i, &seq, &hits));
+    }
+}
+
+static bool device_start(const bench_link_t * p_link)
+{
+    sim_config_t       config    = { .ble_interval_ns = p_link->interval_us * 1000UL, .ble_busy_ns = 1000000UL };
+    sim_gatt_config_t  link      = { .tx_buffers = p_link->tx_buffers, .packets_per_event = p_link->packets,
+                                     .att_mtu = GATT_MTU_SIZE_DEFAULT };
+    ble_wiegand_init_t init;
+    ble_gap_conn_params_t params;
+    ble_wiegand_conn_t conn;
+
+    m_interval_ns = config.ble_interval_ns;
+    sim_init(&config, bench_thread);
+    sim_gatt_init(&link, ble_evt, central_notify, central_done);
+    wiegand_init(&m_store);
+    wiegand_evt_handler_set(wiegand_evt);
+    store_fill();
+
+    memset(&init, 0, sizeof(init));
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&init.wiegand_last_cards_attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&init.wiegand_last_cards_attr_md.write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&init.wiegand_last_cards_attr_md.cccd_write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&init.wiegand_replay_attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&init.wiegand_replay_attr_md.write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&init.wiegand_replay_attr_md.cccd_write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&init.wiegand_send_data_attr_md.write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&init.wiegand_data_length_attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&init.wiegand_data_length_attr_md.write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&init.wiegand_tx_timing_attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&init.wiegand_tx_timing_attr_md.write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&init.wiegand_clock_attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&init.wiegand_clock_attr_md.write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&init.wiegand_export_attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&init.wiegand_export_attr_md.write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&init.wiegand_export_attr_md.cccd_write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&init.wiegand_conn_attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&init.wiegand_conn_attr_md.write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&init.wiegand_control_attr_md.write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&init.wiegand_control_attr_md.cccd_write_perm);
+    init.evt_handler  = wiegand_svc_evt;
+    init.p_card_store = &m_store;
+    if (ble_wiegand_init(&m_wiegand, &init) != NRF_SUCCESS)
+    {
+        return false;
+    }
+    UNUSED_VARIABLE(ble_wiegand_tx_timing_update(&m_wiegand));
+    UNUSED_VARIABLE(ble_wiegand_replay_status_update(&m_wiegand, false));
+    UNUSED_VARIABLE(ble_wiegand_clock_update(&m_wiegand));
+
+    params.min_conn_interval = p_link->interval_us / 1250;
+    params.max_conn_interval = p_link->interval_us / 1250;
+    params.slave_latency     = 0;
+    params.conn_sup_timeout  = 400;
+    sim_gatt_connect(&params);
+    memset(&conn, 0, sizeof(conn));
+    conn.profile = BLE_WIEGAND_CONN_FAST;
+    conn.params  = params;
+    return ble_wiegand_conn_set(&m_wiegand, &conn) == NRF_SUCCESS;
+}
+
+/*
+ * Checks
+ */
+
+static bool handles_check(void)
+{
+    return m_wiegand.last_cards_handles.value_handle == BENCH_LAST_CARDS_HND &&
+           m_wiegand.replay_handles.value_handle == BENCH_REPLAY_HND &&
+           m_wiegand.send_data_handles.value_handle == BENCH_SEND_DATA_HND &&
+           m_wiegand.data_length_handles.value_handle == BENCH_DATA_LENGTH_HND &&
+           m_wiegand.tx_timing_handles.value_handle == BENCH_TX_TIMING_HND &&
+           m_wiegand.clock_handles.value_handle == BENCH_CLOCK_HND &&
+           m_wiegand.export_handles.value_handle == BENCH_EXPORT_HND &&
+           m_wiegand.conn_handles.value_handle == BENCH_CONN_HND &&
+           m_wiegand.control_handles.value_handle == BENCH_CONTROL_HND;
+}
+
+// every one of len bytes is 0
+static bool is_zero(const uint8_t * p_data, uint16_t len)
+{
+    for (uint16_t i = 0; i < len; i++)
+    {
+        if (p_data[i] != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the collected export decodes to every stored record, oldest first
+static bool stream_check(uint32_t * p_records)
+{
+    card_codec_t codec;
+    uint8_t      rec[CARD_RECORD_MAX];
+    uint16_t     count;
+    uint32_t     first;
+    uint32_t     seq;
+    uint16_t     pos = card_codec_header_get(m_stream, m_stream_len, &count, &first);
+
+    *p_records = 0;
+    if (pos == 0 || count != CARD_CODEC_COUNT_OPEN || first != m_store.first_seq)
+    {
+        return false;
+    }
+    card_codec_start(&codec, first);
+    while (pos < m_stream_len)
+    {
+        uint16_t        rec_len;
+        uint16_t        stored_len;
+        uint16_t        used     = card_codec_decode(&codec, &m_stream[pos], m_stream_len - pos, &seq, rec, &rec_len);
+        const uint8_t * p_stored = card_store_record(&m_store, seq, &stored_len);
+
+        if (used == 0 || p_stored == NULL || seq != first + *p_records ||
+            rec_len != stored_len || memcmp(rec, p_stored, rec_len) != 0)
+        {
+            return false;
+        }
+        pos += used;
+        (*p_records)++;
+    }
+    return first + *p_records == card_store_next_seq(&m_store);
+}
+
+static void stream_reset(void)
+{
+    m_stream_len    = 0;
+    m_stream_done   = false;
+    m_stream_pieces = 0;
+}
+
+static bool checks_run(void)
+{
+    bool     ok = true;
+    uint8_t  value[BLE_WIEGAND_REPLAY_WRITE_LEN];
+    uint8_t  last_cards[BLE_MAX_TX_LEN];
+    uint16_t len;
+    uint16_t done;
+    uint16_t failed;
+    uint32_t records;
+    uint32_t first;
+    uint32_t n;
+    bool     sent;
+    Card     frame;
+
+    fprintf(mp_report, "checks, %u cards stored:\n", m_store.count);
+    check(&ok, "handles match the client's", handles_check());
+
+    len = card_codec_export(&m_store, last_cards, sizeof(last_cards), NULL);
+    UNUSED_VARIABLE(ble_wiegand_last_cards_set(&m_wiegand, last_cards, len));
+    check(&ok, "last cards read whole, a Read Blob at a time",
+          read_run(BENCH_LAST_CARDS_HND) == BLE_GATT_STATUS_SUCCESS && m_done_len == len &&
+          memcmp(m_done_data, last_cards, len) == 0);
+    check(&ok, "last cards CCCD turns notifications on",
+          cccd_enable(BENCH_LAST_CARDS_HND + 1) == BLE_GATT_STATUS_SUCCESS && m_wiegand.is_notification_enabled);
+
+    uint32_encode(12345, value);
+    check(&ok, "sync with 4 bytes",
+          write_run(BENCH_LAST_CARDS_HND, value, BLE_WIEGAND_SYNC_LEN) == BLE_GATT_STATUS_SUCCESS &&
+          m_wiegand.is_sync && m_wiegand.sync_seq == 12345 && !m_wiegand.is_sync_release);
+    value[4] = BLE_WIEGAND_SYNC_RELEASE;
+    check(&ok, "sync with 5 bytes asks to release",
+          write_run(BENCH_LAST_CARDS_HND, value, BLE_WIEGAND_SYNC_FLAGS_LEN) == BLE_GATT_STATUS_SUCCESS &&
+          m_wiegand.is_sync_release);
+    uint32_encode(7, value);
+    check(&ok, "sync with 3 bytes is ignored",
+          write_run(BENCH_LAST_CARDS_HND, value, 3) == BLE_GATT_STATUS_SUCCESS && m_wiegand.sync_seq == 12345);
+
+    check(&ok, "replay CCCD turns notifications on",
+          cccd_enable(BENCH_REPLAY_HND + 1) == BLE_GATT_STATUS_SUCCESS && m_wiegand.is_replay_notification_enabled);
+    value[0] = 0;
+    m_want   = m_replay_notes + 1;
+    check(&ok, "replay with 1 byte runs a job, its end is notified",
+          write_run(BENCH_REPLAY_HND, value, 1) == BLE_GATT_STATUS_SUCCESS &&
+          link_run(replay_noted, 1000) && uint16_decode(&m_replay_status[4]) == 1);
+    value[0] = 1;
+    value[1] = 2;
+    uint16_encode(5, &value[2]);
+    value[4] = 2;
+    value[5] = 1;
+    uint16_encode(0, &value[6]);
+    m_want = m_replay_notes + 2;
+    check(&ok, "replay with 8 bytes runs two jobs",
+          write_run(BENCH_REPLAY_HND, value, 8) == BLE_GATT_STATUS_SUCCESS &&
+          link_run(replay_noted, 1000) && uint16_decode(&m_replay_status[4]) == 3 &&
+          uint16_decode(&m_replay_status[6]) == 0);
+    done = wiegand_tx_job_status_get()->done;
+    check(&ok, "replay with 6 bytes is ignored",
+          write_run(BENCH_REPLAY_HND, value, 6) == BLE_GATT_STATUS_SUCCESS &&
+          wiegand_tx_job_status_get()->queued == 0 && !wiegand_tx_busy() &&
+          wiegand_tx_job_status_get()->done == done);
+
+    value[0] = WIEGAND_TX_PROFILE_FAST;
+    check(&ok, "TX timing with 1 byte picks a profile",
+          write_run(BENCH_TX_TIMING_HND, value, 1) == BLE_GATT_STATUS_SUCCESS &&
+          read_run(BENCH_TX_TIMING_HND) == BLE_GATT_STATUS_SUCCESS &&
+          m_done_len == BLE_WIEGAND_TX_TIMING_LEN && m_done_data[0] == WIEGAND_TX_PROFILE_FAST);
+    value[0] = WIEGAND_TX_PROFILE_CUSTOM;
+    uint16_encode(60, &value[1]);
+    uint16_encode(900, &value[3]);
+    uint16_encode(30, &value[5]);
+    check(&ok, "TX timing with 7 bytes sets the custom timing",
+          write_run(BENCH_TX_TIMING_HND, value, BLE_WIEGAND_TX_TIMING_WRITE_LEN) == BLE_GATT_STATUS_SUCCESS &&
+          read_run(BENCH_TX_TIMING_HND) == BLE_GATT_STATUS_SUCCESS && m_done_data[0] == WIEGAND_TX_PROFILE_CUSTOM &&
+          memcmp(&m_done_data[1], &value[1], 6) == 0);
+    value[0] = WIEGAND_TX_PROFILE_STANDARD;
+    check(&ok, "TX timing with 2 bytes is ignored",
+          write_run(BENCH_TX_TIMING_HND, value, 2) == BLE_GATT_STATUS_SUCCESS &&
+          wiegand_tx_profile_get(NULL) == WIEGAND_TX_PROFILE_CUSTOM);
+    UNUSED_VARIABLE(write_run(BENCH_TX_TIMING_HND, value, 1));
+
+    uint32_encode(BENCH_CLOCK_UNIX, value);
+    check(&ok, "clock write sets the boot time",
+          write_run(BENCH_CLOCK_HND, value, BLE_WIEGAND_CLOCK_LEN) == BLE_GATT_STATUS_SUCCESS &&
+          read_run(BENCH_CLOCK_HND) == BLE_GATT_STATUS_SUCCESS && m_done_len == BLE_WIEGAND_CLOCK_LEN &&
+          uint32_decode(m_done_data) == wiegand_clock_boot_time() &&
+          wiegand_clock_boot_time() + sim_time_ns() / 1000000000ULL - BENCH_CLOCK_UNIX <= 1);
+
+    // a frame longer than a write goes in with queued writes, its length sends it
+    memset(&frame, 0, sizeof(frame));
+    frame.bit_len = BENCH_FRAME_BITS;
+    for (uint16_t i = 0; i < CARD_BYTES(BENCH_FRAME_BITS); i++)
+    {
+        frame.data[i] = (uint8_t)bench_rand();
+    }
+    uint16_encode(BENCH_FRAME_BITS, value);
+    done   = wiegand_tx_job_status_get()->done;
+    m_want = m_replay_notes + 1;
+    check(&ok, "custom frame by queued write, then its length",
+          write_run(BENCH_SEND_DATA_HND, frame.data, CARD_BYTES(BENCH_FRAME_BITS)) == BLE_GATT_STATUS_SUCCESS &&
+          memcmp(wiegand_tx_custom_get()->data, frame.data, CARD_BYTES(BENCH_FRAME_BITS)) == 0 &&
+          write_run(BENCH_DATA_LENGTH_HND, value, BLE_WIEGAND_DATA_LENGTH_LEN) == BLE_GATT_STATUS_SUCCESS &&
+          wiegand_tx_custom_get()->bit_len == BENCH_FRAME_BITS &&
+          link_run(replay_noted, 1000) && wiegand_tx_job_status_get()->done == done + 1 &&
+          wiegand_tx_job_status_get()->last_err == NRF_SUCCESS);
+    failed = wiegand_tx_job_status_get()->failed;
+    m_want = m_replay_notes + 1;
+    check(&ok, "custom frame longer than its data is not sent",
+          write_run(BENCH_SEND_DATA_HND, frame.data, 2) == BLE_GATT_STATUS_SUCCESS &&
+          write_run(BENCH_DATA_LENGTH_HND, value, BLE_WIEGAND_DATA_LENGTH_LEN) == BLE_GATT_STATUS_SUCCESS &&
+          link_run(replay_noted, 1000) && wiegand_tx_job_status_get()->done == done + 1 &&
+          wiegand_tx_job_status_get()->failed == failed + 1 &&
+          wiegand_tx_job_status_get()->last_err == NRF_ERROR_INVALID_LENGTH);
+    uint16_encode(20, value);
+    m_want = m_replay_notes + 1;
+    check(&ok, "custom frame length written in part not sent",
+          write_run(BENCH_SEND_DATA_HND, frame.data, CARD_BYTES(20)) == BLE_GATT_STATUS_SUCCESS &&
+          write_run(BENCH_DATA_LENGTH_HND, value, 1) == BLE_GATT_STATUS_SUCCESS &&
+          link_run(replay_noted, 1000) && wiegand_tx_job_status_get()->done == done + 1 &&
+          wiegand_tx_job_status_get()->failed == failed + 2);
+    m_want = m_replay_notes + 1;
+    check(&ok, "shorter custom frame leaves no stale tail",
+          write_run(BENCH_DATA_LENGTH_HND, value, BLE_WIEGAND_DATA_LENGTH_LEN) == BLE_GATT_STATUS_SUCCESS &&
+          wiegand_tx_custom_get()->bit_len == 20 &&
+          is_zero(&wiegand_tx_custom_get()->data[CARD_BYTES(20)], CARD_DATA_LEN - CARD_BYTES(20)) &&
+          link_run(replay_noted, 1000) && wiegand_tx_job_status_get()->done == done + 2 &&
+          wiegand_tx_job_status_get()->last_err == NRF_SUCCESS);
+
+    check(&ok, "connection read gives the parameters in use",
+          read_run(BENCH_CONN_HND) == BLE_GATT_STATUS_SUCCESS && m_done_len == BLE_WIEGAND_CONN_LEN &&
+          m_done_data[0] == BLE_WIEGAND_CONN_FAST && uint16_decode(&m_done_data[1]) == m_interval_ns / 1250000);
+    check(&ok, "connection write is turned away",
+          write_run(BENCH_CONN_HND, value, 1) == BLE_GATT_STATUS_ATTERR_WRITE_NOT_PERMITTED);
+
+    check(&ok, "export CCCD turns notifications on",
+          cccd_enable(BENCH_EXPORT_HND + 1) == BLE_GATT_STATUS_SUCCESS && m_wiegand.is_export_enabled);
+    stream_reset();
+    uint32_encode(0, value);
+    check(&ok, "export with 3 bytes is ignored",
+          write_run(BENCH_EXPORT_HND, value, 3) == BLE_GATT_STATUS_SUCCESS &&
+          !link_run(export_ended, 10) && m_stream_pieces == 0);
+    check(&ok, "export from 0 gives every stored card",
+          write_run(BENCH_EXPORT_HND, value, BLE_WIEGAND_EXPORT_START_LEN) == BLE_GATT_STATUS_SUCCESS &&
+          link_run(export_ended, 1000) && stream_check(&records) && records == m_store.count &&
+          read_run(BENCH_EXPORT_HND) == BLE_GATT_STATUS_SUCCESS && uint32_decode(m_done_data) == records &&
+          uint32_decode(&m_done_data[4]) == m_stream_len);
+
+    m_card_note_ok = true;
+    m_want         = m_card_notes + BENCH_BURST;
+    m_burst        = true;
+    check(&ok, "card notifications, a stream of one card each",
+          link_run(cards_noted, 100) && m_card_note_ok);
+    check(&ok, "last cards value put back after them",
+          read_run(BENCH_LAST_CARDS_HND) == BLE_GATT_STATUS_SUCCESS && m_done_len == len &&
+          memcmp(m_done_data, last_cards, len) == 0);
+
+    // every command in one go, the results come back in the order written
+    check(&ok, "control point CCCD turns results on",
+          cccd_enable(BENCH_CONTROL_HND + 1) == BLE_GATT_STATUS_SUCCESS && m_wiegand.is_control_notification_enabled);
+    first = m_store.first_seq;
+    n     = m_result_count;
+    stream_reset();
+    uint32_encode(BENCH_CLOCK_UNIX + 100, value);
+    sent = control_send(BLE_WIEGAND_CONTROL_TIME, 1, value, BLE_WIEGAND_CLOCK_LEN) == NRF_SUCCESS;
+    value[0] = WIEGAND_TX_PROFILE_FAST;
+    sent = sent && control_send(BLE_WIEGAND_CONTROL_PROFILE, 2, value, 1) == NRF_SUCCESS;
+    value[0] = 0;
+    sent = sent && control_send(BLE_WIEGAND_CONTROL_REPLAY, 3, value, 1) == NRF_SUCCESS;
+    uint32_encode(first + 10, value);
+    sent = sent && control_send(BLE_WIEGAND_CONTROL_CLEAR, 4, value, 4) == NRF_SUCCESS;
+    uint32_encode(0, value);
+    sent = sent && control_send(BLE_WIEGAND_CONTROL_EXPORT, 5, value, BLE_WIEGAND_EXPORT_START_LEN) == NRF_SUCCESS;
+    sent = sent && control_send(0x7F, 6, value, 0) == NRF_SUCCESS;
+    sent = sent && control_send(BLE_WIEGAND_CONTROL_TIME, 7, value, 3) == NRF_SUCCESS;
+    m_want = n + 7;
+    check(&ok, "control commands pipelined, results in order",
+          sent && link_run(results_noted, 100) &&
+          result_check(n, BLE_WIEGAND_CONTROL_TIME, 1, BLE_WIEGAND_CONTROL_OK) &&
+          result_check(n + 1, BLE_WIEGAND_CONTROL_PROFILE, 2, BLE_WIEGAND_CONTROL_OK) &&
+          result_check(n + 2, BLE_WIEGAND_CONTROL_REPLAY, 3, BLE_WIEGAND_CONTROL_OK) &&
+          result_check(n + 3, BLE_WIEGAND_CONTROL_CLEAR, 4, BLE_WIEGAND_CONTROL_OK) &&
+          result_check(n + 4, BLE_WIEGAND_CONTROL_EXPORT, 5, BLE_WIEGAND_CONTROL_OK) &&
+          result_check(n + 5, 0x7F, 6, BLE_WIEGAND_CONTROL_NOT_SUPPORTED) &&
+          result_check(n + 6, BLE_WIEGAND_CONTROL_TIME, 7, BLE_WIEGAND_CONTROL_BAD_LENGTH));
+    check(&ok, "control results carry the boot time, profile, jobs, cards freed",
+          m_results[n % BENCH_RESULTS].len == 8 &&
+          uint32_decode(&m_results[n % BENCH_RESULTS].data[4]) == wiegand_clock_boot_time() &&
+          m_results[(n + 1) % BENCH_RESULTS].data[4] == WIEGAND_TX_PROFILE_FAST &&
+          m_results[(n + 2) % BENCH_RESULTS].data[4] == 1 &&
+          uint16_decode(&m_results[(n + 3) % BENCH_RESULTS].data[4]) == 10 && m_store.first_seq == first + 10);
+    check(&ok, "control export gives the cards left",
+          link_run(export_ended, 1000) && stream_check(&records) && records == m_store.count);
+    check(&ok, "no write errors beyond the one asked for", sim_gatt_stats()->errors == 1);
+    return ok;
+}
+
+/*
+ * Benchmarks
+ */
+
+static bool link_bench(const bench_link_t * p_link)
+{
+    const sim_gatt_stats_t * p_stats = sim_gatt_stats();
+    uint8_t  value[BLE_WIEGAND_EXPORT_START_LEN];
+    uint32_t records = 0;
+    uint32_t events;
+    uint64_t start;
+    uint64_t export_ns;
+    uint64_t burst_ns;
+    uint64_t requests_ns;
+    uint64_t control_ns;
+    bool     ok;
+
+    ok = cccd_enable(BENCH_LAST_CARDS_HND + 1) == BLE_GATT_STATUS_SUCCESS &&
+         cccd_enable(BENCH_EXPORT_HND + 1) == BLE_GATT_STATUS_SUCCESS &&
+         cccd_enable(BENCH_CONTROL_HND + 1) == BLE_GATT_STATUS_SUCCESS;
+
+    // the whole store, from the write that asks for it to the empty piece
+    stream_reset();
+    uint32_encode(0, value);
+    start  = sim_time_ns();
+    events = p_stats->events;
+    ok = ok && sim_gatt_write(BENCH_EXPORT_HND, value, sizeof(value), true) == NRF_SUCCESS &&
+         link_run(export_ended, 10000) && stream_check(&records);
+    export_ns = m_stream_end_ns - start;
+    events    = p_stats->events - events;
+
+    // cards read faster than the link can notify them
+    m_want  = m_card_notes + BENCH_BURST;
+    m_burst = true;
+    start   = sim_time_ns();
+    ok = ok && link_run(cards_noted, 1000);
+    burst_ns = m_card_note_ns - start;
+
+    // commands as write requests to their own characteristics, each waits for the one before
+    start = sim_time_ns();
+    for (uint32_t i = 0; i < BENCH_COMMANDS; i++)
+    {
+        ok = ok && command_send(i, false) == NRF_SUCCESS;
+    }
+    ok = ok && link_run(central_answered, 1000) && m_done_status == BLE_GATT_STATUS_SUCCESS;
+    requests_ns = sim_time_ns() - start;
+
+    // the same commands pipelined to the control point, until the last result is in
+    start  = sim_time_ns();
+    m_want = m_result_count + BENCH_COMMANDS;
+    for (uint32_t i = 0; i < BENCH_COMMANDS; i++)
+    {
+        ok = ok && command_send(i, true) == NRF_SUCCESS;
+    }
+    ok = ok && link_run(results_noted, 1000) && result_check(m_want - 1, BLE_WIEGAND_CONTROL_PROFILE,
+                                                             BENCH_COMMANDS - 1, NRF_SUCCESS);
+    control_ns = sim_time_ns() - start;
+
+    fprintf(mp_report, "%8.1f %7u %4u %7u %6u %8.0f %6u %7u %8.1f %8.1f %8.1f %s\n",
+            p_link->interval_us / 1000.0, p_link->packets, p_link->tx_buffers, records, m_stream_len,
+            export_ns ? m_stream_len * 1e9 / export_ns : 0.0, events, p_stats->notify_max,
+            burst_ns / 1e6, requests_ns / 1e6, control_ns / 1e6, ok ? "ok" : "FAIL");
+    return ok;
+}
+
+// wiegand.c keeps its state in statics, so every run is a child of its own
+static bool run_forked(bool (*run)(const bench_link_t *), const bench_link_t * p_link)
+{
+    int   status;
+    pid_t pid;
+
+    fflush(NULL);
+    pid = fork();
+    if (pid == 0)
+    {
+        bool ok = device_start(p_link) && run(p_link);
+
+        fflush(mp_report);
+        _exit(ok ? 0 : 1);
+    }
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool checks_link_run(const bench_link_t * p_link)
+{
+    return checks_run();
+}
+
+int main(int argc, char * argv[])
+{
+    bool ok      = true;
+    bool verbose = argc > 1 && (strcmp(argv[1], "-v") == 0 || strcmp(argv[1], "--verbose") == 0);
+
+    // the firmware's printf goes to stdout, the report elsewhere
+    mp_report = fdopen(dup(STDOUT_FILENO), "w");
+    if (!verbose && !freopen("/dev/null", "w", stdout))
+    {
+        perror("/dev/null");
+        return 1;
+    }
+
+    ok = run_forked(checks_link_run, &m_links[0]);
+    store_fill();
+    fprintf(mp_report, "\n%u cards exported, %u card notifications, %u commands as requests and "
+            "pipelined to the control point\n\n", m_store.count, BENCH_BURST, BENCH_COMMANDS);
+    fprintf(mp_report, "%8s %7s %4s %7s %6s %8s %6s %7s %8s %8s %8s\n", "interval", "packets", "tx",
+            "records", "bytes", "bytes/s", "events", "max/evt", "burst ms", "req ms", "ctl ms");
+    for (uint32_t i = 0; i < sizeof(m_links) / sizeof(m_links[0]); i++)
+    {
+        ok = run_forked(link_bench, &m_links[i]) && ok;
+    }
+    fclose(mp_report);
+    return ok ? 0 : 1;
+}
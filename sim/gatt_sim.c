@@ -0,0 +1,882 @@
+/* Simulated S110 GATT server, see gatt_sim.h.
+ *
+ * Only what the Wiegand service relies on is modelled: one connection,
+ * primary services with characteristics and their CCCDs, notifications,
+ * write requests and commands, reads and Read Blob, and queued writes
+ * through user memory. Security and authorization are left out, every
+ * attribute is open.
+ */
+#include <stddef.h>
+#include <string.h>
+
+#include "nrf.h"
+#include "nrf_error.h"
+#include "ble.h"
+#include "ble_gatts.h"
+#include "ble_hci.h"
+#include "nrf_sim.h"
+#include "gatt_sim.h"
+
+#define SIM_GATT_ATTRS      64
+#define SIM_GATT_TABLE_SIZE 2048        // stack memory for attribute values
+#define SIM_GATT_OPS        32          // central operations waiting, power of two
+#define SIM_GATT_TX_MAX     16          // most TX buffers the model holds
+#define SIM_GATT_MTU_MAX    64
+#define SIM_GATT_QUEUE_LEN  BLE_GATTS_VAR_ATTR_LEN_MAX  // the stack's own queued writes memory
+
+typedef enum
+{
+    ATTR_SERVICE,
+    ATTR_CHAR,                          // characteristic declaration
+    ATTR_VALUE,
+    ATTR_USER_DESC,
+    ATTR_CCCD
+} attr_type_t;
+
+typedef struct
+{
+    attr_type_t           type;
+    uint16_t              uuid;
+    uint16_t              value_handle;     // of the characteristic the attribute belongs to
+    ble_gatt_char_props_t props;            // ... and its properties
+    bool                  vlen;
+    uint8_t *             p_value;          // stack or user memory
+    uint16_t              len;
+    uint16_t              max_len;
+} sim_attr_t;
+
+typedef enum
+{
+    OP_WRITE_REQ,
+    OP_WRITE_CMD,
+    OP_WRITE_LONG,                      // prepare writes, then an execute write
+    OP_READ                             // read, then read blobs
+} op_type_t;
+
+typedef struct
+{
+    op_type_t type;
+    uint16_t  handle;
+    uint16_t  len;
+    uint16_t  offset;                   // long writes and reads: how far they got
+    uint16_t  status;                   // of the request in flight
+    bool      executed;                 // long writes: the execute write is in flight
+    uint8_t   data[BLE_GATTS_VAR_ATTR_LEN_MAX];
+} sim_op_t;
+
+typedef struct
+{
+    uint16_t handle;
+    uint16_t len;
+    uint8_t  data[SIM_GATT_MTU_MAX];
+} sim_tx_t;
+
+static sim_gatt_config_t    m_cfg;
+static sim_gatt_evt_fn_t    m_evt_fn;
+static sim_gatt_notify_fn_t m_notify_fn;
+static sim_gatt_done_fn_t   m_done_fn;
+static sim_attr_t           m_attrs[SIM_GATT_ATTRS];
+static uint16_t             m_attr_count;
+static uint8_t              m_table[SIM_GATT_TABLE_SIZE];
+static uint16_t             m_table_used;
+static bool                 m_connected;
+static sim_op_t             m_ops[SIM_GATT_OPS];
+static uint32_t             m_op_head;
+static uint32_t             m_op_tail;
+static bool                 m_req_sent;         // the request at the head is answered next event
+static sim_tx_t             m_tx[SIM_GATT_TX_MAX];
+static uint8_t              m_tx_head;
+static uint8_t              m_tx_count;
+static bool                 m_queue_active;     // prepare writes since the last execute
+static ble_user_mem_block_t m_user_mem;         // from sd_ble_user_mem_reply, p_mem NULL for the stack's own
+static uint8_t              m_queue_own[SIM_GATT_QUEUE_LEN];
+static uint16_t             m_queue_used;
+static uint32_t             m_evt_buf[(sizeof(ble_evt_t) + BLE_GATTS_VAR_ATTR_LEN_MAX + 3) / 4];
+static sim_gatt_stats_t     m_stats;
+
+static sim_attr_t * attr_get(uint16_t handle)
+{
+    if (handle < SIM_GATT_FIRST_HANDLE || handle >= SIM_GATT_FIRST_HANDLE + m_attr_count)
+    {
+        return NULL;
+    }
+    return &m_attrs[handle - SIM_GATT_FIRST_HANDLE];
+}
+
+static uint16_t attr_add(attr_type_t type, uint16_t uuid, uint16_t max_len, uint8_t * p_user)
+{
+    sim_attr_t * p_attr;
+
+    if (m_attr_count == SIM_GATT_ATTRS || (p_user == NULL && m_table_used + max_len > SIM_GATT_TABLE_SIZE))
+    {
+        return BLE_GATT_HANDLE_INVALID;
+    }
+    p_attr = &m_attrs[m_attr_count];
+    memset(p_attr, 0, sizeof(*p_attr));
+    p_attr->type    = type;
+    p_attr->uuid    = uuid;
+    p_attr->max_len = max_len;
+    p_attr->p_value = p_user;
+    if (p_user == NULL)
+    {
+        p_attr->p_value = &m_table[m_table_used];
+        m_table_used   += max_len;
+    }
+    return SIM_GATT_FIRST_HANDLE + m_attr_count++;
+}
+
+static void le16_put(uint8_t * p, uint16_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+}
+
+static uint16_t le16_get(const uint8_t * p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static ble_evt_t * evt_get(uint16_t evt_id)
+{
+    ble_evt_t * p_ble_evt = (ble_evt_t *)m_evt_buf;
+
+    memset(m_evt_buf, 0, sizeof(m_evt_buf));
+    p_ble_evt->header.evt_id  = evt_id;
+    p_ble_evt->header.evt_len = sizeof(p_ble_evt->evt);
+    return p_ble_evt;
+}
+
+static void evt_send(ble_evt_t * p_ble_evt)
+{
+    if (m_evt_fn)
+    {
+        m_evt_fn(p_ble_evt);
+    }
+}
+
+static void write_evt_send(uint16_t handle, uint8_t op, uint16_t offset, const uint8_t * p_data, uint16_t len)
+{
+    ble_evt_t *             p_ble_evt   = evt_get(BLE_GATTS_EVT_WRITE);
+    ble_gatts_evt_write_t * p_evt_write = &p_ble_evt->evt.gatts_evt.params.write;
+    sim_attr_t *            p_attr      = attr_get(handle);
+
+    p_ble_evt->evt.gatts_evt.conn_handle = SIM_GATT_CONN_HANDLE;
+    p_evt_write->handle = handle;
+    p_evt_write->op     = op;
+    p_evt_write->offset = offset;
+    p_evt_write->len    = len;
+    if (p_attr)
+    {
+        p_evt_write->context.char_uuid.type  = BLE_UUID_TYPE_BLE;
+        p_evt_write->context.char_uuid.uuid  = attr_get(p_attr->value_handle)->uuid;
+        p_evt_write->context.value_handle    = p_attr->value_handle;
+    }
+    memcpy(p_evt_write->data, p_data, len);
+    m_stats.write_evts++;
+    evt_send(p_ble_evt);
+}
+
+// the checks the stack makes before a central's write goes in
+static uint16_t write_check(const sim_attr_t * p_attr, op_type_t type, uint16_t offset, uint16_t len)
+{
+    if (p_attr == NULL)
+    {
+        return BLE_GATT_STATUS_ATTERR_INVALID_HANDLE;
+    }
+    if (p_attr->type == ATTR_CCCD)
+    {
+        return offset == 0 && len == 2 ? BLE_GATT_STATUS_SUCCESS : BLE_GATT_STATUS_ATTERR_INVALID_ATT_VAL_LENGTH;
+    }
+    if (p_attr->type != ATTR_VALUE ||
+        (type == OP_WRITE_CMD ? !p_attr->props.write_wo_resp : !p_attr->props.write))
+    {
+        return BLE_GATT_STATUS_ATTERR_WRITE_NOT_PERMITTED;
+    }
+    if (offset + len > p_attr->max_len)
+    {
+        return BLE_GATT_STATUS_ATTERR_INVALID_ATT_VAL_LENGTH;
+    }
+    return BLE_GATT_STATUS_SUCCESS;
+}
+
+static void value_write(sim_attr_t * p_attr, uint16_t offset, const uint8_t * p_data, uint16_t len)
+{
+    memcpy(&p_attr->p_value[offset], p_data, len);
+    if (p_attr->vlen || offset + len > p_attr->len)
+    {
+        p_attr->len = offset + len;
+    }
+}
+
+// a write request or command as it arrives, the value is in before the application hears of it
+static uint16_t write_run(sim_op_t * p_op)
+{
+    sim_attr_t * p_attr = attr_get(p_op->handle);
+    uint16_t     status = write_check(p_attr, p_op->type, 0, p_op->len);
+
+    if (status == BLE_GATT_STATUS_SUCCESS)
+    {
+        value_write(p_attr, 0, p_op->data, p_op->len);
+        write_evt_send(p_op->handle, p_op->type == OP_WRITE_CMD ? BLE_GATTS_OP_WRITE_CMD : BLE_GATTS_OP_WRITE_REQ,
+                       0, p_op->data, p_op->len);
+    }
+    return status;
+}
+
+static uint8_t * queue_mem(uint16_t * p_size)
+{
+    if (m_user_mem.p_mem != NULL)
+    {
+        *p_size = m_user_mem.len;
+        return m_user_mem.p_mem;
+    }
+    *p_size = sizeof(m_queue_own);
+    return m_queue_own;
+}
+
+// one prepare write: handle, offset and length, then the data, ended by an invalid handle
+static uint16_t queue_prepare(uint16_t handle, uint16_t offset, const uint8_t * p_data, uint16_t len)
+{
+    uint16_t  size;
+    uint8_t * p_mem;
+    uint16_t  status;
+
+    if (!m_queue_active)
+    {
+        ble_evt_t * p_ble_evt = evt_get(BLE_EVT_USER_MEM_REQUEST);
+
+        m_queue_active    = true;
+        m_queue_used      = 0;
+        m_user_mem.p_mem  = NULL;
+        m_user_mem.len    = 0;
+        p_ble_evt->evt.common_evt.conn_handle                  = SIM_GATT_CONN_HANDLE;
+        p_ble_evt->evt.common_evt.params.user_mem_request.type = BLE_USER_MEM_TYPE_GATTS_QUEUED_WRITES;
+        evt_send(p_ble_evt);
+    }
+    p_mem  = queue_mem(&size);
+    status = write_check(attr_get(handle), OP_WRITE_LONG, offset, len);
+    if (status != BLE_GATT_STATUS_SUCCESS)
+    {
+        return status;
+    }
+    if (m_queue_used + 6 + len > size)
+    {
+        return BLE_GATT_STATUS_ATTERR_PREPARE_QUEUE_FULL;
+    }
+    le16_put(&p_mem[m_queue_used], handle);
+    le16_put(&p_mem[m_queue_used + 2], offset);
+    le16_put(&p_mem[m_queue_used + 4], len);
+    memcpy(&p_mem[m_queue_used + 6], p_data, len);
+    m_queue_used += 6 + len;
+    if (m_queue_used + 2 <= size)
+    {
+        le16_put(&p_mem[m_queue_used], BLE_GATT_HANDLE_INVALID);
+    }
+    return BLE_GATT_STATUS_SUCCESS;
+}
+
+static uint16_t queue_exec(void)
+{
+    uint16_t        size;
+    const uint8_t * p_mem  = queue_mem(&size);
+    uint16_t        status = BLE_GATT_STATUS_SUCCESS;
+
+    // every piece is checked before any goes in
+    for (uint16_t pos = 0; pos < m_queue_used; pos += 6 + le16_get(&p_mem[pos + 4]))
+    {
+        uint16_t check = write_check(attr_get(le16_get(&p_mem[pos])), OP_WRITE_LONG,
+                                     le16_get(&p_mem[pos + 2]), le16_get(&p_mem[pos + 4]));
+        if (check != BLE_GATT_STATUS_SUCCESS)
+        {
+            status = check;
+            break;
+        }
+    }
+    if (status == BLE_GATT_STATUS_SUCCESS)
+    {
+        for (uint16_t pos = 0; pos < m_queue_used; pos += 6 + le16_get(&p_mem[pos + 4]))
+        {
+            value_write(attr_get(le16_get(&p_mem[pos])), le16_get(&p_mem[pos + 2]),
+                        &p_mem[pos + 6], le16_get(&p_mem[pos + 4]));
+        }
+        write_evt_send(BLE_GATT_HANDLE_INVALID, BLE_GATTS_OP_EXEC_WRITE_REQ_NOW, 0, NULL, 0);
+    }
+    if (m_user_mem.p_mem != NULL)
+    {
+        ble_evt_t * p_ble_evt = evt_get(BLE_EVT_USER_MEM_RELEASE);
+
+        p_ble_evt->evt.common_evt.conn_handle                       = SIM_GATT_CONN_HANDLE;
+        p_ble_evt->evt.common_evt.params.user_mem_release.type      = BLE_USER_MEM_TYPE_GATTS_QUEUED_WRITES;
+        p_ble_evt->evt.common_evt.params.user_mem_release.mem_block = m_user_mem;
+        evt_send(p_ble_evt);
+    }
+    m_queue_active = false;
+    return status;
+}
+
+// the request at the head of the queue reaches the stack
+static void request_send(sim_op_t * p_op)
+{
+    sim_attr_t * p_attr = attr_get(p_op->handle);
+
+    m_stats.requests++;
+    switch (p_op->type)
+    {
+        case OP_WRITE_REQ:
+            p_op->status = write_run(p_op);
+            break;
+        case OP_WRITE_LONG:
+            if (p_op->offset < p_op->len)
+            {
+                uint16_t piece = p_op->len - p_op->offset;
+
+                if (piece > m_cfg.att_mtu - 5)
+                {
+                    piece = m_cfg.att_mtu - 5;
+                }
+                p_op->status = queue_prepare(p_op->handle, p_op->offset, &p_op->data[p_op->offset], piece);
+                p_op->offset += piece;
+            }
+            else
+            {
+                p_op->status   = queue_exec();
+                p_op->executed = true;
+            }
+            break;
+        case OP_READ:
+            p_op->status = BLE_GATT_STATUS_SUCCESS;
+            if (p_attr == NULL)
+            {
+                p_op->status = BLE_GATT_STATUS_ATTERR_INVALID_HANDLE;
+            }
+            else if (p_attr->type == ATTR_VALUE && !p_attr->props.read)
+            {
+                p_op->status = BLE_GATT_STATUS_ATTERR_READ_NOT_PERMITTED;
+            }
+            else if (p_op->offset > p_attr->len)
+            {
+                p_op->status = BLE_GATT_STATUS_ATTERR_INVALID_OFFSET;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void op_done(sim_op_t * p_op, const uint8_t * p_data, uint16_t len)
+{
+    if (p_op->status != BLE_GATT_STATUS_SUCCESS)
+    {
+        m_stats.errors++;
+    }
+    if (m_done_fn)
+    {
+        m_done_fn(p_op->handle, p_op->status, p_data, len);
+    }
+    m_op_tail++;
+}
+
+// the response to the request at the head reaches the central
+static void request_answer(sim_op_t * p_op)
+{
+    if (p_op->status != BLE_GATT_STATUS_SUCCESS)
+    {
+        if (p_op->type == OP_WRITE_LONG && !p_op->executed)
+        {
+            // the central cancels what it prepared
+            m_queue_active = false;
+        }
+        op_done(p_op, NULL, 0);
+        return;
+    }
+    switch (p_op->type)
+    {
+        case OP_READ:
+        {
+            sim_attr_t * p_attr = attr_get(p_op->handle);
+            uint16_t     piece  = p_attr->len - p_op->offset;
+
+            if (piece > m_cfg.att_mtu - 1)
+            {
+                piece = m_cfg.att_mtu - 1;
+            }
+            memcpy(&p_op->data[p_op->offset], &p_attr->p_value[p_op->offset], piece);
+            p_op->offset += piece;
+            // a full response may not be the end, the central asks for the rest
+            if (piece < m_cfg.att_mtu - 1 || p_op->offset == sizeof(p_op->data))
+            {
+                op_done(p_op, p_op->data, p_op->offset);
+            }
+            break;
+        }
+        case OP_WRITE_LONG:
+            if (p_op->executed)
+            {
+                op_done(p_op, NULL, 0);
+            }
+            break;
+        default:
+            op_done(p_op, NULL, 0);
+            break;
+    }
+}
+
+// a connection event: the central's packets in, then the stack's out
+static void conn_event(void)
+{
+    uint8_t in        = 0;
+    uint8_t out       = 0;
+    uint8_t sent      = 0;
+    bool    responded = false;
+
+    if (!m_connected)
+    {
+        return;
+    }
+    m_stats.events++;
+    while (in < m_cfg.packets_per_event && m_op_tail != m_op_head)
+    {
+        sim_op_t * p_op = &m_ops[m_op_tail % SIM_GATT_OPS];
+
+        if (p_op->type == OP_WRITE_CMD)
+        {
+            in++;
+            m_stats.commands++;
+            if (write_run(p_op) != BLE_GATT_STATUS_SUCCESS)
+            {
+                // no response to tell the central
+                m_stats.errors++;
+            }
+            m_op_tail++;
+            continue;
+        }
+        if (m_req_sent)
+        {
+            // answered in this event, the next request waits for the one after
+            out++;
+            m_req_sent = false;
+            responded  = true;
+            request_answer(p_op);
+            continue;
+        }
+        if (responded)
+        {
+            break;
+        }
+        in++;
+        request_send(p_op);
+        m_req_sent = true;
+        break;
+    }
+    if (m_req_sent && !responded && in == 0 && out < m_cfg.packets_per_event)
+    {
+        // a request from the last event with nothing queued before it
+        out++;
+        m_req_sent = false;
+        request_answer(&m_ops[m_op_tail % SIM_GATT_OPS]);
+    }
+
+    while (out < m_cfg.packets_per_event && m_tx_count > 0)
+    {
+        sim_tx_t * p_tx = &m_tx[m_tx_head];
+
+        if (m_notify_fn)
+        {
+            m_notify_fn(p_tx->handle, p_tx->data, p_tx->len);
+        }
+        m_stats.notifications++;
+        m_stats.notify_bytes += p_tx->len;
+        m_tx_head = (m_tx_head + 1) % SIM_GATT_TX_MAX;
+        m_tx_count--;
+        out++;
+        sent++;
+    }
+    if (sent > m_stats.notify_max)
+    {
+        m_stats.notify_max = sent;
+    }
+    if (in || out)
+    {
+        m_stats.events_used++;
+    }
+    if (sent)
+    {
+        ble_evt_t * p_ble_evt = evt_get(BLE_EVT_TX_COMPLETE);
+
+        p_ble_evt->evt.common_evt.conn_handle              = SIM_GATT_CONN_HANDLE;
+        p_ble_evt->evt.common_evt.params.tx_complete.count = sent;
+        evt_send(p_ble_evt);
+    }
+}
+
+/*
+ * The central
+ */
+
+void sim_gatt_init(const sim_gatt_config_t * p_config, sim_gatt_evt_fn_t evt_fn,
+                   sim_gatt_notify_fn_t notify_fn, sim_gatt_done_fn_t done_fn)
+{
+    m_cfg = *p_config;
+    if (m_cfg.tx_buffers > SIM_GATT_TX_MAX)
+    {
+        m_cfg.tx_buffers = SIM_GATT_TX_MAX;
+    }
+    if (m_cfg.att_mtu < GATT_MTU_SIZE_DEFAULT || m_cfg.att_mtu > SIM_GATT_MTU_MAX)
+    {
+        m_cfg.att_mtu = GATT_MTU_SIZE_DEFAULT;
+    }
+    if (m_cfg.packets_per_event == 0)
+    {
+        m_cfg.packets_per_event = 1;
+    }
+    m_evt_fn       = evt_fn;
+    m_notify_fn    = notify_fn;
+    m_done_fn      = done_fn;
+    m_attr_count   = 0;
+    m_table_used   = 0;
+    m_connected    = false;
+    m_op_head      = 0;
+    m_op_tail      = 0;
+    m_req_sent     = false;
+    m_tx_head      = 0;
+    m_tx_count     = 0;
+    m_queue_active = false;
+    memset(&m_stats, 0, sizeof(m_stats));
+    sim_radio_hook_set(conn_event);
+}
+
+void sim_gatt_connect(const ble_gap_conn_params_t * p_params)
+{
+    ble_evt_t * p_ble_evt = evt_get(BLE_GAP_EVT_CONNECTED);
+
+    m_connected = true;
+    p_ble_evt->evt.gap_evt.conn_handle                      = SIM_GATT_CONN_HANDLE;
+    p_ble_evt->evt.gap_evt.params.connected.conn_params     = *p_params;
+    evt_send(p_ble_evt);
+}
+
+void sim_gatt_disconnect(void)
+{
+    ble_evt_t * p_ble_evt = evt_get(BLE_GAP_EVT_DISCONNECTED);
+
+    m_connected    = false;
+    m_op_tail      = m_op_head;
+    m_req_sent     = false;
+    m_tx_count     = 0;
+    m_queue_active = false;
+    // no bonding, the CCCDs start over
+    for (uint16_t i = 0; i < m_attr_count; i++)
+    {
+        if (m_attrs[i].type == ATTR_CCCD)
+        {
+            memset(m_attrs[i].p_value, 0, m_attrs[i].len);
+        }
+    }
+    p_ble_evt->evt.gap_evt.conn_handle              = SIM_GATT_CONN_HANDLE;
+    p_ble_evt->evt.gap_evt.params.disconnected.reason = BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION;
+    evt_send(p_ble_evt);
+}
+
+static sim_op_t * op_add(op_type_t type, uint16_t handle)
+{
+    sim_op_t * p_op;
+
+    if (m_op_head - m_op_tail == SIM_GATT_OPS)
+    {
+        return NULL;
+    }
+    p_op = &m_ops[m_op_head % SIM_GATT_OPS];
+    memset(p_op, 0, offsetof(sim_op_t, data));
+    p_op->type   = type;
+    p_op->handle = handle;
+    return p_op;
+}
+
+uint32_t sim_gatt_write(uint16_t handle, const uint8_t * p_data, uint16_t len, bool response)
+{
+    bool       long_write = len > m_cfg.att_mtu - 3;
+    sim_op_t * p_op;
+
+    if (!m_connected)
+    {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    if (len > BLE_GATTS_VAR_ATTR_LEN_MAX || (long_write && !response))
+    {
+        return NRF_ERROR_DATA_SIZE;
+    }
+    p_op = op_add(!response ? OP_WRITE_CMD : long_write ? OP_WRITE_LONG : OP_WRITE_REQ, handle);
+    if (p_op == NULL)
+    {
+        return NRF_ERROR_NO_MEM;
+    }
+    p_op->len = len;
+    memcpy(p_op->data, p_data, len);
+    m_op_head++;
+    return NRF_SUCCESS;
+}
+
+uint32_t sim_gatt_read(uint16_t handle)
+{
+    if (!m_connected)
+    {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    if (op_add(OP_READ, handle) == NULL)
+    {
+        return NRF_ERROR_NO_MEM;
+    }
+    m_op_head++;
+    return NRF_SUCCESS;
+}
+
+bool sim_gatt_idle(void)
+{
+    return m_op_tail == m_op_head;
+}
+
+uint8_t sim_gatt_tx_queued(void)
+{
+    return m_tx_count;
+}
+
+const sim_gatt_stats_t * sim_gatt_stats(void)
+{
+    return &m_stats;
+}
+
+/*
+ * SoftDevice calls
+ */
+
+uint32_t sd_ble_gatts_service_add(uint8_t type, ble_uuid_t const * const p_uuid, uint16_t * const p_handle)
+{
+    uint16_t handle;
+
+    if (type != BLE_GATTS_SRVC_TYPE_PRIMARY || p_uuid == NULL || p_handle == NULL)
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    handle = attr_add(ATTR_SERVICE, p_uuid->uuid, 0, NULL);
+    if (handle == BLE_GATT_HANDLE_INVALID)
+    {
+        return NRF_ERROR_NO_MEM;
+    }
+    *p_handle = handle;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_characteristic_add(uint16_t service_handle, ble_gatts_char_md_t const * const p_char_md,
+                                         ble_gatts_attr_t const * const p_attr_char_value,
+                                         ble_gatts_char_handles_t * const p_handles)
+{
+    const ble_gatts_attr_md_t * p_md       = p_attr_char_value->p_attr_md;
+    bool                        user       = p_md->vloc == BLE_GATTS_VLOC_USER;
+    uint16_t                    first      = SIM_GATT_FIRST_HANDLE + m_attr_count;
+    uint16_t                    table_used = m_table_used;
+    uint16_t                    value_handle;
+    sim_attr_t *                p_value;
+
+    if (attr_get(service_handle) == NULL || attr_get(service_handle)->type != ATTR_SERVICE)
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    if (p_attr_char_value->max_len > BLE_GATTS_VAR_ATTR_LEN_MAX ||
+        p_attr_char_value->init_len > p_attr_char_value->max_len ||
+        (user && p_attr_char_value->p_value == NULL))
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+
+    p_handles->user_desc_handle = BLE_GATT_HANDLE_INVALID;
+    p_handles->cccd_handle      = BLE_GATT_HANDLE_INVALID;
+    p_handles->sccd_handle      = BLE_GATT_HANDLE_INVALID;
+    if (attr_add(ATTR_CHAR, p_attr_char_value->p_uuid->uuid, 0, NULL) == BLE_GATT_HANDLE_INVALID)
+    {
+        return NRF_ERROR_NO_MEM;
+    }
+    value_handle = attr_add(ATTR_VALUE, p_attr_char_value->p_uuid->uuid, p_attr_char_value->max_len,
+                            user ? p_attr_char_value->p_value : NULL);
+    if (value_handle != BLE_GATT_HANDLE_INVALID && p_char_md->p_char_user_desc != NULL)
+    {
+        p_handles->user_desc_handle = attr_add(ATTR_USER_DESC, BLE_UUID_DESCRIPTOR_CHAR_USER_DESC,
+                                               p_char_md->char_user_desc_max_size, NULL);
+    }
+    if (value_handle != BLE_GATT_HANDLE_INVALID && (p_char_md->char_props.notify || p_char_md->char_props.indicate))
+    {
+        p_handles->cccd_handle = attr_add(ATTR_CCCD, BLE_UUID_DESCRIPTOR_CLIENT_CHAR_CONFIG, 2, NULL);
+    }
+    if (value_handle == BLE_GATT_HANDLE_INVALID ||
+        (p_char_md->p_char_user_desc != NULL && p_handles->user_desc_handle == BLE_GATT_HANDLE_INVALID) ||
+        ((p_char_md->char_props.notify || p_char_md->char_props.indicate) &&
+         p_handles->cccd_handle == BLE_GATT_HANDLE_INVALID))
+    {
+        // nothing of it stays in the table
+        m_attr_count = first - SIM_GATT_FIRST_HANDLE;
+        m_table_used = table_used;
+        return NRF_ERROR_NO_MEM;
+    }
+
+    for (uint16_t handle = first; handle < SIM_GATT_FIRST_HANDLE + m_attr_count; handle++)
+    {
+        attr_get(handle)->value_handle = value_handle;
+        attr_get(handle)->props        = p_char_md->char_props;
+    }
+    p_value       = attr_get(value_handle);
+    p_value->vlen = p_md->vlen;
+    p_value->len  = p_attr_char_value->init_len;
+    if (!user)
+    {
+        memset(p_value->p_value, 0, p_value->max_len);
+        if (p_attr_char_value->p_value != NULL)
+        {
+            memcpy(p_value->p_value, p_attr_char_value->p_value, p_attr_char_value->init_len);
+        }
+    }
+    if (p_handles->user_desc_handle != BLE_GATT_HANDLE_INVALID)
+    {
+        sim_attr_t * p_desc = attr_get(p_handles->user_desc_handle);
+
+        p_desc->len = p_char_md->char_user_desc_size;
+        memcpy(p_desc->p_value, p_char_md->p_char_user_desc, p_desc->len);
+    }
+    if (p_handles->cccd_handle != BLE_GATT_HANDLE_INVALID)
+    {
+        attr_get(p_handles->cccd_handle)->len = 2;
+    }
+    p_handles->value_handle = value_handle;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_value_set(uint16_t handle, uint16_t offset, uint16_t * const p_len, uint8_t const * const p_value)
+{
+    sim_attr_t * p_attr = attr_get(handle);
+
+    if (p_attr == NULL || p_attr->type == ATTR_SERVICE || p_attr->type == ATTR_CHAR)
+    {
+        return NRF_ERROR_NOT_FOUND;
+    }
+    if (offset + *p_len > p_attr->max_len)
+    {
+        return NRF_ERROR_DATA_SIZE;
+    }
+    if (p_value != NULL)
+    {
+        memcpy(&p_attr->p_value[offset], p_value, *p_len);
+    }
+    if (p_attr->vlen)
+    {
+        p_attr->len = offset + *p_len;
+    }
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_value_get(uint16_t handle, uint16_t offset, uint16_t * const p_len, uint8_t * const p_data)
+{
+    sim_attr_t * p_attr = attr_get(handle);
+    uint16_t     len;
+
+    if (p_attr == NULL || p_attr->type == ATTR_SERVICE || p_attr->type == ATTR_CHAR)
+    {
+        return NRF_ERROR_NOT_FOUND;
+    }
+    if (offset > p_attr->len)
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    len = p_attr->len - offset;
+    if (p_data != NULL)
+    {
+        memcpy(p_data, &p_attr->p_value[offset], *p_len < len ? *p_len : len);
+    }
+    *p_len = len;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_gatts_hvx(uint16_t conn_handle, ble_gatts_hvx_params_t const * const p_hvx_params)
+{
+    sim_attr_t * p_attr = attr_get(p_hvx_params->handle);
+    sim_attr_t * p_cccd;
+    sim_tx_t *   p_tx;
+    uint16_t     len;
+
+    if (!m_connected || conn_handle != SIM_GATT_CONN_HANDLE)
+    {
+        return BLE_ERROR_INVALID_CONN_HANDLE;
+    }
+    if (p_attr == NULL || p_attr->type != ATTR_VALUE)
+    {
+        return BLE_ERROR_INVALID_ATTR_HANDLE;
+    }
+    if (p_hvx_params->type != BLE_GATT_HVX_NOTIFICATION)
+    {
+        return NRF_ERROR_NOT_SUPPORTED;
+    }
+    // notifications carry what fits a packet, the value takes all of it
+    len = *p_hvx_params->p_len;
+    if (p_hvx_params->p_data != NULL)
+    {
+        uint32_t err_code = sd_ble_gatts_value_set(p_hvx_params->handle, p_hvx_params->offset,
+                                                   &len, p_hvx_params->p_data);
+        if (err_code != NRF_SUCCESS)
+        {
+            return err_code;
+        }
+    }
+    if (p_hvx_params->offset > p_attr->len)
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    if (len > p_attr->len - p_hvx_params->offset)
+    {
+        len = p_attr->len - p_hvx_params->offset;
+    }
+    if (len > m_cfg.att_mtu - 3)
+    {
+        len = m_cfg.att_mtu - 3;
+    }
+    p_cccd = attr_get(p_attr->value_handle + 1);
+    if (p_cccd == NULL || p_cccd->type != ATTR_CCCD || !(le16_get(p_cccd->p_value) & BLE_GATT_HVX_NOTIFICATION))
+    {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    if (m_tx_count == m_cfg.tx_buffers)
+    {
+        m_stats.no_tx_buffers++;
+        return BLE_ERROR_NO_TX_BUFFERS;
+    }
+    p_tx = &m_tx[(m_tx_head + m_tx_count++) % SIM_GATT_TX_MAX];
+    p_tx->handle = p_hvx_params->handle;
+    p_tx->len    = len;
+    memcpy(p_tx->data, &p_attr->p_value[p_hvx_params->offset], len);
+    *p_hvx_params->p_len = len;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_tx_buffer_count_get(uint8_t * p_count)
+{
+    *p_count = m_cfg.tx_buffers;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ble_user_mem_reply(uint16_t conn_handle, ble_user_mem_block_t * p_block)
+{
+    if (!m_connected || conn_handle != SIM_GATT_CONN_HANDLE)
+    {
+        return BLE_ERROR_INVALID_CONN_HANDLE;
+    }
+    if (!m_queue_active || m_queue_used != 0)
+    {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    if (p_block == NULL)
+    {
+        m_user_mem.p_mem = NULL;
+        m_user_mem.len   = 0;
+    }
+    else
+    {
+        m_user_mem = *p_block;
+    }
+    return NRF_SUCCESS;
+}
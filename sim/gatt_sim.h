@@ -0,0 +1,92 @@
+/* Simulated S110 GATT server and the central at the other end of the link.
+ *
+ * gatt_sim.c implements the sd_ble_gatts_* calls ble_wiegand.c makes, with
+ * the attribute table, value storage in the stack or in user memory and the
+ * CCCD checks the SoftDevice does, handles given out the way S110 does after
+ * its own GAP and GATT services. Notifications take one of a fixed number of
+ * TX buffers and only leave at a connection event, which is the end of each
+ * radio event of nrf_sim.c (ble_interval_ns and ble_busy_ns must be set).
+ * Each connection event carries at most packets_per_event packets each way:
+ * the central's writes and requests in, then the response to its last
+ * request and queued notifications out, which frees their TX buffers with a
+ * BLE_EVT_TX_COMPLETE. ATT requests take a round trip each, the response
+ * goes in the connection event after the request, and only one may be
+ * outstanding; write commands go in any event with room. The ATT MTU stays
+ * at the default, so values longer than a packet are read a piece at a time
+ * and written with queued writes through the application's user memory.
+ */
+#ifndef GATT_SIM_H__
+#define GATT_SIM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ble.h"
+
+#define SIM_GATT_CONN_HANDLE    0
+#define SIM_GATT_FIRST_HANDLE   9       /**< Handles 1 to 8 are the stack's GAP and GATT services. */
+
+/** Knobs for the simulated link. */
+typedef struct
+{
+    uint8_t  tx_buffers;                /**< Notifications the stack can hold, sd_ble_tx_buffer_count_get. */
+    uint8_t  packets_per_event;         /**< Most packets the link carries each way in a connection event. */
+    uint16_t att_mtu;                   /**< ATT MTU, GATT_MTU_SIZE_DEFAULT on S110. */
+} sim_gatt_config_t;
+
+/** Link activity since sim_gatt_init. */
+typedef struct
+{
+    uint32_t events;                    /**< Connection events while connected. */
+    uint32_t events_used;               /**< ... that carried a packet either way. */
+    uint32_t notifications;             /**< Notifications that reached the central. */
+    uint32_t notify_bytes;              /**< ... and their payload. */
+    uint8_t  notify_max;                /**< Most notifications in one connection event. */
+    uint32_t no_tx_buffers;             /**< sd_ble_gatts_hvx calls turned away for want of a TX buffer. */
+    uint32_t requests;                  /**< ATT requests the central made, each a round trip. */
+    uint32_t commands;                  /**< Write commands it sent. */
+    uint32_t write_evts;                /**< BLE_GATTS_EVT_WRITE events given to the application. */
+    uint32_t errors;                    /**< Requests answered with an error, commands dropped. */
+} sim_gatt_stats_t;
+
+/** The central's end: a notification arrived. */
+typedef void (*sim_gatt_notify_fn_t)(uint16_t handle, const uint8_t * p_data, uint16_t len);
+
+/** The central's end: a write was answered, or a read came back whole, or either failed. */
+typedef void (*sim_gatt_done_fn_t)(uint16_t handle, uint16_t gatt_status, const uint8_t * p_data, uint16_t len);
+
+/** Stack event for the application, delivered at interrupt level like the SWI2 dispatch. */
+typedef void (*sim_gatt_evt_fn_t)(ble_evt_t * p_ble_evt);
+
+/*
+ * Empties the attribute table and takes over the end of nrf_sim.c's radio
+ * events, so call it after sim_init and before the services are added.
+ */
+void sim_gatt_init(const sim_gatt_config_t * p_config, sim_gatt_evt_fn_t evt_fn,
+                   sim_gatt_notify_fn_t notify_fn, sim_gatt_done_fn_t done_fn);
+
+/* Connects the central, with connection parameters to report, or drops the link. */
+void sim_gatt_connect(const ble_gap_conn_params_t * p_params);
+void sim_gatt_disconnect(void);
+
+/*
+ * Queues a write by the central: a write request if response is true,
+ * written with queued writes if longer than a packet, else a write command.
+ * Operations go out in the order they were queued. Returns NRF_ERROR_NO_MEM
+ * if too many are waiting, NRF_ERROR_DATA_SIZE if a command does not fit a
+ * packet.
+ */
+uint32_t sim_gatt_write(uint16_t handle, const uint8_t * p_data, uint16_t len, bool response);
+
+/* Queues a read by the central of the whole value, Read Blob after the first piece. */
+uint32_t sim_gatt_read(uint16_t handle);
+
+/* True if the central has nothing waiting or in flight. */
+bool sim_gatt_idle(void);
+
+/* Notifications queued in the stack, not yet sent. */
+uint8_t sim_gatt_tx_queued(void);
+
+const sim_gatt_stats_t * sim_gatt_stats(void);
+
+#endif /* GATT_SIM_H__ */
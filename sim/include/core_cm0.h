@@ -0,0 +1,18 @@
+/* Host stand-in for the CMSIS Cortex-M0 core header.
+ *
+ * nrf51.h only needs the register access qualifiers from here; the NVIC and
+ * SysTick helpers are not used by the application code that the simulator
+ * compiles.
+ */
+#ifndef __CORE_CM0_H_GENERIC
+#define __CORE_CM0_H_GENERIC
+
+#include <stdint.h>
+
+#define __I     volatile const
+#define __O     volatile
+#define __IO    volatile
+
+#define __STATIC_INLINE static inline
+
+#endif /* __CORE_CM0_H_GENERIC */
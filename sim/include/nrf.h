@@ -0,0 +1,42 @@
+/* Host stand-in for nrf.h.
+ *
+ * Pulls in the real nRF51 register layouts from the SDK and then points the
+ * peripherals the Wiegand code touches at simulated register blocks. Every
+ * peripheral access first calls the matching sim_*_sync() so that task
+ * writes and cleared events from the previous access take effect, the same
+ * way they would on the real bus.
+ */
+#ifndef NRF_H
+#define NRF_H
+
+#ifndef NRF51
+#define NRF51
+#endif
+
+/* The SDK version reads the ARM stack pointer, which a host build cannot do. */
+#define _COMPILER_ABSTRACTION_H
+#define __ASM       __asm
+#define __INLINE    inline
+
+#include "nrf51.h"
+#include "nrf51_bitfields.h"
+#include "nrf51_deprecated.h"
+
+#include "nrf_sim.h"
+
+#undef NRF_FICR
+#undef NRF_UICR
+#undef NRF_GPIO
+#undef NRF_GPIOTE
+#undef NRF_TIMER1
+#undef NRF_TIMER2
+
+#define NRF_FICR        (&sim_ficr)
+#define NRF_UICR        (&sim_uicr)
+
+#define NRF_GPIO        (sim_gpio_sync(), &sim_gpio)
+#define NRF_GPIOTE      (sim_gpiote_sync(), &sim_gpiote)
+#define NRF_TIMER1      (sim_timer_sync(&sim_timer1), &sim_timer1.regs)
+#define NRF_TIMER2      (sim_timer_sync(&sim_timer2), &sim_timer2.regs)
+
+#endif /* NRF_H */
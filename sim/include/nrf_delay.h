@@ -0,0 +1,20 @@
+/* Host stand-in for nrf_delay.h: busy waits advance simulated time, and any
+ * interrupts that fall due during the wait are serviced as they would be on
+ * the target.
+ */
+#ifndef _NRF_DELAY_H
+#define _NRF_DELAY_H
+
+#include "nrf.h"
+
+static inline void nrf_delay_us(uint32_t volatile number_of_us)
+{
+    sim_delay_us(number_of_us);
+}
+
+static inline void nrf_delay_ms(uint32_t volatile number_of_ms)
+{
+    sim_delay_us(number_of_ms * 1000UL);
+}
+
+#endif
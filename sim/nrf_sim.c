@@ -0,0 +1,1072 @@
+/* Simulated nRF51 peripherals, interrupt controller and SoftDevice calls.
+ *
+ * Only the behaviour the application relies on is modelled: GPIO input
+ * levels and SENSE/PORT detection, GPIOTE IN channel events, TIMER tasks,
+ * compare events and shorts in timer and counter mode, PPI event to task
+ * routing, NVIC enable/priority/pending state, the app_timer module and the
+ * small set of sd_nvic_* and sd_ppi_* SVC calls the Wiegand code makes.
+ * flash_sim.c stands in for pstorage on top of the CPU halt and SoftDevice
+ * event hooks here.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "nrf.h"
+#include "nrf_soc.h"
+#include "app_timer.h"
+#include "retarget.h"
+#include "nrf_sim.h"
+
+#define SIM_APP_TIMERS      8
+#define SIM_RTC_FREQ        32768ULL
+#define SIM_NONE            UINT64_MAX
+#define SIM_PPI_CHANNELS    16
+#define SIM_LOOP_EDGES      16          // power of two
+
+void GPIOTE_IRQHandler(void) __attribute__((weak));
+void TIMER1_IRQHandler(void) __attribute__((weak));
+void TIMER2_IRQHandler(void) __attribute__((weak));
+
+typedef struct
+{
+    void            (*handler)(void);
+    bool            enabled;
+    uint8_t         prio;
+    bool            pending;
+    bool            active;
+    uint64_t        pended_ns;
+    uint64_t        due_ns;
+    sim_irq_stats_t stats;
+} sim_irq_t;
+
+typedef struct
+{
+    app_timer_timeout_handler_t handler;
+    app_timer_mode_t            mode;
+    bool                        running;
+    uint64_t                    expiry_ns;
+    uint64_t                    period_ns;
+    void *                      p_context;
+} sim_app_timer_t;
+
+typedef struct
+{
+    const volatile void * p_evt;
+    const volatile void * p_task;
+} sim_ppi_t;
+
+// a 256 kB part with 1 kB pages and no bootloader
+NRF_FICR_Type   sim_ficr = { .CODEPAGESIZE = 1024, .CODESIZE = 256 };
+NRF_UICR_Type   sim_uicr = { .BOOTLOADERADDR = 0xFFFFFFFF };
+NRF_GPIO_Type   sim_gpio;
+NRF_GPIOTE_Type sim_gpiote;
+sim_timer_t     sim_timer1;
+sim_timer_t     sim_timer2;
+
+static sim_timer_t * const m_timers[] = { &sim_timer1, &sim_timer2 };
+#define SIM_TIMERS          (sizeof(m_timers) / sizeof(m_timers[0]))
+
+static sim_config_t       m_cfg;
+static sim_thread_fn_t    m_thread_fn;
+static uint64_t           m_now_ns;
+static uint32_t           m_rand_state;
+static uint32_t           m_wire_level;             // levels driven onto the input pins
+static bool               m_port_detect;            // state of the GPIO DETECT signal
+static uint32_t           m_gpiote_inten;
+static uint32_t           m_gpiote_config[4];       // CONFIG as last latched
+static uint32_t           m_gpiote_out;             // output state of the task mode channels
+static uint32_t           m_out_level;              // levels driven onto the output pins
+static sim_output_fn_t    m_output_fn;
+static uint8_t            m_loop_in[32];            // input pin wired to each output pin, or 0xFF
+static uint32_t           m_loop_delay_ns;
+static sim_edge_t         m_loop_edges[SIM_LOOP_EDGES];  // output changes on their way to the inputs
+static uint32_t           m_loop_head;
+static uint32_t           m_loop_tail;
+static uint64_t           m_reg_accesses;
+static uint32_t           m_delay_depth;            // > 0 while thread mode is busy waiting
+static uint32_t           m_isr_depth;
+static uint64_t           m_thread_last_ns;
+static uint64_t           m_thread_due_ns;          // deferred main loop pass, or SIM_NONE
+static uint64_t           m_halt_until_ns;          // CPU halted by a flash operation until then
+static uint64_t           m_sd_evt_ns;              // pending SoftDevice event, or SIM_NONE
+static sim_sd_evt_fn_t    m_sd_evt_fn;
+static sim_radio_fn_t     m_radio_fn;               // run as each radio event ends, or NULL
+static const sim_edge_t * mp_edges;
+static uint32_t           m_edge_count;
+static uint32_t           m_edge_idx;
+static sim_irq_t          m_irq[SIM_MAX_IRQS];
+static sim_app_timer_t    m_app_timers[SIM_APP_TIMERS];
+static uint32_t           m_app_timer_count;
+static sim_ppi_t          m_ppi[SIM_PPI_CHANNELS];
+static uint32_t           m_ppi_enabled;
+
+static void gpio_latch(void);
+static void gpiote_latch(void);
+static void timer_latch(sim_timer_t * p_timer);
+
+static uint64_t host_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint32_t sim_rand(void)
+{
+    // xorshift32, deterministic for a given seed
+    m_rand_state ^= m_rand_state << 13;
+    m_rand_state ^= m_rand_state >> 17;
+    m_rand_state ^= m_rand_state << 5;
+    return m_rand_state;
+}
+
+uint64_t sim_time_ns(void)
+{
+    return m_now_ns;
+}
+
+/*
+ * Interrupt controller
+ */
+
+static uint64_t ble_window_end(uint64_t t_ns)
+{
+    if (m_cfg.ble_interval_ns == 0 || m_cfg.ble_busy_ns == 0)
+    {
+        return t_ns;
+    }
+    uint64_t offset = t_ns % m_cfg.ble_interval_ns;
+    if (offset < m_cfg.ble_busy_ns)
+    {
+        // application interrupts are held off until the radio event ends
+        return t_ns - offset + m_cfg.ble_busy_ns;
+    }
+    return t_ns;
+}
+
+static void irq_pend(IRQn_Type irqn)
+{
+    sim_irq_t * p_irq = &m_irq[irqn];
+
+    // a level that is still asserted re-pends only once the handler exits
+    if (p_irq->pending || p_irq->active || !p_irq->enabled)
+    {
+        return;
+    }
+    uint64_t latency = m_cfg.latency_ns;
+    if (m_cfg.latency_jitter_ns)
+    {
+        latency += sim_rand() % (m_cfg.latency_jitter_ns + 1);
+    }
+    p_irq->pending   = true;
+    p_irq->pended_ns = m_now_ns;
+    p_irq->due_ns    = ble_window_end(m_now_ns + latency);
+}
+
+static bool timer_irq_line(const sim_timer_t * p_timer)
+{
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        if (p_timer->regs.EVENTS_COMPARE[i] &&
+            (p_timer->inten & (TIMER_INTENSET_COMPARE0_Msk << i)))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool gpiote_irq_line(void)
+{
+    if (sim_gpiote.EVENTS_PORT && (m_gpiote_inten & GPIOTE_INTENSET_PORT_Msk))
+    {
+        return true;
+    }
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        if (sim_gpiote.EVENTS_IN[i] && (m_gpiote_inten & (1UL << i)))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void irq_lines_update(void)
+{
+    // GPIOTE first, task mode channels take over their pin from GPIO OUT
+    gpiote_latch();
+    gpio_latch();
+    for (uint32_t i = 0; i < SIM_TIMERS; i++)
+    {
+        timer_latch(m_timers[i]);
+    }
+
+    if (gpiote_irq_line())
+    {
+        irq_pend(GPIOTE_IRQn);
+    }
+    for (uint32_t i = 0; i < SIM_TIMERS; i++)
+    {
+        if (timer_irq_line(m_timers[i]))
+        {
+            irq_pend(m_timers[i]->irqn);
+        }
+    }
+}
+
+/*
+ * PPI
+ */
+
+// an event fired: trigger every enabled channel listening to it right away
+static void ppi_event(const volatile void * p_evt)
+{
+    for (uint8_t i = 0; i < SIM_PPI_CHANNELS; i++)
+    {
+        if ((m_ppi_enabled & (1UL << i)) && m_ppi[i].p_evt == p_evt)
+        {
+            *(volatile uint32_t *)m_ppi[i].p_task = 1;
+        }
+    }
+    irq_lines_update();
+}
+
+uint32_t sd_ppi_channel_assign(uint8_t               channel_num,
+                               const volatile void * evt_endpoint,
+                               const volatile void * task_endpoint)
+{
+    // channels 8 and up belong to the SoftDevice
+    if (channel_num >= 8)
+    {
+        return NRF_ERROR_SOC_PPI_INVALID_CHANNEL;
+    }
+    m_ppi[channel_num].p_evt  = evt_endpoint;
+    m_ppi[channel_num].p_task = task_endpoint;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ppi_channel_enable_set(uint32_t channel_enable_set_msk)
+{
+    if (channel_enable_set_msk & ~0xFFUL)
+    {
+        return NRF_ERROR_SOC_PPI_INVALID_CHANNEL;
+    }
+    m_ppi_enabled |= channel_enable_set_msk;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ppi_channel_enable_clr(uint32_t channel_enable_clr_msk)
+{
+    if (channel_enable_clr_msk & ~0xFFUL)
+    {
+        return NRF_ERROR_SOC_PPI_INVALID_CHANNEL;
+    }
+    m_ppi_enabled &= ~channel_enable_clr_msk;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_ppi_channel_enable_get(uint32_t * p_channel_enable)
+{
+    *p_channel_enable = m_ppi_enabled;
+    return NRF_SUCCESS;
+}
+
+static void thread_run(void)
+{
+    if (!m_thread_fn || m_delay_depth != 0 || m_isr_depth != 0)
+    {
+        return;
+    }
+    if (m_cfg.thread_interval_ns && m_thread_last_ns &&
+        m_now_ns < m_thread_last_ns + m_cfg.thread_interval_ns)
+    {
+        // main loop is still busy with something else, catch up later
+        m_thread_due_ns = m_thread_last_ns + m_cfg.thread_interval_ns;
+        return;
+    }
+    m_thread_last_ns = m_now_ns;
+    m_thread_due_ns  = SIM_NONE;
+    m_thread_fn();
+}
+
+static void irq_service(IRQn_Type irqn)
+{
+    sim_irq_t * p_irq = &m_irq[irqn];
+
+    p_irq->pending = false;
+    if (m_now_ns - p_irq->pended_ns > p_irq->stats.max_latency_ns)
+    {
+        p_irq->stats.max_latency_ns = m_now_ns - p_irq->pended_ns;
+    }
+    if (p_irq->handler)
+    {
+        uint64_t accesses = m_reg_accesses;
+        uint64_t start    = host_ns();
+
+        m_isr_depth++;
+        p_irq->active = true;
+        p_irq->handler();
+        p_irq->active = false;
+        m_isr_depth--;
+
+        uint64_t spent = host_ns() - start;
+        p_irq->stats.calls++;
+        p_irq->stats.total_ns     += spent;
+        p_irq->stats.reg_accesses += m_reg_accesses - accesses;
+        if (spent > p_irq->stats.max_ns)
+        {
+            p_irq->stats.max_ns = spent;
+        }
+    }
+    irq_lines_update();
+}
+
+const sim_irq_stats_t * sim_irq_stats(IRQn_Type irqn)
+{
+    return &m_irq[irqn].stats;
+}
+
+/*
+ * GPIO and GPIOTE
+ */
+
+static void port_detect_update(void)
+{
+    bool detect = false;
+
+    for (uint8_t pin = 0; pin < 32; pin++)
+    {
+        uint32_t sense = (sim_gpio.PIN_CNF[pin] & GPIO_PIN_CNF_SENSE_Msk) >> GPIO_PIN_CNF_SENSE_Pos;
+        uint32_t level = (m_wire_level >> pin) & 1UL;
+
+        if ((sense == GPIO_PIN_CNF_SENSE_Low && !level) ||
+            (sense == GPIO_PIN_CNF_SENSE_High && level))
+        {
+            detect = true;
+        }
+    }
+    // the PORT event fires on the rising edge of DETECT only
+    if (detect && !m_port_detect)
+    {
+        sim_gpiote.EVENTS_PORT = 1;
+    }
+    m_port_detect = detect;
+}
+
+// work out what every output pin is driven to and report the changes
+static void out_update(uint32_t dir)
+{
+    uint32_t level = sim_gpio.OUT & dir;
+
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        uint32_t config = m_gpiote_config[i];
+        uint32_t psel   = (config & GPIOTE_CONFIG_PSEL_Msk) >> GPIOTE_CONFIG_PSEL_Pos;
+
+        if (((config & GPIOTE_CONFIG_MODE_Msk) >> GPIOTE_CONFIG_MODE_Pos) == GPIOTE_CONFIG_MODE_Task)
+        {
+            level = (level & ~(1UL << psel)) | (((m_gpiote_out >> i) & 1UL) << psel);
+        }
+    }
+
+    uint32_t changed = level ^ m_out_level;
+    m_out_level = level;
+    for (uint8_t pin = 0; changed && pin < 32; pin++)
+    {
+        if (!(changed & (1UL << pin)))
+        {
+            continue;
+        }
+        sim_edge_t edge = { .t_ns = m_now_ns, .pin = pin, .level = (level >> pin) & 1UL };
+        if (m_output_fn)
+        {
+            m_output_fn(&edge);
+        }
+        // a driven output pulls its wired input low, like the CTL transistors
+        if (m_loop_in[pin] != 0xFF && m_loop_head - m_loop_tail < SIM_LOOP_EDGES)
+        {
+            sim_edge_t * p_loop = &m_loop_edges[m_loop_head++ % SIM_LOOP_EDGES];
+            p_loop->t_ns  = m_now_ns + m_loop_delay_ns;
+            p_loop->pin   = m_loop_in[pin];
+            p_loop->level = !edge.level;
+        }
+    }
+}
+
+static void gpio_latch(void)
+{
+    uint32_t dir = 0;
+
+    if (sim_gpio.OUTSET)
+    {
+        sim_gpio.OUT |= sim_gpio.OUTSET;
+        sim_gpio.OUTSET = 0;
+    }
+    if (sim_gpio.OUTCLR)
+    {
+        sim_gpio.OUT &= ~sim_gpio.OUTCLR;
+        sim_gpio.OUTCLR = 0;
+    }
+    for (uint8_t pin = 0; pin < 32; pin++)
+    {
+        dir |= (sim_gpio.PIN_CNF[pin] & GPIO_PIN_CNF_DIR_Msk) << pin;
+    }
+    sim_gpio.DIR = dir;
+    out_update(dir);
+    *(volatile uint32_t *)&sim_gpio.IN = (m_wire_level & ~dir) | (m_out_level & dir);
+    port_detect_update();
+}
+
+void sim_gpio_sync(void)
+{
+    m_reg_accesses++;
+    irq_lines_update();
+}
+
+static void gpiote_latch(void)
+{
+    m_gpiote_inten |= sim_gpiote.INTENSET;
+    m_gpiote_inten &= ~sim_gpiote.INTENCLR;
+    sim_gpiote.INTENSET = 0;
+    sim_gpiote.INTENCLR = 0;
+
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        uint32_t config = sim_gpiote.CONFIG[i];
+        uint32_t mode   = (config & GPIOTE_CONFIG_MODE_Msk) >> GPIOTE_CONFIG_MODE_Pos;
+
+        // a channel entering task mode, or moving to another pin, starts at OUTINIT
+        if (config != m_gpiote_config[i] && mode == GPIOTE_CONFIG_MODE_Task &&
+            (config & (GPIOTE_CONFIG_MODE_Msk | GPIOTE_CONFIG_PSEL_Msk)) !=
+            (m_gpiote_config[i] & (GPIOTE_CONFIG_MODE_Msk | GPIOTE_CONFIG_PSEL_Msk)))
+        {
+            m_gpiote_out &= ~(1UL << i);
+            m_gpiote_out |= ((config & GPIOTE_CONFIG_OUTINIT_Msk) >> GPIOTE_CONFIG_OUTINIT_Pos) << i;
+        }
+        m_gpiote_config[i] = config;
+
+        if (sim_gpiote.TASKS_OUT[i])
+        {
+            if (mode == GPIOTE_CONFIG_MODE_Task)
+            {
+                switch ((config & GPIOTE_CONFIG_POLARITY_Msk) >> GPIOTE_CONFIG_POLARITY_Pos)
+                {
+                    case GPIOTE_CONFIG_POLARITY_LoToHi: m_gpiote_out |= (1UL << i);  break;
+                    case GPIOTE_CONFIG_POLARITY_HiToLo: m_gpiote_out &= ~(1UL << i); break;
+                    case GPIOTE_CONFIG_POLARITY_Toggle: m_gpiote_out ^= (1UL << i);  break;
+                }
+            }
+            sim_gpiote.TASKS_OUT[i] = 0;
+        }
+    }
+}
+
+void sim_gpiote_sync(void)
+{
+    m_reg_accesses++;
+    irq_lines_update();
+}
+
+// GPIOTE channels in event mode watching the pin
+static void gpiote_in_detect(const sim_edge_t * p_edge)
+{
+    uint32_t old_level = (m_wire_level >> p_edge->pin) & 1UL;
+
+    if (old_level == p_edge->level)
+    {
+        return;
+    }
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        uint32_t config   = sim_gpiote.CONFIG[i];
+        uint32_t mode     = (config & GPIOTE_CONFIG_MODE_Msk) >> GPIOTE_CONFIG_MODE_Pos;
+        uint32_t psel     = (config & GPIOTE_CONFIG_PSEL_Msk) >> GPIOTE_CONFIG_PSEL_Pos;
+        uint32_t polarity = (config & GPIOTE_CONFIG_POLARITY_Msk) >> GPIOTE_CONFIG_POLARITY_Pos;
+
+        if (mode != GPIOTE_CONFIG_MODE_Event || psel != p_edge->pin)
+        {
+            continue;
+        }
+        if (polarity == GPIOTE_CONFIG_POLARITY_Toggle ||
+            (polarity == GPIOTE_CONFIG_POLARITY_LoToHi && p_edge->level) ||
+            (polarity == GPIOTE_CONFIG_POLARITY_HiToLo && !p_edge->level))
+        {
+            sim_gpiote.EVENTS_IN[i] = 1;
+            ppi_event(&sim_gpiote.EVENTS_IN[i]);
+        }
+    }
+}
+
+static void wire_apply(const sim_edge_t * p_edge)
+{
+    gpiote_in_detect(p_edge);
+    if (p_edge->level)
+    {
+        m_wire_level |= (1UL << p_edge->pin);
+    }
+    else
+    {
+        m_wire_level &= ~(1UL << p_edge->pin);
+    }
+    irq_lines_update();
+}
+
+void sim_wire_schedule(const sim_edge_t * p_edges, uint32_t count)
+{
+    mp_edges     = p_edges;
+    m_edge_count = count;
+    m_edge_idx   = 0;
+}
+
+/*
+ * TIMER
+ */
+
+static uint32_t timer_mask(const sim_timer_t * p_timer)
+{
+    switch (p_timer->regs.BITMODE)
+    {
+        case TIMER_BITMODE_BITMODE_08Bit: return 0xFF;
+        case TIMER_BITMODE_BITMODE_24Bit: return 0xFFFFFF;
+        case TIMER_BITMODE_BITMODE_32Bit: return 0xFFFFFFFF;
+        default:                          return 0xFFFF;
+    }
+}
+
+// ticks elapsed between start_ns and t_ns at 16 MHz / 2^PRESCALER
+static uint64_t timer_ticks(const sim_timer_t * p_timer, uint64_t t_ns)
+{
+    return ((t_ns - p_timer->start_ns) * 16) / (1000ULL << p_timer->regs.PRESCALER);
+}
+
+// time at which the counter has advanced by the given number of ticks
+static uint64_t timer_tick_time(const sim_timer_t * p_timer, uint64_t ticks)
+{
+    uint64_t div = 16;
+    return p_timer->start_ns + (ticks * (1000ULL << p_timer->regs.PRESCALER) + div - 1) / div;
+}
+
+static uint32_t timer_counter(const sim_timer_t * p_timer)
+{
+    uint64_t count = p_timer->base;
+
+    if (p_timer->running && p_timer->regs.MODE == TIMER_MODE_MODE_Timer)
+    {
+        count += timer_ticks(p_timer, m_now_ns);
+    }
+    return (uint32_t)count & timer_mask(p_timer);
+}
+
+static void timer_rebase(sim_timer_t * p_timer, uint32_t value)
+{
+    p_timer->base     = value;
+    p_timer->start_ns = m_now_ns;
+}
+
+// apply task and interrupt enable writes made since the last access
+static void timer_latch(sim_timer_t * p_timer)
+{
+    NRF_TIMER_Type * p_regs = &p_timer->regs;
+
+    if (p_regs->TASKS_STOP)
+    {
+        timer_rebase(p_timer, timer_counter(p_timer));
+        p_timer->running  = false;
+        p_regs->TASKS_STOP = 0;
+    }
+    if (p_regs->TASKS_START)
+    {
+        if (!p_timer->running)
+        {
+            timer_rebase(p_timer, p_timer->base);
+            p_timer->running = true;
+        }
+        p_regs->TASKS_START = 0;
+    }
+    if (p_regs->TASKS_CLEAR)
+    {
+        timer_rebase(p_timer, 0);
+        p_regs->TASKS_CLEAR = 0;
+    }
+    if (p_regs->TASKS_COUNT)
+    {
+        if (p_timer->running && p_regs->MODE == TIMER_MODE_MODE_Counter)
+        {
+            timer_rebase(p_timer, (p_timer->base + 1) & timer_mask(p_timer));
+        }
+        p_regs->TASKS_COUNT = 0;
+    }
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        if (p_regs->TASKS_CAPTURE[i])
+        {
+            p_regs->CC[i] = timer_counter(p_timer);
+            p_regs->TASKS_CAPTURE[i] = 0;
+        }
+    }
+    p_timer->inten |= p_regs->INTENSET;
+    p_timer->inten &= ~p_regs->INTENCLR;
+    p_regs->INTENSET = 0;
+    p_regs->INTENCLR = 0;
+}
+
+void sim_timer_sync(sim_timer_t * p_timer)
+{
+    m_reg_accesses++;
+    irq_lines_update();
+}
+
+// next time any CC register of a running timer matches, or SIM_NONE
+static uint64_t timer_next_compare(const sim_timer_t * p_timer, uint8_t * p_cc)
+{
+    uint64_t next = SIM_NONE;
+
+    if (!p_timer->running || p_timer->regs.MODE != TIMER_MODE_MODE_Timer)
+    {
+        return next;
+    }
+    uint32_t mask  = timer_mask(p_timer);
+    uint64_t ticks = timer_ticks(p_timer, m_now_ns);
+    uint32_t now   = (uint32_t)(p_timer->base + ticks) & mask;
+
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        uint64_t delta = (p_timer->regs.CC[i] - now) & mask;
+        if (delta == 0)
+        {
+            delta = (uint64_t)mask + 1;
+        }
+        uint64_t t = timer_tick_time(p_timer, ticks + delta);
+        if (t < next)
+        {
+            next  = t;
+            *p_cc = i;
+        }
+    }
+    return next;
+}
+
+static void timer_compare(sim_timer_t * p_timer, uint8_t cc)
+{
+    p_timer->regs.EVENTS_COMPARE[cc] = 1;
+    ppi_event(&p_timer->regs.EVENTS_COMPARE[cc]);
+    if (p_timer->regs.SHORTS & (TIMER_SHORTS_COMPARE0_CLEAR_Msk << cc))
+    {
+        timer_rebase(p_timer, 0);
+    }
+    else
+    {
+        timer_rebase(p_timer, timer_counter(p_timer));
+    }
+    if (p_timer->regs.SHORTS & (TIMER_SHORTS_COMPARE0_STOP_Msk << cc))
+    {
+        p_timer->running = false;
+    }
+    irq_lines_update();
+}
+
+/*
+ * app_timer, driven from the simulated RTC1
+ */
+
+static uint64_t rtc_ticks_to_ns(uint64_t ticks)
+{
+    return (ticks * 1000000000ULL) / SIM_RTC_FREQ;
+}
+
+uint32_t app_timer_create(app_timer_id_t *            p_timer_id,
+                          app_timer_mode_t            mode,
+                          app_timer_timeout_handler_t timeout_handler)
+{
+    if (m_app_timer_count >= SIM_APP_TIMERS)
+    {
+        return NRF_ERROR_NO_MEM;
+    }
+    m_app_timers[m_app_timer_count].handler = timeout_handler;
+    m_app_timers[m_app_timer_count].mode    = mode;
+    *p_timer_id = m_app_timer_count++;
+    return NRF_SUCCESS;
+}
+
+uint32_t app_timer_start(app_timer_id_t timer_id, uint32_t timeout_ticks, void * p_context)
+{
+    sim_app_timer_t * p_timer = &m_app_timers[timer_id];
+
+    if (timer_id >= m_app_timer_count)
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    p_timer->running   = true;
+    p_timer->period_ns = rtc_ticks_to_ns(timeout_ticks);
+    p_timer->expiry_ns = m_now_ns + p_timer->period_ns;
+    p_timer->p_context = p_context;
+    return NRF_SUCCESS;
+}
+
+uint32_t app_timer_stop(app_timer_id_t timer_id)
+{
+    if (timer_id >= m_app_timer_count)
+    {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    m_app_timers[timer_id].running = false;
+    return NRF_SUCCESS;
+}
+
+uint32_t app_timer_cnt_get(uint32_t * p_ticks)
+{
+    *p_ticks = (uint32_t)((m_now_ns * SIM_RTC_FREQ) / 1000000000ULL) & 0x00FFFFFF;
+    return NRF_SUCCESS;
+}
+
+static uint64_t app_timer_next(uint32_t * p_id)
+{
+    uint64_t next = SIM_NONE;
+
+    for (uint32_t i = 0; i < m_app_timer_count; i++)
+    {
+        if (m_app_timers[i].running && m_app_timers[i].expiry_ns < next)
+        {
+            next  = m_app_timers[i].expiry_ns;
+            *p_id = i;
+        }
+    }
+    return next;
+}
+
+static void app_timer_expire(uint32_t id)
+{
+    sim_app_timer_t * p_timer = &m_app_timers[id];
+
+    if (p_timer->mode == APP_TIMER_MODE_REPEATED)
+    {
+        p_timer->expiry_ns += p_timer->period_ns;
+    }
+    else
+    {
+        p_timer->running = false;
+    }
+    // timeout handlers run from the SWI0 interrupt on the target
+    m_isr_depth++;
+    p_timer->handler(p_timer->p_context);
+    m_isr_depth--;
+}
+
+/*
+ * SoftDevice calls
+ */
+
+uint32_t sd_nvic_EnableIRQ(IRQn_Type IRQn)
+{
+    m_irq[IRQn].enabled = true;
+    irq_lines_update();
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_nvic_DisableIRQ(IRQn_Type IRQn)
+{
+    m_irq[IRQn].enabled = false;
+    m_irq[IRQn].pending = false;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_nvic_ClearPendingIRQ(IRQn_Type IRQn)
+{
+    m_irq[IRQn].pending = false;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_nvic_SetPriority(IRQn_Type IRQn, nrf_app_irq_priority_t priority)
+{
+    m_irq[IRQn].prio = priority;
+    return NRF_SUCCESS;
+}
+
+/*
+ * Interrupts are only taken as sim_run_until moves time on, in a busy wait at
+ * the most, never between two statements, so every region is critical already.
+ */
+uint32_t sd_nvic_critical_region_enter(uint8_t * p_is_nested_critical_region)
+{
+    *p_is_nested_critical_region = 0;
+    return NRF_SUCCESS;
+}
+
+uint32_t sd_nvic_critical_region_exit(uint8_t is_nested_critical_region)
+{
+    return NRF_SUCCESS;
+}
+
+void sim_cpu_halt(uint64_t until_ns)
+{
+    if (until_ns > m_halt_until_ns)
+    {
+        m_halt_until_ns = until_ns;
+    }
+}
+
+void sim_sd_evt_schedule(uint64_t t_ns, sim_sd_evt_fn_t evt_fn)
+{
+    m_sd_evt_ns = t_ns;
+    m_sd_evt_fn = evt_fn;
+}
+
+void sim_radio_hook_set(sim_radio_fn_t radio_fn)
+{
+    m_radio_fn = radio_fn;
+}
+
+void retarget_init(void)
+{
+    // printf already goes to stdout on the host
+}
+
+/*
+ * Scheduler
+ */
+
+void sim_init(const sim_config_t * p_config, sim_thread_fn_t thread_fn)
+{
+    memset(&sim_gpio, 0, sizeof(sim_gpio));
+    memset(&sim_gpiote, 0, sizeof(sim_gpiote));
+    memset(&sim_timer1, 0, sizeof(sim_timer1));
+    memset(&sim_timer2, 0, sizeof(sim_timer2));
+    memset(m_ppi, 0, sizeof(m_ppi));
+    memset(m_irq, 0, sizeof(m_irq));
+    memset(m_app_timers, 0, sizeof(m_app_timers));
+
+    m_cfg             = *p_config;
+    m_thread_fn       = thread_fn;
+    m_now_ns          = 0;
+    m_rand_state      = p_config->seed ? p_config->seed : 1;
+    m_wire_level      = 0xFFFFFFFF;     // Wiegand lines idle high
+    m_port_detect     = false;
+    m_gpiote_inten    = 0;
+    m_gpiote_out      = 0;
+    m_out_level       = 0;
+    m_output_fn       = NULL;
+    memset(m_loop_in, 0xFF, sizeof(m_loop_in));
+    m_loop_delay_ns   = 0;
+    m_loop_head       = 0;
+    m_loop_tail       = 0;
+    memset(m_gpiote_config, 0, sizeof(m_gpiote_config));
+    m_reg_accesses    = 0;
+    m_delay_depth     = 0;
+    m_isr_depth       = 0;
+    m_thread_last_ns  = 0;
+    m_thread_due_ns   = SIM_NONE;
+    m_halt_until_ns   = 0;
+    m_sd_evt_ns       = SIM_NONE;
+    m_sd_evt_fn       = NULL;
+    m_radio_fn        = NULL;
+    m_app_timer_count = 0;
+    mp_edges          = NULL;
+    m_edge_count      = 0;
+    m_edge_idx        = 0;
+    m_ppi_enabled     = 0;
+
+    sim_timer1.irqn = TIMER1_IRQn;
+    sim_timer2.irqn = TIMER2_IRQn;
+
+    m_irq[GPIOTE_IRQn].handler = GPIOTE_IRQHandler;
+    m_irq[TIMER1_IRQn].handler = TIMER1_IRQHandler;
+    m_irq[TIMER2_IRQn].handler = TIMER2_IRQHandler;
+}
+
+enum
+{
+    SIM_EVT_NONE,
+    SIM_EVT_EDGE,
+    SIM_EVT_LOOP,
+    SIM_EVT_TIMER,
+    SIM_EVT_IRQ,
+    SIM_EVT_APP_TIMER,
+    SIM_EVT_BLE_END,
+    SIM_EVT_THREAD,
+    SIM_EVT_SD
+};
+
+// the CPU runs nothing before a flash operation is over
+static uint64_t cpu_time(uint64_t t_ns)
+{
+    return t_ns < m_halt_until_ns ? m_halt_until_ns : t_ns;
+}
+
+void sim_run_until(uint64_t t_ns)
+{
+    for (;;)
+    {
+        uint64_t next  = t_ns;
+        uint32_t kind  = SIM_EVT_NONE;
+        uint32_t which = 0;
+        uint8_t  cc    = 0;
+        uint8_t  timer = 0;
+
+        irq_lines_update();
+
+        // earliest wire edge
+        if (m_edge_idx < m_edge_count && mp_edges[m_edge_idx].t_ns <= next)
+        {
+            next = mp_edges[m_edge_idx].t_ns;
+            kind = SIM_EVT_EDGE;
+        }
+
+        // output change arriving back on an input
+        if (m_loop_tail != m_loop_head && m_loop_edges[m_loop_tail % SIM_LOOP_EDGES].t_ns < next)
+        {
+            next = m_loop_edges[m_loop_tail % SIM_LOOP_EDGES].t_ns;
+            kind = SIM_EVT_LOOP;
+        }
+
+        // earliest timer compare
+        uint64_t t;
+        for (uint8_t i = 0; i < SIM_TIMERS; i++)
+        {
+            uint8_t timer_cc = 0;
+            t = timer_next_compare(m_timers[i], &timer_cc);
+            if (t <= next && t != SIM_NONE)
+            {
+                next  = t;
+                kind  = SIM_EVT_TIMER;
+                timer = i;
+                cc    = timer_cc;
+            }
+        }
+
+        // earliest serviceable interrupt; the lowest priority number wins a tie
+        if (m_isr_depth == 0)
+        {
+            for (uint32_t i = 0; i < SIM_MAX_IRQS; i++)
+            {
+                if (!m_irq[i].pending || !m_irq[i].enabled)
+                {
+                    continue;
+                }
+                uint64_t due = cpu_time(m_irq[i].due_ns < m_now_ns ? m_now_ns : m_irq[i].due_ns);
+                if (due < next || (due == next &&
+                    (kind != SIM_EVT_IRQ || m_irq[i].prio < m_irq[which].prio)))
+                {
+                    next  = due;
+                    kind  = SIM_EVT_IRQ;
+                    which = i;
+                }
+            }
+
+            uint32_t id = 0;
+            t = app_timer_next(&id);
+            if (t != SIM_NONE && cpu_time(t) < next)
+            {
+                next  = cpu_time(t);
+                kind  = SIM_EVT_APP_TIMER;
+                which = id;
+            }
+
+            if (m_sd_evt_ns != SIM_NONE && cpu_time(m_sd_evt_ns) < next)
+            {
+                next = cpu_time(m_sd_evt_ns);
+                kind = SIM_EVT_SD;
+            }
+        }
+
+        // end of the next radio event wakes the main loop
+        if (m_cfg.ble_interval_ns && m_cfg.ble_busy_ns)
+        {
+            uint64_t end = (m_now_ns / m_cfg.ble_interval_ns) * m_cfg.ble_interval_ns + m_cfg.ble_busy_ns;
+            if (end <= m_now_ns)
+            {
+                end += m_cfg.ble_interval_ns;
+            }
+            if (cpu_time(end) < next)
+            {
+                next = cpu_time(end);
+                kind = SIM_EVT_BLE_END;
+            }
+        }
+
+        if (m_delay_depth == 0 && m_isr_depth == 0 && m_thread_due_ns != SIM_NONE &&
+            cpu_time(m_thread_due_ns) < next)
+        {
+            next = cpu_time(m_thread_due_ns);
+            kind = SIM_EVT_THREAD;
+        }
+
+        if (kind == SIM_EVT_NONE)
+        {
+            break;
+        }
+        if (next > m_now_ns)
+        {
+            m_now_ns = next;
+        }
+
+        switch (kind)
+        {
+            case SIM_EVT_EDGE:
+                wire_apply(&mp_edges[m_edge_idx++]);
+                break;
+            case SIM_EVT_LOOP:
+                wire_apply(&m_loop_edges[m_loop_tail++ % SIM_LOOP_EDGES]);
+                break;
+            case SIM_EVT_TIMER:
+                timer_compare(m_timers[timer], cc);
+                break;
+            case SIM_EVT_IRQ:
+                irq_service((IRQn_Type)which);
+                thread_run();
+                break;
+            case SIM_EVT_APP_TIMER:
+                app_timer_expire(which);
+                thread_run();
+                break;
+            case SIM_EVT_SD:
+            {
+                sim_sd_evt_fn_t evt_fn = m_sd_evt_fn;
+
+                // the handler may schedule the next one
+                m_sd_evt_ns = SIM_NONE;
+                m_isr_depth++;
+                evt_fn();
+                m_isr_depth--;
+                thread_run();
+                break;
+            }
+            case SIM_EVT_BLE_END:
+                if (m_radio_fn)
+                {
+                    // what the radio event carried reaches the application as stack events
+                    m_isr_depth++;
+                    m_radio_fn();
+                    m_isr_depth--;
+                }
+                thread_run();
+                break;
+            case SIM_EVT_THREAD:
+                thread_run();
+                break;
+        }
+    }
+    if (t_ns > m_now_ns)
+    {
+        m_now_ns = t_ns;
+    }
+}
+
+void sim_output_hook_set(sim_output_fn_t output_fn)
+{
+    m_output_fn = output_fn;
+}
+
+void sim_loopback_set(uint8_t out_pin, uint8_t in_pin, uint32_t delay_ns)
+{
+    m_loop_in[out_pin] = in_pin;
+    m_loop_delay_ns    = delay_ns;
+}
+
+void sim_delay_us(uint32_t us)
+{
+    m_delay_depth++;
+    sim_run_until(m_now_ns + (uint64_t)us * 1000ULL);
+    m_delay_depth--;
+}
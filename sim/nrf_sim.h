@@ -0,0 +1,116 @@
+/* Simulated nRF51 peripherals for running the Wiegand code on a host.
+ *
+ * Time is kept in nanoseconds and only moves forward when the simulator is
+ * asked to run (sim_run_until) or when application code busy-waits through
+ * nrf_delay_us. Reader pulses are scheduled up front as wire edges; each edge
+ * updates the GPIO input levels, raises GPIOTE events, fires the PPI channels
+ * listening to them and pends interrupts, which are then serviced after the
+ * configured latency. Level changes on output pins, whether from GPIO OUT or
+ * from GPIOTE task mode channels, are passed to the output hook and can be
+ * wired back onto an input to model the shared Wiegand lines. Flash writes
+ * and erases halt the CPU: peripherals and PPI carry on, but interrupts and
+ * the main loop wait until the flash is done.
+ */
+#ifndef NRF_SIM_H__
+#define NRF_SIM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SIM_MAX_IRQS    32
+
+/** One level change on an input wire, as seen by the pin. */
+typedef struct
+{
+    uint64_t t_ns;                      /**< Absolute time of the change. */
+    uint8_t  pin;                       /**< GPIO pin number. */
+    uint8_t  level;                     /**< New level, 0 or 1. */
+} sim_edge_t;
+
+/** Simulated TIMER peripheral. */
+typedef struct
+{
+    NRF_TIMER_Type regs;                /**< Register block seen by the application. */
+    IRQn_Type      irqn;                /**< Interrupt line of this instance. */
+    bool           running;             /**< True between START and STOP tasks. */
+    uint64_t       start_ns;            /**< Time the counter last started or was rebased. */
+    uint32_t       base;                /**< Counter value at start_ns. */
+    uint32_t       inten;               /**< Enabled interrupt sources. */
+} sim_timer_t;
+
+/** Per-interrupt cost counters, collected around every handler call. */
+typedef struct
+{
+    uint32_t calls;                     /**< Number of times the handler ran. */
+    uint64_t total_ns;                  /**< Host time spent inside the handler. */
+    uint64_t max_ns;                    /**< Longest single call. */
+    uint64_t reg_accesses;              /**< Peripheral register block accesses. */
+    uint64_t max_latency_ns;            /**< Worst pend-to-service delay. */
+} sim_irq_stats_t;
+
+/** Knobs for interrupt latency and SoftDevice activity. */
+typedef struct
+{
+    uint32_t latency_ns;                /**< Fixed delay from pend to service. */
+    uint32_t latency_jitter_ns;         /**< Uniform random extra delay on top. */
+    uint32_t ble_interval_ns;           /**< Period of radio events, 0 for none. */
+    uint32_t ble_busy_ns;               /**< Time each radio event holds off application interrupts. */
+    uint32_t thread_interval_ns;        /**< Minimum time between main loop passes, models a busy main loop. */
+    uint32_t seed;                      /**< PRNG seed for the jitter. */
+} sim_config_t;
+
+/** Flash activity seen through the simulated pstorage module. */
+typedef struct
+{
+    uint32_t writes;                    /**< Store operations done. */
+    uint64_t words;                     /**< Words written by them. */
+    uint32_t erases;                    /**< Pages erased. */
+    uint32_t page_erases_min;           /**< Fewest erases of any page a module owns. */
+    uint32_t page_erases_max;           /**< Most erases of any such page. */
+    uint64_t busy_ns;                   /**< Time the CPU spent halted on flash. */
+    uint64_t halt_max_ns;               /**< Longest single halt. */
+} sim_flash_stats_t;
+
+/** Thread-mode work run each time the CPU would return from sd_app_evt_wait. */
+typedef void (*sim_thread_fn_t)(void);
+
+/** SoftDevice event, run at interrupt level like the SWI2 event dispatch. */
+typedef void (*sim_sd_evt_fn_t)(void);
+
+/** Radio activity, run at interrupt level at the end of every radio event. */
+typedef void (*sim_radio_fn_t)(void);
+
+/** Called for every level change on an output pin. */
+typedef void (*sim_output_fn_t)(const sim_edge_t * p_edge);
+
+extern NRF_FICR_Type   sim_ficr;
+extern NRF_UICR_Type   sim_uicr;
+extern NRF_GPIO_Type   sim_gpio;
+extern NRF_GPIOTE_Type sim_gpiote;
+extern sim_timer_t     sim_timer1;
+extern sim_timer_t     sim_timer2;
+
+void sim_gpio_sync(void);
+void sim_gpiote_sync(void);
+void sim_timer_sync(sim_timer_t * p_timer);
+
+void     sim_init(const sim_config_t * p_config, sim_thread_fn_t thread_fn);
+uint64_t sim_time_ns(void);
+void     sim_wire_schedule(const sim_edge_t * p_edges, uint32_t count);
+void     sim_run_until(uint64_t t_ns);
+void     sim_delay_us(uint32_t us);
+void     sim_output_hook_set(sim_output_fn_t output_fn);
+void     sim_loopback_set(uint8_t out_pin, uint8_t in_pin, uint32_t delay_ns);
+uint32_t sim_rand(void);
+void     sim_cpu_halt(uint64_t until_ns);
+void     sim_sd_evt_schedule(uint64_t t_ns, sim_sd_evt_fn_t evt_fn);
+void     sim_radio_hook_set(sim_radio_fn_t radio_fn);
+
+const sim_irq_stats_t * sim_irq_stats(IRQn_Type irqn);
+
+void                      sim_flash_init(void);
+const sim_flash_stats_t * sim_flash_stats(void);
+uint32_t                  sim_flash_tear(void);
+void                      sim_flash_fail_set(uint32_t every);
+
+#endif /* NRF_SIM_H__ */
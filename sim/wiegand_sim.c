@@ -0,0 +1,1664 @@
+/* Host-side Wiegand capture simulator and ISR benchmark.
+ *
+ * Builds wiegand.c against the simulated peripherals in nrf_sim.c, replays a
+ * synthetic or recorded pulse train into DATA0_IN/DATA1_IN and reports what
+ * the firmware decoded, how many bits were lost and what each interrupt
+ * handler cost. See README.md for the trace file format.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "nrf.h"
+#include "nrf_error.h"
+#include "wiegand.h"
+#include "card_codec.h"
+#include "card_journal.h"
+#include "pstorage.h"
+#include "nrf_sim.h"
+
+#define SIM_MAX_EXPECTED    4096
+#define SIM_RESYNC_WINDOW   8
+#define SIM_TAIL_NS         20000000ULL     // run on after the last edge so frames close
+#define SIM_REPLAY_NONE     -1
+#define SIM_BLE_WINDOW      511             // BLE_MAX_TX_LEN, the last cards characteristic
+#define SIM_JOURNAL_STEP_NS 100000000ULL    // run on in these steps until the journal has written everything
+#define SIM_JOURNAL_STEPS   100
+#define SIM_RTC_HZ          32768ULL        // app_timer's RTC1
+#define SIM_FRAME_GAP_NS    3000000ULL      // a pulse this long after the one before starts a card
+#define SIM_STAMP_SLACK_NS  100000ULL       // allowed past the interrupt hold-offs for a capture stamp
+#define SIM_CLOCK_UNIX      1700000000UL    // Unix time the client sets the clock to
+
+
+typedef struct
+{
+    uint32_t cards;
+    uint16_t lens[16];
+    uint8_t  len_count;
+    uint32_t period_us;
+    uint32_t width_us;
+    uint32_t jitter_us;
+    uint32_t gap_us;
+    uint32_t repeat;                // times each card is presented in a row
+    uint32_t latency_us;
+    uint32_t latency_jitter_us;
+    uint32_t ble_interval_us;
+    uint32_t ble_busy_us;
+    uint32_t thread_interval_us;
+    uint32_t seed;
+    wiegand_capture_mode_t mode;    // WIEGAND_CAPTURE_MODES keeps the firmware default
+    int      replay;                // card to send back after the capture, or SIM_REPLAY_NONE
+    Card     frame;                 // custom frame uploaded for WIEGAND_TX_CUSTOM
+    uint8_t  replay_repeat;         // frames the replay job sends
+    uint16_t replay_gap_ms;         // ... and the gap it asks for between them
+    uint8_t  profile;               // transmit timing profile
+    wiegand_tx_timing_t custom;     // ... and its timing when it is the custom one
+    bool     loopback;              // wire the CTL lines back onto the inputs and measure
+    uint8_t  eof_multiple;          // end of frame timeout in learnt bit gaps, 0 for fixed
+    card_store_policy_t store_policy;   // what the card store does when full
+    bool     journal;               // keep the cards in the flash journal
+    bool     tear;                  // ... and cut its last write short before the reset
+    uint32_t flash_fail;            // ... and fail every so many flash writes, 0 for none
+    const char * p_trace_in;
+    const char * p_trace_out;
+    bool     sweep;
+    bool     verbose;
+} sim_opts_t;
+
+typedef struct
+{
+    uint32_t        sent;
+    uint32_t        decoded;
+    uint32_t        ok;
+    uint32_t        corrupt;
+    uint32_t        missing;
+    uint32_t        extra;
+    uint32_t        overwritten;    // cards the store dropped to make room for newer ones
+    uint32_t        refused;        // cards the store had no room for
+    uint16_t        window_cards;   // newest records coded for the BLE characteristic
+    uint16_t        window_len;
+    uint32_t        window_raw;     // ... and the bytes they take in the store
+    uint32_t        window_seq;
+    bool            window_ok;      // ... and they are the newest cards, whole
+    uint32_t        bits_sent;
+    uint32_t        bits_dropped;
+    uint32_t        formatted;      // intact cards of a known format
+    uint32_t        fields_ok;      // ... whose stored fields match the sent ones
+    uint8_t         refs_ok;        // reference cards that decode and encode as published
+    uint32_t        reads;          // presentations, repeats included
+    uint32_t        hits_ok;        // intact cards whose hit count matches the reads
+    uint32_t        coalesced;      // repeat reads the store folded into a record
+    sim_irq_stats_t gpiote;
+    sim_irq_stats_t timer2;
+    wiegand_capture_mode_t  mode;
+    wiegand_capture_stats_t capture;
+    wiegand_eof_stats_t eof;
+    uint32_t        closed;         // frames the firmware closed
+    uint64_t        close_sum_ns;   // ... and the time from their last pulse to the close
+    uint64_t        close_max_ns;
+    bool            replayed;       // a replay was asked for
+    bool            replay_ok;      // ... and the pulses on the CTL lines match the stored card
+    uint32_t        replay_err;     // result of queueing the job, then of the job
+    uint16_t        replay_bits;    // the first frame: bits
+    uint64_t        replay_ns;      // ... first pulse start to last pulse end
+    uint64_t        replay_done_ns; // ... first pulse start to TX done, gap included
+    uint64_t        replay_blocked_ns;  // time spent inside wiegand_tx_job_add
+    uint32_t        replay_frames;  // frames the job sent
+    uint32_t        replay_frames_ok;   // ... that match the card
+    uint64_t        replay_gap_min_ns;  // ... and the shortest quiet line between them
+    bool            replay_gap_ok;  // ... never shorter than asked for
+    uint32_t        width_min_ns;   // pulses as driven on the CTL lines
+    uint32_t        width_max_ns;
+    uint32_t        period_min_ns;
+    uint32_t        period_max_ns;
+    bool            measured;       // loopback measurement was on
+    wiegand_tx_measure_t loopback;  // ... and what the firmware measured
+    sim_irq_stats_t timer1;
+    bool            journaled;      // the flash journal was on
+    card_journal_stats_t journal;
+    card_journal_stats_t restore;   // the journal's statistics after the reset
+    sim_flash_stats_t flash;
+    uint32_t        restored;       // entries read back after a simulated reset
+    uint16_t        restored_cards; // ... cards the store held afterwards
+    uint32_t        restored_seq;   // ... and the sequence number it carried on from
+    uint32_t        torn_bytes;     // bytes of the last write undone before the reset
+    bool            journal_ok;     // ... which match the cards held before the reset
+    uint32_t        stamped;        // cards stored with a capture stamp
+    int64_t         stamp_min_ns;   // ... and how far it was from the card's first pulse
+    int64_t         stamp_max_ns;
+    bool            stamp_ok;       // ... never more than the interrupts were held off
+    uint32_t        passes;         // main loop passes, one per wakeup
+    uint32_t        loads;          // ... that loaded the last cards characteristic
+    uint64_t        load_ns;        // ... and the host time the loads took
+    uint32_t        clock_cards;    // cards moved onto Unix time by setting the clock
+    uint32_t        clock_boot;     // ... and the boot time it set
+    bool            clock_ok;       // ... every one by its time since boot
+} sim_result_t;
+
+static Card         m_expected[SIM_MAX_EXPECTED];
+static uint32_t     m_expected_count;
+static sim_edge_t * mp_edges;
+static uint32_t     m_edge_count;
+static uint32_t     m_edge_cap;
+static card_store_t m_store;
+static card_store_t m_restored;         // the store as rebuilt from flash after a reset
+static bool         m_journal;
+static FILE *       mp_report;
+static Card         m_replayed;         // card rebuilt from the CTL line pulses
+static uint64_t     m_replay_first_ns;
+static uint64_t     m_replay_rise_ns;   // start of the last pulse
+static uint64_t     m_replay_fall_ns;   // end of the last pulse
+static uint32_t     m_width_min_ns;
+static uint32_t     m_width_max_ns;
+static uint32_t     m_period_min_ns;
+static uint32_t     m_period_max_ns;
+static bool         m_replay_done;      // the replay job has ended
+static Card         m_replay_expected;  // card the job sends
+static uint32_t     m_replay_frames;    // frames sent so far
+static uint32_t     m_replay_frames_ok; // ... that match the card
+static uint16_t     m_replay_bits;      // the first frame: bits
+static uint64_t     m_replay_ns;        // ... first pulse start to last pulse end
+static uint64_t     m_replay_done_ns;   // ... first pulse start to TX done, gap included
+static uint64_t     m_replay_gap_min_ns;    // shortest quiet line between frames
+static wiegand_tx_job_t m_replay_job;   // job the simulated BLE write queues
+static uint32_t     m_replay_err;       // ... the result of queueing it
+static uint64_t     m_replay_blocked_ns;    // ... and the time that took
+static uint32_t     m_press_idx;        // next wire edge not yet gone by
+static uint64_t     m_last_press_ns;    // start of the newest pulse on the wire
+static uint32_t     m_closed;
+static uint64_t     m_close_sum_ns;
+static uint64_t     m_close_max_ns;
+static uint32_t     m_start_idx;        // next wire edge not yet looked at for card starts
+static uint64_t     m_start_ns[2];      // start of the newest card on the wire and the one before
+static uint64_t     m_start_press_ns;   // newest pulse start looked at
+static uint32_t     m_stamped;
+static int64_t      m_stamp_min_ns;
+static int64_t      m_stamp_max_ns;
+static uint32_t     m_updated;          // WIEGAND_EVT_CARD_UPDATED events
+static bool         m_cards_dirty;      // the store changed since the last cards were loaded
+static uint32_t     m_passes;
+static uint32_t     m_loads;
+static uint64_t     m_load_ns;
+
+static void edge_add(uint64_t t_ns, uint8_t pin, uint8_t level)
+{
+    if (m_edge_count == m_edge_cap)
+    {
+        m_edge_cap = m_edge_cap ? m_edge_cap * 2 : 1024;
+        mp_edges   = realloc(mp_edges, m_edge_cap * sizeof(sim_edge_t));
+    }
+    mp_edges[m_edge_count].t_ns  = t_ns;
+    mp_edges[m_edge_count].pin   = pin;
+    mp_edges[m_edge_count].level = level;
+    m_edge_count++;
+}
+
+static void pulse_add(uint64_t t_ns, uint8_t bit, uint64_t width_ns)
+{
+    uint8_t pin = bit ? DATA1_IN : DATA0_IN;
+    edge_add(t_ns, pin, 0);
+    edge_add(t_ns + width_ns, pin, 1);
+}
+
+static int edge_cmp(const void * p_a, const void * p_b)
+{
+    const sim_edge_t * p_ea = p_a;
+    const sim_edge_t * p_eb = p_b;
+
+    if (p_ea->t_ns != p_eb->t_ns)
+    {
+        return p_ea->t_ns < p_eb->t_ns ? -1 : 1;
+    }
+    return (int)p_eb->level - (int)p_ea->level;    // release before the next press
+}
+
+/*
+ * Cards use the firmware's Card layout: a big endian number of
+ * CARD_BYTES(bit_len) bytes, the first bit sent being the most significant.
+ */
+
+static uint8_t card_bit(const Card * p_card, uint16_t n)
+{
+    uint16_t pos = p_card->bit_len - 1 - n;
+    return (p_card->data[CARD_BYTES(p_card->bit_len) - 1 - pos / 8] >> (pos % 8)) & 1;
+}
+
+static void card_value_set(Card * p_card, uint64_t value)
+{
+    for (uint16_t i = CARD_BYTES(p_card->bit_len); i-- > 0; value >>= 8)
+    {
+        p_card->data[i] = (uint8_t)value;
+    }
+}
+
+// value of a card of up to 64 bits
+static uint64_t card_value(const Card * p_card)
+{
+    uint64_t value = 0;
+
+    for (uint16_t i = 0; i < CARD_BYTES(p_card->bit_len); i++)
+    {
+        value = (value << 8) | p_card->data[i];
+    }
+    return value;
+}
+
+static bool card_equal(const Card * p_a, const Card * p_b)
+{
+    return p_a->bit_len == p_b->bit_len &&
+           memcmp(p_a->data, p_b->data, CARD_BYTES(p_a->bit_len)) == 0;
+}
+
+static void card_print(FILE * p_file, const Card * p_card)
+{
+    for (uint16_t i = 0; i < CARD_BYTES(p_card->bit_len); i++)
+    {
+        fprintf(p_file, "%02x", p_card->data[i]);
+    }
+}
+
+// parse a hex value right aligned into the card, false if it does not fit
+static bool card_parse(Card * p_card, uint16_t len, const char * p_hex)
+{
+    size_t digits = strspn(p_hex, "0123456789abcdefABCDEF");
+
+    if (len == 0 || len > WIEGAND_MAX_BITS || digits == 0 || digits > 2 * CARD_BYTES(len))
+    {
+        return false;
+    }
+    memset(p_card, 0, sizeof(*p_card));
+    p_card->bit_len = len;
+    for (size_t i = 0; i < digits; i++)
+    {
+        char     c     = p_hex[digits - 1 - i];
+        uint8_t  digit = c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+        p_card->data[CARD_BYTES(len) - 1 - i / 2] |= digit << (4 * (i % 2));
+    }
+    return true;
+}
+
+// Cards packed by hand to their format's published layout, so a wrong parity
+// mask shows up even though generated cards go through the same encoder
+typedef struct
+{
+    const char * p_name;
+    uint8_t      bit_len;
+    uint64_t     value;
+    uint32_t     facility;
+    uint32_t     number;
+} format_ref_t;
+
+static const format_ref_t m_format_refs[] =
+{
+    { "C1k35s", 35, 0x6b422468bULL,    0x5a1,   0x12345 },   // every parity bit set
+    { "C1k48s", 48, 0x8123450a8642ULL, 0x12345, 0x54321 },
+};
+
+#define FORMAT_REFS (sizeof(m_format_refs) / sizeof(m_format_refs[0]))
+
+// decodes each reference card and encodes its fields back
+static uint8_t format_refs_check(void)
+{
+    uint8_t refs_ok = 0;
+
+    for (size_t i = 0; i < FORMAT_REFS; i++)
+    {
+        const format_ref_t *      p_ref = &m_format_refs[i];
+        const wiegand_format_t *  p_format;
+        wiegand_fields_t          fields;
+        uint64_t                  bits = 0;
+
+        p_format = wiegand_format_get(wiegand_format_decode(p_ref->value, p_ref->bit_len, &fields));
+        if (p_format != NULL && strcmp(p_format->name, p_ref->p_name) == 0 &&
+            fields.facility == p_ref->facility && fields.number == p_ref->number &&
+            wiegand_format_encode(&fields, &bits) == p_ref->bit_len && bits == p_ref->value)
+        {
+            refs_ok++;
+        }
+    }
+    return refs_ok;
+}
+
+// random card, with valid parity when the length matches a known format
+static void card_random(Card * p_card, uint16_t len)
+{
+    wiegand_fields_t fields = { .format = wiegand_format_find(len) };
+
+    memset(p_card, 0, sizeof(*p_card));
+    p_card->bit_len = len;
+    if (fields.format != WIEGAND_FORMAT_UNKNOWN)
+    {
+        uint64_t bits;
+        fields.facility = sim_rand();
+        fields.number   = sim_rand();
+        wiegand_format_encode(&fields, &bits);
+        card_value_set(p_card, bits);
+        return;
+    }
+    for (uint16_t i = 0; i < CARD_BYTES(len); i++)
+    {
+        p_card->data[i] = (uint8_t)sim_rand();
+    }
+    if (len % 8)
+    {
+        p_card->data[0] &= (1U << (len % 8)) - 1;
+    }
+}
+
+static bool card_is_control(const Card * p_card)
+{
+    return p_card->bit_len == 32 &&
+           (card_value(p_card) == 0xDEADBEEF || card_value(p_card) == 0xBAADF00D);
+}
+
+static void train_build(const sim_opts_t * p_opts)
+{
+    uint64_t t        = 1000000ULL;
+    uint64_t period   = p_opts->period_us * 1000ULL;
+    uint64_t width    = p_opts->width_us * 1000ULL;
+    uint32_t jitter   = p_opts->jitter_us * 1000UL;
+
+    for (uint32_t c = 0; c < p_opts->cards; c++)
+    {
+        Card * p_card = &m_expected[m_expected_count++];
+
+        do
+        {
+            card_random(p_card, p_opts->lens[c % p_opts->len_count]);
+        } while (card_is_control(p_card));
+        // the store should keep one record counting every read
+        p_card->hits = p_opts->repeat;
+
+        for (uint32_t n = 0; n < p_opts->repeat; n++)
+        {
+            for (uint16_t i = 0; i < p_card->bit_len; i++)
+            {
+                uint64_t at = t;
+                if (jitter)
+                {
+                    at += sim_rand() % (2 * jitter + 1);
+                    at -= jitter;
+                }
+                pulse_add(at, card_bit(p_card, i), width);
+                t += period;
+            }
+            t += p_opts->gap_us * 1000ULL;
+        }
+    }
+}
+
+/*
+ * Trace lines are either "card <bits> <hex value>" giving an expected card,
+ * or "<time us> <0|1> [width us]" giving a pulse on DATA0 or DATA1.
+ */
+static int trace_load(const sim_opts_t * p_opts)
+{
+    char   line[256];
+    FILE * p_file = fopen(p_opts->p_trace_in, "r");
+
+    if (!p_file)
+    {
+        perror(p_opts->p_trace_in);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), p_file))
+    {
+        unsigned long long t_us;
+        char               hex[2 * CARD_DATA_LEN + 2];
+        unsigned int       bit;
+        unsigned int       len;
+        unsigned int       width_us = p_opts->width_us;
+
+        if (line[0] == '#' || line[0] == '\n')
+        {
+            continue;
+        }
+        if (sscanf(line, "card %u %66s", &len, hex) == 2)
+        {
+            Card * p_card = &m_expected[m_expected_count];
+
+            if (m_expected_count < SIM_MAX_EXPECTED && card_parse(p_card, len, hex))
+            {
+                // a card read again straight away only adds to its hits
+                if (m_expected_count && card_equal(p_card - 1, p_card))
+                {
+                    (p_card - 1)->hits++;
+                }
+                else
+                {
+                    p_card->hits = 1;
+                    m_expected_count++;
+                }
+            }
+            continue;
+        }
+        if (sscanf(line, "%llu %u %u", &t_us, &bit, &width_us) >= 2)
+        {
+            pulse_add(t_us * 1000ULL, bit & 1, width_us * 1000ULL);
+            continue;
+        }
+        fprintf(stderr, "%s: cannot parse '%s'\n", p_opts->p_trace_in, line);
+    }
+    fclose(p_file);
+    qsort(mp_edges, m_edge_count, sizeof(sim_edge_t), edge_cmp);
+    return 0;
+}
+
+static void trace_dump(const char * p_path)
+{
+    FILE * p_file = fopen(p_path, "w");
+
+    if (!p_file)
+    {
+        perror(p_path);
+        return;
+    }
+    fprintf(p_file, "# wiegand_sim pulse train\n");
+    for (uint32_t i = 0; i < m_expected_count; i++)
+    {
+        for (uint16_t n = 0; n < m_expected[i].hits; n++)
+        {
+            fprintf(p_file, "card %u ", m_expected[i].bit_len);
+            card_print(p_file, &m_expected[i]);
+            fprintf(p_file, "\n");
+        }
+    }
+    for (uint32_t i = 0; i < m_edge_count; i++)
+    {
+        if (mp_edges[i].level == 0)
+        {
+            // find the matching release to recover the pulse width
+            uint64_t width = 0;
+            for (uint32_t j = i + 1; j < m_edge_count; j++)
+            {
+                if (mp_edges[j].pin == mp_edges[i].pin)
+                {
+                    width = mp_edges[j].t_ns - mp_edges[i].t_ns;
+                    break;
+                }
+            }
+            fprintf(p_file, "%llu %u %llu\n",
+                    (unsigned long long)(mp_edges[i].t_ns / 1000ULL),
+                    mp_edges[i].pin == DATA1_IN ? 1 : 0,
+                    (unsigned long long)(width / 1000ULL));
+        }
+    }
+    fclose(p_file);
+}
+
+// the n-th card in the store
+static bool stored_card_get(uint32_t n, Card * p_card)
+{
+    return card_store_get(&m_store, n, p_card) == NRF_SUCCESS;
+}
+
+static void fields_check(sim_result_t * p_result, const Card * p_stored, const Card * p_expected)
+{
+    wiegand_fields_t fields;
+
+    if (p_expected->bit_len > 64 ||
+        wiegand_format_decode(card_value(p_expected), p_expected->bit_len, &fields) == WIEGAND_FORMAT_UNKNOWN)
+    {
+        return;
+    }
+    p_result->formatted++;
+    if (p_stored->format == fields.format && p_stored->facility == fields.facility &&
+        p_stored->number == fields.number)
+    {
+        p_result->fields_ok++;
+    }
+}
+
+/*
+ * Decodes what the BLE characteristic would be loaded with and checks it is
+ * the newest records of the store, whole and in order.
+ */
+static void window_check(sim_result_t * p_result)
+{
+    uint8_t         buf[SIM_BLE_WINDOW];
+    uint8_t         rec[CARD_RECORD_MAX];
+    card_codec_t    codec;
+    uint16_t        count;
+    uint32_t        first;
+    uint16_t        pos;
+    uint32_t        seq = 0;
+
+    p_result->window_len = card_codec_export(&m_store, buf, sizeof(buf), &p_result->window_seq);
+    pos                  = card_codec_header_get(buf, p_result->window_len, &count, &first);
+    p_result->window_ok  = pos != 0 && first == p_result->window_seq;
+    card_codec_start(&codec, first);
+    while (p_result->window_ok && pos < p_result->window_len)
+    {
+        uint16_t        rec_len;
+        uint16_t        stored_len;
+        uint16_t        len    = card_codec_decode(&codec, &buf[pos], p_result->window_len - pos,
+                                                   &seq, rec, &rec_len);
+        const uint8_t * p_stored = card_store_record(&m_store, seq, &stored_len);
+
+        if (len == 0 || p_stored == NULL || seq != p_result->window_seq + p_result->window_cards ||
+            rec_len != stored_len || memcmp(rec, p_stored, rec_len) != 0)
+        {
+            p_result->window_ok = false;
+            break;
+        }
+        pos += len;
+        p_result->window_cards++;
+        p_result->window_raw += rec_len;
+    }
+    p_result->window_ok = p_result->window_ok && count == p_result->window_cards &&
+                          p_result->window_seq + p_result->window_cards == card_store_next_seq(&m_store);
+}
+
+static void result_collect(sim_result_t * p_result)
+{
+    Card     card;
+    uint32_t e = 0;
+
+    memset(p_result, 0, sizeof(*p_result));
+    p_result->sent = m_expected_count;
+    p_result->overwritten = m_store.overwritten;
+    p_result->refused     = m_store.refused;
+    // cards are numbered as they are stored, so the oldest one left is the
+    // first_seq-th decoded; overwritten cards are not missing
+    e = m_store.first_seq < m_expected_count ? m_store.first_seq : m_expected_count;
+    for (uint32_t i = 0; i < m_expected_count; i++)
+    {
+        p_result->reads     += m_expected[i].hits;
+        p_result->bits_sent += m_expected[i].bit_len * m_expected[i].hits;
+    }
+    p_result->coalesced = m_store.coalesced;
+
+    for (uint32_t d = 0; stored_card_get(d, &card); d++)
+    {
+        uint32_t j;
+
+        p_result->decoded++;
+        for (j = e; j < m_expected_count && j < e + SIM_RESYNC_WINDOW; j++)
+        {
+            if (card_equal(&m_expected[j], &card))
+            {
+                break;
+            }
+        }
+        if (j < m_expected_count && j < e + SIM_RESYNC_WINDOW)
+        {
+            // everything skipped over to get here was never decoded
+            for (; e < j; e++)
+            {
+                p_result->missing++;
+                p_result->bits_dropped += m_expected[e].bit_len;
+            }
+            p_result->ok++;
+            p_result->hits_ok += card.hits == m_expected[e].hits;
+            fields_check(p_result, &card, &m_expected[e]);
+            e++;
+        }
+        else if (e < m_expected_count)
+        {
+            p_result->corrupt++;
+            if (card.bit_len < m_expected[e].bit_len)
+            {
+                p_result->bits_dropped += m_expected[e].bit_len - card.bit_len;
+            }
+            e++;
+        }
+        else
+        {
+            p_result->extra++;
+        }
+    }
+    for (; e < m_expected_count; e++)
+    {
+        p_result->missing++;
+        p_result->bits_dropped += m_expected[e].bit_len;
+    }
+
+    p_result->gpiote = *sim_irq_stats(GPIOTE_IRQn);
+    p_result->timer2 = *sim_irq_stats(TIMER2_IRQn);
+    p_result->mode    = wiegand_capture_mode_get();
+    p_result->capture = *wiegand_capture_stats_get(p_result->mode);
+    p_result->eof     = *wiegand_eof_stats_get();
+    window_check(p_result);
+    p_result->closed       = m_closed;
+    p_result->close_sum_ns = m_close_sum_ns;
+    p_result->close_max_ns = m_close_max_ns;
+}
+
+static uint64_t host_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Main loop pass. Every frame the decoder closes is timed from the start of
+ * the last pulse on the wire, which is when the firmware's timeout starts.
+ * The last cards characteristic is coded the way main.c does it, only once
+ * the store has changed.
+ */
+static void sim_thread(void)
+{
+    const wiegand_capture_stats_t * p_stats = wiegand_capture_stats_get(wiegand_capture_mode_get());
+    uint32_t before = p_stats->frames + p_stats->frames_dropped;
+    uint64_t now    = sim_time_ns();
+
+    m_passes++;
+    wiegand_task();
+    if (m_journal)
+    {
+        card_journal_task(!wiegand_rx_busy());
+    }
+    if (m_cards_dirty)
+    {
+        uint8_t  buf[SIM_BLE_WINDOW];
+        uint64_t start = host_ns();
+
+        m_cards_dirty = false;
+        card_codec_export(&m_store, buf, sizeof(buf), NULL);
+        m_load_ns += host_ns() - start;
+        m_loads++;
+    }
+    for (; m_press_idx < m_edge_count && mp_edges[m_press_idx].t_ns <= now; m_press_idx++)
+    {
+        if (mp_edges[m_press_idx].level == 0)
+        {
+            m_last_press_ns = mp_edges[m_press_idx].t_ns;
+        }
+    }
+    if (p_stats->frames + p_stats->frames_dropped != before)
+    {
+        uint64_t close = now - m_last_press_ns;
+        m_closed++;
+        m_close_sum_ns += close;
+        m_close_max_ns  = close > m_close_max_ns ? close : m_close_max_ns;
+    }
+}
+
+// a pulse on DATA0_CTL/DATA1_CTL is one bit of the replayed card
+static void replay_output(const sim_edge_t * p_edge)
+{
+    uint16_t n = m_replayed.bit_len;
+
+    if (p_edge->pin != DATA0_CTL && p_edge->pin != DATA1_CTL)
+    {
+        return;
+    }
+    if (!p_edge->level)
+    {
+        uint32_t width = p_edge->t_ns - m_replay_rise_ns;
+        m_width_min_ns = width < m_width_min_ns ? width : m_width_min_ns;
+        m_width_max_ns = width > m_width_max_ns ? width : m_width_max_ns;
+        m_replay_fall_ns = p_edge->t_ns;
+        return;
+    }
+    if (n >= WIEGAND_MAX_BITS)
+    {
+        return;
+    }
+    if (n == 0)
+    {
+        m_replay_first_ns = p_edge->t_ns;
+        if (m_replay_frames > 0 && p_edge->t_ns - m_replay_fall_ns < m_replay_gap_min_ns)
+        {
+            m_replay_gap_min_ns = p_edge->t_ns - m_replay_fall_ns;
+        }
+    }
+    else
+    {
+        uint32_t period = p_edge->t_ns - m_replay_rise_ns;
+        m_period_min_ns = period < m_period_min_ns ? period : m_period_min_ns;
+        m_period_max_ns = period > m_period_max_ns ? period : m_period_max_ns;
+    }
+    m_replay_rise_ns = p_edge->t_ns;
+    // shift the bits collected so far up and add the new one at the bottom
+    for (uint16_t i = 0; i < CARD_DATA_LEN - 1; i++)
+    {
+        m_replayed.data[i] = (m_replayed.data[i] << 1) | (m_replayed.data[i + 1] >> 7);
+    }
+    m_replayed.data[CARD_DATA_LEN - 1] = (m_replayed.data[CARD_DATA_LEN - 1] << 1) |
+                                         (p_edge->pin == DATA1_CTL);
+    m_replayed.bit_len++;
+}
+
+// a frame is over once its gap has run out, check it against the card
+static void replay_evt(const wiegand_evt_t * p_evt)
+{
+    if (p_evt->evt_type == WIEGAND_EVT_TX_DONE)
+    {
+        uint16_t bits = m_replayed.bit_len;
+
+        // the data was collected right aligned over the whole buffer, move it to the card layout
+        memmove(m_replayed.data, &m_replayed.data[CARD_DATA_LEN - CARD_BYTES(bits)], CARD_BYTES(bits));
+        if (m_replay_frames == 0)
+        {
+            m_replay_bits    = bits;
+            m_replay_ns      = bits ? m_replay_fall_ns - m_replay_first_ns : 0;
+            m_replay_done_ns = sim_time_ns() - m_replay_first_ns;
+        }
+        m_replay_frames++;
+        if (m_replay_expected.bit_len != 0 && card_equal(&m_replay_expected, &m_replayed))
+        {
+            m_replay_frames_ok++;
+        }
+        memset(&m_replayed, 0, sizeof(m_replayed));
+    }
+    else if (p_evt->evt_type == WIEGAND_EVT_JOB_DONE)
+    {
+        m_replay_done = true;
+    }
+}
+
+// the replay characteristic's write handler, run as the stack's event
+static void replay_write(void)
+{
+    uint64_t start = sim_time_ns();
+
+    m_replay_err        = wiegand_tx_job_add(&m_replay_job);
+    m_replay_blocked_ns = sim_time_ns() - start;
+    if (m_replay_job.card_idx == WIEGAND_TX_CUSTOM)
+    {
+        // the client goes on to upload its next frame, the queued one must not change
+        Card * p_custom = wiegand_tx_custom_get();
+
+        memset(p_custom->data, 0xA5, sizeof(p_custom->data));
+        p_custom->bit_len = 8;
+    }
+}
+
+static void replay_run(const sim_opts_t * p_opts, sim_result_t * p_result)
+{
+    uint64_t         deadline;
+    uint16_t         idx = (uint16_t)p_opts->replay;
+    uint32_t         done = wiegand_tx_job_status_get()->done;
+    uint16_t         gap_ms;
+
+    memset(&m_replayed, 0, sizeof(m_replayed));
+    m_replay_done       = false;
+    m_replay_frames     = 0;
+    m_replay_frames_ok  = 0;
+    m_replay_bits       = 0;
+    m_replay_ns         = 0;
+    m_replay_done_ns    = 0;
+    m_replay_fall_ns    = 0;
+    m_replay_gap_min_ns = UINT64_MAX;
+    m_width_min_ns  = UINT32_MAX;
+    m_width_max_ns  = 0;
+    m_period_min_ns = UINT32_MAX;
+    m_period_max_ns = 0;
+    sim_output_hook_set(replay_output);
+    wiegand_evt_handler_set(replay_evt);
+    p_result->replay_err = wiegand_tx_profile_set(p_opts->profile, &p_opts->custom);
+    if (p_result->replay_err == NRF_SUCCESS && p_opts->loopback)
+    {
+        sim_loopback_set(DATA0_CTL, DATA0_IN, 0);
+        sim_loopback_set(DATA1_CTL, DATA1_IN, 0);
+        p_result->replay_err = wiegand_tx_loopback_set(true);
+        p_result->measured   = p_result->replay_err == NRF_SUCCESS;
+    }
+    if (p_result->replay_err != NRF_SUCCESS)
+    {
+        p_result->replayed = true;
+        return;
+    }
+
+    if (idx == WIEGAND_TX_CUSTOM)
+    {
+        // as the BLE stack writes Send Data and Data Length, in place
+        Card *  p_custom = wiegand_tx_custom_get();
+        uint8_t len      = CARD_BYTES(p_opts->frame.bit_len);
+
+        memcpy(p_custom->data, p_opts->frame.data, len);
+        memcpy(&p_custom->bit_len, &p_opts->frame.bit_len, sizeof(p_custom->bit_len));
+        m_replay_expected = p_opts->frame;
+    }
+    else if (card_store_get(&m_store, idx == WIEGAND_TX_LAST ? m_store.count - 1 : idx,
+                            &m_replay_expected) != NRF_SUCCESS)
+    {
+        // the last card read is also the last one stored
+        m_replay_expected.bit_len = 0;
+    }
+
+    // queued from the stack's event, the frames go out from wiegand_task
+    m_replay_job.card_idx = (uint8_t)idx;
+    m_replay_job.repeat   = p_opts->replay_repeat;
+    m_replay_job.gap_ms   = p_opts->replay_gap_ms;
+    m_replay_err          = NRF_SUCCESS;
+    sim_sd_evt_schedule(sim_time_ns(), replay_write);
+    // a card takes well under two seconds even at the longest timings
+    deadline = sim_time_ns() + (uint64_t)p_opts->replay_repeat * (2000000000ULL + p_opts->replay_gap_ms * 1000000ULL);
+    while (m_replay_err == NRF_SUCCESS && !m_replay_done && sim_time_ns() < deadline)
+    {
+        sim_run_until(sim_time_ns() + 100000000ULL);
+    }
+    sim_output_hook_set(NULL);
+    p_result->replay_err        = m_replay_err;
+    p_result->replay_blocked_ns = m_replay_blocked_ns;
+    if (p_result->replay_err == NRF_SUCCESS)
+    {
+        p_result->replay_err = wiegand_tx_job_status_get()->last_err;
+    }
+
+    p_result->replayed    = true;
+    p_result->replay_bits = m_replay_bits;
+    p_result->replay_ns   = m_replay_ns;
+    p_result->replay_done_ns = m_replay_done_ns;
+    p_result->replay_frames    = m_replay_frames;
+    p_result->replay_frames_ok = m_replay_frames_ok;
+    p_result->replay_gap_min_ns = m_replay_frames > 1 ? m_replay_gap_min_ns : 0;
+    p_result->width_min_ns  = m_width_min_ns;
+    p_result->width_max_ns  = m_width_max_ns;
+    p_result->period_min_ns = m_period_min_ns;
+    p_result->period_max_ns = m_period_max_ns;
+    p_result->loopback      = *wiegand_tx_measure_get();
+    p_result->timer1      = *sim_irq_stats(TIMER1_IRQn);
+    // frames must be at least the job's gap and the profile's apart, the
+    // gap timer counts whole RTC ticks
+    gap_ms = wiegand_tx_profile_info(wiegand_tx_profile_get(NULL))->timing.gap_ms;
+    gap_ms = p_opts->replay_gap_ms > gap_ms ? p_opts->replay_gap_ms : gap_ms;
+    p_result->replay_gap_ok = m_replay_frames < 2 ||
+                              m_replay_gap_min_ns + 1000000000ULL / SIM_RTC_HZ >= gap_ms * 1000000ULL;
+    p_result->replay_ok = p_result->replay_err == NRF_SUCCESS && m_replay_done &&
+                          wiegand_tx_job_status_get()->done == done + 1 &&
+                          m_replay_frames == p_opts->replay_repeat &&
+                          m_replay_frames_ok == m_replay_frames && p_result->replay_gap_ok;
+}
+
+/*
+ * Compares the capture stamp of a card with the start of its first pulse on
+ * the wire, which is either the newest card to have started or, if that is
+ * still coming in, the one before.
+ */
+static void stamp_check(uint64_t ticks)
+{
+    uint64_t now      = sim_time_ns();
+    int64_t  stamp_ns = (int64_t)(ticks * 1000000000ULL / SIM_RTC_HZ);
+    int64_t  err;
+
+    for (; m_start_idx < m_edge_count && mp_edges[m_start_idx].t_ns <= now; m_start_idx++)
+    {
+        const sim_edge_t * p_edge = &mp_edges[m_start_idx];
+
+        if (p_edge->level != 0 || (p_edge->pin != DATA0_IN && p_edge->pin != DATA1_IN))
+        {
+            continue;
+        }
+        if (m_start_press_ns == 0 || p_edge->t_ns - m_start_press_ns > SIM_FRAME_GAP_NS)
+        {
+            m_start_ns[1] = m_start_ns[0];
+            m_start_ns[0] = p_edge->t_ns;
+        }
+        m_start_press_ns = p_edge->t_ns;
+    }
+    err = stamp_ns - (int64_t)m_start_ns[0];
+    if (llabs(stamp_ns - (int64_t)m_start_ns[1]) < llabs(err))
+    {
+        err = stamp_ns - (int64_t)m_start_ns[1];
+    }
+    m_stamp_min_ns = m_stamped == 0 || err < m_stamp_min_ns ? err : m_stamp_min_ns;
+    m_stamp_max_ns = m_stamped == 0 || err > m_stamp_max_ns ? err : m_stamp_max_ns;
+    m_stamped++;
+}
+
+static void card_evt(const wiegand_evt_t * p_evt)
+{
+    if (p_evt->evt_type == WIEGAND_EVT_CARD_STORED)
+    {
+        stamp_check(p_evt->ticks);
+        m_cards_dirty = true;
+    }
+    if (p_evt->evt_type == WIEGAND_EVT_CARD_UPDATED)
+    {
+        m_updated++;
+        m_cards_dirty = true;
+    }
+    if (m_journal && ((p_evt->evt_type == WIEGAND_EVT_CARD_STORED && p_evt->hits > 1) ||
+                      p_evt->evt_type == WIEGAND_EVT_CARD_UPDATED))
+    {
+        card_journal_touch(p_evt->seq);
+    }
+}
+
+/*
+ * Sets the clock the way a client would and checks every card read since
+ * boot went from its time since boot onto Unix time, and nothing else moved.
+ */
+static void clock_check(sim_result_t * p_result)
+{
+    static uint32_t seen[CARD_STORE_MAX_RECORDS];
+    Card            card;
+    uint16_t        count;
+
+    for (count = 0; stored_card_get(count, &card); count++)
+    {
+        seen[count] = card.last_seen;
+    }
+    m_updated = 0;
+    wiegand_evt_handler_set(card_evt);
+    p_result->clock_ok   = wiegand_clock_set(SIM_CLOCK_UNIX) == NRF_SUCCESS;
+    p_result->clock_boot = wiegand_clock_boot_time();
+    for (uint16_t i = 0; stored_card_get(i, &card); i++)
+    {
+        p_result->clock_ok = p_result->clock_ok && i < count && seen[i] < WIEGAND_TIME_UNIX &&
+                             card.last_seen == p_result->clock_boot + seen[i];
+        p_result->clock_cards++;
+    }
+    p_result->clock_ok = p_result->clock_ok && m_updated == count &&
+                         p_result->clock_boot + sim_time_ns() / 1000000000ULL == SIM_CLOCK_UNIX &&
+                         wiegand_clock_set(SIM_CLOCK_UNIX - 1) == NRF_SUCCESS && m_updated == count;
+}
+
+/*
+ * Resets into a fresh store and journal on the same flash and checks every
+ * card both stores hold is the same, hit count and all, and that numbering
+ * carries on where it left off. With a torn last write the cards in it may be
+ * missing or older, but no other card may change.
+ */
+static void journal_check(const sim_opts_t * p_opts, sim_result_t * p_result)
+{
+    uint32_t seq;
+
+    p_result->journaled = true;
+    p_result->journal   = *card_journal_stats_get();
+    p_result->flash     = *sim_flash_stats();
+    if (p_opts->tear)
+    {
+        p_result->torn_bytes = sim_flash_tear();
+    }
+
+    card_store_init(&m_restored, p_opts->store_policy);
+    pstorage_init();
+    if (card_journal_init(&m_restored) != NRF_SUCCESS)
+    {
+        return;
+    }
+    p_result->restored       = card_journal_stats_get()->restored;
+    p_result->restore        = *card_journal_stats_get();
+    p_result->restored_cards = m_restored.count;
+    p_result->restored_seq   = card_store_next_seq(&m_restored);
+    if (p_opts->tear)
+    {
+        p_result->journal_ok = p_result->restored_seq <= card_store_next_seq(&m_store);
+    }
+    else
+    {
+        p_result->journal_ok = p_result->restored_seq == card_store_next_seq(&m_store) &&
+                               (m_store.count == 0 || m_restored.count > 0);
+    }
+    for (seq = m_restored.first_seq; seq != card_store_next_seq(&m_restored); seq++)
+    {
+        uint16_t        len;
+        uint16_t        restored_len;
+        const uint8_t * p_rec      = card_store_record(&m_store, seq, &len);
+        const uint8_t * p_restored = card_store_record(&m_restored, seq, &restored_len);
+
+        // a torn write can only have taken the latest reads of a card with it
+        if (p_rec && (len != restored_len ||
+                      memcmp(p_rec, p_restored, p_opts->tear ? 2 : len) != 0 ||
+                      memcmp(p_rec + CARD_HEADER_LEN, p_restored + CARD_HEADER_LEN, len - CARD_HEADER_LEN) != 0))
+        {
+            p_result->journal_ok = false;
+        }
+    }
+}
+
+static void run_once(const sim_opts_t * p_opts, sim_result_t * p_result)
+{
+    sim_config_t config =
+    {
+        .latency_ns        = p_opts->latency_us * 1000UL,
+        .latency_jitter_ns = p_opts->latency_jitter_us * 1000UL,
+        .ble_interval_ns   = p_opts->ble_interval_us * 1000UL,
+        .ble_busy_ns       = p_opts->ble_busy_us * 1000UL,
+        .thread_interval_ns = p_opts->thread_interval_us * 1000UL,
+        .seed              = p_opts->seed,
+    };
+
+    m_press_idx    = 0;
+    m_closed       = 0;
+    m_close_sum_ns = 0;
+    m_close_max_ns = 0;
+    m_start_idx      = 0;
+    m_start_ns[0]    = 0;
+    m_start_ns[1]    = 0;
+    m_start_press_ns = 0;
+    m_stamped        = 0;
+    m_cards_dirty    = true;
+    m_passes         = 0;
+    m_loads          = 0;
+    m_load_ns        = 0;
+    sim_init(&config, sim_thread);
+    card_store_init(&m_store, p_opts->store_policy);
+    m_journal = p_opts->journal;
+    if (m_journal)
+    {
+        sim_flash_init();
+        pstorage_init();
+        card_journal_init(&m_store);
+        sim_flash_fail_set(p_opts->flash_fail);
+    }
+    wiegand_init(&m_store);
+    wiegand_evt_handler_set(card_evt);
+    wiegand_eof_multiple_set(p_opts->eof_multiple);
+    if (p_opts->mode < WIEGAND_CAPTURE_MODES)
+    {
+        wiegand_capture_mode_set(p_opts->mode);
+    }
+
+    sim_wire_schedule(mp_edges, m_edge_count);
+    // leave time for the last frame to close and a held-off main loop to drain it
+    sim_run_until((m_edge_count ? mp_edges[m_edge_count - 1].t_ns : 0) + SIM_TAIL_NS +
+                  2ULL * config.thread_interval_ns);
+    for (uint32_t i = 0; m_journal && card_journal_busy() && i < SIM_JOURNAL_STEPS; i++)
+    {
+        sim_run_until(sim_time_ns() + SIM_JOURNAL_STEP_NS);
+    }
+    result_collect(p_result);
+    p_result->passes       = m_passes;
+    p_result->loads        = m_loads;
+    p_result->load_ns      = m_load_ns;
+    p_result->stamped      = m_stamped;
+    p_result->stamp_min_ns = m_stamp_min_ns;
+    p_result->stamp_max_ns = m_stamp_max_ns;
+    p_result->stamp_ok     = m_stamp_min_ns >= -(int64_t)(1000000000ULL / SIM_RTC_HZ) - 1 &&
+                             m_stamp_max_ns <= (int64_t)(config.latency_ns + config.latency_jitter_ns +
+                                                         config.ble_busy_ns + SIM_STAMP_SLACK_NS +
+                                                         sim_flash_stats()->halt_max_ns);
+    if (p_opts->replay != SIM_REPLAY_NONE)
+    {
+        replay_run(p_opts, p_result);
+    }
+    if (m_journal)
+    {
+        journal_check(p_opts, p_result);
+        // the journal now keeps the restored store, leave it out of the clock check
+        m_journal = false;
+    }
+    clock_check(p_result);
+    p_result->refs_ok = format_refs_check();
+}
+
+// wiegand.c keeps its state in statics, so every sweep point runs in a child
+static bool run_forked(const sim_opts_t * p_opts, sim_result_t * p_result)
+{
+    int   fds[2];
+    pid_t pid;
+
+    if (pipe(fds) != 0)
+    {
+        return false;
+    }
+    fflush(NULL);
+    pid = fork();
+    if (pid == 0)
+    {
+        close(fds[0]);
+        m_expected_count = 0;
+        m_edge_count     = 0;
+        train_build(p_opts);
+        run_once(p_opts, p_result);
+        if (write(fds[1], p_result, sizeof(*p_result)) != sizeof(*p_result))
+        {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    close(fds[1]);
+    bool ok = read(fds[0], p_result, sizeof(*p_result)) == sizeof(*p_result);
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    return ok;
+}
+
+static void irq_report(const char * p_name, const sim_irq_stats_t * p_stats, uint32_t bits)
+{
+    fprintf(mp_report, "%-18s %6u calls", p_name, p_stats->calls);
+    if (p_stats->calls)
+    {
+        fprintf(mp_report, ", %5llu ns avg, %6llu ns max, %.1f reg accesses/call, %llu us max latency",
+                (unsigned long long)(p_stats->total_ns / p_stats->calls),
+                (unsigned long long)p_stats->max_ns,
+                (double)p_stats->reg_accesses / p_stats->calls,
+                (unsigned long long)(p_stats->max_latency_ns / 1000ULL));
+    }
+    fprintf(mp_report, "\n");
+    if (bits && p_stats->calls)
+    {
+        fprintf(mp_report, "%-18s %6llu ns/bit, %.1f reg accesses/bit\n", "",
+                (unsigned long long)(p_stats->total_ns / bits),
+                (double)p_stats->reg_accesses / bits);
+    }
+}
+
+static void result_report(const sim_result_t * p_result)
+{
+    Card card;
+
+    for (uint32_t d = 0; stored_card_get(d, &card); d++)
+    {
+        const wiegand_format_t * p_format = wiegand_format_get(card.format);
+
+        fprintf(mp_report, "%4u. %3u bits 0x", d, card.bit_len);
+        card_print(mp_report, &card);
+        if (p_format)
+        {
+            fprintf(mp_report, " %s fc %u cn %u", p_format->name, card.facility, card.number);
+        }
+        fprintf(mp_report, "\n");
+    }
+    fprintf(mp_report, "cards sent         %6u (%u reads)\n", p_result->sent, p_result->reads);
+    fprintf(mp_report, "cards decoded      %6u (ok %u, corrupt %u, missing %u, extra %u)\n",
+            p_result->decoded, p_result->ok, p_result->corrupt,
+            p_result->missing, p_result->extra);
+    fprintf(mp_report, "ble export         %6u cards, %u bytes (%u as stored) from seq %u, %s\n",
+            p_result->window_cards, p_result->window_len, p_result->window_raw,
+            p_result->window_seq, p_result->window_ok ? "ok" : "BAD");
+    if (p_result->overwritten || p_result->refused)
+    {
+        fprintf(mp_report, "card store full    %6u overwritten, %u refused, %u bytes\n",
+                p_result->overwritten, p_result->refused, WIEGAND_STORE_SIZE);
+    }
+    fprintf(mp_report, "repeat reads       %6u coalesced (hits ok %u)\n", p_result->coalesced, p_result->hits_ok);
+    if (p_result->stamped)
+    {
+        fprintf(mp_report, "capture stamps     %6u cards, %+.1f to %+.1f us from the first pulse, %s\n",
+                p_result->stamped, p_result->stamp_min_ns / 1000.0, p_result->stamp_max_ns / 1000.0,
+                p_result->stamp_ok ? "ok" : "BAD");
+    }
+    fprintf(mp_report, "clock set          %6u cards moved onto Unix time, booted at %u, %s\n",
+            p_result->clock_cards, p_result->clock_boot, p_result->clock_ok ? "ok" : "BAD");
+    fprintf(mp_report, "formatted cards    %6u (fields ok %u)\n", p_result->formatted, p_result->fields_ok);
+    fprintf(mp_report, "reference cards    %6u of %u decode and encode as published, %s\n",
+            p_result->refs_ok, (unsigned)FORMAT_REFS, p_result->refs_ok == FORMAT_REFS ? "ok" : "BAD");
+    fprintf(mp_report, "bits sent          %6u\n", p_result->bits_sent);
+    fprintf(mp_report, "bits dropped       %6u\n", p_result->bits_dropped);
+    irq_report("GPIOTE_IRQHandler", &p_result->gpiote, p_result->bits_sent);
+    irq_report("TIMER2_IRQHandler", &p_result->timer2, 0);
+    fprintf(mp_report, "capture mode %-5s  %6u frames, %u dropped, %u bits, %u lost, %u overflows\n",
+            p_result->mode == WIEGAND_CAPTURE_PPI ? "ppi" : "sense",
+            p_result->capture.frames, p_result->capture.frames_dropped,
+            p_result->capture.bits, p_result->capture.bits_lost,
+            p_result->capture.overflows);
+    fprintf(mp_report, "end of frame       %6u us timeout (x%u of %u us learnt), %u closed early\n",
+            p_result->eof.timeout_us, wiegand_eof_multiple_get(), p_result->eof.interval_us,
+            p_result->eof.frames_early);
+    if (p_result->loads)
+    {
+        fprintf(mp_report, "main loop          %6u passes, %u last cards loads, %llu us host time (%llu us loading every pass)\n",
+                p_result->passes, p_result->loads,
+                (unsigned long long)(p_result->load_ns / 1000ULL),
+                (unsigned long long)(p_result->load_ns / p_result->loads * p_result->passes / 1000ULL));
+    }
+    if (p_result->closed)
+    {
+        fprintf(mp_report, "frame close        %6llu us avg, %llu us max after the last pulse\n",
+                (unsigned long long)(p_result->close_sum_ns / p_result->closed / 1000ULL),
+                (unsigned long long)(p_result->close_max_ns / 1000ULL));
+    }
+    if (p_result->journaled)
+    {
+        const card_journal_stats_t * p_journal = &p_result->journal;
+        const sim_flash_stats_t *    p_flash   = &p_result->flash;
+
+        fprintf(mp_report, "journal            %6u entries, %u bytes in %u writes, %u missed, %u errors\n",
+                p_journal->entries, p_journal->bytes, p_journal->writes,
+                p_journal->missed, p_journal->errors);
+        fprintf(mp_report, "flash              %6u pages erased (%u-%u per page), CPU halted %llu us, longest %llu us\n",
+                p_flash->erases, p_flash->page_erases_min, p_flash->page_erases_max,
+                (unsigned long long)(p_flash->busy_ns / 1000ULL),
+                (unsigned long long)(p_flash->halt_max_ns / 1000ULL));
+        if (p_result->torn_bytes)
+        {
+            fprintf(mp_report, "journal torn       %6u bytes of the last write undone, %u writes found torn\n",
+                    p_result->torn_bytes, p_result->restore.torn);
+        }
+        fprintf(mp_report, "journal restore    %6u entries read back from %u pages of %u entries, %u cards up to seq %u, %s\n",
+                p_result->restored, p_result->restore.pages_read, p_result->restore.logged,
+                p_result->restored_cards, p_result->restored_seq,
+                p_result->journal_ok ? "ok" : "BAD");
+    }
+    if (p_result->replayed)
+    {
+        const wiegand_tx_profile_t * p_profile = wiegand_tx_profile_info(wiegand_tx_profile_get(NULL));
+
+        fprintf(mp_report, "replay             %6s %u bits in %llu us (%llu us with gap), %llu us blocked queueing",
+                p_result->replay_ok ? "ok" : "FAILED", p_result->replay_bits,
+                (unsigned long long)(p_result->replay_ns / 1000ULL),
+                (unsigned long long)(p_result->replay_done_ns / 1000ULL),
+                (unsigned long long)(p_result->replay_blocked_ns / 1000ULL));
+        if (p_result->replay_err != NRF_SUCCESS)
+        {
+            fprintf(mp_report, ", error %u", p_result->replay_err);
+        }
+        fprintf(mp_report, "\n");
+        if (p_result->replay_frames > 1)
+        {
+            fprintf(mp_report, "replay job         %6s %u of %u frames intact, %llu us min gap\n",
+                    p_result->replay_gap_ok ? "ok" : "FAILED", p_result->replay_frames_ok,
+                    p_result->replay_frames, (unsigned long long)(p_result->replay_gap_min_ns / 1000ULL));
+        }
+        fprintf(mp_report, "tx profile %-8s %u us pulses every %u us, %u ms gap\n", p_profile->name,
+                p_profile->timing.pulse_us, p_profile->timing.period_us, p_profile->timing.gap_ms);
+        if (p_result->replay_bits > 1)
+        {
+            fprintf(mp_report, "tx driven          width %.1f-%.1f us, period %.1f-%.1f us\n",
+                    p_result->width_min_ns / 1000.0, p_result->width_max_ns / 1000.0,
+                    p_result->period_min_ns / 1000.0, p_result->period_max_ns / 1000.0);
+        }
+        if (p_result->measured)
+        {
+            const wiegand_tx_measure_t * p_measure = &p_result->loopback;
+            fprintf(mp_report, "tx loopback        %u pulses, %u missed, width %u-%u us (avg %u), "
+                    "period %u-%u us (avg %u), jitter %u us\n",
+                    p_measure->pulses, p_measure->missed,
+                    p_measure->pulse_min_us, p_measure->pulse_max_us, p_measure->pulse_avg_us,
+                    p_measure->period_min_us, p_measure->period_max_us, p_measure->period_avg_us,
+                    p_measure->pulses > 1 ? p_measure->period_max_us - p_measure->period_min_us : 0);
+        }
+        irq_report("TIMER1_IRQHandler", &p_result->timer1, p_result->replay_bits);
+    }
+}
+
+static bool result_clean(const sim_result_t * p_result)
+{
+    // cards the store let go of because it was full do not count against the capture
+    return p_result->ok + p_result->overwritten + p_result->refused == p_result->sent &&
+           p_result->ok == p_result->decoded && p_result->fields_ok == p_result->formatted &&
+           p_result->refs_ok == FORMAT_REFS &&
+           p_result->hits_ok == p_result->ok &&
+           p_result->window_ok &&
+           (p_result->stamped == 0 || p_result->stamp_ok) && p_result->clock_ok &&
+           (!p_result->replayed || p_result->replay_ok) &&
+           (!p_result->journaled || p_result->journal_ok);
+}
+
+static int sweep(sim_opts_t * p_opts)
+{
+    sim_result_t result;
+    uint32_t     best = 0;
+
+    fprintf(mp_report, "%10s %10s %6s %8s %8s\n", "period us", "bits/s", "ok", "corrupt", "missing");
+    for (uint32_t period = p_opts->period_us; period > 2 * p_opts->width_us;
+         period = period * 9 / 10)
+    {
+        p_opts->period_us = period;
+        if (!run_forked(p_opts, &result))
+        {
+            fprintf(stderr, "sweep step failed\n");
+            return 1;
+        }
+        fprintf(mp_report, "%10u %10u %6u %8u %8u\n", period, 1000000 / period,
+                result.ok, result.corrupt, result.missing);
+        if (!result_clean(&result))
+        {
+            break;
+        }
+        best = period;
+    }
+    if (best)
+    {
+        fprintf(mp_report, "max sustainable bit rate: %u bits/s (%u us period)\n",
+                1000000 / best, best);
+    }
+    else
+    {
+        fprintf(mp_report, "no clean run at any period\n");
+    }
+    return 0;
+}
+
+static void lens_parse(sim_opts_t * p_opts, char * p_arg)
+{
+    p_opts->len_count = 0;
+    for (char * p_tok = strtok(p_arg, ","); p_tok && p_opts->len_count < 16;
+         p_tok = strtok(NULL, ","))
+    {
+        int len = atoi(p_tok);
+        if (len > 0 && len <= WIEGAND_MAX_BITS)
+        {
+            p_opts->lens[p_opts->len_count++] = (uint16_t)len;
+        }
+    }
+    if (p_opts->len_count == 0)
+    {
+        p_opts->lens[p_opts->len_count++] = 26;
+    }
+}
+
+// BITS:HEX, the frame's bits right aligned in hex, first bit sent first
+static bool frame_parse(sim_opts_t * p_opts, const char * p_arg)
+{
+    char *       p_hex;
+    unsigned     bits = strtoul(p_arg, &p_hex, 0);
+    Card *       p_frame = &p_opts->frame;
+    size_t       digits;
+
+    if (*p_hex++ != ':' || bits == 0 || bits > WIEGAND_MAX_BITS)
+    {
+        return false;
+    }
+    memset(p_frame, 0, sizeof(*p_frame));
+    p_frame->bit_len = bits;
+    p_frame->format  = WIEGAND_FORMAT_UNKNOWN;
+    digits           = strlen(p_hex);
+    if (digits == 0 || digits > 2 * CARD_BYTES(bits))
+    {
+        return false;
+    }
+    // right aligned, the last digit is the last bit's nibble
+    for (size_t i = 0; i < digits; i++)
+    {
+        char     c   = p_hex[digits - 1 - i];
+        uint8_t  pos = CARD_BYTES(bits) - 1 - i / 2;
+        unsigned nibble;
+
+        if (c >= '0' && c <= '9')      nibble = c - '0';
+        else if (c >= 'a' && c <= 'f') nibble = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') nibble = c - 'A' + 10;
+        else                           return false;
+        p_frame->data[pos] |= nibble << (4 * (i & 1));
+    }
+    if (bits % 8)
+    {
+        p_frame->data[0] &= (1U << (bits % 8)) - 1;
+    }
+    p_opts->replay = WIEGAND_TX_CUSTOM;
+    return true;
+}
+
+// N[,GAP_MS], frames of the replay job and the gap between them
+static bool replay_repeat_parse(sim_opts_t * p_opts, const char * p_arg)
+{
+    unsigned int repeat;
+    unsigned int gap = 0;
+
+    if (sscanf(p_arg, "%u,%u", &repeat, &gap) < 1 || repeat == 0 || repeat > UINT8_MAX ||
+        gap > UINT16_MAX)
+    {
+        return false;
+    }
+    p_opts->replay_repeat = repeat;
+    p_opts->replay_gap_ms = gap;
+    return true;
+}
+
+static bool policy_parse(sim_opts_t * p_opts, const char * p_arg)
+{
+    if (strcmp(p_arg, "overwrite") == 0)
+    {
+        p_opts->store_policy = CARD_STORE_OVERWRITE;
+    }
+    else if (strcmp(p_arg, "stop") == 0)
+    {
+        p_opts->store_policy = CARD_STORE_STOP;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+static bool mode_parse(sim_opts_t * p_opts, const char * p_arg)
+{
+    if (strcmp(p_arg, "sense") == 0)
+    {
+        p_opts->mode = WIEGAND_CAPTURE_SENSE;
+    }
+    else if (strcmp(p_arg, "ppi") == 0)
+    {
+        p_opts->mode = WIEGAND_CAPTURE_PPI;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+// a profile name, or PULSE,PERIOD,GAP for a custom timing
+static bool profile_parse(sim_opts_t * p_opts, const char * p_arg)
+{
+    unsigned int pulse, period, gap;
+
+    for (uint8_t i = 0; i < WIEGAND_TX_PROFILES; i++)
+    {
+        if (strcmp(p_arg, wiegand_tx_profile_info(i)->name) == 0)
+        {
+            p_opts->profile = i;
+            return i != WIEGAND_TX_PROFILE_CUSTOM;
+        }
+    }
+    if (sscanf(p_arg, "%u,%u,%u", &pulse, &period, &gap) != 3)
+    {
+        return false;
+    }
+    p_opts->profile          = WIEGAND_TX_PROFILE_CUSTOM;
+    p_opts->custom.pulse_us  = pulse;
+    p_opts->custom.period_us = period;
+    p_opts->custom.gap_ms    = gap;
+    return true;
+}
+
+static void usage(const char * p_prog)
+{
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -n, --cards N           cards to send (default 20)\n"
+            "  -b, --bits L[,L...]     card lengths, cycled (default 26)\n"
+            "  -p, --period US         bit period (default 2000)\n"
+            "  -w, --width US          pulse width (default 50)\n"
+            "  -j, --jitter US         +/- random jitter on each pulse (default 0)\n"
+            "  -g, --gap US            gap between cards (default 50000)\n"
+            "  -R, --repeat N          present each card N times in a row (default 1)\n"
+            "  -l, --latency US        interrupt latency (default 0)\n"
+            "  -L, --latency-jitter US random extra interrupt latency (default 0)\n"
+            "  -I, --ble-interval US   radio event period, 0 for none (default 0)\n"
+            "  -B, --ble-busy US       time each radio event blocks interrupts (default 0)\n"
+            "  -T, --thread-interval US minimum time between main loop passes (default 0)\n"
+            "  -m, --mode sense|ppi    capture mode (default: firmware default)\n"
+            "  -r, --replay IDX        send stored card IDX back out afterwards, 255 for the last\n"
+            "  -F, --frame BITS:HEX    send this custom frame out afterwards, as uploaded over BLE\n"
+            "  -X, --replay-repeat N[,GAP]  send the card or frame N times, GAP ms apart, as one replay job\n"
+            "  -P, --profile NAME      replay timing: standard, fast, slow or PULSE,PERIOD,GAP\n"
+            "  -k, --loopback          wire the CTL lines onto the inputs and measure the replay\n"
+            "  -f, --store-full overwrite|stop  card store policy when full (default overwrite)\n"
+            "  -e, --eof-multiple N    end of frame after N learnt bit gaps, 0 for fixed 3 ms (default 4)\n"
+            "  -J, --journal           keep the cards in the flash journal and check them after a reset\n"
+            "  -U, --tear              with --journal, cut the last flash write short before the reset\n"
+            "  -E, --flash-fail N      with --journal, fail every Nth flash write\n"
+            "  -s, --seed N            PRNG seed (default 1)\n"
+            "  -t, --trace FILE        replay a recorded pulse train\n"
+            "  -o, --dump FILE         write the pulse train to a trace file\n"
+            "  -S, --sweep             shorten the period until decoding fails\n"
+            "  -v, --verbose           show firmware printf output\n",
+            p_prog);
+}
+
+int main(int argc, char ** argv)
+{
+    static const struct option long_opts[] =
+    {
+        { "cards",          required_argument, NULL, 'n' },
+        { "bits",           required_argument, NULL, 'b' },
+        { "period",         required_argument, NULL, 'p' },
+        { "width",          required_argument, NULL, 'w' },
+        { "jitter",         required_argument, NULL, 'j' },
+        { "gap",            required_argument, NULL, 'g' },
+        { "repeat",         required_argument, NULL, 'R' },
+        { "latency",        required_argument, NULL, 'l' },
+        { "latency-jitter", required_argument, NULL, 'L' },
+        { "ble-interval",   required_argument, NULL, 'I' },
+        { "ble-busy",       required_argument, NULL, 'B' },
+        { "thread-interval", required_argument, NULL, 'T' },
+        { "mode",           required_argument, NULL, 'm' },
+        { "replay",         required_argument, NULL, 'r' },
+        { "frame",          required_argument, NULL, 'F' },
+        { "replay-repeat",  required_argument, NULL, 'X' },
+        { "profile",        required_argument, NULL, 'P' },
+        { "loopback",       no_argument,       NULL, 'k' },
+        { "store-full",     required_argument, NULL, 'f' },
+        { "eof-multiple",   required_argument, NULL, 'e' },
+        { "journal",        no_argument,       NULL, 'J' },
+        { "tear",           no_argument,       NULL, 'U' },
+        { "flash-fail",     required_argument, NULL, 'E' },
+        { "seed",           required_argument, NULL, 's' },
+        { "trace",          required_argument, NULL, 't' },
+        { "dump",           required_argument, NULL, 'o' },
+        { "sweep",          no_argument,       NULL, 'S' },
+        { "verbose",        no_argument,       NULL, 'v' },
+        { "help",           no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    sim_opts_t opts =
+    {
+        .cards     = 20,
+        .lens      = { 26 },
+        .len_count = 1,
+        .period_us = 2000,
+        .width_us  = 50,
+        .gap_us    = 50000,
+        .repeat    = 1,
+        .seed      = 1,
+        .mode      = WIEGAND_CAPTURE_MODES,
+        .replay    = SIM_REPLAY_NONE,
+        .replay_repeat = 1,
+        .eof_multiple = WIEGAND_EOF_MULTIPLE_DEFAULT,
+    };
+    sim_result_t result;
+    int          opt;
+
+    while ((opt = getopt_long(argc, argv, "n:b:p:w:j:g:R:l:L:I:B:T:m:r:F:X:P:kf:e:JUE:s:t:o:Svh", long_opts, NULL)) != -1)
+    {
+        switch (opt)
+        {
+            case 'n': opts.cards             = strtoul(optarg, NULL, 0); break;
+            case 'b': lens_parse(&opts, optarg);                         break;
+            case 'p': opts.period_us         = strtoul(optarg, NULL, 0); break;
+            case 'w': opts.width_us          = strtoul(optarg, NULL, 0); break;
+            case 'j': opts.jitter_us         = strtoul(optarg, NULL, 0); break;
+            case 'g': opts.gap_us            = strtoul(optarg, NULL, 0); break;
+            case 'R':
+                opts.repeat = strtoul(optarg, NULL, 0);
+                if (opts.repeat == 0)
+                {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'l': opts.latency_us        = strtoul(optarg, NULL, 0); break;
+            case 'L': opts.latency_jitter_us = strtoul(optarg, NULL, 0); break;
+            case 'I': opts.ble_interval_us   = strtoul(optarg, NULL, 0); break;
+            case 'B': opts.ble_busy_us       = strtoul(optarg, NULL, 0); break;
+            case 'T': opts.thread_interval_us = strtoul(optarg, NULL, 0); break;
+            case 'm':
+                if (!mode_parse(&opts, optarg))
+                {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'r': opts.replay            = strtol(optarg, NULL, 0) & 0xFF; break;
+            case 'P':
+                if (!profile_parse(&opts, optarg))
+                {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'k': opts.loopback          = true;                     break;
+            case 'F':
+                if (!frame_parse(&opts, optarg))
+                {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'X':
+                if (!replay_repeat_parse(&opts, optarg))
+                {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'f':
+                if (!policy_parse(&opts, optarg))
+                {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'e':
+                opts.eof_multiple = strtoul(optarg, NULL, 0);
+                if (opts.eof_multiple &&
+                    (opts.eof_multiple < WIEGAND_EOF_MULTIPLE_MIN || opts.eof_multiple > WIEGAND_EOF_MULTIPLE_MAX))
+                {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'J': opts.journal           = true;                     break;
+            case 'U': opts.tear              = true;                     break;
+            case 'E': opts.flash_fail        = strtoul(optarg, NULL, 0); break;
+            case 's': opts.seed              = strtoul(optarg, NULL, 0); break;
+            case 't': opts.p_trace_in        = optarg;                   break;
+            case 'o': opts.p_trace_out       = optarg;                   break;
+            case 'S': opts.sweep             = true;                     break;
+            case 'v': opts.verbose           = true;                     break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+
+    if (opts.jitter_us * 2 >= opts.period_us - opts.width_us)
+    {
+        fprintf(stderr, "jitter must be less than half the gap between pulses\n");
+        return 2;
+    }
+
+    // keep the report on stdout and send firmware logging elsewhere
+    mp_report = fdopen(dup(STDOUT_FILENO), "w");
+    if (!opts.verbose && !freopen("/dev/null", "w", stdout))
+    {
+        perror("/dev/null");
+        return 2;
+    }
+
+    sim_config_t seed_only = { .seed = opts.seed };
+    sim_init(&seed_only, NULL);
+
+    if (opts.sweep)
+    {
+        return sweep(&opts);
+    }
+
+    if (opts.p_trace_in)
+    {
+        if (trace_load(&opts) != 0)
+        {
+            return 2;
+        }
+    }
+    else
+    {
+        train_build(&opts);
+    }
+    if (opts.p_trace_out)
+    {
+        trace_dump(opts.p_trace_out);
+    }
+
+    run_once(&opts, &result);
+    fflush(stdout);
+    result_report(&result);
+    fclose(mp_report);
+    return result_clean(&result) ? 0 : 1;
+}
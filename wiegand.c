@@ -15,35 +15,186 @@
 #include "ble_wiegand.h"
 #include "app_timer.h"
 
-// wiegand data pins
-#define DATA0_IN 0
-#define DATA1_IN 7
-#define DATA0_CTL 2
-#define DATA1_CTL 3
-
-// macro to grab bit n from a unit64_t
-#define GETBIT(x,n) ((x >> n)&1ULL)
+// bit n of a card, counting from the first bit sent
+#define CARD_BIT(card, n) (((card)->data[CARD_BYTES((card)->bit_len) - 1 - \
+                            (((card)->bit_len - 1 - (n)) >> 3)] >> (((card)->bit_len - 1 - (n)) & 7)) & 1)
 
 #define TIMER_DELAY 3000 // Timer is set at 1Mhz, 3000 ticks = 3ms
+#define EOF_TIMEOUT_MIN 500 // never end a frame sooner than this, whatever the reader
+#define EOF_HISTORY 2      // cards learnt from before the end of frame timeout adapts
+#define EOF_LEARN_BITS 26  // shorter frames are too likely to be noise to learn from
+#define EOF_ARM_MARGIN 20  // ticks to arm the compare ahead when the handler ran late
+#define EDGE_FIFO_SIZE 128 // must be a power of two
+#define EDGE_FIFO_MASK (EDGE_FIFO_SIZE - 1)
 #define MAX_LEN 44
+#define TS_NOW_CC 3        // TIMER2 CC register used to read the current time
+#ifndef WIEGAND_CAPTURE_DEFAULT
+#define WIEGAND_CAPTURE_DEFAULT WIEGAND_CAPTURE_PPI
+#endif
+
+// resources used by the PPI capture mode. S110 leaves PPI channels 0-7 to
+// the application.
+#define GPIOTE_CH_DATA0 0
+#define GPIOTE_CH_DATA1 1
+#define PPI_CH_DATA0_TS 0   // DATA0 pulse -> TIMER2 CAPTURE[1]
+#define PPI_CH_DATA1_TS 1   // DATA1 pulse -> TIMER2 CAPTURE[2]
+#define PPI_CH_DATA0_CNT 2  // DATA0 pulse -> TIMER1 COUNT
+#define PPI_CH_DATA1_CNT 3  // DATA1 pulse -> TIMER1 COUNT
+#define PPI_CAPTURE_MSK ((1UL << PPI_CH_DATA0_TS) | (1UL << PPI_CH_DATA1_TS) | \
+                         (1UL << PPI_CH_DATA0_CNT) | (1UL << PPI_CH_DATA1_CNT))
+
+// resources used by the transmitter. TIMER1 is borrowed from the capture
+// edge counter while sending, reads are ignored then anyway.
+#define GPIOTE_CH_TX 2
+#define PPI_CH_TX_START 4   // TIMER1 COMPARE[0] -> toggle the TX line high
+#define PPI_CH_TX_END 5     // TIMER1 COMPARE[1] -> toggle it low again
+#define PPI_TX_MSK ((1UL << PPI_CH_TX_START) | (1UL << PPI_CH_TX_END))
+#define TX_LEAD_US 10       // first pulse starts this long after the timer
+#define TX_PULSE_MIN_US 10
+#define TX_GAP_MIN_MS 1     // a reader needs some quiet time to see the card end
+#define TX_GAP_MAX_MS 10000
+#define RTC_HZ 32768        // app_timer runs RTC1 unscaled
+#define RTC_MASK 0x00FFFFFF
 #define CTL_CARD_1 0xDEADBEEF
 #define CTL_CARD_2 0xBAADF00D
+#define CTL_REPLAY_LEAD_MS 50   // quiet line between the control card and its replay
 
 uint8_t bar;
-static uint64_t last_card = 0xDEADBEEF;        // unpadded last card for ease of re-transmission
-static uint8_t last_size = 32;                 // number of bits in last card
+static Card last_card =                        // last card for ease of re-transmission
+{
+    .bit_len = 32,
+    .format = WIEGAND_FORMAT_UNKNOWN,
+    .data = { 0xDE, 0xAD, 0xBE, 0xEF },
+};
+static Card tx_custom =                        // frame uploaded by the client, the BLE stack writes it in place
+{
+    .format = WIEGAND_FORMAT_UNKNOWN,
+};
 static uint32_t num_reads = 0;                 // number of cards read by BLEKey
 
-static volatile uint64_t card_data = 0;        // incoming wiegand data stored here
-static volatile uint8_t bit_count = 0;         // number of bits in the incoming card
-static volatile bool data_incoming = false;    // true when data starts coming in
-static volatile bool data_ready = false;       // set when timer interrupt fires
-static volatile bool timer_started = false;    // if recv wiegand
-static volatile bool card_fubar = false;       // set if BLE screws up an incoming card
-static volatile bool start_tx = false;         // triggers sending of wiegand data
+// Time since boot in RTC1 ticks, extended from the 24 bit counter, which
+// wraps every 512s, by wiegand_task. Card times are in seconds, counted from
+// clock_boot_time once a client has set the clock.
+static uint32_t clock_rtc = 0;                 // RTC1 at the last clock update
+static uint64_t clock_ticks = 0;               // ticks since boot at the last clock update
+static uint32_t clock_boot_time = 0;           // Unix time at boot, 0 until the clock is set
+// Records stamped with a time since boot, new or read again, marked by
+// sequence number modulo CARD_STORE_MAX_RECORDS like the store's offsets,
+// until the clock is set. Records restored from flash are left unmarked,
+// their times since boot are from an earlier boot.
+static uint8_t clock_boot_marks[(CARD_STORE_MAX_RECORDS + 7) / 8];
+static volatile uint32_t clock_request = 0;    // Unix time a client wrote, for wiegand_task to set
+static volatile bool clock_requested = false;  // ... is clock_request
+
+// Edge events queued by the interrupt handlers for wiegand_task to decode.
+// Each entry is (type << 24) | 24 bits of payload, the TIMER2 timestamp for
+// all but EDGE_STAMP. GPIOTE and TIMER2 run at the same priority so there is
+// only ever one producer, and wiegand_task is the only consumer.
+typedef enum {
+    EDGE_DATA0,     // pulse on DATA0, a 0 bit
+    EDGE_DATA1,     // pulse on DATA1, a 1 bit
+    EDGE_LOST,      // pulse seen but its line is unknown, BLE delayed the read
+    EDGE_END,       // no pulse for the end of frame timeout, the frame is complete
+    EDGE_STAMP      // RTC1 counter as the next frame opened, queued ahead of its first pulse
+} edge_type_t;
+
+#define EDGE_ENTRY(type, payload) (((uint32_t)(type) << 24) | ((payload) & RTC_MASK))
+#define EDGE_TYPE(entry) ((edge_type_t)((entry) >> 24))
+#define EDGE_TS(entry) ((uint16_t)(entry))
+#define EDGE_RTC(entry) ((entry) & RTC_MASK)
+
+static volatile uint32_t edge_fifo[EDGE_FIFO_SIZE];
+static volatile uint8_t edge_head = 0;         // written by the ISRs only
+static volatile uint8_t edge_tail = 0;         // written by wiegand_task only
+static volatile uint16_t edge_last_ts = 0;     // timestamp of the newest pulse
+static volatile uint32_t edge_overflows = 0;   // events dropped because the fifo was full
+
+// PPI capture state, only touched from the GPIOTE and TIMER2 handlers
+static uint16_t capture_count = 0;             // TIMER1 edge count at the last drain
+static int16_t capture_balance = 0;            // edges counted but not yet seen as events
+
+// end of frame state, only touched from the GPIOTE and TIMER2 handlers
+static bool capture_frame_open = false;        // end of frame compare is armed
+static uint16_t edge_timeout = TIMER_DELAY;    // timeout armed for the newest pulse
+static uint16_t edge_gap_max = 0;              // longest gap between pulses in the open frame
+
+// end of frame timeout learnt by wiegand_task and read by the GPIOTE handler
+static volatile uint8_t eof_multiple = WIEGAND_EOF_MULTIPLE_DEFAULT; // 0 keeps TIMER_DELAY
+static volatile uint16_t eof_timeout = TIMER_DELAY;
+static uint16_t eof_interval = 0;              // longest gap between bits of recent cards
+static uint8_t eof_frames = 0;                 // cards learnt from, up to EOF_HISTORY
+static wiegand_eof_stats_t eof_stats = { .timeout_us = TIMER_DELAY };
+
+static volatile wiegand_capture_mode_t capture_mode = WIEGAND_CAPTURE_SENSE;
+static wiegand_capture_stats_t capture_stats[WIEGAND_CAPTURE_MODES];
+
+// frame being decoded, only touched from wiegand_task
+static uint8_t card_data[CARD_DATA_LEN];       // incoming wiegand data, first bit in the top of byte 0
+static uint16_t bit_count = 0;                 // number of bits in the incoming card
+static bool card_fubar = false;                // set if BLE screws up an incoming card
+static uint16_t frame_lost = 0;                // pulses in the frame with an unknown line
+static uint16_t frame_last_ts = 0;             // timestamp of the last bit in the frame
+static uint16_t frame_gap_max = 0;             // longest gap between bits in the frame
+static uint32_t frame_overflows = 0;           // edge_overflows seen by the decoder
+static uint64_t frame_ticks = 0;               // clock ticks when the frame's first pulse came in
+static uint32_t stamp_rtc = 0;                 // RTC1 of the newest EDGE_STAMP
+static bool stamp_pending = false;             // ... not yet taken by a frame
+
 static volatile bool ignore_reads = false;     // flag to ignore read cards
 
-static Wiegand_ctx *p_ctx;              // Struct to store card data
+// transmitter state. tx_card and tx_config are set up before the timer
+// starts and then only read by TIMER1_IRQHandler until tx_done is set.
+static Card tx_card;                           // card being sent
+static uint32_t tx_config[2];                  // GPIOTE CONFIG steering a pulse to DATA0_CTL/DATA1_CTL
+static volatile uint16_t tx_bit = 0;           // bit whose pulse is scheduled
+static volatile bool tx_busy = false;          // set from wiegand_tx_start until the inter-frame gap is over
+static volatile bool tx_done = false;          // set by TIMER1_IRQHandler after the last pulse
+static volatile bool tx_gap_over = false;      // set by the gap timer once the line has been quiet long enough
+static bool tx_holding = false;                // tx_busy only holds the line quiet before the next frame
+static uint16_t tx_gap_ms;                     // quiet time after the card being sent
+
+// Replay jobs, added from the BLE event handler and the main loop and taken
+// by wiegand_task. Adding holds off the application interrupts, so there is
+// only ever one producer at a time.
+static wiegand_tx_job_t tx_jobs[WIEGAND_TX_JOBS];
+static Card tx_job_frames[WIEGAND_TX_JOBS];    // tx_custom as it was when each WIEGAND_TX_CUSTOM job was added
+static bool tx_job_dos_marks[WIEGAND_TX_JOBS]; // the job replays a control card, the DoS follows it
+static volatile uint8_t tx_job_head = 0;       // written by wiegand_tx_job_add only
+static volatile uint8_t tx_job_tail = 0;       // written by wiegand_task only
+static wiegand_tx_job_t tx_job;                // job running
+static Card tx_job_frame;                      // ... and its frame if a custom one
+static bool tx_job_active = false;
+static uint8_t tx_job_left = 0;                // frames of tx_job still to start
+static wiegand_tx_job_status_t tx_job_status = { .card_idx = WIEGAND_TX_JOB_IDLE };
+static bool tx_job_dos = false;                // ... and its DoS mark
+
+// Named transmit timings. Most readers take anything from 20 to 100us
+// pulses every 200us to 20ms; "standard" is what the reference readers send.
+static wiegand_tx_profile_t tx_profiles[WIEGAND_TX_PROFILES] =
+{
+    [WIEGAND_TX_PROFILE_STANDARD] = { "standard", {  40, 2000,  50 } },
+    [WIEGAND_TX_PROFILE_FAST]     = { "fast",     {  20,  500,  20 } },
+    [WIEGAND_TX_PROFILE_SLOW]     = { "slow",     { 100, 5000, 100 } },
+    [WIEGAND_TX_PROFILE_CUSTOM]   = { "custom",   {  40, 2000,  50 } },
+};
+static uint8_t tx_profile = WIEGAND_TX_PROFILE_STANDARD;
+static app_timer_id_t tx_gap_timer_id;
+
+// loopback measurement, our own pulses as seen on the input pins
+static bool tx_loopback = false;               // measure the next transmissions
+static volatile bool tx_loopback_active = false;   // measuring the current one
+static uint16_t loop_fall_ts[2];               // start of the pulse in progress on each line
+static bool loop_fall_pending[2];
+static uint16_t loop_last_end;                 // end of the previous pulse on either line
+static bool loop_last_valid;
+static uint32_t loop_pulse_sum;
+static uint32_t loop_period_sum;
+static uint16_t loop_periods;
+static wiegand_tx_measure_t tx_measure;
+
+static wiegand_evt_handler_t evt_handler = NULL;
+
+static card_store_t *p_store;           // cards read, kept for BLE and replay
 
 static app_timer_id_t dos_timer_id;
 // static value that needs to be prepended to HID Prox cards
@@ -77,10 +228,15 @@ void dos_timer_handler(void * p_context)
     printf("timer off - DoS complete...\r\n");
 }
 
-void wiegand_init(Wiegand_ctx *ctx)
+void tx_gap_timer_handler(void * p_context)
+{
+    tx_gap_over = true;
+}
+
+void wiegand_init(card_store_t *store)
 {
     uint32_t err_code;
-    p_ctx = ctx;
+    p_store = store;
 
     retarget_init(); // retarget printf to UART pins 9(tx) and 11(rx)
     printf("Initializing wiegand stuff...\r\n");
@@ -92,18 +248,16 @@ void wiegand_init(Wiegand_ctx *ctx)
     nrf_gpio_pin_clear(DATA1_CTL);
 
     printf("Pin interrupts...");
-    // Set up GPIO and pin interrupts
-    nrf_gpio_cfg_sense_input(DATA0_IN, NRF_GPIO_PIN_NOPULL, NRF_GPIO_PIN_SENSE_LOW);
-    nrf_gpio_cfg_sense_input(DATA1_IN, NRF_GPIO_PIN_NOPULL, NRF_GPIO_PIN_SENSE_LOW);
-    // Set the GPIOTE PORT event as interrupt source, and enable interrupts for GPIOTE
-    NRF_GPIOTE->INTENSET = GPIOTE_INTENSET_PORT_Msk;
+    // the capture mode picks the GPIOTE interrupt sources, see wiegand_capture_mode_set
     sd_nvic_SetPriority(GPIOTE_IRQn, 1);
     sd_nvic_ClearPendingIRQ(GPIOTE_IRQn);
     err_code = sd_nvic_EnableIRQ(GPIOTE_IRQn);
     check_err(err_code);
 
     printf("Timers...");
-    // set up timer 2
+    // set up timer 2, it timestamps pulses and times out the end of a card.
+    // it runs at the GPIOTE priority so the two handlers never preempt
+    // each other while queueing edges.
     // adapted from https://github.com/NordicSemiconductor/nrf51-TIMER-examples/blob/master/timer_example_timer_mode/main.c
     // and https://devzone.nordicsemi.com/question/6278/setting-timer2-interval/
     NRF_TIMER2->MODE = TIMER_MODE_MODE_Timer;  // Set the timer in Timer mode
@@ -114,78 +268,646 @@ void wiegand_init(Wiegand_ctx *ctx)
     // Enable interrupt on Timer 2 for CC[0]
     NRF_TIMER2->INTENSET = TIMER_INTENSET_COMPARE0_Enabled << TIMER_INTENSET_COMPARE0_Pos;
     sd_nvic_ClearPendingIRQ(TIMER2_IRQn);
-    sd_nvic_SetPriority(TIMER2_IRQn, 3);
+    sd_nvic_SetPriority(TIMER2_IRQn, 1);
     err_code = sd_nvic_EnableIRQ(TIMER2_IRQn);
     check_err(err_code);
 
+    // timer 1 counts pulses on both lines in PPI capture mode, so pulses
+    // whose events got merged before the handler ran are still noticed.
+    // the transmitter borrows it to time pulses.
+    NRF_TIMER1->MODE = TIMER_MODE_MODE_Counter;
+    NRF_TIMER1->BITMODE = TIMER_BITMODE_BITMODE_16Bit;
+    NRF_TIMER1->TASKS_CLEAR = 1;
+    sd_nvic_ClearPendingIRQ(TIMER1_IRQn);
+    sd_nvic_SetPriority(TIMER1_IRQn, 1);
+    err_code = sd_nvic_EnableIRQ(TIMER1_IRQn);
+    check_err(err_code);
+
+    printf("Tx PPI...");
+    err_code = sd_ppi_channel_assign(PPI_CH_TX_START,
+                                     &NRF_TIMER1->EVENTS_COMPARE[0],
+                                     &NRF_GPIOTE->TASKS_OUT[GPIOTE_CH_TX]);
+    err_code |= sd_ppi_channel_assign(PPI_CH_TX_END,
+                                      &NRF_TIMER1->EVENTS_COMPARE[1],
+                                      &NRF_GPIOTE->TASKS_OUT[GPIOTE_CH_TX]);
+    check_err(err_code);
+
+    printf("Capture mode %d...", WIEGAND_CAPTURE_DEFAULT);
+    err_code = wiegand_capture_mode_set(WIEGAND_CAPTURE_DEFAULT);
+    check_err(err_code);
+
     printf("Configuring app timer for DoS function...\r\n");
     err_code = app_timer_create(&dos_timer_id,
             APP_TIMER_MODE_REPEATED,
             dos_timer_handler);
     check_err(err_code);
 
+    printf("Tx gap timer...");
+    err_code = app_timer_create(&tx_gap_timer_id,
+            APP_TIMER_MODE_SINGLE_SHOT,
+            tx_gap_timer_handler);
+    check_err(err_code);
+
     printf("Done, happy pwning.\r\n");
 }
 
-void add_card(uint64_t *data, uint8_t len)
+// GPIOTE event configuration for a data input
+static uint32_t capture_config(uint8_t pin, uint32_t polarity)
+{
+    return (GPIOTE_CONFIG_MODE_Event << GPIOTE_CONFIG_MODE_Pos)
+         | (pin << GPIOTE_CONFIG_PSEL_Pos)
+         | (polarity << GPIOTE_CONFIG_POLARITY_Pos);
+}
+
+/*
+ * Switches how pulses are captured. SENSE mode only needs the GPIO DETECT
+ * signal and keeps the 16 MHz clock off between cards, but every pulse has
+ * to be read from the pins before it ends. PPI mode timestamps and counts
+ * the pulses in hardware, so the handler can be held off by the SoftDevice
+ * for a whole radio event without losing a bit.
+ */
+uint32_t wiegand_capture_mode_set(wiegand_capture_mode_t mode)
+{
+    uint32_t err_code = NRF_SUCCESS;
+
+    if (tx_busy) {
+        return NRF_ERROR_BUSY;      // TIMER1 is in use by the transmitter
+    }
+
+    // park both capture paths first
+    NRF_GPIOTE->INTENCLR = GPIOTE_INTENCLR_PORT_Msk | GPIOTE_INTENCLR_IN0_Msk | GPIOTE_INTENCLR_IN1_Msk;
+    err_code |= sd_ppi_channel_enable_clr(PPI_CAPTURE_MSK);
+    NRF_GPIOTE->CONFIG[GPIOTE_CH_DATA0] = 0;
+    NRF_GPIOTE->CONFIG[GPIOTE_CH_DATA1] = 0;
+    NRF_TIMER1->TASKS_STOP = 1;
+    NRF_TIMER2->TASKS_STOP = 1;
+    NRF_TIMER2->TASKS_CLEAR = 1;
+    NRF_TIMER2->EVENTS_COMPARE[0] = 0;
+    edge_last_ts = 0;
+    capture_frame_open = false;
+
+    if (mode == WIEGAND_CAPTURE_PPI)
+    {
+        nrf_gpio_cfg_input(DATA0_IN, NRF_GPIO_PIN_NOPULL);
+        nrf_gpio_cfg_input(DATA1_IN, NRF_GPIO_PIN_NOPULL);
+        NRF_GPIOTE->CONFIG[GPIOTE_CH_DATA0] = capture_config(DATA0_IN, GPIOTE_CONFIG_POLARITY_HiToLo);
+        NRF_GPIOTE->CONFIG[GPIOTE_CH_DATA1] = capture_config(DATA1_IN, GPIOTE_CONFIG_POLARITY_HiToLo);
+        NRF_GPIOTE->EVENTS_IN[GPIOTE_CH_DATA0] = 0;
+        NRF_GPIOTE->EVENTS_IN[GPIOTE_CH_DATA1] = 0;
+
+        err_code |= sd_ppi_channel_assign(PPI_CH_DATA0_TS,
+                                          &NRF_GPIOTE->EVENTS_IN[GPIOTE_CH_DATA0],
+                                          &NRF_TIMER2->TASKS_CAPTURE[1]);
+        err_code |= sd_ppi_channel_assign(PPI_CH_DATA1_TS,
+                                          &NRF_GPIOTE->EVENTS_IN[GPIOTE_CH_DATA1],
+                                          &NRF_TIMER2->TASKS_CAPTURE[2]);
+        err_code |= sd_ppi_channel_assign(PPI_CH_DATA0_CNT,
+                                          &NRF_GPIOTE->EVENTS_IN[GPIOTE_CH_DATA0],
+                                          &NRF_TIMER1->TASKS_COUNT);
+        err_code |= sd_ppi_channel_assign(PPI_CH_DATA1_CNT,
+                                          &NRF_GPIOTE->EVENTS_IN[GPIOTE_CH_DATA1],
+                                          &NRF_TIMER1->TASKS_COUNT);
+        err_code |= sd_ppi_channel_enable_set(PPI_CAPTURE_MSK);
+
+        NRF_TIMER1->TASKS_CLEAR = 1;
+        NRF_TIMER1->TASKS_START = 1;
+        capture_count = 0;
+        capture_balance = 0;
+
+        // the capture timebase free runs, the end of frame compare is only
+        // armed while a frame is open
+        NRF_TIMER2->INTENCLR = TIMER_INTENCLR_COMPARE0_Msk;
+        capture_frame_open = false;
+        NRF_TIMER2->TASKS_START = 1;
+
+        NRF_GPIOTE->INTENSET = GPIOTE_INTENSET_IN0_Msk | GPIOTE_INTENSET_IN1_Msk;
+    }
+    else
+    {
+        tx_loopback = false;        // needs the PPI timestamps
+        // Set up GPIO and pin interrupts
+        nrf_gpio_cfg_sense_input(DATA0_IN, NRF_GPIO_PIN_NOPULL, NRF_GPIO_PIN_SENSE_LOW);
+        nrf_gpio_cfg_sense_input(DATA1_IN, NRF_GPIO_PIN_NOPULL, NRF_GPIO_PIN_SENSE_LOW);
+        NRF_TIMER2->INTENSET = TIMER_INTENSET_COMPARE0_Msk;
+        // Set the GPIOTE PORT event as interrupt source
+        NRF_GPIOTE->EVENTS_PORT = 0;
+        NRF_GPIOTE->INTENSET = GPIOTE_INTENSET_PORT_Msk;
+    }
+    capture_mode = mode;
+
+    return err_code;
+}
+
+wiegand_capture_mode_t wiegand_capture_mode_get(void)
+{
+    return capture_mode;
+}
+
+const wiegand_capture_stats_t *wiegand_capture_stats_get(wiegand_capture_mode_t mode)
+{
+    return &capture_stats[mode];
+}
+
+/*
+ * Works out the end of frame timeout from what has been learnt so far. Until
+ * EOF_HISTORY cards have been seen the fixed TIMER_DELAY is used.
+ */
+static void eof_update(void)
+{
+    uint32_t timeout = TIMER_DELAY;
+
+    if (eof_multiple && eof_frames >= EOF_HISTORY) {
+        timeout = (uint32_t)eof_interval * eof_multiple;
+        timeout = timeout < EOF_TIMEOUT_MIN ? EOF_TIMEOUT_MIN : timeout;
+        timeout = timeout > TIMER_DELAY ? TIMER_DELAY : timeout;
+    }
+    eof_timeout = timeout;
+    eof_stats.interval_us = eof_interval;
+    eof_stats.timeout_us = timeout;
+}
+
+/*
+ * Learns the gap between bits from a card that decoded cleanly. A longer gap
+ * is taken at once, a shorter one only gradually, so one quick card does not
+ * cut the next slow one short.
+ */
+static void eof_learn(uint16_t gap_max)
+{
+    if (eof_frames == 0 || gap_max > eof_interval) {
+        eof_interval = gap_max;
+    } else {
+        eof_interval -= (eof_interval - gap_max) >> 2;
+    }
+    if (eof_frames < EOF_HISTORY) {
+        eof_frames++;
+    }
+    eof_update();
+}
+
+/*
+ * Sets how many times the learnt gap between bits the lines have to be quiet
+ * for a frame to end. 0 always waits the fixed TIMER_DELAY.
+ */
+uint32_t wiegand_eof_multiple_set(uint8_t multiple)
+{
+    if (multiple && (multiple < WIEGAND_EOF_MULTIPLE_MIN || multiple > WIEGAND_EOF_MULTIPLE_MAX)) {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    eof_multiple = multiple;
+    eof_update();
+    return NRF_SUCCESS;
+}
+
+uint8_t wiegand_eof_multiple_get(void)
+{
+    return eof_multiple;
+}
+
+const wiegand_eof_stats_t *wiegand_eof_stats_get(void)
+{
+    return &eof_stats;
+}
+
+static void print_card(const Card *card);
+
+void wiegand_evt_handler_set(wiegand_evt_handler_t handler)
+{
+    evt_handler = handler;
+}
+
+/*
+ * Picks the timing used by the next transmission. p_timing is only read for
+ * WIEGAND_TX_PROFILE_CUSTOM, the other profiles are fixed.
+ */
+uint32_t wiegand_tx_profile_set(uint8_t profile, const wiegand_tx_timing_t *p_timing)
+{
+    if (profile >= WIEGAND_TX_PROFILES) {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    if (profile == WIEGAND_TX_PROFILE_CUSTOM) {
+        // the pulse has to end before the period does, and leave the
+        // handler at least a pulse width to pick the next line
+        if (p_timing == NULL || p_timing->pulse_us < TX_PULSE_MIN_US ||
+            p_timing->period_us < TX_LEAD_US + 2 * (uint32_t)p_timing->pulse_us ||
+            p_timing->gap_ms < TX_GAP_MIN_MS || p_timing->gap_ms > TX_GAP_MAX_MS) {
+            return NRF_ERROR_INVALID_PARAM;
+        }
+        tx_profiles[WIEGAND_TX_PROFILE_CUSTOM].timing = *p_timing;
+    }
+    tx_profile = profile;
+    return NRF_SUCCESS;
+}
+
+uint8_t wiegand_tx_profile_get(wiegand_tx_timing_t *p_timing)
+{
+    if (p_timing) {
+        *p_timing = tx_profiles[tx_profile].timing;
+    }
+    return tx_profile;
+}
+
+const wiegand_tx_profile_t *wiegand_tx_profile_info(uint8_t profile)
 {
-    // add card to store
-    p_ctx->card_store[num_reads].bit_len = len;
-    // zero out old data to avoid garbage data from longer cards
-    memset(p_ctx->card_store[num_reads].data, 0, CARD_DATA_LEN);
-    memcpy(p_ctx->card_store[num_reads].data, data, CARD_DATA_LEN);
-    p_ctx->card_count++;
+    return profile < WIEGAND_TX_PROFILES ? &tx_profiles[profile] : NULL;
 }
 
 /*
- * Sends data out on the Wiegand lines
+ * Measures the following transmissions on the input pins. The Wiegand lines
+ * are shared with the reader, so our own pulses show up on DATA0_IN and
+ * DATA1_IN and are timestamped by the PPI capture path.
  */
+uint32_t wiegand_tx_loopback_set(bool enable)
+{
+    if (enable && capture_mode != WIEGAND_CAPTURE_PPI) {
+        return NRF_ERROR_INVALID_STATE;
+    }
+    tx_loopback = enable;
+    return NRF_SUCCESS;
+}
+
+bool wiegand_tx_loopback_get(void)
+{
+    return tx_loopback;
+}
+
+const wiegand_tx_measure_t *wiegand_tx_measure_get(void)
+{
+    return &tx_measure;
+}
+
+/*
+ * Sends a card out on the Wiegand lines without blocking. TIMER1 runs one
+ * bit period per cycle: COMPARE[0] and COMPARE[1] toggle a GPIOTE task
+ * channel over PPI to make the pulse, COMPARE[2] clears the timer for the
+ * next bit. The timer stops at the end of each pulse until TIMER1_IRQHandler
+ * has pointed the channel at DATA0_CTL or DATA1_CTL for the next bit, so a
+ * late interrupt stretches the gap between pulses instead of sending a bit
+ * on the wrong line. WIEGAND_EVT_TX_DONE is sent from wiegand_task once the
+ * last pulse is out and the profile's inter-frame gap has passed.
+ */
+uint32_t wiegand_tx_start(const Card *card)
+{
+    const wiegand_tx_timing_t *timing = &tx_profiles[tx_profile].timing;
+
+    if (card->bit_len == 0 || card->bit_len > WIEGAND_MAX_BITS) {
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    if (tx_busy) {
+        return NRF_ERROR_BUSY;
+    }
+    tx_busy = true;
+    tx_done = false;
+    tx_gap_over = false;
+    tx_gap_ms = timing->gap_ms;
+    ignore_reads = true;        // we'd only read back our own pulses
+
+    if (tx_loopback) {
+        memset(&tx_measure, 0, sizeof(tx_measure));
+        tx_measure.pulse_min_us = UINT16_MAX;
+        tx_measure.period_min_us = UINT16_MAX;
+        loop_fall_pending[0] = false;
+        loop_fall_pending[1] = false;
+        loop_last_valid = false;
+        loop_pulse_sum = 0;
+        loop_period_sum = 0;
+        loop_periods = 0;
+        // see both edges of each pulse
+        NRF_GPIOTE->CONFIG[GPIOTE_CH_DATA0] = capture_config(DATA0_IN, GPIOTE_CONFIG_POLARITY_Toggle);
+        NRF_GPIOTE->CONFIG[GPIOTE_CH_DATA1] = capture_config(DATA1_IN, GPIOTE_CONFIG_POLARITY_Toggle);
+        NRF_GPIOTE->EVENTS_IN[GPIOTE_CH_DATA0] = 0;
+        NRF_GPIOTE->EVENTS_IN[GPIOTE_CH_DATA1] = 0;
+        tx_loopback_active = true;
+    }
+
+    tx_card = *card;
+    tx_bit = 0;
+    for (uint8_t bit = 0; bit < 2; bit++) {
+        tx_config[bit] = (GPIOTE_CONFIG_MODE_Task << GPIOTE_CONFIG_MODE_Pos)
+                       | ((bit ? DATA1_CTL : DATA0_CTL) << GPIOTE_CONFIG_PSEL_Pos)
+                       | (GPIOTE_CONFIG_POLARITY_Toggle << GPIOTE_CONFIG_POLARITY_Pos)
+                       | (GPIOTE_CONFIG_OUTINIT_Low << GPIOTE_CONFIG_OUTINIT_Pos);
+    }
+    NRF_GPIOTE->CONFIG[GPIOTE_CH_TX] = tx_config[CARD_BIT(&tx_card, 0)];
+
+    NRF_TIMER1->TASKS_STOP = 1;
+    NRF_TIMER1->MODE = TIMER_MODE_MODE_Timer;
+    NRF_TIMER1->PRESCALER = 4;  // 1MHz
+    NRF_TIMER1->TASKS_CLEAR = 1;
+    NRF_TIMER1->CC[0] = TX_LEAD_US;
+    NRF_TIMER1->CC[1] = TX_LEAD_US + timing->pulse_us;
+    NRF_TIMER1->CC[2] = timing->period_us;
+    NRF_TIMER1->SHORTS = TIMER_SHORTS_COMPARE1_STOP_Msk | TIMER_SHORTS_COMPARE2_CLEAR_Msk;
+    NRF_TIMER1->EVENTS_COMPARE[0] = 0;
+    NRF_TIMER1->EVENTS_COMPARE[1] = 0;
+    NRF_TIMER1->INTENSET = TIMER_INTENSET_COMPARE1_Msk;
+    sd_ppi_channel_enable_set(PPI_TX_MSK);
+    NRF_TIMER1->TASKS_START = 1;
+
+    return NRF_SUCCESS;
+}
+
+bool wiegand_tx_busy(void)
+{
+    return tx_busy;
+}
+
+// true from the first pulse of a card until wiegand_task has decoded it
+bool wiegand_rx_busy(void)
+{
+    return capture_frame_open || bit_count > 0 || edge_tail != edge_head;
+}
+
+/*
+ * Stops the transmitter once the last pulse is out and starts the
+ * inter-frame gap
+ */
+static void tx_finish(void)
+{
+    sd_ppi_channel_enable_clr(PPI_TX_MSK);
+    NRF_TIMER1->INTENCLR = TIMER_INTENCLR_COMPARE1_Msk;
+    NRF_TIMER1->SHORTS = 0;
+    app_timer_start(tx_gap_timer_id, APP_TIMER_TICKS(tx_gap_ms, 0), NULL);
+}
+
+/*
+ * The line has been quiet for the inter-frame gap. Hands TIMER1 back to the
+ * capture path, the last edge of the loopback measurement being in by now.
+ */
+static void tx_complete(void)
+{
+    wiegand_evt_t evt;
+
+    NRF_TIMER1->MODE = TIMER_MODE_MODE_Counter;
+    NRF_TIMER1->TASKS_CLEAR = 1;
+    capture_count = 0;
+    capture_balance = 0;
+    if (tx_loopback_active) {
+        tx_loopback_active = false;
+        NRF_GPIOTE->CONFIG[GPIOTE_CH_DATA0] = capture_config(DATA0_IN, GPIOTE_CONFIG_POLARITY_HiToLo);
+        NRF_GPIOTE->CONFIG[GPIOTE_CH_DATA1] = capture_config(DATA1_IN, GPIOTE_CONFIG_POLARITY_HiToLo);
+        NRF_GPIOTE->EVENTS_IN[GPIOTE_CH_DATA0] = 0;
+        NRF_GPIOTE->EVENTS_IN[GPIOTE_CH_DATA1] = 0;
+    }
+    if (capture_mode == WIEGAND_CAPTURE_PPI) {
+        NRF_TIMER1->TASKS_START = 1;
+    }
+    ignore_reads = false;
+    tx_busy = false;
 
-void tx_wiegand(uint64_t data, uint8_t size)
+    printf("Tx %d bits: ", tx_card.bit_len);
+    print_card(&tx_card);
+    printf(", Wiegandses pwned!\r\n");
+
+    if (tx_loopback) {
+        if (tx_measure.pulses) {
+            tx_measure.pulse_avg_us = loop_pulse_sum / tx_measure.pulses;
+        }
+        if (loop_periods) {
+            tx_measure.period_avg_us = loop_period_sum / loop_periods;
+        }
+        printf("Loopback: %d pulses, %d missed, width %d-%d us (avg %d), period %d-%d us (avg %d)\r\n",
+               tx_measure.pulses, tx_measure.missed,
+               tx_measure.pulse_min_us, tx_measure.pulse_max_us, tx_measure.pulse_avg_us,
+               tx_measure.period_min_us, tx_measure.period_max_us, tx_measure.period_avg_us);
+    }
+
+    if (evt_handler) {
+        evt.evt_type = WIEGAND_EVT_TX_DONE;
+        evt.bit_len = tx_card.bit_len;
+        evt_handler(&evt);
+    }
+}
+
+// prints the card data in hex
+static void print_card(const Card *card)
 {
-    // this turns off application interrupts (not softdevice)
-    for (uint8_t i = size; i-- > 0;)
+    printf("0x");
+    for (uint8_t i = 0; i < CARD_BYTES(card->bit_len); i++)
     {
-        // wiegand pulses should be ~40us, there should be ~2.025ms
-        // between each pulse...correcting for fubar nrf delay here.
-        uint8_t bit = GETBIT(data, i);
-        bit ? nrf_gpio_pin_set(DATA1_CTL) : nrf_gpio_pin_set(DATA0_CTL);
-        nrf_delay_us(26);
-        bit ? nrf_gpio_pin_clear(DATA1_CTL) : nrf_gpio_pin_clear(DATA0_CTL);
-        nrf_delay_us(1380);
+        printf("%02x", card->data[i]);
     }
 }
 
+// starts sending card, checked and logged first
+static uint32_t card_send(const Card *card)
+{
+    uint32_t err_code;
+
+    if (card->bit_len > WIEGAND_MAX_BITS) {
+        printf("data of %d bits is too long\r\n", card->bit_len);
+        return NRF_ERROR_INVALID_PARAM;
+    }
+    printf("data ");
+    print_card(card);
+    printf(" and len is %d\r\n", card->bit_len);
+    err_code = wiegand_tx_start(card);
+    if (err_code != NRF_SUCCESS) {
+        printf("Tx not started, error %ld\r\n", err_code);
+    }
+    return err_code;
+}
+
+// queues a replay job, with the DoS to follow it if dos
+static uint32_t tx_job_push(const wiegand_tx_job_t *p_job, bool dos)
+{
+    uint32_t err_code = NRF_SUCCESS;
+    uint8_t is_nested;
+    uint8_t head;
+    uint8_t next;
+
+    // the BLE events add jobs too, neither may see the other's head half written
+    sd_nvic_critical_region_enter(&is_nested);
+    head = tx_job_head;
+    next = (head + 1) & (WIEGAND_TX_JOBS - 1);
+    if (next == tx_job_tail) {
+        tx_job_status.rejected++;
+        err_code = NRF_ERROR_NO_MEM;
+    } else {
+        tx_jobs[head] = *p_job;
+        if (p_job->card_idx == WIEGAND_TX_CUSTOM) {
+            // the client may upload the next frame before this one goes out
+            tx_job_frames[head] = tx_custom;
+        }
+        tx_job_dos_marks[head] = dos;
+        tx_job_head = next;
+    }
+    sd_nvic_critical_region_exit(is_nested);
+    return err_code;
+}
+
 /*
- * Utility function for starting Wiegand transmission
+ * Queues a replay job. Safe from the BLE event handler and the main loop
+ * alike, the job starts from wiegand_task once the transmitter is free.
  */
+uint32_t wiegand_tx_job_add(const wiegand_tx_job_t *p_job)
+{
+    return tx_job_push(p_job, false);
+}
+
+/*
+ * Queues the frame the client uploaded to wiegand_tx_custom_get once its
+ * length is in, data_len the bytes of data it wrote and len_whole false if
+ * it wrote only part of the length. A frame its data does not cover, or
+ * longer than WIEGAND_MAX_BITS, would go out with what an earlier upload
+ * left behind; it is not queued but ends as a failed job instead. Safe from
+ * the BLE event handler like wiegand_tx_job_add.
+ */
+uint32_t wiegand_tx_custom_add(uint16_t data_len, bool len_whole)
+{
+    wiegand_tx_job_t job = { .card_idx = WIEGAND_TX_CUSTOM, .repeat = 1, .gap_ms = 0 };
+    uint16_t bit_len = tx_custom.bit_len;
+    uint8_t is_nested;
+
+    if (!len_whole || bit_len == 0 || bit_len > WIEGAND_MAX_BITS || CARD_BYTES(bit_len) > data_len) {
+        sd_nvic_critical_region_enter(&is_nested);
+        tx_job_status.failed++;
+        tx_job_status.last_err = NRF_ERROR_INVALID_LENGTH;
+        sd_nvic_critical_region_exit(is_nested);
+        return NRF_ERROR_INVALID_LENGTH;
+    }
+    // nothing of a longer frame before it goes out with this one
+    memset(&tx_custom.data[CARD_BYTES(bit_len)], 0, CARD_DATA_LEN - CARD_BYTES(bit_len));
+    return tx_job_push(&job, false);
+}
+
+/*
+ * Keeps the line quiet for ms before the next frame starts, unless a frame
+ * is going out already, its gap keeps it quiet then
+ */
+static void tx_hold(uint16_t ms)
+{
+    if (tx_busy) {
+        return;
+    }
+    tx_busy = true;
+    tx_holding = true;
+    app_timer_start(tx_gap_timer_id, APP_TIMER_TICKS(ms, 0), NULL);
+}
+
+// holds the Wiegand lines low for 20 seconds
+static void dos_start(void)
+{
+    printf("DoS Wiegand for 20 seconds...\r\n");
+    //sd_nvic_DisableIRQ(GPIOTE_IRQn);
+    nrf_gpio_pin_set(DATA0_CTL);
+    nrf_gpio_pin_set(DATA1_CTL);
+    app_timer_start(dos_timer_id, APP_TIMER_TICKS(20000, 0), NULL);
+}
+
+const wiegand_tx_job_status_t *wiegand_tx_job_status_get(void)
+{
+    tx_job_status.queued = (tx_job_head - tx_job_tail) & (WIEGAND_TX_JOBS - 1);
+    tx_job_status.left = tx_job_active ? tx_job_left : 0;
+    tx_job_status.card_idx = tx_job_active ? tx_job.card_idx : WIEGAND_TX_JOB_IDLE;
+    return &tx_job_status;
+}
+
+static void tx_job_end(uint32_t err_code)
+{
+    wiegand_evt_t evt;
+    uint8_t is_nested;
+
+    tx_job_active = false;
+    tx_job_left = 0;
+    if (tx_job_dos) {
+        // the control card's replay, the DoS follows once it is out
+        tx_job_dos = false;
+        if (err_code == NRF_SUCCESS) {
+            dos_start();
+        }
+    }
+    // wiegand_tx_custom_add ends jobs from the BLE events too
+    sd_nvic_critical_region_enter(&is_nested);
+    tx_job_status.last_err = err_code;
+    if (err_code == NRF_SUCCESS) {
+        tx_job_status.done++;
+    } else {
+        tx_job_status.failed++;
+    }
+    sd_nvic_critical_region_exit(is_nested);
+    if (evt_handler) {
+        memset(&evt, 0, sizeof(evt));
+        evt.evt_type = WIEGAND_EVT_JOB_DONE;
+        evt_handler(&evt);
+    }
+}
 
-void send_wiegand(uint8_t card_idx)
+// starts the next frame of the running job, or the next job, if the line is free
+static void tx_job_run(void)
 {
-    uint64_t data;
-    uint8_t bit_len;
-    ignore_reads = true;
+    while (!tx_busy) {
+        uint32_t err_code;
+
+        if (!tx_job_active) {
+            if (tx_job_tail == tx_job_head) {
+                return;
+            }
+            tx_job = tx_jobs[tx_job_tail];
+            if (tx_job.card_idx == WIEGAND_TX_CUSTOM) {
+                tx_job_frame = tx_job_frames[tx_job_tail];
+            }
+            tx_job_dos = tx_job_dos_marks[tx_job_tail];
+            tx_job_tail = (tx_job_tail + 1) & (WIEGAND_TX_JOBS - 1);
+            tx_job_left = tx_job.repeat ? tx_job.repeat : 1;
+            tx_job_active = true;
+        }
+        if (tx_job.card_idx == WIEGAND_TX_CUSTOM) {
+            err_code = card_send(&tx_job_frame);
+        } else {
+            err_code = send_wiegand(tx_job.card_idx);
+        }
+        if (err_code == NRF_SUCCESS) {
+            tx_job_left--;
+            if (tx_job.gap_ms > tx_gap_ms) {
+                tx_gap_ms = tx_job.gap_ms;
+            }
+            return;
+        }
+        // a card that will not start now will not later either
+        tx_job_end(err_code);
+    }
+}
+
+Card *wiegand_tx_custom_get(void)
+{
+    return &tx_custom;
+}
+
+uint32_t send_wiegand(uint8_t card_idx)
+{
+    Card stored;
+    const Card *card = &stored;
     printf("got card %d from BLE\r\n", card_idx);
     switch(card_idx){
-        case 255:
+        case WIEGAND_TX_LAST:
             // replay last card
-            data = last_card;
-            bit_len = last_size;
+            card = &last_card;
             break;
-        case 254:
-            // do something to replay custom data.
-            data = 0;
-            bit_len = 0;
+        case WIEGAND_TX_CUSTOM:
+            // the frame as the client uploaded it, wiegand_tx_start takes its own copy
+            card = &tx_custom;
             break;
         default:
-            // replay a card in the struct
-            bit_len = p_ctx->card_store[card_idx].bit_len;
-            memcpy(&data, p_ctx->card_store[card_idx].data, CARD_DATA_LEN);
+            // replay a card in the store
+            if (card_store_get(p_store, card_idx, &stored) != NRF_SUCCESS) {
+                stored.bit_len = 0;
+            }
     }
-    printf("data %llx and len is %d\r\n", data, bit_len);
-    tx_wiegand(data, bit_len);
-    printf("data sent\r\n");
-    ignore_reads = false;
+    return card_send(card);
+}
+
+/*
+ * Card value as an integer, for cards of up to 64 bits
+ */
+static uint64_t card_value(const Card *card)
+{
+    uint64_t value = 0;
+
+    for (uint8_t i = 0; i < CARD_BYTES(card->bit_len); i++)
+    {
+        value = (value << 8) | card->data[i];
+    }
+    return value;
 }
 
 /*
@@ -194,6 +916,9 @@ void send_wiegand(uint8_t card_idx)
  */
 uint64_t pad_card(uint64_t data, uint8_t size)
 {
+    if (size > MAX_LEN) {
+        return data;
+    }
     uint8_t pad_len = (MAX_LEN - size);
     uint64_t card_val = padding[pad_len];
     card_val <<= size;
@@ -201,69 +926,348 @@ uint64_t pad_card(uint64_t data, uint8_t size)
     return card_val;
 }
 
-void wiegand_task(void)
+/*
+ * Queue an edge event, called from interrupt context only
+ */
+static void edge_push(edge_type_t type, uint32_t payload)
+{
+    uint8_t head = edge_head;
+    uint8_t next = (head + 1) & EDGE_FIFO_MASK;
+
+    if (next == edge_tail) {
+        edge_overflows++;
+        return;
+    }
+    edge_fifo[head] = EDGE_ENTRY(type, payload);
+    edge_head = next;
+}
+
+/*
+ * Stamps a frame opening with the RTC1 counter. This is the only clock read
+ * the ISRs make, wiegand_task turns it into a time.
+ */
+static void stamp_push(void)
+{
+    uint32_t rtc;
+
+    app_timer_cnt_get(&rtc);
+    edge_push(EDGE_STAMP, rtc);
+}
+
+/*
+ * Brings the clock up to date. The main loop wakes up more often than every
+ * 512s for the battery timer, so the counter never wraps twice in between.
+ */
+static void clock_update(void)
+{
+    uint32_t rtc;
+
+    app_timer_cnt_get(&rtc);
+    clock_ticks += (rtc - clock_rtc) & RTC_MASK;
+    clock_rtc = rtc;
+}
+
+/*
+ * Ticks since boot for an RTC1 reading from within 256s either side of the
+ * last clock update
+ */
+static uint64_t clock_ticks_at(uint32_t rtc)
+{
+    int32_t delta = (int32_t)(((rtc - clock_rtc) & RTC_MASK) << 8) >> 8;
+
+    return clock_ticks + delta;
+}
+
+// card time of a tick count, see WIEGAND_TIME_UNIX
+static uint32_t clock_time(uint64_t ticks)
+{
+    return clock_boot_time + (uint32_t)(ticks / RTC_HZ);
+}
+
+uint64_t wiegand_clock_ticks(void)
+{
+    clock_update();
+    return clock_ticks;
+}
+
+uint32_t wiegand_clock_boot_time(void)
 {
-    if (start_tx && !timer_started) {
-        // send the data on the Wiegands
-        tx_wiegand(last_card, last_size);
-        printf("Tx %d bits: 0x%llx, Wiegandses pwned!\r\n", last_size, pad_card(last_card, last_size));
-        start_tx = false;
+    return clock_boot_time;
+}
+
+/*
+ * Sets the clock from the Unix time now. Cards stored since boot with times
+ * since boot are moved onto it, the event handler hears of each as
+ * WIEGAND_EVT_CARD_UPDATED. Setting it again only changes later times.
+ * Walks the store, so only from the main loop.
+ */
+uint32_t wiegand_clock_set(uint32_t unix_time)
+{
+    uint32_t boot_time;
+
+    clock_update();
+    if (unix_time < WIEGAND_TIME_UNIX || unix_time - WIEGAND_TIME_UNIX < clock_ticks / RTC_HZ) {
+        return NRF_ERROR_INVALID_PARAM;
     }
+    boot_time = unix_time - (uint32_t)(clock_ticks / RTC_HZ);
+    if (clock_boot_time == 0) {
+        // one pass over the records stored, only the marked ones are moved
+        for (uint32_t seq = p_store->first_seq; seq != card_store_next_seq(p_store); seq++) {
+            uint16_t slot = seq % CARD_STORE_MAX_RECORDS;
 
-    if (data_incoming && !timer_started) {
-        NRF_TIMER2->TASKS_START = 1;    // Start TIMER2
-        timer_started = true;
+            if ((clock_boot_marks[slot / 8] & (1 << (slot % 8))) &&
+                card_store_seen_shift(p_store, seq, WIEGAND_TIME_UNIX, boot_time) == NRF_SUCCESS &&
+                evt_handler) {
+                wiegand_evt_t evt = {
+                    .evt_type = WIEGAND_EVT_CARD_UPDATED,
+                    .seq = seq,
+                };
+                evt_handler(&evt);
+            }
+        }
+        memset(clock_boot_marks, 0, sizeof(clock_boot_marks));
     }
+    clock_boot_time = boot_time;
+    printf("Clock set, booted at %ld\r\n", boot_time);
+    return NRF_SUCCESS;
+}
 
-    if (data_ready) {
-        if (bit_count > 1 && !card_fubar)   // avoid garbage data at startup.
-        {
-            uint64_t proxmark_fmt = 0;  // proxmark formatted card
+/*
+ * Asks for the clock to be set to unix_time from wiegand_task, from the BLE
+ * event handler. A later request before then replaces it.
+ */
+void wiegand_clock_request(uint32_t unix_time)
+{
+    clock_request = unix_time;
+    clock_requested = true;
+}
+
+/*
+ * Handles a complete frame once the decoder has all of its bits
+ */
+static void frame_complete(void)
+{
+    wiegand_capture_stats_t *stats = &capture_stats[capture_mode];
+
+    if (eof_timeout < TIMER_DELAY && bit_count > 1) {
+        eof_stats.frames_early++;
+    }
+    if (bit_count >= EOF_LEARN_BITS && !card_fubar) {
+        eof_learn(frame_gap_max);
+    }
+
+    if (bit_count > 1)
+    {
+        stats->bits += bit_count - frame_lost;
+        stats->bits_lost += frame_lost;
+        card_fubar ? stats->frames_dropped++ : stats->frames++;
+    }
 
-            switch(card_data)
+    if (bit_count > 1 && !card_fubar)   // avoid garbage data at startup.
+    {
+        Card card = { .bit_len = bit_count };
+        wiegand_fields_t fields = { .format = WIEGAND_FORMAT_UNKNOWN };
+        const wiegand_format_t *format;
+
+        // move the bits to the bottom of the data so it reads as a big endian number
+        uint8_t len = CARD_BYTES(bit_count);
+        uint8_t shift = (8 - (bit_count & 7)) & 7;
+        for (uint8_t i = len; i-- > 0;) {
+            card.data[i] = (card_data[i] >> shift) | (i ? card_data[i - 1] << (8 - shift) : 0);
+        }
+        uint64_t value = bit_count <= 64 ? card_value(&card) : 0;
+
+        if (bit_count == 32 && value == CTL_CARD_1)
+        {
+            printf("Control card: deadbeef\r\n");
+            printf("Replay last card ");
+            print_card(&last_card);
+            printf("\r\n");
+            // a replay job like any other, after a quiet gap so the
+            // controller takes it as a card of its own; the DoS follows it,
+            // each control card read gets a replay and DoS of its own
+            wiegand_tx_job_t job = { .card_idx = WIEGAND_TX_LAST, .repeat = 1, .gap_ms = 0 };
+            if (tx_job_push(&job, true) == NRF_SUCCESS) {
+                tx_hold(CTL_REPLAY_LEAD_MS);
+            }
+        }
+        else if (bit_count == 32 && value == CTL_CARD_2)
+        {
+            printf("Control card baadf00d\r\n");
+            printf("Do something else...\r\n");
+        }
+        else
+        {
+            // print debug information to the serial terminal
+            printf("%ld. Rx %d bits: ", num_reads, bit_count);
+            for (uint16_t i = 0; i < bit_count; i++)
             {
-                case CTL_CARD_1:
-                    printf("Control card: deadbeef\r\n");
-                    printf("Replay last card %llx\r\n", last_card);
-                    nrf_delay_us(50000);
-                    send_wiegand(255);
-                    nrf_delay_us(50000);
-                    printf("DoS Wiegand for 20 seconds...\r\n");
-                    //sd_nvic_DisableIRQ(GPIOTE_IRQn);
-                    nrf_gpio_pin_set(DATA0_CTL);
-                    nrf_gpio_pin_set(DATA1_CTL);
-                    app_timer_start(dos_timer_id, APP_TIMER_TICKS(20000, 0), NULL);
-                    break;
-                case CTL_CARD_2:
-                    printf("Control card baadf00d\r\n");
-                    printf("Do something else...\r\n");
-                    break;
-                default:
-                    last_card = card_data;
-                    last_size = bit_count;
-                    // print debug information to the serial terminal
-                    printf("%ld. Rx %d bits: ", num_reads, bit_count);
-                    for (uint8_t i = last_size; i-- > 0;)
-                    {
-                        printf("%lld", GETBIT(last_card, i));
-                    }
-                    proxmark_fmt = pad_card(card_data, bit_count);
-                    printf( " Raw: 0x%llx Padded: 0x%llx\r\n", card_data, proxmark_fmt);
-                    // store the card's information for replay later
-                    // add card to struct for BLE transmission
-                    add_card(&proxmark_fmt, bit_count);
-                    num_reads++;
+                printf("%d", CARD_BIT(&card, i));
+            }
+            printf(" Raw: ");
+            print_card(&card);
+            if (bit_count <= MAX_LEN) {
+                // proxmark formatted card
+                printf(" Padded: 0x%llx", pad_card(value, bit_count));
+            }
+            printf("\r\n");
+            if (bit_count <= 64) {
+                wiegand_format_decode(value, bit_count, &fields);
             }
+            format = wiegand_format_get(fields.format);
+            if (format) {
+                printf("%s FC: %ld CN: %ld\r\n", format->name, fields.facility, fields.number);
+            } else {
+                printf("Unknown format or bad parity\r\n");
+            }
+            card.format = fields.format;
+            card.facility = fields.facility;
+            card.number = fields.number;
+            last_card = card;
+            // store the card's information for replay later
+            // add card to store for BLE transmission
+            uint32_t seq;
+            uint16_t hits;
+            if (card_store_add(p_store, &card, clock_time(frame_ticks), &seq, &hits) != NRF_SUCCESS) {
+                printf("Card store full, %d bit card not stored\r\n", card.bit_len);
+            } else {
+                if (hits > 1) {
+                    printf("Seen %d times\r\n", hits);
+                }
+                if (clock_boot_time == 0) {
+                    uint16_t slot = seq % CARD_STORE_MAX_RECORDS;
 
-            //reset vars for next read
-            data_incoming = false;
-            timer_started = false;
-            data_ready = false;
-            card_fubar = false;
-            bit_count = 0;
-            card_data = 0;
+                    clock_boot_marks[slot / 8] |= 1 << (slot % 8);
+                }
+                if (evt_handler) {
+                    wiegand_evt_t evt = {
+                        .evt_type = WIEGAND_EVT_CARD_STORED,
+                        .bit_len = card.bit_len,
+                        .seq = seq,
+                        .hits = hits,
+                        .ticks = frame_ticks,
+                    };
+                    evt_handler(&evt);
+                }
+            }
+            num_reads++;
         }
     }
+    else if (bit_count > 1)
+    {
+        printf("Dropped %d bit card, %d pulses lost, %ld of %ld cards dropped\r\n",
+               bit_count, frame_lost, stats->frames_dropped,
+               stats->frames + stats->frames_dropped);
+    }
+
+    //reset vars for next read
+    card_fubar = false;
+    frame_lost = 0;
+    frame_gap_max = 0;
+    memset(card_data, 0, CARD_BYTES(bit_count < WIEGAND_MAX_BITS ? bit_count : WIEGAND_MAX_BITS));
+    bit_count = 0;
+}
+
+void wiegand_task(void)
+{
+    clock_update();
+    if (clock_requested) {
+        // cleared first, a request coming in meanwhile is set on the next pass
+        clock_requested = false;
+        if (wiegand_clock_set(clock_request) == NRF_SUCCESS && evt_handler) {
+            wiegand_evt_t evt = {
+                .evt_type = WIEGAND_EVT_CLOCK_SET,
+            };
+            evt_handler(&evt);
+        }
+    }
+    if (tx_done) {
+        tx_done = false;
+        tx_finish();
+    }
+    if (tx_gap_over) {
+        tx_gap_over = false;
+        if (tx_holding) {
+            // nothing was sent, the line has only been kept quiet
+            tx_holding = false;
+            tx_busy = false;
+        } else {
+            tx_complete();
+            if (tx_job_active && tx_job_left == 0) {
+                tx_job_end(NRF_SUCCESS);
+            }
+        }
+    }
+    tx_job_run();
+
+    // decode everything the ISRs have queued since the last pass
+    while (edge_tail != edge_head) {
+        uint32_t entry = edge_fifo[edge_tail];
+        edge_tail = (edge_tail + 1) & EDGE_FIFO_MASK;
+
+        if (edge_overflows != frame_overflows) {
+            // events went missing somewhere in this frame
+            capture_stats[capture_mode].overflows += edge_overflows - frame_overflows;
+            frame_overflows = edge_overflows;
+            card_fubar = true;
+        }
+
+        edge_type_t type = EDGE_TYPE(entry);
+        uint16_t ts = EDGE_TS(entry);
+
+        if (type == EDGE_END) {
+            frame_complete();
+            continue;
+        }
+        if (type == EDGE_STAMP) {
+            stamp_rtc = EDGE_RTC(entry);
+            stamp_pending = true;
+            continue;
+        }
+        // a quiet gap means the previous frame ended, even if its end
+        // marker was never queued
+        if (bit_count > 0 && (uint16_t)(ts - frame_last_ts) > TIMER_DELAY) {
+            frame_complete();
+        }
+        if (bit_count == 0) {
+            // a frame whose stamp was lost to an overflow is timed as it is decoded
+            frame_ticks = stamp_pending ? clock_ticks_at(stamp_rtc) : clock_ticks;
+            stamp_pending = false;
+        }
+        if (bit_count > 0 && (uint16_t)(ts - frame_last_ts) > frame_gap_max) {
+            frame_gap_max = ts - frame_last_ts;
+        }
+        frame_last_ts = ts;
+
+        if (bit_count >= WIEGAND_MAX_BITS) {
+            card_fubar = true;                      // too long to keep
+        } else if (type == EDGE_DATA1) {
+            card_data[bit_count >> 3] |= 0x80 >> (bit_count & 7);
+        }
+        if (type == EDGE_LOST) {
+            card_fubar = true;
+            frame_lost++;
+        }
+        bit_count++;
+    }
+}
+
+void TIMER1_IRQHandler(void)
+{
+    if (NRF_TIMER1->EVENTS_COMPARE[1])
+    {
+        NRF_TIMER1->EVENTS_COMPARE[1] = 0;          // a pulse just ended, timer stopped
+        uint16_t bit = tx_bit + 1;
+        if (bit < tx_card.bit_len) {
+            // steer the next pulse to its line and carry on
+            NRF_GPIOTE->CONFIG[GPIOTE_CH_TX] = tx_config[CARD_BIT(&tx_card, bit)];
+            NRF_TIMER1->TASKS_START = 1;
+        } else {
+            NRF_GPIOTE->CONFIG[GPIOTE_CH_TX] = 0;   // lines back to GPIO, low
+            tx_done = true;
+        }
+        tx_bit = bit;
+    }
 }
 
 void TIMER2_IRQHandler(void)
@@ -271,15 +1275,200 @@ void TIMER2_IRQHandler(void)
     if (NRF_TIMER2->EVENTS_COMPARE[0])
     {
         NRF_TIMER2->EVENTS_COMPARE[0] = 0;           // Clear compare register 0 event
-        NRF_TIMER2->TASKS_STOP = 1;                  // Stop the timer
-        NRF_TIMER2->TASKS_CAPTURE[0] = 1;           // Start task to capture timer value
-        NRF_TIMER2->CC[0] = (NRF_TIMER2->CC[0] + TIMER_DELAY); // Add TIMER_DELAY to get ready for next card
-        data_ready = true;                          // trigger data processing
+        NRF_TIMER2->TASKS_CAPTURE[TS_NOW_CC] = 1;    // Capture timer value
+        uint16_t now = NRF_TIMER2->CC[TS_NOW_CC];
+        // a pulse may have been queued after the compare matched
+        if ((uint16_t)(now - edge_last_ts) < edge_timeout) {
+            return;
+        }
+        capture_frame_open = false;
+        if (capture_mode == WIEGAND_CAPTURE_PPI) {
+            // keep the timebase running for the PPI captures
+            NRF_TIMER2->INTENCLR = TIMER_INTENCLR_COMPARE0_Msk;
+        } else {
+            NRF_TIMER2->TASKS_STOP = 1;              // Stop the timer until the next card
+        }
+        edge_push(EDGE_END, now);                   // trigger data processing
+    }
+}
+
+/*
+ * Times our own pulses while transmitting. The inputs fire on both edges
+ * then; the pin level tells a pulse start from its end. If both edges of a
+ * pulse went by before the handler ran only the end is left, so the width
+ * of that pulse is missed but the period, taken between pulse ends, is not.
+ */
+static void loopback_measure(uint8_t line, uint16_t ts, bool level)
+{
+    uint16_t dt;
+
+    if (!level) {
+        // line pulled low, a pulse started
+        loop_fall_pending[line] = true;
+        loop_fall_ts[line] = ts;
+        return;
+    }
+    if (loop_fall_pending[line]) {
+        loop_fall_pending[line] = false;
+        dt = ts - loop_fall_ts[line];
+        tx_measure.pulse_min_us = dt < tx_measure.pulse_min_us ? dt : tx_measure.pulse_min_us;
+        tx_measure.pulse_max_us = dt > tx_measure.pulse_max_us ? dt : tx_measure.pulse_max_us;
+        loop_pulse_sum += dt;
+        tx_measure.pulses++;
+    } else {
+        tx_measure.missed++;
+    }
+    if (loop_last_valid) {
+        dt = ts - loop_last_end;
+        tx_measure.period_min_us = dt < tx_measure.period_min_us ? dt : tx_measure.period_min_us;
+        tx_measure.period_max_us = dt > tx_measure.period_max_us ? dt : tx_measure.period_max_us;
+        loop_period_sum += dt;
+        loop_periods++;
+    }
+    loop_last_end = ts;
+    loop_last_valid = true;
+}
+
+static void loopback_drain(void)
+{
+    static const uint8_t pins[2] = { DATA0_IN, DATA1_IN };
+
+    for (uint8_t line = 0; line < 2; line++) {
+        if (!NRF_GPIOTE->EVENTS_IN[GPIOTE_CH_DATA0 + line]) {
+            continue;
+        }
+        NRF_GPIOTE->EVENTS_IN[GPIOTE_CH_DATA0 + line] = 0;
+        // an edge between reading the timestamp and the level would pair
+        // them up wrongly, so read the timestamp again to check
+        uint16_t ts;
+        uint32_t level;
+        do {
+            ts = NRF_TIMER2->CC[1 + line];
+            level = nrf_gpio_pin_read(pins[line]);
+        } while (ts != (uint16_t)NRF_TIMER2->CC[1 + line]);
+        loopback_measure(line, ts, level);
+    }
+}
+
+/*
+ * Arms the end of frame compare for a pulse at ts. The first pulse of a frame
+ * always gets the full TIMER_DELAY, after that the learnt timeout is
+ * stretched for a frame whose own bits come slower, so a slower reader than
+ * the one learnt from is not cut short. A short timeout may already have run
+ * out if the handler was held up, the compare then goes off right away.
+ */
+static void eof_arm(uint16_t ts)
+{
+    uint16_t timeout = eof_timeout;
+
+    if (capture_frame_open) {
+        uint16_t gap = ts - edge_last_ts;
+        edge_gap_max = gap > edge_gap_max ? gap : edge_gap_max;
+    } else {
+        edge_gap_max = 0;
+    }
+    if (edge_gap_max == 0) {
+        timeout = TIMER_DELAY;
+    } else if (timeout < TIMER_DELAY) {
+        uint32_t stretched = (uint32_t)edge_gap_max * eof_multiple;
+        if (stretched > timeout) {
+            timeout = stretched < TIMER_DELAY ? stretched : TIMER_DELAY;
+        }
+    }
+
+    uint16_t deadline = ts + timeout;
+    if (timeout < TIMER_DELAY) {
+        NRF_TIMER2->TASKS_CAPTURE[TS_NOW_CC] = 1;
+        uint16_t now = NRF_TIMER2->CC[TS_NOW_CC];
+        if ((uint16_t)(now - ts) > timeout - EOF_ARM_MARGIN) {
+            deadline = now + EOF_ARM_MARGIN;
+        }
+    }
+    NRF_TIMER2->CC[0] = deadline;       // wait for another bit until then
+    edge_timeout = timeout;
+    edge_last_ts = ts;
+}
+
+/*
+ * Moves the pulses captured over PPI into the edge fifo. The TIMER1 count is
+ * read before the IN events, so a pulse landing in between shows up as an
+ * event ahead of its count rather than as a lost pulse. Whatever the count
+ * is still ahead by after that are pulses whose events were merged.
+ */
+static void capture_drain(void)
+{
+    if (ignore_reads) {
+        // TIMER1 may be timing a transmission, leave it alone
+        if (tx_loopback_active) {
+            loopback_drain();
+        }
+        NRF_GPIOTE->EVENTS_IN[GPIOTE_CH_DATA0] = 0;
+        NRF_GPIOTE->EVENTS_IN[GPIOTE_CH_DATA1] = 0;
+        return;
+    }
+
+    NRF_TIMER1->TASKS_CAPTURE[0] = 1;
+    uint16_t count = NRF_TIMER1->CC[0];
+    bool in0 = NRF_GPIOTE->EVENTS_IN[GPIOTE_CH_DATA0];
+    bool in1 = NRF_GPIOTE->EVENTS_IN[GPIOTE_CH_DATA1];
+
+    if (in0) {
+        NRF_GPIOTE->EVENTS_IN[GPIOTE_CH_DATA0] = 0;
+    }
+    if (in1) {
+        NRF_GPIOTE->EVENTS_IN[GPIOTE_CH_DATA1] = 0;
+    }
+    capture_balance += (uint16_t)(count - capture_count) - in0 - in1;
+    capture_count = count;
+
+    if (!in0 && !in1) {
+        return;
+    }
+
+    uint16_t ts0 = NRF_TIMER2->CC[1];
+    uint16_t ts1 = NRF_TIMER2->CC[2];
+    uint16_t ts;
+
+    if (!capture_frame_open) {
+        stamp_push();
+    }
+    if (in0 && in1) {
+        // both lines pulsed since the last drain, queue them oldest first
+        if ((int16_t)(ts1 - ts0) < 0) {
+            edge_push(EDGE_DATA1, ts1);
+            edge_push(EDGE_DATA0, ts0);
+            ts = ts0;
+        } else {
+            edge_push(EDGE_DATA0, ts0);
+            edge_push(EDGE_DATA1, ts1);
+            ts = ts1;
+        }
+    } else if (in0) {
+        edge_push(EDGE_DATA0, ts0);
+        ts = ts0;
+    } else {
+        edge_push(EDGE_DATA1, ts1);
+        ts = ts1;
+    }
+    for (; capture_balance > 0; capture_balance--) {
+        edge_push(EDGE_LOST, ts);
+    }
+
+    eof_arm(ts);
+    if (!capture_frame_open) {
+        NRF_TIMER2->EVENTS_COMPARE[0] = 0;
+        NRF_TIMER2->INTENSET = TIMER_INTENSET_COMPARE0_Msk;
+        capture_frame_open = true;
     }
 }
 
 void GPIOTE_IRQHandler(void)
 {
+    if (capture_mode == WIEGAND_CAPTURE_PPI) {
+        capture_drain();
+        return;
+    }
+
     // This handler will be run after wakeup from system ON (GPIO wakeup)
     uint32_t port_status = NRF_GPIO->IN;
     NRF_GPIOTE->EVENTS_PORT = 0;    // Clear event
@@ -288,19 +1477,21 @@ void GPIOTE_IRQHandler(void)
         return;
     }
 
-    card_data <<= 1;
+    NRF_TIMER2->TASKS_START = 1;        // no effect if the timer is already running
+    NRF_TIMER2->TASKS_CAPTURE[TS_NOW_CC] = 1; // timestamp the pulse
+    uint16_t ts = NRF_TIMER2->CC[TS_NOW_CC];
+    if (!capture_frame_open) {
+        stamp_push();
+    }
+    eof_arm(ts);
+    capture_frame_open = true;
+
     if (!(port_status >> DATA1_IN & 1UL)) {
-        card_data |= 1;
+        edge_push(EDGE_DATA1, ts);
     } else if (!(port_status >> DATA0_IN & 1UL)) {
-        // 0 is already assigned, don't need to do anything
+        edge_push(EDGE_DATA0, ts);
     } else {
-        // port status lost thanks to BLE delaying read.
-        card_fubar = true;
+        edge_push(EDGE_LOST, ts);
     }
-    data_incoming = true;
-    NRF_TIMER2->TASKS_CAPTURE[0] = 1;   // trigger CAPTURE task
-    NRF_TIMER2->CC[0] = (NRF_TIMER2->CC[0] + TIMER_DELAY); // Add TIMER_DELAY to wait for another bit
-    bit_count++;
 }
 
-
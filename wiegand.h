@@ -1,24 +1,154 @@
 #ifndef WIEGAND_H_
 #define WIEGAND_H_
 
-#define CARD_DATA_LEN 6
-#define WIEGAND_MAX_CARDS 100
-
-typedef struct Card Card;
-struct Card {
-    uint8_t bit_len;
-    uint8_t data[CARD_DATA_LEN];
-};
-
-typedef struct Wiegand_ctx Wiegand_ctx;
-struct Wiegand_ctx {
-    Card card_store[WIEGAND_MAX_CARDS];
-    uint8_t card_count;
-};
-
-void wiegand_init(Wiegand_ctx *ctx);
+#include "wiegand_format.h"
+#include "card_store.h"
+
+// wiegand data pins
+#define DATA0_IN 0
+#define DATA1_IN 7
+#define DATA0_CTL 2
+#define DATA1_CTL 3
+
+// how pulses on DATA0_IN/DATA1_IN are captured
+typedef enum {
+    WIEGAND_CAPTURE_SENSE,  // PORT interrupt, the ISR reads the pins and timestamps the pulse
+    WIEGAND_CAPTURE_PPI,    // GPIOTE IN events timestamped by TIMER2 and counted by TIMER1 over PPI
+    WIEGAND_CAPTURE_MODES
+} wiegand_capture_mode_t;
+
+// decode statistics, kept separately for each capture mode
+typedef struct {
+    uint32_t frames;            // cards decoded
+    uint32_t frames_dropped;    // cards thrown away because pulses were lost
+    uint32_t bits;              // pulses decoded
+    uint32_t bits_lost;         // pulses seen but not identified as 0 or 1
+    uint32_t overflows;         // edge events dropped because the queue was full
+} wiegand_capture_stats_t;
+
+// End of frame detection. A frame ends once its lines have been quiet for
+// the multiple times the longest gap between bits learnt from recent cards,
+// or between bits of the frame itself if that is longer. The fixed 3ms is
+// used until enough cards have been seen, and always after the first bit.
+#define WIEGAND_EOF_MULTIPLE_DEFAULT 4
+#define WIEGAND_EOF_MULTIPLE_MIN 2
+#define WIEGAND_EOF_MULTIPLE_MAX 16
+
+typedef struct {
+    uint16_t interval_us;       // longest gap between bits learnt, 0 until a card was seen
+    uint16_t timeout_us;        // quiet time that currently ends a frame
+    uint32_t frames_early;      // frames closed with a learnt timeout
+} wiegand_eof_stats_t;
+
+// transmit timing
+typedef struct {
+    uint16_t pulse_us;          // how long a line is pulled low for each bit
+    uint16_t period_us;         // from the start of one pulse to the next
+    uint16_t gap_ms;            // quiet time after a card before the next can be sent
+} wiegand_tx_timing_t;
+
+typedef enum {
+    WIEGAND_TX_PROFILE_STANDARD,
+    WIEGAND_TX_PROFILE_FAST,
+    WIEGAND_TX_PROFILE_SLOW,
+    WIEGAND_TX_PROFILE_CUSTOM,  // timing set with wiegand_tx_profile_set
+    WIEGAND_TX_PROFILES
+} wiegand_tx_profile_id_t;
+
+typedef struct {
+    const char *name;
+    wiegand_tx_timing_t timing;
+} wiegand_tx_profile_t;
+
+// transmit timing as seen on the input pins, see wiegand_tx_loopback_set
+typedef struct {
+    uint16_t pulses;            // pulses measured
+    uint16_t missed;            // pulses whose start went by unseen, no width for those
+    uint16_t pulse_min_us;
+    uint16_t pulse_max_us;
+    uint16_t pulse_avg_us;
+    uint16_t period_min_us;
+    uint16_t period_max_us;
+    uint16_t period_avg_us;
+} wiegand_tx_measure_t;
+
+// Replay jobs. Each sends a card repeat times with at least gap_ms of quiet
+// line between frames, the profile's gap if that is longer. Jobs are queued
+// from the BLE event handler or the main loop and run back to back from
+// wiegand_task.
+#define WIEGAND_TX_JOBS 8           // must be a power of two
+#define WIEGAND_TX_JOB_IDLE 0xFFFF  // card_idx of wiegand_tx_job_status_t while no job runs
+
+typedef struct {
+    uint8_t card_idx;           // as for send_wiegand
+    uint8_t repeat;             // frames to send, 0 is taken as 1
+    uint16_t gap_ms;            // quiet time between frames
+} wiegand_tx_job_t;
+
+typedef struct {
+    uint8_t queued;             // jobs waiting, the running one left out
+    uint8_t left;               // frames of the running job still to start
+    uint16_t card_idx;          // card of the running job, WIEGAND_TX_JOB_IDLE if none
+    uint16_t done;              // jobs finished
+    uint16_t failed;            // jobs given up on because a frame would not start or was not all written
+    uint16_t rejected;          // jobs turned away because the queue was full
+    uint32_t last_err;          // result of the last job to end
+} wiegand_tx_job_status_t;
+
+// Every card is stamped from RTC1 as its first pulse comes in. Card times
+// are in seconds, since boot until a client sets the clock and Unix time
+// after that; times from WIEGAND_TIME_UNIX (2000-01-01) on are Unix time.
+#define WIEGAND_TIME_UNIX 946684800UL
+
+// events reported to the application from wiegand_task
+typedef enum {
+    WIEGAND_EVT_TX_DONE,        // the last pulse of a card has been sent
+    WIEGAND_EVT_CARD_STORED,    // a card read has gone into the store
+    WIEGAND_EVT_CARD_UPDATED,   // setting the clock changed the time of a stored card
+    WIEGAND_EVT_JOB_DONE,       // a replay job has ended, see wiegand_tx_job_status_get
+    WIEGAND_EVT_CLOCK_SET,      // the clock was set as wiegand_clock_request asked
+} wiegand_evt_type_t;
+
+typedef struct {
+    wiegand_evt_type_t evt_type;
+    uint16_t bit_len;           // bits sent or read
+    uint32_t seq;               // card stored or updated: sequence number of its record
+    uint16_t hits;              // card stored: times it has been read, 1 if new
+    uint64_t ticks;             // ... and RTC1 ticks since boot at its first pulse
+} wiegand_evt_t;
+
+typedef void (*wiegand_evt_handler_t)(const wiegand_evt_t *p_evt);
+
+// send_wiegand card_idx values besides the position of a card in the store
+#define WIEGAND_TX_CUSTOM 254   // the frame from wiegand_tx_custom_get, as it was when a job was queued
+#define WIEGAND_TX_LAST 255     // the last card read
+
+void wiegand_init(card_store_t *store);
+void wiegand_evt_handler_set(wiegand_evt_handler_t handler);
+uint32_t wiegand_tx_start(const Card *card);
+uint32_t wiegand_tx_job_add(const wiegand_tx_job_t *p_job);
+uint32_t wiegand_tx_custom_add(uint16_t data_len, bool len_whole);
+const wiegand_tx_job_status_t *wiegand_tx_job_status_get(void);
+bool wiegand_tx_busy(void);
+bool wiegand_rx_busy(void);
+uint32_t wiegand_tx_profile_set(uint8_t profile, const wiegand_tx_timing_t *p_timing);
+uint8_t wiegand_tx_profile_get(wiegand_tx_timing_t *p_timing);
+const wiegand_tx_profile_t *wiegand_tx_profile_info(uint8_t profile);
+uint32_t wiegand_tx_loopback_set(bool enable);
+bool wiegand_tx_loopback_get(void);
+const wiegand_tx_measure_t *wiegand_tx_measure_get(void);
+uint32_t wiegand_capture_mode_set(wiegand_capture_mode_t mode);
+wiegand_capture_mode_t wiegand_capture_mode_get(void);
+const wiegand_capture_stats_t *wiegand_capture_stats_get(wiegand_capture_mode_t mode);
+uint32_t wiegand_eof_multiple_set(uint8_t multiple);
+uint8_t wiegand_eof_multiple_get(void);
+const wiegand_eof_stats_t *wiegand_eof_stats_get(void);
+uint64_t wiegand_clock_ticks(void);
+uint32_t wiegand_clock_boot_time(void);
+uint32_t wiegand_clock_set(uint32_t unix_time);
+void wiegand_clock_request(uint32_t unix_time);
 void wiegand_task(void);
-void add_card(uint64_t *data, uint8_t len);
-void send_wiegand(uint8_t card_idx);
+Card *wiegand_tx_custom_get(void);
+uint32_t send_wiegand(uint8_t card_idx);
 
 #endif /* WIEGAND_H_ */
@@ -0,0 +1,149 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "wiegand_format.h"
+
+// mask of bits first..last of a len bit card, positions counted from the first bit sent
+#define BITS(len, first, last) ((~0ULL >> (63 - (last) + (first))) << ((len) - 1 - (last)))
+
+#define FORMAT_COUNT (sizeof(formats) / sizeof(formats[0]))
+
+// Known card formats. Parity bits are listed in the order they are computed,
+// so a parity that covers another parity bit has to come after it.
+static const wiegand_format_t formats[] =
+{
+    {
+        .name = "H10301", .bit_len = 26,
+        .fc_pos = 1, .fc_len = 8, .cn_pos = 9, .cn_len = 16,
+        .parity_count = 2,
+        .parity = {
+            { .pos = 0,  .odd = false, .mask = BITS(26, 0, 12) },
+            { .pos = 25, .odd = true,  .mask = BITS(26, 13, 25) },
+        },
+    },
+    {
+        .name = "H10306", .bit_len = 34,
+        .fc_pos = 1, .fc_len = 16, .cn_pos = 17, .cn_len = 16,
+        .parity_count = 2,
+        .parity = {
+            { .pos = 0,  .odd = false, .mask = BITS(34, 0, 16) },
+            { .pos = 33, .odd = true,  .mask = BITS(34, 17, 33) },
+        },
+    },
+    {
+        // Corporate 1000 35 bit, the first two parities cover two of every three bits
+        .name = "C1k35s", .bit_len = 35,
+        .fc_pos = 2, .fc_len = 12, .cn_pos = 14, .cn_len = 20,
+        .parity_count = 3,
+        .parity = {
+            { .pos = 1,  .odd = false, .mask = 0x3b6db6db6ULL },
+            { .pos = 34, .odd = true,  .mask = 0x36db6db6dULL },
+            { .pos = 0,  .odd = true,  .mask = BITS(35, 0, 34) },
+        },
+    },
+    {
+        .name = "H10304", .bit_len = 37,
+        .fc_pos = 1, .fc_len = 16, .cn_pos = 17, .cn_len = 19,
+        .parity_count = 2,
+        .parity = {
+            { .pos = 0,  .odd = false, .mask = BITS(37, 0, 18) },
+            { .pos = 36, .odd = true,  .mask = BITS(37, 18, 36) },
+        },
+    },
+    {
+        // Corporate 1000 48 bit, two of every three bits again but counted
+        // from the end of the card, so not the 35 bit masks stretched
+        .name = "C1k48s", .bit_len = 48,
+        .fc_pos = 2, .fc_len = 22, .cn_pos = 24, .cn_len = 23,
+        .parity_count = 3,
+        .parity = {
+            { .pos = 1,  .odd = false, .mask = 0x5b6db6db6db6ULL },
+            { .pos = 47, .odd = true,  .mask = 0x36db6db6db6dULL },
+            { .pos = 0,  .odd = true,  .mask = BITS(48, 0, 47) },
+        },
+    },
+};
+
+static uint32_t field_get(uint64_t data, uint8_t bit_len, uint8_t pos, uint8_t len)
+{
+    if (len == 0) {
+        return 0;
+    }
+    return (uint32_t)((data >> (bit_len - pos - len)) & (~0ULL >> (64 - len)));
+}
+
+static void field_set(uint64_t *data, uint8_t bit_len, uint8_t pos, uint8_t len, uint32_t value)
+{
+    if (len == 0) {
+        return;
+    }
+    uint64_t mask = ~0ULL >> (64 - len);
+    uint8_t shift = bit_len - pos - len;
+    *data = (*data & ~(mask << shift)) | (((uint64_t)value & mask) << shift);
+}
+
+static bool parity_ok(const wiegand_format_t *format, uint64_t data)
+{
+    bool ok = true;
+
+    // check every parity rather than returning early so each frame costs the same
+    for (uint8_t i = 0; i < format->parity_count; i++) {
+        const wiegand_parity_t *parity = &format->parity[i];
+        ok &= (bool)(__builtin_popcountll(data & parity->mask) & 1) == parity->odd;
+    }
+    return ok;
+}
+
+uint8_t wiegand_format_decode(uint64_t data, uint8_t bit_len, wiegand_fields_t *fields)
+{
+    fields->format = WIEGAND_FORMAT_UNKNOWN;
+    fields->facility = 0;
+    fields->number = 0;
+
+    for (uint8_t i = 0; i < FORMAT_COUNT; i++) {
+        const wiegand_format_t *format = &formats[i];
+
+        if (format->bit_len != bit_len || !parity_ok(format, data)) {
+            continue;
+        }
+        fields->format = i;
+        fields->facility = field_get(data, bit_len, format->fc_pos, format->fc_len);
+        fields->number = field_get(data, bit_len, format->cn_pos, format->cn_len);
+        break;
+    }
+    return fields->format;
+}
+
+uint8_t wiegand_format_encode(const wiegand_fields_t *fields, uint64_t *data)
+{
+    const wiegand_format_t *format = wiegand_format_get(fields->format);
+
+    if (format == NULL) {
+        return 0;
+    }
+    *data = 0;
+    field_set(data, format->bit_len, format->fc_pos, format->fc_len, fields->facility);
+    field_set(data, format->bit_len, format->cn_pos, format->cn_len, fields->number);
+    for (uint8_t i = 0; i < format->parity_count; i++) {
+        const wiegand_parity_t *parity = &format->parity[i];
+        // the parity bit is still 0 here, so the covered bits alone decide it
+        bool bit = (bool)(__builtin_popcountll(*data & parity->mask) & 1) != parity->odd;
+        field_set(data, format->bit_len, parity->pos, 1, bit);
+    }
+    return format->bit_len;
+}
+
+const wiegand_format_t *wiegand_format_get(uint8_t format)
+{
+    return format < FORMAT_COUNT ? &formats[format] : NULL;
+}
+
+uint8_t wiegand_format_find(uint8_t bit_len)
+{
+    for (uint8_t i = 0; i < FORMAT_COUNT; i++) {
+        if (formats[i].bit_len == bit_len) {
+            return i;
+        }
+    }
+    return WIEGAND_FORMAT_UNKNOWN;
+}
@@ -0,0 +1,58 @@
+#ifndef WIEGAND_FORMAT_H_
+#define WIEGAND_FORMAT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define WIEGAND_FORMAT_UNKNOWN 0xFF
+#define WIEGAND_FORMAT_MAX_PARITY 3
+
+// Bit positions in a format are counted from the first bit sent, which is
+// the most significant bit of the card data.
+
+// one parity bit and the bits it covers
+typedef struct {
+    uint8_t pos;            // position of the parity bit
+    bool odd;               // odd parity if true, even otherwise
+    uint64_t mask;          // bits covered in the card data, including the parity bit
+} wiegand_parity_t;
+
+// layout of one card format
+typedef struct {
+    const char *name;
+    uint8_t bit_len;
+    uint8_t fc_pos;         // first bit of the facility code
+    uint8_t fc_len;         // 0 if the format has no facility code
+    uint8_t cn_pos;         // first bit of the card number
+    uint8_t cn_len;
+    uint8_t parity_count;
+    wiegand_parity_t parity[WIEGAND_FORMAT_MAX_PARITY]; // checked in this order
+} wiegand_format_t;
+
+// fields decoded from a card
+typedef struct {
+    uint8_t format;         // index into the format table or WIEGAND_FORMAT_UNKNOWN
+    uint32_t facility;
+    uint32_t number;
+} wiegand_fields_t;
+
+/*
+ * Finds the format matching the card's length and parity and extracts its
+ * fields. Returns the format index, or WIEGAND_FORMAT_UNKNOWN with the fields
+ * zeroed if no format matches.
+ */
+uint8_t wiegand_format_decode(uint64_t data, uint8_t bit_len, wiegand_fields_t *fields);
+
+/*
+ * Builds the card data for the given fields, parity bits included. Returns
+ * the card length, or 0 if the format is unknown.
+ */
+uint8_t wiegand_format_encode(const wiegand_fields_t *fields, uint64_t *data);
+
+// returns the descriptor for a format index, or NULL if there is none
+const wiegand_format_t *wiegand_format_get(uint8_t format);
+
+// returns the first format of the given length, or WIEGAND_FORMAT_UNKNOWN
+uint8_t wiegand_format_find(uint8_t bit_len);
+
+#endif /* WIEGAND_FORMAT_H_ */